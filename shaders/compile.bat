@@ -1,2 +1,8 @@
 %VK_SDK_PATH%/Bin32/glslc.exe shader.vert -o vert.spv
 %VK_SDK_PATH%/Bin32/glslc.exe shader.frag -o frag.spv
+%VK_SDK_PATH%/Bin32/glslc.exe depth.vert -o depth.spv
+%VK_SDK_PATH%/Bin32/glslc.exe cull.comp -o cull.spv
+%VK_SDK_PATH%/Bin32/glslc.exe depth_pyramid.comp -o depth_pyramid.spv
+%VK_SDK_PATH%/Bin32/glslc.exe cluster_lights.comp -o cluster_lights.spv
+%VK_SDK_PATH%/Bin32/glslc.exe fullscreen.vert -o fullscreen.spv
+%VK_SDK_PATH%/Bin32/glslc.exe fxaa.frag -o fxaa.spv
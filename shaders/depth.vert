@@ -0,0 +1,26 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+// Writes depth alone for the pre-pass, from the position-only stream. The
+// main pass tests for equal depth, so gl_Position must be computed exactly
+// as in shader.vert.
+
+struct ObjectUniforms {
+    mat4 model;
+    mat4 model_view_proj;
+    mat4 normal;
+};
+
+// Every object's constants, indexed by the draw's first instance
+layout(std430, binding = 2) readonly buffer Objects {
+    ObjectUniforms objects[];
+};
+
+layout(location = 0) in vec3 in_position;
+
+invariant gl_Position;
+
+void main() {
+    const ObjectUniforms object = objects[gl_InstanceIndex];
+    gl_Position = object.model_view_proj * vec4(in_position, 1);
+}
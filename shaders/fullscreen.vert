@@ -0,0 +1,12 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+// Covers the screen with one triangle, from three vertices and no vertex
+// buffer. The texture coordinates run from 0 to 1 across the screen.
+
+layout(location = 0) out vec2 frag_uv;
+
+void main() {
+    frag_uv = vec2((gl_VertexIndex << 1) & 2, gl_VertexIndex & 2);
+    gl_Position = vec4(frag_uv * 2 - 1, 0, 1);
+}
@@ -0,0 +1,62 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+// Smooths edges after the fact, in the manner of the original FXAA. The
+// luma of the four diagonal neighbours gives the direction along the edge,
+// and the pixel is blurred along it, unless the blur reaches past the
+// local range of luma and so across another edge. Reads the scene at the
+// render extent and writes the swap chain image, so it also scales up.
+
+layout(binding = 0) uniform sampler2D scene;
+
+layout(push_constant) uniform Constants {
+    vec2 uv_scale;   // The render extent over the scene image's size
+    vec2 texel_size; // Of the scene image
+} constants;
+
+layout(location = 0) in vec2 frag_uv;
+
+layout(location = 0) out vec4 out_colour;
+
+const float reduce_min = 1.0 / 128;
+const float reduce_mul = 1.0 / 8;
+const float span_max = 8; // In texels
+
+// Reads within the drawn part of the scene image
+vec3 fetch(vec2 uv) {
+    const vec2 uv_max = constants.uv_scale - 0.5 * constants.texel_size;
+    return textureLod(scene, min(uv, uv_max), 0).rgb;
+}
+
+float luma(vec3 colour) {
+    return dot(colour, vec3(0.299, 0.587, 0.114));
+}
+
+void main() {
+    const vec2 uv = frag_uv * constants.uv_scale;
+    const vec2 texel = constants.texel_size;
+    const vec3 colour = fetch(uv);
+    const float luma_m = luma(colour);
+    const float luma_nw = luma(fetch(uv + vec2(-1, -1) * texel));
+    const float luma_ne = luma(fetch(uv + vec2(1, -1) * texel));
+    const float luma_sw = luma(fetch(uv + vec2(-1, 1) * texel));
+    const float luma_se = luma(fetch(uv + vec2(1, 1) * texel));
+    const float luma_min = min(luma_m, min(min(luma_nw, luma_ne), min(luma_sw, luma_se)));
+    const float luma_max = max(luma_m, max(max(luma_nw, luma_ne), max(luma_sw, luma_se)));
+
+    // Across the gradient, so along the edge
+    vec2 direction = vec2(-((luma_nw + luma_ne) - (luma_sw + luma_se)),
+                          (luma_nw + luma_sw) - (luma_ne + luma_se));
+    const float reduce = max((luma_nw + luma_ne + luma_sw + luma_se) * 0.25 * reduce_mul,
+                             reduce_min);
+    const float scale = 1 / (min(abs(direction.x), abs(direction.y)) + reduce);
+    direction = clamp(direction * scale, -span_max, span_max) * texel;
+
+    // Two taps near the pixel, and two more farther out along the edge
+    const vec3 inner = 0.5 * (fetch(uv + direction * (1.0 / 3 - 0.5)) +
+                              fetch(uv + direction * (2.0 / 3 - 0.5)));
+    const vec3 outer = inner * 0.5 + 0.25 * (fetch(uv - direction * 0.5) +
+                                            fetch(uv + direction * 0.5));
+    const float luma_outer = luma(outer);
+    out_colour = vec4(luma_outer < luma_min || luma_outer > luma_max ? inner : outer, 1);
+}
@@ -1,20 +1,116 @@
 #version 450
 #extension GL_ARB_separate_shader_objects : enable
 
+// As in cluster_lights.comp
+const uvec3 grid = uvec3(16, 9, 24);
+const uint cluster_count = grid.x * grid.y * grid.z;
+const uint max_cluster_lights = 128;
+
+struct PointLight {
+    vec4 position; // World space, and the radius it reaches in w
+    vec4 colour;
+};
+
+// Specialised for each material and setting. The defaults make the uber
+// shader, which draws any of them.
+layout(constant_id = 0) const uint max_point_lights = 128; // In a cluster
+layout(constant_id = 1) const bool fog = true;
+layout(constant_id = 2) const bool vertex_colour = true;
+layout(constant_id = 3) const bool textured = true;
+// Linear, in place of a texture that is one colour throughout
+layout(constant_id = 4) const float base_red = 1;
+layout(constant_id = 5) const float base_green = 1;
+layout(constant_id = 6) const float base_blue = 1;
+
+layout(binding = 0) uniform FrameUniforms {
+    mat4 view;
+    mat4 proj;
+    float time;
+    vec4 sun_position;
+    vec2 viewport;
+    float near_plane;
+    float far_plane;
+    uint light_count;
+} frame;
+
 layout(binding = 1) uniform sampler2D tex_sampler;
 
+layout(std430, binding = 3) readonly buffer Lights {
+    PointLight lights[];
+};
+
+// The lights touching each cluster, as binned by cluster_lights.comp
+layout(std430, binding = 4) readonly buffer Clusters {
+    uint light_counts[cluster_count];
+    uint light_indices[cluster_count * max_cluster_lights];
+};
+
 layout(location = 0) in vec3 frag_colour;
 layout(location = 1) in vec2 frag_tex_coord;
 layout(location = 2) in float frag_height;
+layout(location = 3) in vec3 frag_position;
+layout(location = 4) in vec3 frag_normal;
 
 layout(location = 0) out vec4 out_colour;
 
+const vec3 colour_sun = vec3 (1, 0.894, 0.518);
 const vec3 colour_sky = vec3 (0.537, 0.671, 0.847);
 
+// Far enough away to light the scene evenly
+const vec3 sky_positions[4] = {
+    vec3(-100, 100, 0),
+    vec3(100, 100, 0),
+    vec3(0, 100, 100),
+    vec3(0, 100, -100),
+};
+
+vec3 diffuse(vec3 normal, vec3 direction, vec3 colour) {
+    return colour * 0.5 * max(dot(normal, direction), 0.0);
+}
+
+// Finds the fragment's cluster from its pixel and view depth
+uint cluster_index() {
+    const uvec2 tile = min(uvec2(gl_FragCoord.xy / frame.viewport * vec2(grid.xy)),
+                           grid.xy - 1u);
+    const float depth = 1 / gl_FragCoord.w;
+    const float slice = log(depth / frame.near_plane) /
+                        log(frame.far_plane / frame.near_plane) * grid.z;
+    const uint clamped_slice = uint(clamp(slice, 0.0, float(grid.z - 1)));
+    return tile.x + grid.x * (tile.y + grid.y * clamped_slice);
+}
+
 void main() {
-    vec4 colour = vec4(frag_colour * texture(tex_sampler, frag_tex_coord).rgb, 1.0);
-    float depth = clamp(0.1 * gl_FragCoord.z / gl_FragCoord.w, 0, 1);
-    float fog = 0.5 * mix(0, clamp(mix(-1.0, 2.0, clamp(1.0 - exp(-depth * 2), 0, 1)), 0, 1), clamp(1 - frag_height, 0, 1));
-    colour = mix(colour, vec4(colour_sky, 1), fog);
+    const vec3 normal = normalize(frag_normal);
+    vec3 light = colour_sky * 0.05;
+    light += diffuse(normal, normalize(frame.sun_position.xyz - frag_position),
+                     colour_sun * 2.0);
+    for (int i = 0; i < 4; ++i) {
+        light += diffuse(normal, normalize(sky_positions[i] - frag_position),
+                         colour_sky * 0.1);
+    }
+
+    // Each light fades out smoothly at its radius
+    const uint cluster = cluster_index();
+    const uint count = min(light_counts[cluster], max_point_lights);
+    for (uint i = 0; i < count; ++i) {
+        const PointLight point = lights[light_indices[cluster * max_cluster_lights + i]];
+        const vec3 offset = point.position.xyz - frag_position;
+        const float distance_squared = max(dot(offset, offset), 1e-6);
+        const float falloff = max(1 - distance_squared / (point.position.w * point.position.w), 0);
+        light += diffuse(normal, offset * inversesqrt(distance_squared),
+                         point.colour.rgb * falloff * falloff);
+    }
+
+    vec3 albedo = textured ? texture(tex_sampler, frag_tex_coord).rgb
+                           : vec3(base_red, base_green, base_blue);
+    if (vertex_colour) {
+        albedo *= frag_colour;
+    }
+    vec4 colour = vec4(light * albedo, 1.0);
+    if (fog) {
+        float depth = clamp(0.1 * gl_FragCoord.z / gl_FragCoord.w, 0, 1);
+        float amount = 0.5 * mix(0, clamp(mix(-1.0, 2.0, clamp(1.0 - exp(-depth * 2), 0, 1)), 0, 1), clamp(1 - frag_height, 0, 1));
+        colour = mix(colour, vec4(colour_sky, 1), amount);
+    }
     out_colour = colour;
 }
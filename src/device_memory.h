@@ -0,0 +1,547 @@
+// Hello Vulkan
+// Benjamin Porter, 2020
+//
+// Device memory sub-allocation, kept apart from the window system and the
+// Vulkan loader so that it can be tested against a fake device
+
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <gsl/gsl>
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <set>
+#include <stdexcept>
+#include <vector>
+
+// Power-of-two buddy allocator over the offsets of a single memory block.
+// Allocations are rounded up to a power of two, which also aligns them to
+// any smaller power of two.
+class BuddyAllocator
+{
+  public:
+    BuddyAllocator(VkDeviceSize size, VkDeviceSize min_size)
+        : min_size_(min_size),
+          free_lists_(gsl::narrow_cast<std::size_t>(
+                          std::countr_zero(size) -
+                          std::countr_zero(min_size)) +
+                      1)
+    {
+        Expects(std::has_single_bit(size) && std::has_single_bit(min_size) &&
+                size >= min_size);
+        free_lists_.back().insert(0);
+    }
+
+    VkDeviceSize size() const noexcept
+    {
+        return min_size_ << (free_lists_.size() - 1);
+    }
+
+    VkDeviceSize used() const noexcept { return used_; }
+
+    // The largest request that would currently succeed
+    VkDeviceSize largest_free() const noexcept
+    {
+        for (std::size_t i = free_lists_.size(); i > 0; --i)
+        {
+            if (!free_lists_[i - 1].empty())
+            {
+                return min_size_ << (i - 1);
+            }
+        }
+        return 0;
+    }
+
+    // The number of bytes allocate reserves for a request
+    VkDeviceSize rounded_size(VkDeviceSize size,
+                              VkDeviceSize alignment) const noexcept
+    {
+        return std::bit_ceil(std::max({size, alignment, min_size_}));
+    }
+
+    std::optional<VkDeviceSize> allocate(VkDeviceSize size,
+                                         VkDeviceSize alignment)
+    {
+        const VkDeviceSize block_size = rounded_size(size, alignment);
+        const std::size_t order       = order_of(block_size);
+        if (order >= free_lists_.size())
+        {
+            return std::nullopt;
+        }
+
+        // Take the smallest free block that fits and split it down
+        std::size_t i = order;
+        while (i < free_lists_.size() && free_lists_[i].empty())
+        {
+            ++i;
+        }
+        if (i == free_lists_.size())
+        {
+            return std::nullopt;
+        }
+
+        const VkDeviceSize offset = *free_lists_[i].begin();
+        free_lists_[i].erase(free_lists_[i].begin());
+        for (; i > order; --i)
+        {
+            free_lists_[i - 1].insert(offset + (min_size_ << (i - 1)));
+        }
+
+        used_ += block_size;
+        return offset;
+    }
+
+    void free(VkDeviceSize offset, VkDeviceSize block_size)
+    {
+        Expects(used_ >= block_size);
+        used_ -= block_size;
+
+        // Merge with the buddy for as long as it is free too
+        std::size_t order = order_of(block_size);
+        while (order + 1 < free_lists_.size())
+        {
+            const VkDeviceSize buddy = offset ^ (min_size_ << order);
+            const auto it            = free_lists_[order].find(buddy);
+            if (it == free_lists_[order].end())
+            {
+                break;
+            }
+            free_lists_[order].erase(it);
+            offset = std::min(offset, buddy);
+            ++order;
+        }
+        free_lists_[order].insert(offset);
+    }
+
+  private:
+    std::size_t order_of(VkDeviceSize block_size) const noexcept
+    {
+        return gsl::narrow_cast<std::size_t>(std::countr_zero(block_size) -
+                                             std::countr_zero(min_size_));
+    }
+
+    VkDeviceSize min_size_                        = {};
+    VkDeviceSize used_                            = 0;
+    std::vector<std::set<VkDeviceSize>> free_lists_ = {};
+};
+
+// Device memory bound to a buffer or image, either carved out of a shared
+// block or allocated just for that resource
+struct MemoryAllocation
+{
+    VkDeviceMemory memory = {};
+    VkDeviceSize offset   = {};
+    VkDeviceSize size     = {};
+    uint8_t *mapped       = nullptr; // Set for host visible memory
+    uint32_t memory_type  = {};
+    uint32_t pool         = {};
+    int32_t block         = -1; // -1 for dedicated allocations
+};
+
+struct HeapStatistics
+{
+    uint32_t block_count          = 0;
+    VkDeviceSize block_bytes      = 0;
+    uint32_t allocation_count     = 0;
+    VkDeviceSize allocation_bytes = 0;
+    uint32_t dedicated_count      = 0;
+    VkDeviceSize dedicated_bytes  = 0;
+};
+
+// The device calls the allocator makes. The application forwards them to
+// Vulkan, and the tests to a fake device. Map maps the whole allocation.
+class DeviceMemoryInterface
+{
+  public:
+    virtual ~DeviceMemoryInterface() = default;
+
+    virtual VkPhysicalDeviceMemoryProperties memory_properties() const = 0;
+    virtual VkDeviceSize buffer_image_granularity() const              = 0;
+    virtual VkResult allocate(const VkMemoryAllocateInfo &info,
+                              VkDeviceMemory *memory)                  = 0;
+    virtual void free(VkDeviceMemory memory) noexcept                  = 0;
+    virtual VkResult map(VkDeviceMemory memory, void **data)           = 0;
+};
+
+// Sub-allocates buffers and images from large per-memory-type blocks, so
+// the number of vkAllocateMemory calls stays far below
+// maxMemoryAllocationCount. Host visible blocks stay mapped.
+class DeviceMemoryAllocator
+{
+  public:
+    static constexpr VkDeviceSize max_block_size      = 64 * 1024 * 1024;
+    static constexpr VkDeviceSize min_allocation_size = 256;
+    static constexpr VkDeviceSize dedicated_image_size = 16 * 1024 * 1024;
+
+    void init(std::unique_ptr<DeviceMemoryInterface> device)
+    {
+        device_            = std::move(device);
+        memory_properties_ = device_->memory_properties();
+
+        // Buffers and optimal images may only share a granularity sized
+        // page when the buddy blocks are at least that large
+        separate_tilings_ =
+            device_->buffer_image_granularity() > min_allocation_size;
+
+        pools_.resize(memory_properties_.memoryTypeCount * 2);
+        heap_statistics_.resize(memory_properties_.memoryHeapCount);
+    }
+
+    void destroy() noexcept
+    {
+        for (auto &pool : pools_)
+        {
+            for (auto &block : pool)
+            {
+                if (block)
+                {
+                    device_->free(block->memory);
+                }
+            }
+        }
+        pools_.clear();
+        heap_statistics_.clear();
+        device_.reset();
+    }
+
+    // Linear is true for buffers and linear images, false for optimal images
+    MemoryAllocation allocate(const VkMemoryRequirements &requirements,
+                              VkMemoryPropertyFlags properties, bool linear)
+    {
+        const uint32_t memory_type =
+            find_memory_type(requirements.memoryTypeBits, properties);
+        HeapStatistics &heap = heap_statistics_[heap_index(memory_type)];
+        const VkDeviceSize block_size = block_size_for(memory_type);
+
+        // Lazily allocated memory is only committed per allocation, so it
+        // can't be shared out of a block
+        if (requirements.size > block_size / 2 ||
+            (!linear && requirements.size >= dedicated_image_size) ||
+            (property_flags(memory_type) &
+             VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT))
+        {
+            MemoryAllocation allocation = {
+                .size        = requirements.size,
+                .memory_type = memory_type,
+            };
+            allocation.memory = allocate_memory(memory_type, requirements.size,
+                                                &allocation.mapped);
+            heap.dedicated_count += 1;
+            heap.dedicated_bytes += requirements.size;
+            ++generation_;
+            return allocation;
+        }
+
+        const uint32_t pool_index =
+            memory_type * 2 + (separate_tilings_ && linear ? 1 : 0);
+        auto &pool = pools_[pool_index];
+
+        for (gsl::index i = 0; i < std::ssize(pool); ++i)
+        {
+            if (auto allocation = suballocate(pool_index, i, requirements))
+            {
+                return *allocation;
+            }
+        }
+
+        // Reuse the slot of a freed block if there is one
+        auto it = std::find(pool.begin(), pool.end(), std::nullopt);
+        if (it == pool.end())
+        {
+            it = pool.insert(pool.end(), std::nullopt);
+        }
+        MemoryBlock block = {
+            .allocator = BuddyAllocator(block_size, min_allocation_size),
+        };
+        block.memory = allocate_memory(memory_type, block_size, &block.mapped);
+        *it          = std::move(block);
+        heap.block_count += 1;
+        heap.block_bytes += block_size;
+
+        return *suballocate(pool_index, it - pool.begin(), requirements);
+    }
+
+    // Whether allocate can find a memory type with the properties
+    bool supports(uint32_t type_filter,
+                  VkMemoryPropertyFlags properties) const noexcept
+    {
+        return match_memory_type(type_filter, properties).has_value();
+    }
+
+    // Whether moving the allocation elsewhere helps compact its pool.
+    // Compaction drains the least occupied block of a pool into the other
+    // blocks, once they have room for everything in it, so that the
+    // emptied block can be freed.
+    bool should_move(const MemoryAllocation &allocation) const noexcept
+    {
+        if (allocation.block < 0)
+        {
+            return false;
+        }
+
+        const auto &pool            = pools_[allocation.pool];
+        const VkDeviceSize used     = pool[allocation.block]->allocator.used();
+        VkDeviceSize free_elsewhere = 0;
+        for (gsl::index i = 0; i < std::ssize(pool); ++i)
+        {
+            if (!pool[i] || i == allocation.block)
+            {
+                continue;
+            }
+            const BuddyAllocator &allocator = pool[i]->allocator;
+            if (allocator.used() < used ||
+                (allocator.used() == used && i < allocation.block))
+            {
+                return false;
+            }
+            free_elsewhere += allocator.size() - allocator.used();
+        }
+        return free_elsewhere >= used;
+    }
+
+    // Allocates room for a copy of an allocation in another block of its
+    // pool, filling the fullest blocks first. Never allocates a new block.
+    std::optional<MemoryAllocation>
+    allocate_for_move(const MemoryAllocation &allocation,
+                      const VkMemoryRequirements &requirements)
+    {
+        Expects(allocation.block >= 0 &&
+                (requirements.memoryTypeBits & (1u << allocation.memory_type)));
+
+        const auto &pool = pools_[allocation.pool];
+        std::vector<gsl::index> blocks;
+        for (gsl::index i = 0; i < std::ssize(pool); ++i)
+        {
+            if (pool[i] && i != allocation.block)
+            {
+                blocks.push_back(i);
+            }
+        }
+        std::sort(blocks.begin(), blocks.end(),
+                  [&](gsl::index a, gsl::index b) {
+                      return pool[a]->allocator.used() >
+                             pool[b]->allocator.used();
+                  });
+
+        for (const gsl::index i : blocks)
+        {
+            if (auto moved = suballocate(allocation.pool, i, requirements))
+            {
+                return moved;
+            }
+        }
+        return std::nullopt;
+    }
+
+    void free(const MemoryAllocation &allocation) noexcept
+    {
+        if (allocation.memory == VK_NULL_HANDLE)
+        {
+            return;
+        }
+        ++generation_;
+
+        HeapStatistics &heap =
+            heap_statistics_[heap_index(allocation.memory_type)];
+
+        if (allocation.block < 0)
+        {
+            device_->free(allocation.memory);
+            heap.dedicated_count -= 1;
+            heap.dedicated_bytes -= allocation.size;
+            return;
+        }
+
+        auto &pool  = pools_[allocation.pool];
+        auto &block = pool[allocation.block];
+        block->allocator.free(allocation.offset, allocation.size);
+        heap.allocation_count -= 1;
+        heap.allocation_bytes -= allocation.size;
+
+        // Give empty blocks back to the driver, keeping one per pool to
+        // avoid churn when a single resource is recreated
+        if (block->allocator.used() == 0 &&
+            std::count_if(pool.begin(), pool.end(),
+                          [](const auto &b) { return b.has_value(); }) > 1)
+        {
+            heap.block_count -= 1;
+            heap.block_bytes -= block->allocator.size();
+            device_->free(block->memory);
+            block.reset();
+        }
+    }
+
+    const std::vector<HeapStatistics> &heap_statistics() const noexcept
+    {
+        return heap_statistics_;
+    }
+
+    // 0 while the free space of every block is a single range, approaching
+    // 1 as it breaks up into ranges too small for most requests
+    double fragmentation() const noexcept
+    {
+        VkDeviceSize free_bytes    = 0;
+        VkDeviceSize largest_bytes = 0;
+        for (const auto &pool : pools_)
+        {
+            for (const auto &block : pool)
+            {
+                if (block)
+                {
+                    free_bytes +=
+                        block->allocator.size() - block->allocator.used();
+                    largest_bytes += block->allocator.largest_free();
+                }
+            }
+        }
+        return free_bytes > 0
+                   ? 1.0 - gsl::narrow_cast<double>(largest_bytes) / free_bytes
+                   : 0.0;
+    }
+
+    // Changes whenever memory is allocated or freed
+    uint64_t generation() const noexcept { return generation_; }
+
+  private:
+    struct MemoryBlock
+    {
+        VkDeviceMemory memory    = {};
+        uint8_t *mapped          = nullptr;
+        BuddyAllocator allocator;
+    };
+
+    std::optional<MemoryAllocation>
+    suballocate(uint32_t pool_index, gsl::index block_index,
+                const VkMemoryRequirements &requirements)
+    {
+        auto &block = pools_[pool_index][block_index];
+        if (!block)
+        {
+            return std::nullopt;
+        }
+
+        const auto offset = block->allocator.allocate(requirements.size,
+                                                      requirements.alignment);
+        if (!offset)
+        {
+            return std::nullopt;
+        }
+
+        const uint32_t memory_type = pool_index / 2;
+        MemoryAllocation allocation = {
+            .memory      = block->memory,
+            .offset      = *offset,
+            .size        = block->allocator.rounded_size(
+                requirements.size, requirements.alignment),
+            .mapped      = block->mapped
+                               ? std::next(block->mapped,
+                                           gsl::narrow_cast<std::ptrdiff_t>(
+                                               *offset))
+                               : nullptr,
+            .memory_type = memory_type,
+            .pool        = pool_index,
+            .block       = gsl::narrow_cast<int32_t>(block_index),
+        };
+
+        HeapStatistics &heap = heap_statistics_[heap_index(memory_type)];
+        heap.allocation_count += 1;
+        heap.allocation_bytes += allocation.size;
+        ++generation_;
+        return allocation;
+    }
+
+    uint32_t heap_index(uint32_t memory_type) const noexcept
+    {
+        [[gsl::suppress(bounds .2)]] return memory_properties_
+            .memoryTypes[memory_type]
+            .heapIndex;
+    }
+
+    // Small heaps get smaller blocks so that a few blocks can't exhaust them
+    VkDeviceSize block_size_for(uint32_t memory_type) const noexcept
+    {
+        [[gsl::suppress(bounds .2)]] const VkDeviceSize heap_size =
+            memory_properties_.memoryHeaps[heap_index(memory_type)].size;
+        return std::clamp(std::bit_floor(heap_size / 8),
+                          min_allocation_size, max_block_size);
+    }
+
+    VkMemoryPropertyFlags property_flags(uint32_t memory_type) const noexcept
+    {
+        [[gsl::suppress(bounds .2)]] return memory_properties_
+            .memoryTypes[memory_type]
+            .propertyFlags;
+    }
+
+    std::optional<uint32_t>
+    match_memory_type(uint32_t type_filter,
+                      VkMemoryPropertyFlags properties) const noexcept
+    {
+        for (uint32_t i = 0; i < memory_properties_.memoryTypeCount; ++i)
+        {
+            const bool matches_type_filter = (type_filter & (1 << i)) != 0;
+            const bool matches_properties =
+                (property_flags(i) & properties) == properties;
+            if (matches_type_filter && matches_properties)
+            {
+                return i;
+            }
+        }
+        return std::nullopt;
+    }
+
+    uint32_t find_memory_type(uint32_t type_filter,
+                              VkMemoryPropertyFlags properties) const
+    {
+        if (const auto memory_type = match_memory_type(type_filter, properties))
+        {
+            return *memory_type;
+        }
+
+        throw std::runtime_error("Failed to find suitable memory type!");
+    }
+
+    VkDeviceMemory allocate_memory(uint32_t memory_type, VkDeviceSize size,
+                                   uint8_t **mapped)
+    {
+        const VkMemoryAllocateInfo alloc_info = {
+            .sType           = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+            .allocationSize  = size,
+            .memoryTypeIndex = memory_type,
+        };
+
+        VkDeviceMemory memory = {};
+        if (device_->allocate(alloc_info, &memory) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to allocate device memory!");
+        }
+
+        *mapped = nullptr;
+        if (property_flags(memory_type) & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+        {
+            void *data = nullptr;
+            if (device_->map(memory, &data) != VK_SUCCESS)
+            {
+                throw std::runtime_error("Failed to map device memory!");
+            }
+            *mapped = static_cast<uint8_t *>(data);
+        }
+        return memory;
+    }
+
+    std::unique_ptr<DeviceMemoryInterface> device_      = {};
+    VkPhysicalDeviceMemoryProperties memory_properties_ = {};
+    bool separate_tilings_                              = true;
+    // Indexed by memory type * 2 + 1 for linear resources when they need
+    // their own blocks. Freed blocks leave an empty slot.
+    std::vector<std::vector<std::optional<MemoryBlock>>> pools_ = {};
+    std::vector<HeapStatistics> heap_statistics_                = {};
+    uint64_t generation_                                        = 0;
+};
@@ -25,26 +25,53 @@
 
 #include <fmt/core.h>
 
+#include "device_memory.h"
+#include "masked_occlusion.h"
+
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <bit>
 #include <chrono>
 #include <cmath>
+#include <compare>
+#include <condition_variable>
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <exception>
 #include <filesystem>
 #include <fstream>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <numbers>
+#include <numeric>
 #include <optional>
+#include <semaphore>
 #include <set>
+#include <span>
+#include <stop_token>
 #include <stdexcept>
 #include <string>
 #include <string_view>
 #include <thread>
+#include <tuple>
 #include <vector>
 
+#if defined(__SSE2__) || defined(_M_X64) ||                                   \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define USE_SSE2
+#include <emmintrin.h>
+#endif
+
 using glm::vec2, glm::vec3, glm::vec4, glm::mat4;
 using index_t = gsl::index;
 using gsl::narrow_cast;
@@ -131,6 +158,387 @@ DestroyDebugUtilsMessengerEXT(VkInstance instance,
     }
 }
 
+// Explicitly loaded extension
+[[gsl::suppress(26490)]] // Don't warn about the reinterpret_cast below
+static PFN_vkCmdDrawIndexedIndirectCountKHR
+LoadCmdDrawIndexedIndirectCountKHR(VkDevice device) noexcept
+{
+    return reinterpret_cast<PFN_vkCmdDrawIndexedIndirectCountKHR>(
+        vkGetDeviceProcAddr(device, "vkCmdDrawIndexedIndirectCountKHR"));
+}
+
+// Explicitly loaded, from Vulkan 1.2 or VK_KHR_timeline_semaphore
+[[gsl::suppress(26490)]] // Don't warn about the reinterpret_cast below
+static PFN_vkWaitSemaphoresKHR LoadWaitSemaphores(VkDevice device,
+                                                  bool khr) noexcept
+{
+    return reinterpret_cast<PFN_vkWaitSemaphoresKHR>(vkGetDeviceProcAddr(
+        device, khr ? "vkWaitSemaphoresKHR" : "vkWaitSemaphores"));
+}
+
+// Explicitly loaded, from Vulkan 1.2 or VK_KHR_timeline_semaphore
+[[gsl::suppress(26490)]] // Don't warn about the reinterpret_cast below
+static PFN_vkGetSemaphoreCounterValueKHR
+LoadGetSemaphoreCounterValue(VkDevice device, bool khr) noexcept
+{
+    return reinterpret_cast<PFN_vkGetSemaphoreCounterValueKHR>(
+        vkGetDeviceProcAddr(device, khr ? "vkGetSemaphoreCounterValueKHR"
+                                        : "vkGetSemaphoreCounterValue"));
+}
+
+// Explicitly loaded extension
+[[gsl::suppress(26490)]] // Don't warn about the reinterpret_cast below
+static PFN_vkGetPipelineExecutablePropertiesKHR
+LoadGetPipelineExecutablePropertiesKHR(VkDevice device) noexcept
+{
+    return reinterpret_cast<PFN_vkGetPipelineExecutablePropertiesKHR>(
+        vkGetDeviceProcAddr(device, "vkGetPipelineExecutablePropertiesKHR"));
+}
+
+// Explicitly loaded extension
+[[gsl::suppress(26490)]] // Don't warn about the reinterpret_cast below
+static PFN_vkGetPipelineExecutableStatisticsKHR
+LoadGetPipelineExecutableStatisticsKHR(VkDevice device) noexcept
+{
+    return reinterpret_cast<PFN_vkGetPipelineExecutableStatisticsKHR>(
+        vkGetDeviceProcAddr(device, "vkGetPipelineExecutableStatisticsKHR"));
+}
+
+struct HostScopeStatistics
+{
+    uint64_t calls         = 0; // Allocations and reallocations
+    uint64_t frees         = 0;
+    uint64_t bytes         = 0; // Requested over all calls
+    int64_t live_bytes     = 0;
+    int64_t peak_bytes     = 0;
+    int64_t internal_bytes = 0; // Allocated by the driver itself
+};
+
+// Receives the host allocations the Vulkan implementation makes through
+// VkAllocationCallbacks and counts them by VkSystemAllocationScope.
+// Command scope allocations only live for the duration of one call, so
+// they come from free lists private to the calling thread. The longer
+// lived scopes each share a locked pool. Small allocations are carved out
+// of chunks that are kept until exit, large ones go to operator new.
+class HostAllocator
+{
+  public:
+    static constexpr std::size_t scope_count =
+        VK_SYSTEM_ALLOCATION_SCOPE_INSTANCE + 1;
+
+    using Statistics = std::array<HostScopeStatistics, scope_count>;
+
+    HostAllocator() noexcept
+        : callbacks_ {
+              .pUserData             = this,
+              .pfnAllocation         = allocation,
+              .pfnReallocation       = reallocation,
+              .pfnFree               = free,
+              .pfnInternalAllocation = internal_allocation,
+              .pfnInternalFree       = internal_free,
+          }
+    {
+    }
+    HostAllocator(const HostAllocator &) = delete;
+    HostAllocator &operator=(const HostAllocator &) = delete;
+
+    const VkAllocationCallbacks *callbacks() const noexcept
+    {
+        return &callbacks_;
+    }
+
+    Statistics statistics() const noexcept
+    {
+        Statistics result = {};
+        for (std::size_t i = 0; i < scope_count; ++i)
+        {
+            const Counters &counters = counters_[i];
+            result[i]                = {
+                .calls          = counters.calls.load(),
+                .frees          = counters.frees.load(),
+                .bytes          = counters.bytes.load(),
+                .live_bytes     = counters.live_bytes.load(),
+                .peak_bytes     = counters.peak_bytes.load(),
+                .internal_bytes = counters.internal_bytes.load(),
+            };
+        }
+        return result;
+    }
+
+    // Logs the calls and bytes of each scope since an earlier snapshot
+    void log_statistics(std::string_view label,
+                        const Statistics &since = {}) const
+    {
+        constexpr std::array scope_names = {"command", "object", "cache",
+                                            "device", "instance"};
+
+        constexpr double kibibyte = 1024.0;
+        const Statistics now      = statistics();
+        for (std::size_t i = 0; i < scope_count; ++i)
+        {
+            const uint64_t calls = now[i].calls - since[i].calls;
+            if (calls == 0)
+            {
+                continue;
+            }
+            log_info("Host allocations for {}, {} scope: {} calls ({:.1f} "
+                     "KiB), {} frees, {:.1f} KiB live, {:.1f} KiB peak, "
+                     "{:.1f} KiB internal",
+                     label, scope_names[i], calls,
+                     (now[i].bytes - since[i].bytes) / kibibyte,
+                     now[i].frees - since[i].frees,
+                     now[i].live_bytes / kibibyte,
+                     now[i].peak_bytes / kibibyte,
+                     now[i].internal_bytes / kibibyte);
+        }
+    }
+
+  private:
+    static constexpr std::size_t chunk_size       = 64 * 1024;
+    static constexpr std::size_t min_block_size   = 16;
+    static constexpr std::size_t size_class_count = 9; // Up to 4 KiB
+    static constexpr uint32_t large_block         = UINT32_MAX;
+
+    // Stored just before every pointer handed out
+    struct Header
+    {
+        void *block         = nullptr;
+        std::size_t size    = 0;
+        uint32_t scope      = 0;
+        uint32_t size_class = 0;
+    };
+
+    struct Pool
+    {
+        std::array<void *, size_class_count> free_lists = {};
+        std::byte *chunk_head                           = nullptr;
+        std::byte *chunk_end                            = nullptr;
+    };
+
+    struct Counters
+    {
+        std::atomic<uint64_t> calls         = 0;
+        std::atomic<uint64_t> frees         = 0;
+        std::atomic<uint64_t> bytes         = 0;
+        std::atomic<int64_t> live_bytes     = 0;
+        std::atomic<int64_t> peak_bytes     = 0;
+        std::atomic<int64_t> internal_bytes = 0;
+    };
+
+    static HostAllocator &self(void *user_data) noexcept
+    {
+        return *static_cast<HostAllocator *>(user_data);
+    }
+
+    static Header &header_of(void *memory) noexcept
+    {
+        return *std::prev(static_cast<Header *>(memory));
+    }
+
+    static VKAPI_ATTR void *VKAPI_CALL
+    allocation(void *user_data, std::size_t size, std::size_t alignment,
+               VkSystemAllocationScope scope) noexcept
+    {
+        void *memory = self(user_data).allocate(size, alignment, scope);
+        if (memory == nullptr)
+        {
+            return nullptr;
+        }
+
+        Counters &counters = self(user_data).counters_[scope];
+        counters.calls += 1;
+        counters.bytes += size;
+
+        const int64_t live =
+            counters.live_bytes += narrow_cast<int64_t>(size);
+        int64_t peak = counters.peak_bytes.load();
+        while (live > peak &&
+               !counters.peak_bytes.compare_exchange_weak(peak, live))
+        {
+        }
+        return memory;
+    }
+
+    static VKAPI_ATTR void *VKAPI_CALL
+    reallocation(void *user_data, void *original, std::size_t size,
+                 std::size_t alignment, VkSystemAllocationScope scope) noexcept
+    {
+        if (original == nullptr)
+        {
+            return allocation(user_data, size, alignment, scope);
+        }
+        if (size == 0)
+        {
+            free(user_data, original);
+            return nullptr;
+        }
+
+        void *memory = allocation(user_data, size, alignment, scope);
+        if (memory != nullptr)
+        {
+            std::memcpy(memory, original,
+                        std::min(size, header_of(original).size));
+            free(user_data, original);
+        }
+        return memory;
+    }
+
+    static VKAPI_ATTR void VKAPI_CALL free(void *user_data,
+                                           void *memory) noexcept
+    {
+        if (memory == nullptr)
+        {
+            return;
+        }
+
+        const Header header = header_of(memory);
+        Counters &counters  = self(user_data).counters_[header.scope];
+
+        counters.frees += 1;
+        counters.live_bytes -= narrow_cast<int64_t>(header.size);
+        self(user_data).release(header);
+    }
+
+    static VKAPI_ATTR void VKAPI_CALL internal_allocation(
+        void *user_data, std::size_t size,
+        [[maybe_unused]] VkInternalAllocationType type,
+        VkSystemAllocationScope scope) noexcept
+    {
+        self(user_data).counters_[scope].internal_bytes +=
+            narrow_cast<int64_t>(size);
+    }
+
+    static VKAPI_ATTR void VKAPI_CALL internal_free(
+        void *user_data, std::size_t size,
+        [[maybe_unused]] VkInternalAllocationType type,
+        VkSystemAllocationScope scope) noexcept
+    {
+        self(user_data).counters_[scope].internal_bytes -=
+            narrow_cast<int64_t>(size);
+    }
+
+    [[gsl::suppress(26490)]] // Don't warn about the reinterpret_casts below
+    void *allocate(std::size_t size, std::size_t alignment,
+                   VkSystemAllocationScope scope) noexcept
+    {
+        // Keep the header aligned too
+        alignment = std::max(alignment, alignof(Header));
+        const std::size_t needed = sizeof(Header) + alignment + size;
+
+        uint32_t size_class = large_block;
+        void *block         = nullptr;
+        if (needed <= min_block_size << (size_class_count - 1))
+        {
+            size_class = narrow_cast<uint32_t>(
+                std::bit_width(std::bit_ceil(needed) / min_block_size) - 1);
+            if (scope == VK_SYSTEM_ALLOCATION_SCOPE_COMMAND)
+            {
+                block = take(thread_pool_, size_class);
+            }
+            else
+            {
+                std::scoped_lock lock {pool_mutexes_[scope]};
+                block = take(pools_[scope], size_class);
+            }
+        }
+        else
+        {
+            block = ::operator new(needed, std::nothrow);
+        }
+
+        // Vulkan reports a null allocation as out of host memory
+        if (block == nullptr)
+        {
+            return nullptr;
+        }
+
+        const std::uintptr_t address =
+            (reinterpret_cast<std::uintptr_t>(block) + sizeof(Header) +
+             alignment - 1) &
+            ~(alignment - 1);
+        void *memory      = reinterpret_cast<void *>(address);
+        header_of(memory) = {
+            .block      = block,
+            .size       = size,
+            .scope      = narrow_cast<uint32_t>(scope),
+            .size_class = size_class,
+        };
+        return memory;
+    }
+
+    void release(const Header &header) noexcept
+    {
+        if (header.size_class == large_block)
+        {
+            ::operator delete(header.block);
+        }
+        else if (header.scope == VK_SYSTEM_ALLOCATION_SCOPE_COMMAND)
+        {
+            give(thread_pool_, header.size_class, header.block);
+        }
+        else
+        {
+            std::scoped_lock lock {pool_mutexes_[header.scope]};
+            give(pools_[header.scope], header.size_class, header.block);
+        }
+    }
+
+    void *take(Pool &pool, uint32_t size_class) noexcept
+    {
+        void *&free_list = pool.free_lists[size_class];
+        if (free_list != nullptr)
+        {
+            void *block = free_list;
+            free_list   = *static_cast<void **>(block);
+            return block;
+        }
+
+        const auto block_size =
+            narrow_cast<std::ptrdiff_t>(min_block_size << size_class);
+        if (pool.chunk_end - pool.chunk_head < block_size)
+        {
+            // The rest of the old chunk is abandoned
+            std::scoped_lock lock {chunks_mutex_};
+            auto &chunk = chunks_.emplace_back(new (std::nothrow)
+                                                   std::byte[chunk_size]);
+            if (!chunk)
+            {
+                chunks_.pop_back();
+                return nullptr;
+            }
+            pool.chunk_head = chunk.get();
+            pool.chunk_end  = std::next(
+                chunk.get(), narrow_cast<std::ptrdiff_t>(chunk_size));
+        }
+
+        void *block     = pool.chunk_head;
+        pool.chunk_head = std::next(pool.chunk_head, block_size);
+        return block;
+    }
+
+    static void give(Pool &pool, uint32_t size_class, void *block) noexcept
+    {
+        *static_cast<void **>(block) = pool.free_lists[size_class];
+        pool.free_lists[size_class]  = block;
+    }
+
+    VkAllocationCallbacks callbacks_                  = {};
+    std::array<Counters, scope_count> counters_       = {};
+    std::array<Pool, scope_count> pools_              = {};
+    std::array<std::mutex, scope_count> pool_mutexes_ = {};
+    std::mutex chunks_mutex_                          = {};
+    std::vector<std::unique_ptr<std::byte[]>> chunks_ = {};
+    // Blocks can move between threads' free lists, so chunks are owned by
+    // the allocator rather than by the thread that carved them
+    static thread_local Pool thread_pool_;
+};
+
+thread_local HostAllocator::Pool HostAllocator::thread_pool_ = {};
+
+static HostAllocator gHostAllocator;
+static const VkAllocationCallbacks *const gAllocator =
+    gHostAllocator.callbacks();
+
 struct Vertex
 {
     vec3 pos;
@@ -185,14 +593,118 @@ struct Vertex
             },
         }};
     }
+
+    // The depth pre-pass reads positions alone, from their own stream
+    static constexpr VkVertexInputBindingDescription
+    get_position_binding_description() noexcept
+    {
+        return {.binding   = 0,
+                .stride    = sizeof(vec3),
+                .inputRate = VK_VERTEX_INPUT_RATE_VERTEX};
+    }
+
+    static constexpr VkVertexInputAttributeDescription
+    get_position_attribute_description() noexcept
+    {
+        return {
+            .location = 0,
+            .binding  = 0,
+            .format   = VK_FORMAT_R32G32B32_SFLOAT,
+            .offset   = 0,
+        };
+    }
 };
 
-struct UniformBufferObject
+// Constants shared by every draw in a frame
+struct FrameUniforms
 {
-    alignas(16) glm::mat4 model;
     alignas(16) glm::mat4 view;
     alignas(16) glm::mat4 proj;
     alignas(16) float time;
+    alignas(16) vec4 sun_position; // World space
+    vec2 viewport;                 // In pixels
+    float near_plane;
+    float far_plane;
+    uint32_t light_count;
+};
+
+// Constants for a single draw, with the products the vertex shader would
+// otherwise work out per vertex
+struct ObjectUniforms
+{
+    alignas(16) glm::mat4 model;
+    alignas(16) glm::mat4 model_view_proj;
+    alignas(16) glm::mat4 normal; // Inverse transpose of the model
+};
+
+// A dynamic light, matching PointLight in cluster_lights.comp
+struct PointLight
+{
+    vec4 position = {}; // World space, and the radius it reaches in w
+    vec4 colour   = {};
+};
+
+// A mesh's bounds and draw parameters, matching Draw in cull.comp
+struct alignas(16) SceneDraw
+{
+    vec4 sphere            = {}; // Object space centre and radius
+    uint32_t index_count   = 0;
+    uint32_t first_index   = 0;
+    int32_t vertex_offset  = 0;
+    uint32_t bucket        = 0;
+    uint32_t first_command = 0; // Where the bucket's commands start
+    uint32_t bucket_slot   = 0; // The mesh's command when not compacting
+};
+
+// Push constants of depth_pyramid.comp
+struct DepthPyramidConstants
+{
+    glm::ivec2 extent   = {}; // Drawn pixels of the depth buffer
+    int32_t level_count = 0;
+};
+
+struct FxaaConstants
+{
+    vec2 uv_scale   = {}; // The render extent over the scene image's size
+    vec2 texel_size = {}; // Of the scene image
+};
+
+// The specialisation constants of shader.vert and shader.frag, in
+// constant_id order
+struct ShaderConstants
+{
+    uint32_t max_point_lights = 0;
+    VkBool32 fog              = VK_TRUE;
+    VkBool32 vertex_colour    = VK_TRUE;
+    VkBool32 textured         = VK_TRUE;
+    vec3 base_colour          = {1.0f, 1.0f, 1.0f}; // Linear
+};
+
+// Which draws a cull.comp dispatch writes
+enum class CullingPhase : uint32_t
+{
+    All,   // Everything in the frustum
+    Early, // What was visible last frame
+    Late,  // What the depth pyramid shows has come into view
+};
+
+// Push constants of cull.comp
+struct CullingConstants
+{
+    std::array<vec4, 6> frustum_planes = {};
+    uint32_t landed_count              = 0;
+    uint32_t draw_count                = 0;
+    uint32_t compact                   = 0;
+    CullingPhase phase                 = CullingPhase::All;
+    vec2 viewport                      = {};
+};
+
+// What cull.comp counted for a frame, matching Statistics in cull.comp
+struct CullingStatistics
+{
+    uint32_t landed          = 0;
+    uint32_t outside_frustum = 0;
+    uint32_t occluded        = 0;
 };
 
 static constexpr vec4 rgba_to_vec4(uint32_t rgba) noexcept
@@ -223,26 +735,700 @@ static vec4 srgb_to_linear(vec4 colour) noexcept
     };
 }
 
+// Properties of an RGBA8 image that allow it to be stored more compactly
+struct PixelAnalysis
+{
+    bool opaque    = true; // Every alpha is 255
+    bool grayscale = true; // Every pixel has r == g == b
+    bool flat      = true; // Every pixel equals the first pixel
+};
+
+[[gsl::suppress(26490)]] // Don't warn about the reinterpret_cast below
+static PixelAnalysis
+analyse_pixels(const uint8_t *rgba, std::size_t pixel_count) noexcept
+{
+    Expects(rgba != nullptr && pixel_count > 0);
+
+    PixelAnalysis result = {};
+    std::size_t i        = 0;
+
+#ifdef USE_SSE2
+    // Four pixels per iteration. Pixels are little-endian 0xAABBGGRR.
+    uint32_t first = 0;
+    std::memcpy(&first, rgba, sizeof(first));
+    const __m128i first_pixel = _mm_set1_epi32(static_cast<int>(first));
+    const __m128i alpha_mask  = _mm_set1_epi32(static_cast<int>(0xff000000u));
+    const __m128i rgb_mask    = _mm_set1_epi32(0x0000ffff);
+    __m128i opaque            = _mm_set1_epi32(-1);
+    __m128i grayscale         = _mm_set1_epi32(-1);
+    __m128i flat              = _mm_set1_epi32(-1);
+    for (; i + 4 <= pixel_count; i += 4)
+    {
+        const __m128i p = _mm_loadu_si128(
+            reinterpret_cast<const __m128i *>(std::next(rgba, i * 4)));
+
+        opaque = _mm_and_si128(
+            opaque, _mm_cmpeq_epi32(_mm_and_si128(p, alpha_mask), alpha_mask));
+
+        // Bytes 0 and 1 of each lane compare r == g and g == b
+        const __m128i neighbours = _mm_cmpeq_epi8(p, _mm_srli_epi32(p, 8));
+        grayscale                = _mm_and_si128(
+            grayscale,
+            _mm_cmpeq_epi32(_mm_and_si128(neighbours, rgb_mask), rgb_mask));
+
+        flat = _mm_and_si128(flat, _mm_cmpeq_epi32(p, first_pixel));
+
+        // Stop early once nothing can be simplified
+        if ((i & 1023) == 0 && _mm_movemask_epi8(opaque) != 0xffff &&
+            _mm_movemask_epi8(grayscale) != 0xffff &&
+            _mm_movemask_epi8(flat) != 0xffff)
+        {
+            return {false, false, false};
+        }
+    }
+    result.opaque    = _mm_movemask_epi8(opaque) == 0xffff;
+    result.grayscale = _mm_movemask_epi8(grayscale) == 0xffff;
+    result.flat      = _mm_movemask_epi8(flat) == 0xffff;
+#endif
+
+    for (; i < pixel_count; ++i)
+    {
+        const uint8_t *p = std::next(rgba, i * 4);
+        result.opaque    = result.opaque && p[3] == 255;
+        result.grayscale = result.grayscale && p[0] == p[1] && p[1] == p[2];
+        result.flat      = result.flat && std::memcmp(p, rgba, 4) == 0;
+    }
+    return result;
+}
+
+static constexpr VkDeviceSize texture_memory_size(uint32_t width,
+                                                  uint32_t height,
+                                                  uint32_t bytes_per_pixel,
+                                                  uint32_t mip_levels) noexcept
+{
+    VkDeviceSize size = 0;
+    for (uint32_t i = 0; i < mip_levels; ++i)
+    {
+        size += VkDeviceSize {width} * height * bytes_per_pixel;
+        width  = std::max(width / 2, 1u);
+        height = std::max(height / 2, 1u);
+    }
+    return size;
+}
+
+static constexpr uint32_t mip_level_count(uint32_t width,
+                                          uint32_t height) noexcept
+{
+    uint32_t levels = 1;
+    for (uint32_t size = std::max(width, height); size > 1; size /= 2)
+    {
+        ++levels;
+    }
+    return levels;
+}
+
+// Forwards the allocator's device calls to Vulkan
+class VulkanDeviceMemory : public DeviceMemoryInterface
+{
+  public:
+    VulkanDeviceMemory(VkPhysicalDevice physical_device, VkDevice device)
+        : physical_device_(physical_device), device_(device)
+    {
+    }
+
+    VkPhysicalDeviceMemoryProperties memory_properties() const override
+    {
+        VkPhysicalDeviceMemoryProperties properties = {};
+        vkGetPhysicalDeviceMemoryProperties(physical_device_, &properties);
+        return properties;
+    }
+
+    VkDeviceSize buffer_image_granularity() const override
+    {
+        VkPhysicalDeviceProperties properties = {};
+        vkGetPhysicalDeviceProperties(physical_device_, &properties);
+        return properties.limits.bufferImageGranularity;
+    }
+
+    VkResult allocate(const VkMemoryAllocateInfo &info,
+                      VkDeviceMemory *memory) override
+    {
+        return vkAllocateMemory(device_, &info, gAllocator, memory);
+    }
+
+    void free(VkDeviceMemory memory) noexcept override
+    {
+        vkFreeMemory(device_, memory, gAllocator);
+    }
+
+    VkResult map(VkDeviceMemory memory, void **data) override
+    {
+        return vkMapMemory(device_, memory, 0, VK_WHOLE_SIZE, 0, data);
+    }
+
+  private:
+    VkPhysicalDevice physical_device_ = {};
+    VkDevice device_                  = {};
+};
+
+void log_memory_statistics(const DeviceMemoryAllocator &allocator)
+{
+    constexpr double mebibyte = 1024.0 * 1024.0;
+    const auto &heaps         = allocator.heap_statistics();
+    for (index_t i = 0; i < std::ssize(heaps); ++i)
+    {
+        const HeapStatistics &heap = heaps[i];
+        if (heap.block_count == 0 && heap.dedicated_count == 0)
+        {
+            continue;
+        }
+        log_info("Memory heap {}: {} blocks ({:.1f} MiB) holding {} "
+                 "allocations ({:.1f} MiB), {} dedicated ({:.1f} MiB)",
+                 i, heap.block_count, heap.block_bytes / mebibyte,
+                 heap.allocation_count, heap.allocation_bytes / mebibyte,
+                 heap.dedicated_count, heap.dedicated_bytes / mebibyte);
+    }
+    log_info("Memory fragmentation: {:.0f}%",
+             allocator.fragmentation() * 100.0);
+}
+
 class Application
 {
   private:
+    using clock = std::chrono::high_resolution_clock;
+
     struct Texture
     {
-        VkImage image_                = {};
-        VkDeviceMemory device_memory_ = {};
-        VkImageView image_view_       = {};
-        VkSampler sampler_            = {};
-        uint32_t mip_levels_          = {};
+        VkImage image_                  = {};
+        MemoryAllocation device_memory_ = {};
+        VkImageView image_view_         = {};
+        VkSampler sampler_              = {};
+        uint32_t mip_levels_            = {};
+        VkFormat format_                = {};
+        VkDeviceSize memory_size_       = {};
+        VkExtent2D extent_              = {};
+        VkComponentMapping components_  = {};
     };
 
-    // Limit the framerate. Coarse accuracy. Set to 0 for unlimited.
-    static constexpr int max_fps                   = 120;
-    static constexpr int initial_width_            = 800;
-    static constexpr int initial_height_           = 800;
-    static constexpr vec3 initial_camera_position_ = {0.0f, 1.5f, -3.0f};
-    static constexpr int max_frames_in_flight_     = 2;
-    static constexpr std::array validation_layers_ = {
-        "VK_LAYER_KHRONOS_validation"};
+    // Decoded pixels in the format they will be uploaded in
+    struct TextureData
+    {
+        std::string filename          = {};
+        uint32_t width                = {};
+        uint32_t height               = {};
+        uint32_t source_width         = {};
+        uint32_t source_height        = {};
+        VkFormat format               = VK_FORMAT_R8G8B8A8_SRGB;
+        VkComponentMapping components = {};
+        PixelAnalysis analysis        = {};
+        std::vector<uint8_t> pixels   = {};
+    };
+
+    // Every copy, barrier and mip blit for a load phase, recorded into one
+    // command buffer for the transfer queue and one for the graphics queue
+    // that finishes the batch once the copies have landed. Without a
+    // dedicated transfer queue both command buffers are the same. A single
+    // fence tracks the batch through both queues.
+    struct UploadBatch
+    {
+        uint64_t ticket                   = {};
+        VkCommandBuffer transfer_commands = {};
+        VkCommandBuffer graphics_commands = {};
+        VkFence fence                     = {};
+        bool transferred                  = false;
+        VkDeviceSize staging_bytes        = 0;
+        VkDeviceSize staging_end          = 0; // Staging ring head at submit
+        clock::time_point begin_time      = {};
+        clock::time_point submit_time     = {};
+    };
+
+    // Persistently mapped host memory that upload batches stage through.
+    // Positions only ever grow and wrap modulo the size. Everything before
+    // tail has been consumed by the transfer queue and can be overwritten.
+    struct StagingRing
+    {
+        VkBuffer buffer         = {};
+        MemoryAllocation memory = {};
+        uint8_t *mapped         = nullptr;
+        VkDeviceSize size       = {};
+        VkDeviceSize alignment  = {};
+        VkDeviceSize head       = {};
+        VkDeviceSize tail       = {};
+
+        // Returns the offset of bytes contiguous free bytes, skipping the
+        // end of the buffer rather than splitting a region across it
+        std::optional<VkDeviceSize> allocate(VkDeviceSize bytes) noexcept
+        {
+            VkDeviceSize start = (head + alignment - 1) / alignment * alignment;
+            if (start % size + bytes > size)
+            {
+                start += size - start % size;
+            }
+            if (start + bytes - tail > size)
+            {
+                return std::nullopt;
+            }
+            head = start + bytes;
+            return start % size;
+        }
+    };
+
+    // Persistently mapped host memory holding the constants of every frame
+    // in flight. A frame bump-allocates from its own region, which is
+    // reused once the frame has finished on the GPU. Draws find their
+    // constants through dynamic offsets.
+    struct UniformArena
+    {
+        VkBuffer buffer         = {};
+        MemoryAllocation memory = {};
+        VkDeviceSize frame_size = {};
+        VkDeviceSize alignment  = {};
+        VkDeviceSize head       = {};
+        VkDeviceSize end        = {};
+
+        void begin_frame(int frame) noexcept
+        {
+            head = frame * frame_size;
+            end  = head + frame_size;
+        }
+
+        // Copies data into the current frame's region and returns its
+        // dynamic offset
+        template <typename T> uint32_t push(const T &data)
+        {
+            return push_array(std::span(&data, 1));
+        }
+
+        // As push, for an array read by indexing from the returned offset
+        template <typename T> uint32_t push_array(std::span<const T> data)
+        {
+            const VkDeviceSize offset =
+                (head + alignment - 1) / alignment * alignment;
+            if (offset + data.size_bytes() > end)
+            {
+                throw std::runtime_error("Uniform arena is full!");
+            }
+            std::memcpy(std::next(memory.mapped,
+                                  narrow_cast<std::ptrdiff_t>(offset)),
+                        data.data(), data.size_bytes());
+            head = offset + data.size_bytes();
+            return narrow_cast<uint32_t>(offset);
+        }
+    };
+
+    // Copies of live resources into compacted memory, recorded on the
+    // graphics queue. The copies are ordered before every later frame, so
+    // the new handles are used straight away. The replaced resources are
+    // destroyed once the fence shows that the copies, and every frame that
+    // could still use the old handles, have finished.
+    struct DefragmentationPass
+    {
+        VkCommandBuffer commands             = {};
+        VkFence fence                        = {};
+        std::vector<VkBuffer> buffers        = {};
+        std::vector<VkImage> images          = {};
+        std::vector<VkImageView> image_views = {};
+        std::vector<MemoryAllocation> memory = {};
+        VkDeviceSize bytes                   = 0;
+    };
+
+    // Resources that frames in flight may still use, destroyed once every
+    // frame submitted before they were retired has finished
+    struct RetiredResources
+    {
+        uint64_t frame                                 = 0; // frame_number_
+        std::vector<VkSwapchainKHR> swap_chains        = {};
+        std::vector<VkRenderPass> render_passes        = {};
+        std::vector<VkFramebuffer> framebuffers        = {};
+        std::vector<VkDescriptorPool> descriptor_pools = {};
+        std::vector<VkSampler> samplers                = {};
+        std::vector<VkImageView> image_views           = {};
+        std::vector<VkImage> images                    = {};
+        std::vector<VkBuffer> buffers                  = {};
+        std::vector<MemoryAllocation> memory           = {};
+    };
+
+    // Replacement textures streamed in while the current ones are still
+    // drawn. Decoding runs on worker threads and the upload on the transfer
+    // queue, then the textures are swapped in and the old ones retired.
+    struct TextureSwap
+    {
+        std::vector<std::future<TextureData>> data = {}; // As textures_
+        std::vector<Texture> textures              = {};
+        uint64_t ticket                            = 0; // The last batch
+        bool resident                              = false; // Not placeholders
+        clock::time_point begin_time               = {};
+    };
+
+    // Records one slice of a frame's draws into secondary command buffers.
+    // There is a pool per frame in flight, reset wholesale once the frame
+    // has finished, and a buffer allocated from each. The cache pools
+    // hold the cached bucket buffers this recorder owns, which are reset one
+    // at a time. Every recorder but the first owns a thread that waits for
+    // start, runs job and then signals done; the first records on the main
+    // thread.
+    struct CommandRecorder
+    {
+        std::vector<VkCommandPool> pools       = {};
+        std::vector<VkCommandBuffer> buffers   = {};
+        std::vector<VkCommandPool> cache_pools = {};
+        std::binary_semaphore start {0};
+        std::binary_semaphore done {0};
+        std::function<void()> job = {};
+        std::exception_ptr error  = {};
+        std::jthread thread       = {};
+
+        // An empty job tells the thread to exit before it is joined
+        ~CommandRecorder()
+        {
+            if (thread.joinable())
+            {
+                job = {};
+                start.release();
+            }
+        }
+    };
+
+    // Represents a single part of a scene with a single material etc
+    struct MeshObject
+    {
+        std::vector<Vertex> vertices  = {};
+        std::vector<uint16_t> indices = {};
+        std::string texture_name      = {};
+        bool occluder_only            = false;
+    };
+
+    // Where a mesh's geometry sits in the scene's shared vertex and index
+    // buffers
+    struct MeshRange
+    {
+        int32_t vertex_offset = 0;
+        uint32_t first_index  = 0;
+        uint32_t index_count  = 0;
+        uint32_t vertex_count = 0;
+    };
+
+    // An axis-aligned box in object space
+    struct BoundingBox
+    {
+        vec3 lo = {};
+        vec3 hi = {};
+    };
+
+    // Replacement scene buffers with meshes added or removed. The kept
+    // meshes are copied out of the current buffers on the graphics queue
+    // and the added ones uploaded, then the buffers and the mesh tables are
+    // swapped in and the old buffers retired.
+    struct SceneSwap
+    {
+        VkBuffer vertex_buffer                = {};
+        MemoryAllocation vertex_memory        = {};
+        VkBuffer position_buffer              = {};
+        MemoryAllocation position_memory      = {};
+        VkBuffer index_buffer                 = {};
+        MemoryAllocation index_memory         = {};
+        VkDeviceSize vertex_count             = 0;
+        VkDeviceSize index_count              = 0;
+        std::vector<MeshRange> ranges         = {};
+        std::vector<vec4> bounds              = {};
+        std::vector<BoundingBox> boxes        = {};
+        std::vector<uint32_t> texture_indices = {};
+        // Buckets the added meshes make draw vertex colours
+        std::vector<uint32_t> vertex_colour_buckets = {};
+        uint64_t ticket                             = 0; // The last batch
+        clock::time_point begin_time                = {};
+    };
+
+    // The indirect draws cull.comp writes for one frame in flight, in a
+    // range for each bucket, and how many each bucket has when compacted
+    struct CullingFrame
+    {
+        VkBuffer commands                  = {};
+        MemoryAllocation commands_memory   = {};
+        VkBuffer counts                    = {};
+        MemoryAllocation counts_memory     = {};
+        VkBuffer statistics                = {}; // Host visible
+        MemoryAllocation statistics_memory = {};
+        VkDescriptorSet descriptor_set     = {};
+        VkDescriptorSet pyramid_set        = {}; // For depth_pyramid.comp
+        // Of the depth pyramid the sets point at, updated once the frame
+        // has finished
+        uint64_t pyramid_generation = 0;
+        // Of the scene the commands and set were made for, likewise
+        uint64_t scene_generation = 0;
+    };
+
+    // How the frame's draws were chosen, for comparing GPU frame times
+    enum class CullingMode
+    {
+        None,      // Recorded on the CPU, less any software occlusion hid
+        Frustum,   // cull.comp in one phase
+        Occlusion, // cull.comp in two phases around the depth pyramid
+    };
+
+    // The light clusters cluster_lights.comp bins for one frame in flight
+    struct ClusterFrame
+    {
+        VkBuffer clusters                = {}; // Counts, then index lists
+        MemoryAllocation clusters_memory = {};
+        VkDescriptorSet descriptor_set   = {};
+    };
+
+    // How a frame was drawn, for comparing GPU frame times
+    struct FrameSetup
+    {
+        CullingMode culling = CullingMode::None;
+        bool depth_prepass  = false;
+        index_t lights      = 0; // Into light_counts_
+        // The anti-aliasing benchmark run the frame is timed for, if any
+        index_t anti_aliasing_run = -1;
+        bool specialised_shaders  = false;
+    };
+
+    struct FrameTimes
+    {
+        double total_ms = 0.0;
+        uint64_t frames = 0;
+    };
+    using CullingFrameTimes = std::array<FrameTimes, 3>; // By CullingMode
+    using LightFrameTimes   = std::array<FrameTimes, 3>; // By light count
+    using ShaderFrameTimes  = std::array<FrameTimes, 2>; // Uber, specialised
+    // Frames by GPU time, in 1 ms bins and the last for anything longer
+    using FrameTimeHistogram = std::array<uint64_t, 33>;
+
+    // Where the CPU blocked while starting frames with a number in flight
+    struct FramePacingTimes
+    {
+        FrameTimes timeline = {}; // Until an earlier frame had finished
+        FrameTimes acquire  = {}; // In vkAcquireNextImageKHR
+    };
+
+    // How edges are smoothed: by multisampling, or by FXAA after the scene
+    // is drawn with a single sample
+    struct AntiAliasingMode
+    {
+        VkSampleCountFlagBits samples = VK_SAMPLE_COUNT_1_BIT;
+        bool fxaa                     = false;
+    };
+
+    // One mode at one window size, timed by the anti-aliasing benchmark
+    struct AntiAliasingRun
+    {
+        VkExtent2D window     = {}; // As asked for
+        AntiAliasingMode mode = {};
+        VkExtent2D extent     = {}; // As drawn
+        FrameTimes times      = {};
+    };
+
+    // Resizes the window every frame for a while, timing the swap chain
+    // recreations and the frames they land in
+    struct ResizeStorm
+    {
+        int frames                   = 0; // Resizes left
+        int window_width             = 0;
+        int window_height            = 0;
+        clock::time_point last_frame = {};
+        FrameTimes frame_times       = {}; // On the CPU, start to start
+        double worst_frame_ms        = 0.0;
+        FrameTimes recreation_times  = {};
+    };
+
+    // Times every anti-aliasing mode at each benchmark window size, then
+    // puts the window, the mode and dynamic resolution back
+    struct AntiAliasingBenchmark
+    {
+        std::vector<AntiAliasingRun> runs = {};
+        index_t run                       = 0;
+        int frames                        = 0; // Recorded for the run
+        int window_width                  = 0;
+        int window_height                 = 0;
+        AntiAliasingMode mode             = {};
+        bool dynamic_resolution           = false;
+    };
+
+    // Steers the resolution scale to hold the GPU frame time at a budget.
+    // The time grows with the pixel count, the square of the scale, so the
+    // error is the scale that would have met the budget, relative to the
+    // current one.
+    struct ResolutionController
+    {
+        static constexpr float proportional_gain = 0.2f;
+        static constexpr float integral_gain     = 0.05f;
+
+        float scale      = 1.0f;
+        float last_error = 0.0f;
+
+        // Takes the GPU time of a finished frame and returns the new scale.
+        // In velocity form the proportional term acts on the change in
+        // error and the integral term on the error, so clamping the scale
+        // never winds the integral up.
+        float update(double frame_ms, double budget_ms) noexcept
+        {
+            const float error = std::clamp(
+                narrow_cast<float>(std::sqrt(budget_ms / frame_ms)) - 1.0f,
+                -0.5f, 0.5f);
+            scale = std::clamp(scale +
+                                   proportional_gain * (error - last_error) +
+                                   integral_gain * error,
+                               min_resolution_scale_, 1.0f);
+            last_error = error;
+            return scale;
+        }
+    };
+
+    // The draws of one render bucket, the meshes sharing a texture, as
+    // recorded for one frame in flight. Reused while version matches the
+    // bucket's version.
+    struct CachedBucket
+    {
+        VkCommandBuffer buffer       = {};
+        VkCommandBuffer depth_buffer = {}; // Recorded with the pre-pass on
+        uint64_t version             = 0;
+        index_t draw_count           = 0;
+    };
+
+    // The pipelines compiled in the background, for each state they are
+    // asked for in
+    enum class PipelineKind : uint8_t
+    {
+        Shaded,
+        Depth,      // Positions only, for the pre-pass
+        EqualDepth, // Shaded where the depth matches the pre-pass
+        Fxaa,
+    };
+
+    // The features a bucket's shaders are specialised for. The defaults
+    // make the uber shader, which draws any bucket.
+    struct ShaderVariant
+    {
+        uint32_t max_point_lights = max_cluster_lights_;
+        bool fog                  = true;
+        bool vertex_colour        = true;
+        bool textured             = true;
+        uint32_t base_colour      = 0xffffffff; // sRGB RGBA, untextured
+
+        auto operator<=>(const ShaderVariant &) const = default;
+    };
+
+    // Identifies a pipeline by everything it is compiled for that changes
+    // at run time. The depth format and layouts are fixed for the device.
+    struct PipelineState
+    {
+        PipelineKind kind             = PipelineKind::Shaded;
+        VkSampleCountFlagBits samples = VK_SAMPLE_COUNT_1_BIT;
+        VkFormat format               = VK_FORMAT_UNDEFINED;
+        ShaderVariant variant         = {};
+
+        auto operator<=>(const PipelineState &) const = default;
+    };
+
+    // A pipeline waiting for a compile worker, and where its result goes
+    struct CompileJob
+    {
+        PipelineState state               = {};
+        VkRenderPass render_pass          = {};
+        std::promise<VkPipeline> pipeline = {};
+    };
+
+    // What a bucket's meshes need from the shaders
+    struct Material
+    {
+        bool vertex_colour = false; // Some vertex is not white
+        bool flat          = false; // The texture is one colour throughout
+        uint32_t texel     = 0;     // That colour, as sRGB RGBA
+    };
+
+    // The pipelines a bucket's draws are recorded with
+    struct BucketPipelines
+    {
+        VkPipeline shaded      = {};
+        VkPipeline equal_depth = {}; // After the pre-pass
+    };
+
+    // Which of a bucket's draws a secondary command buffer records
+    enum class DrawPass
+    {
+        Depth,  // Positions only, into the depth buffer
+        Colour, // Shaded, testing equal to the pre-pass depth when it is on
+    };
+
+    // Limit the framerate. Coarse accuracy. Set to 0 for unlimited.
+    static constexpr int max_fps                   = 120;
+    static constexpr int initial_width_            = 800;
+    static constexpr int initial_height_           = 800;
+    static constexpr vec3 initial_camera_position_ = {0.0f, 1.5f, -3.0f};
+    // Per frame resources are made for the most frames in flight, and the
+    // frames cycle through all of them however many are allowed in flight
+    static constexpr int max_frames_in_flight_     = 4;
+    // Dynamic resolution holds the GPU frame time at the frame budget by
+    // scaling the render extent down to the minimum. The extent changes in
+    // whole steps, as each change re-records the cached draws.
+    static constexpr double gpu_frame_budget_ms_ =
+        1'000.0 / (max_fps > 0 ? max_fps : 60);
+    static constexpr float min_resolution_scale_  = 0.5f;
+    static constexpr float resolution_scale_step_ = 1.0f / 32;
+    // The multisampling to start with, or the most the device has if less.
+    // M steps down through the other sample counts, then to FXAA.
+    static constexpr VkSampleCountFlagBits default_msaa_samples_ =
+        VK_SAMPLE_COUNT_4_BIT;
+    // The anti-aliasing benchmark times each mode at these window sizes.
+    // It skips the frames after each change while the swap chain settles.
+    static constexpr std::array<VkExtent2D, 2> benchmark_window_sizes_ = {{
+        {1920, 1080},
+        {3840, 2160},
+    }};
+    static constexpr int benchmark_settle_frames_ = 30;
+    static constexpr int benchmark_timed_frames_  = 120;
+    static constexpr int resize_storm_frames_     = 120; // W resizes as often
+    // Staged bytes after which a load phase submits its batch and starts
+    // another, so the GPU can copy while the CPU keeps recording
+    static constexpr VkDeviceSize max_upload_batch_bytes_ = 32 * 1024 * 1024;
+    // Set to true to submit and wait for each mesh's upload on its own, as
+    // loading did before upload batches, to measure batching against
+    static constexpr bool serial_uploads_ = false;
+    static constexpr VkDeviceSize staging_ring_size_      = 64 * 1024 * 1024;
+    // Larger uploads are split so that they never need the whole ring
+    static constexpr VkDeviceSize max_staging_chunk_bytes_ =
+        staging_ring_size_ / 4;
+    // Room for the constants of a few thousand draws and every light in
+    // each frame
+    static constexpr VkDeviceSize uniform_arena_frame_size_ = 2 * 1024 * 1024;
+    // Bytes the defragmenter may copy each frame, beyond its first move
+    static constexpr VkDeviceSize defrag_bytes_per_frame_ = 4 * 1024 * 1024;
+    // Fewer draws than this per thread cost more to hand out than to record
+    static constexpr index_t min_draws_per_recorder_ = 256;
+    static constexpr index_t max_command_recorders_  = 8;
+    // Pipelines compiling at once; the rest wait in the queue
+    static constexpr index_t max_compile_workers_ = 4;
+    // Draws recorded by the command recording benchmark
+    static constexpr index_t benchmark_draw_count_ = 100'000;
+    static constexpr uint32_t culling_group_size_   = 64; // As in cull.comp
+    // Tile and level limit of depth_pyramid.comp
+    static constexpr uint32_t depth_pyramid_tile_size_  = 64;
+    static constexpr uint32_t max_depth_pyramid_levels_ = 16;
+    // Software occlusion buffer size, in whole 32x8 tiles
+    static constexpr int software_occlusion_width_  = 384;
+    static constexpr int software_occlusion_height_ = 216;
+    // Meshes used as occluders when the scene tags none
+    static constexpr index_t occluder_mesh_count_ = 4;
+    // Boxes tested by the software occlusion benchmark
+    static constexpr index_t benchmark_box_count_ = 100'000;
+    static constexpr float near_plane_            = 0.1f;
+    static constexpr float far_plane_             = 10.0f;
+    // Froxel grid of cluster_lights.comp, in tiles across the screen and
+    // slices spaced exponentially in depth. A cluster lists this many
+    // lights at most.
+    static constexpr uint32_t cluster_tiles_x_    = 16;
+    static constexpr uint32_t cluster_tiles_y_    = 9;
+    static constexpr uint32_t cluster_slices_     = 24;
+    static constexpr uint32_t max_cluster_lights_ = 128;
+    static constexpr uint32_t cluster_group_size_ = 64; // As in the shader
+    // The light counts L steps through, timed on the GPU for comparison
+    static constexpr std::array<uint32_t, 3> light_counts_ = {8, 256, 4096};
+    // Saved on exit and loaded at startup, relative to the working directory
+    static constexpr const char *pipeline_cache_path_ = "pipeline_cache.bin";
+    static constexpr std::array validation_layers_ = {
+        "VK_LAYER_KHRONOS_validation"};
     static constexpr std::array device_extensions_ = {
         VK_KHR_SWAPCHAIN_EXTENSION_NAME};
     static constexpr bool enable_validation_layers_ =
@@ -250,10 +1436,37 @@ class Application
 
     GLFWwindow *window_                                  = nullptr;
     VkInstance instance_                                 = {};
+    uint32_t api_version_                                = {}; // Instance
     VkPhysicalDevice physical_device_                    = {};
     VkDevice device_                                     = {};
+    VkPipelineCache pipeline_cache_                      = {};
+    bool pipeline_cache_warm_                            = false; // Loaded
+    // Every pipeline compiled, by state, kept until exit
+    std::map<PipelineState, std::shared_future<VkPipeline>> pipelines_ = {};
+    // Compatible with the passes the pipelines draw in, one per post or
+    // scene, sample count and format. Kept until exit for the compiles that
+    // may outlive the swap chain's own passes.
+    std::map<std::tuple<bool, VkSampleCountFlagBits, VkFormat>, VkRenderPass>
+        pipeline_render_passes_ = {};
+    // Compiles request_pipeline has queued, taken in order by the workers
+    std::deque<CompileJob> compile_jobs_        = {};
+    std::mutex compile_mutex_                   = {};
+    std::condition_variable_any compile_queued_ = {};
+    std::vector<std::jthread> compile_workers_  = {};
+    // Loaded once, and shared by every compile of the graphics pipelines
+    VkShaderModule vert_shader_module_                   = {};
+    VkShaderModule frag_shader_module_                   = {};
+    VkShaderModule depth_shader_module_                  = {};
+    VkShaderModule fullscreen_shader_module_             = {};
+    VkShaderModule fxaa_shader_module_                   = {};
+    clock::time_point pipelines_requested_               = {};
+    bool pipelines_pending_                              = false;
+    DeviceMemoryAllocator memory_allocator_              = {};
     VkQueue graphics_queue_                              = {};
     VkQueue present_queue_                               = {};
+    VkQueue transfer_queue_                              = {};
+    uint32_t graphics_queue_family_                      = {};
+    uint32_t transfer_queue_family_                      = {};
     VkSurfaceKHR surface_                                = {};
     VkSwapchainKHR swap_chain_                           = {};
     VkFormat swap_chain_image_format_                    = {};
@@ -264,31 +1477,169 @@ class Application
     VkDescriptorSetLayout descriptor_set_layout_         = {};
     VkPipelineLayout pipeline_layout_                    = {};
     VkPipeline graphics_pipeline_                        = {};
-    std::vector<VkFramebuffer> swap_chain_framebuffers_  = {};
+    VkPipeline depth_pipeline_                           = {};
+    VkPipeline equal_depth_pipeline_                     = {};
+    bool depth_prepass_                                  = false;
+    bool fog_                                            = true;
+    // Each bucket draws with shaders specialised for its material, rather
+    // than the uber shader
+    bool specialise_shaders_                             = true;
+    bool variants_ready_                                 = false;
+    // Set by the keys that change which variants are drawn, for the next
+    // frame to request them outside the key callback
+    bool pipelines_outdated_                             = false;
+    VkFramebuffer scene_framebuffer_                     = {};
+    // Drawn or resolved into at the render extent, then scaled up to the
+    // swap chain by a blit or by FXAA
+    VkImage scene_image_                                 = {};
+    MemoryAllocation scene_image_memory_                 = {};
+    VkImageView scene_image_view_                        = {};
+    VkExtent2D render_extent_                            = {};
+    bool dynamic_resolution_                             = true;
+    float resolution_scale_                              = 1.0f;
+    ResolutionController resolution_controller_          = {};
+    FrameTimeHistogram gpu_frame_time_histogram_         = {};
+    bool fxaa_                                           = false;
+    VkRenderPass post_render_pass_                       = {};
+    std::vector<VkFramebuffer> post_framebuffers_        = {};
+    VkSampler post_sampler_                              = {};
+    VkDescriptorSetLayout post_set_layout_               = {};
+    VkDescriptorPool post_descriptor_pool_               = {};
+    VkDescriptorSet post_descriptor_set_                 = {};
+    VkPipelineLayout post_pipeline_layout_               = {};
+    VkPipeline post_pipeline_                            = {};
+    std::optional<AntiAliasingBenchmark> aa_benchmark_   = {};
+    bool benchmark_anti_aliasing_                        = false;
     VkCommandPool command_pool_                          = {};
+    VkCommandPool transfer_command_pool_                 = {};
     std::vector<VkCommandBuffer> command_buffers_        = {};
+    std::deque<CommandRecorder> command_recorders_       = {};
+    std::vector<std::vector<index_t>> bucket_meshes_     = {};
+    std::vector<Material> bucket_materials_              = {};
+    std::vector<BucketPipelines> bucket_pipelines_       = {};
+    std::vector<uint32_t> bucket_first_commands_         = {};
+    std::vector<uint64_t> bucket_versions_               = {};
+    std::vector<CachedBucket> bucket_cache_              = {};
+    uint64_t bucket_cache_hits_                          = 0;
+    uint64_t bucket_cache_misses_                        = 0;
+    uint64_t cached_draws_recorded_                      = 0;
+    uint64_t cached_draws_reused_                        = 0;
+    clock::duration bucket_recording_time_               = {};
+    bool benchmark_recording_                            = false;
+    std::vector<uint64_t> descriptor_set_versions_       = {};
     std::vector<VkSemaphore> image_available_semaphores_ = {};
     std::vector<VkSemaphore> render_finished_semaphores_ = {};
-    std::vector<VkFence> in_flight_fences_               = {};
-    std::vector<VkFence> images_in_flight_               = {};
+    // Signalled with frame_number_ + 1 by each frame's submission
+    VkSemaphore frame_timeline_                          = {};
+    // Without timeline semaphores, the fence each slot's submission
+    // signals, and the frame_number_ + 1 it was submitted as
+    std::vector<VkFence> frame_fences_                   = {};
+    std::vector<uint64_t> fence_frames_                  = {};
+    int frames_in_flight_                                = 2; // 1 to max
+    std::array<FramePacingTimes, max_frames_in_flight_> frame_pacing_ = {};
     int current_frame_                                   = 0;
+    uint64_t frame_number_                               = 0; // Submitted
+    std::deque<RetiredResources> retired_resources_      = {};
     bool framebuffer_resized_                            = false;
+    std::optional<ResizeStorm> resize_storm_             = {};
+    bool benchmark_resizing_                             = false;
     VkDebugUtilsMessengerEXT debug_messenger_            = {};
-    std::vector<VkBuffer> vertex_buffers_                = {};
-    std::vector<VkDeviceMemory> vertex_buffer_memory_    = {};
-    std::vector<VkBuffer> index_buffers_                 = {};
-    std::vector<VkDeviceMemory> index_buffer_memory_     = {};
-    std::vector<uint16_t> index_buffer_counts_           = {};
-    std::vector<VkBuffer> uniform_buffers_               = {};
-    std::vector<VkDeviceMemory> uniform_buffers_memory_  = {};
+    VkBuffer scene_vertex_buffer_                        = {};
+    MemoryAllocation scene_vertex_memory_                = {};
+    VkDeviceSize scene_vertex_bytes_                     = 0;
+    VkBuffer scene_position_buffer_                      = {};
+    MemoryAllocation scene_position_memory_              = {};
+    VkDeviceSize scene_position_bytes_                   = 0;
+    VkBuffer scene_index_buffer_                         = {};
+    MemoryAllocation scene_index_memory_                 = {};
+    VkDeviceSize scene_index_bytes_                      = 0;
+    std::vector<MeshRange> mesh_ranges_                  = {};
+    std::vector<vec4> mesh_bounds_                       = {};
+    uint64_t scene_generation_                           = 0; // Swaps
+    UniformArena uniform_arena_                          = {};
+    uint32_t frame_uniform_offset_                       = 0;
+    uint32_t object_uniform_offset_                      = 0;
+    bool gpu_culling_supported_                          = false;
+    bool gpu_culling_                                    = false;
+    VkBuffer scene_draw_buffer_                          = {};
+    MemoryAllocation scene_draw_memory_                  = {};
+    std::vector<CullingFrame> culling_frames_            = {};
+    VkDescriptorSetLayout culling_set_layout_            = {};
+    VkDescriptorPool culling_descriptor_pool_            = {};
+    VkPipelineLayout culling_pipeline_layout_            = {};
+    VkPipeline culling_pipeline_                         = {};
+    std::array<vec4, 6> frustum_planes_                  = {};
+    bool occlusion_culling_supported_                    = false;
+    bool occlusion_culling_                              = false;
+    bool reset_visibility_                               = true;
+    VkBuffer visibility_buffer_                          = {};
+    MemoryAllocation visibility_memory_                  = {};
+    VkRenderPass early_render_pass_                      = {};
+    VkRenderPass late_render_pass_                       = {};
+    VkImage depth_pyramid_                               = {};
+    MemoryAllocation depth_pyramid_memory_               = {};
+    VkImageView depth_pyramid_view_                      = {};
+    std::vector<VkImageView> depth_pyramid_levels_       = {};
+    VkSampler depth_sampler_                             = {};
+    VkBuffer pyramid_progress_buffer_                    = {};
+    MemoryAllocation pyramid_progress_memory_            = {};
+    VkDescriptorSetLayout pyramid_set_layout_            = {};
+    VkDescriptorPool pyramid_descriptor_pool_            = {};
+    uint64_t depth_pyramid_generation_                   = 0;
+    VkPipelineLayout pyramid_pipeline_layout_            = {};
+    VkPipeline pyramid_pipeline_                         = {};
+    VkQueryPool timestamp_pool_                          = {};
+    double timestamp_period_ns_                          = 0.0;
+    uint64_t timestamp_mask_                             = 0;
+    std::vector<std::optional<FrameSetup>> frame_setups_ = {};
+    // Without and with the depth pre-pass
+    std::array<CullingFrameTimes, 2> gpu_frame_times_    = {};
+    LightFrameTimes light_frame_times_                   = {};
+    ShaderFrameTimes shader_frame_times_                 = {};
+    index_t light_count_index_                           = 1;
+    std::vector<PointLight> lights_                      = {};
+    uint32_t light_uniform_offset_                       = 0;
+    std::vector<ClusterFrame> cluster_frames_            = {};
+    VkDescriptorSetLayout cluster_set_layout_            = {};
+    VkDescriptorPool cluster_descriptor_pool_            = {};
+    VkPipelineLayout cluster_pipeline_layout_            = {};
+    VkPipeline cluster_pipeline_                         = {};
+    uint64_t occlusion_landed_                           = 0;
+    uint64_t occlusion_outside_frustum_                  = 0;
+    uint64_t occlusion_occluded_                         = 0;
+    bool software_occlusion_                             = true;
+    MaskedOcclusionBuffer occlusion_buffer_              = {
+        software_occlusion_width_, software_occlusion_height_};
+    std::vector<vec3> occluder_triangles_                = {};
+    std::vector<vec4> occluder_clip_                     = {};
+    mat4 model_view_proj_                                = {};
+    std::vector<BoundingBox> mesh_boxes_                 = {};
+    std::vector<bool> mesh_visibility_                   = {};
+    uint64_t software_occlusion_frames_                  = 0;
+    uint64_t software_occlusion_tested_                  = 0;
+    uint64_t software_occlusion_culled_                  = 0;
+    clock::duration occluder_render_time_                = {};
+    clock::duration occlusion_test_time_                 = {};
     std::vector<uint32_t> texture_indices_               = {};
+    std::vector<uint64_t> mesh_uploads_                  = {};
+    std::deque<UploadBatch> pending_uploads_             = {};
+    StagingRing staging_ring_                            = {};
+    uint64_t issued_uploads_                             = 0;
+    uint64_t completed_uploads_                          = 0;
+    std::optional<DefragmentationPass> defrag_pass_      = {};
+    uint64_t defrag_idle_generation_                     = 0;
+    uint32_t defrag_moves_                               = 0;
+    VkDeviceSize defrag_bytes_moved_                     = 0;
+    clock::time_point init_time_                         = {};
+    // Since the transfer queue last ran out of batches, until the next
+    std::optional<clock::time_point> transfer_idle_since_ = {};
+    clock::duration transfer_idle_time_                   = {};
     VkDescriptorPool descriptor_pool_                    = {};
     std::vector<VkDescriptorSet> descriptor_sets_        = {};
     VkImage colour_image_                                = {};
-    VkDeviceMemory colour_image_memory_                  = {};
     VkImageView colour_image_view_                       = {};
     VkImage depth_image_                                 = {};
-    VkDeviceMemory depth_image_memory_                   = {};
+    std::vector<MemoryAllocation> attachment_memory_     = {};
     VkImageView depth_image_view_                        = {};
     mat4 camera_transform_ =
         glm::lookAt(initial_camera_position_, vec3(0.0f, 0.0f, 0.0f),
@@ -298,7 +1649,28 @@ class Application
     mat4 mouse_grab_transform_                     = {};
     std::vector<Texture> textures_                 = {};
     std::map<std::string, uint32_t> texture_names_ = {};
+    // Whether textures_ holds the loaded textures rather than placeholders
+    bool textures_resident_                        = true;
+    std::optional<TextureSwap> texture_swap_       = {};
+    bool texture_swap_requested_                   = false;
+    std::optional<SceneSwap> scene_swap_           = {};
+    index_t added_cube_count_                      = 0; // At the end
+    bool mesh_add_requested_                       = false;
+    bool mesh_remove_requested_                    = false;
     VkSampleCountFlagBits msaa_samples_            = VK_SAMPLE_COUNT_1_BIT;
+    VkSampleCountFlagBits max_msaa_samples_        = VK_SAMPLE_COUNT_1_BIT;
+    VkSampleCountFlags msaa_sample_counts_         = 0;
+    VkSampleCountFlags sampled_depth_counts_       = 0;
+    // Loaded when VK_KHR_draw_indirect_count is available
+    PFN_vkCmdDrawIndexedIndirectCountKHR cmd_draw_indirect_count_ = {};
+    // Loaded when VK_KHR_pipeline_executable_properties is available, to
+    // report the compiled statistics of each shader variant
+    PFN_vkGetPipelineExecutablePropertiesKHR get_executable_properties_ = {};
+    PFN_vkGetPipelineExecutableStatisticsKHR get_executable_statistics_ = {};
+    // Loaded with timeline semaphores, which pace the frames where the
+    // device has them
+    PFN_vkWaitSemaphoresKHR wait_semaphores_                       = {};
+    PFN_vkGetSemaphoreCounterValueKHR get_semaphore_counter_value_ = {};
 
   public:
     void run()
@@ -336,26 +1708,48 @@ class Application
 
     void init_vulkan()
     {
+        init_time_ = clock::now();
+
         create_instance();
         setup_debug_messenger();
         create_surface();
         pick_physical_device();
         create_logical_device();
+        create_pipeline_cache();
+        create_compile_workers();
         create_swap_chain();
         create_image_views();
         create_render_pass();
         create_descriptor_set_layout();
-        create_graphics_pipeline();
+        create_pipeline_layouts();
+        request_pipelines();
         create_command_pool();
-        create_colour_resources();
-        create_depth_resources();
+        create_command_recorders();
+        create_staging_ring();
+        create_uniform_arena();
+        create_light_clusters();
+        create_transient_attachments();
+        log_attachment_footprints();
+        create_scene_image();
         create_framebuffers();
+        create_post_pass();
+        const auto before_assets = gHostAllocator.statistics();
         create_mesh();
-        create_uniform_buffers();
+        gHostAllocator.log_statistics("asset loading", before_assets);
+        create_bucket_cache();
+        request_pipelines(); // Each bucket's variant
+        create_gpu_culling();
+        create_depth_pyramid();
+        create_timestamp_queries();
         create_descriptor_pool();
         create_descriptor_sets();
         create_command_buffers();
         create_sync_objects();
+
+        log_info("Initialised Vulkan in {} ms",
+                 std::chrono::duration_cast<std::chrono::milliseconds>(
+                     clock::now() - init_time_)
+                     .count());
     }
 
     void main_loop()
@@ -457,67 +1851,129 @@ class Application
 
     void cleanup() noexcept
     {
-        cleanup_swap_chain();
-        for (auto texture : textures_)
+        if (defrag_pass_)
         {
-            vkDestroySampler(device_, texture.sampler_, nullptr);
-            vkDestroyImageView(device_, texture.image_view_, nullptr);
-            vkDestroyImage(device_, texture.image_, nullptr);
-            vkFreeMemory(device_, texture.device_memory_, nullptr);
+            finish_defragmentation_pass();
         }
-        textures_.clear();
-        texture_names_.clear();
-        vkDestroyDescriptorSetLayout(device_, descriptor_set_layout_, nullptr);
-        descriptor_set_layout_ = {};
-        for (auto buffer : index_buffers_)
+        if (texture_swap_)
         {
-            vkDestroyBuffer(device_, buffer, nullptr);
+            for (auto &texture : texture_swap_->textures)
+            {
+                retire_texture(retired_resources(), texture);
+            }
+            texture_swap_.reset();
         }
-        index_buffers_.clear();
-        for (auto memory : index_buffer_memory_)
+        if (scene_swap_)
         {
-            vkFreeMemory(device_, memory, nullptr);
+            retire_scene_swap(retired_resources(), *scene_swap_);
+            scene_swap_.reset();
         }
-        index_buffer_memory_.clear();
-        index_buffer_counts_.clear();
-        for (auto buffer : vertex_buffers_)
+        cleanup_swap_chain();
+        vkDestroyDescriptorPool(device_, descriptor_pool_, gAllocator);
+        descriptor_pool_ = {};
+        vkFreeCommandBuffers(device_, command_pool_,
+                             narrow_cast<uint32_t>(command_buffers_.size()),
+                             command_buffers_.data());
+        for (auto texture : textures_)
         {
-            vkDestroyBuffer(device_, buffer, nullptr);
+            vkDestroySampler(device_, texture.sampler_, gAllocator);
+            vkDestroyImageView(device_, texture.image_view_, gAllocator);
+            vkDestroyImage(device_, texture.image_, gAllocator);
+            memory_allocator_.free(texture.device_memory_);
         }
-        vertex_buffers_.clear();
-        for (auto memory : vertex_buffer_memory_)
+        textures_.clear();
+        texture_names_.clear();
+        // Needs the pipelines and the buckets' materials
+        log_shader_statistics();
+        destroy_pipelines();
+        destroy_compile_workers();
+        vkDestroyDescriptorSetLayout(device_, descriptor_set_layout_,
+                                     gAllocator);
+        descriptor_set_layout_ = {};
+        destroy_gpu_culling();
+        destroy_light_clusters();
+        vkDestroyQueryPool(device_, timestamp_pool_, gAllocator);
+        timestamp_pool_ = {};
+        vkDestroyBuffer(device_, scene_index_buffer_, gAllocator);
+        memory_allocator_.free(scene_index_memory_);
+        scene_index_buffer_ = {};
+        vkDestroyBuffer(device_, scene_vertex_buffer_, gAllocator);
+        memory_allocator_.free(scene_vertex_memory_);
+        scene_vertex_buffer_ = {};
+        vkDestroyBuffer(device_, scene_position_buffer_, gAllocator);
+        memory_allocator_.free(scene_position_memory_);
+        scene_position_buffer_ = {};
+        mesh_ranges_.clear();
+        mesh_bounds_.clear();
+        mesh_boxes_.clear();
+        mesh_visibility_.clear();
+        occluder_triangles_.clear();
+        texture_indices_.clear();
+        mesh_uploads_.clear();
+        for (auto &batch : pending_uploads_)
         {
-            vkFreeMemory(device_, memory, nullptr);
+            destroy_upload_batch(batch);
         }
-        vertex_buffer_memory_.clear();
-        texture_indices_.clear();
+        pending_uploads_.clear();
+        vkDestroyBuffer(device_, staging_ring_.buffer, gAllocator);
+        memory_allocator_.free(staging_ring_.memory);
+        staging_ring_ = {};
+        vkDestroyBuffer(device_, uniform_arena_.buffer, gAllocator);
+        memory_allocator_.free(uniform_arena_.memory);
+        uniform_arena_ = {};
         for (auto semaphore : render_finished_semaphores_)
         {
-            vkDestroySemaphore(device_, semaphore, nullptr);
+            vkDestroySemaphore(device_, semaphore, gAllocator);
         }
         render_finished_semaphores_.clear();
         for (auto semaphore : image_available_semaphores_)
         {
-            vkDestroySemaphore(device_, semaphore, nullptr);
+            vkDestroySemaphore(device_, semaphore, gAllocator);
         }
         image_available_semaphores_.clear();
-        for (auto fence : in_flight_fences_)
+        vkDestroySemaphore(device_, frame_timeline_, gAllocator);
+        frame_timeline_ = {};
+        for (auto fence : frame_fences_)
         {
-            vkDestroyFence(device_, fence, nullptr);
+            vkDestroyFence(device_, fence, gAllocator);
         }
-        in_flight_fences_.clear();
-        vkDestroyCommandPool(device_, command_pool_, nullptr);
-        vkDestroyDevice(device_, nullptr);
+        frame_fences_.clear();
+        fence_frames_.clear();
+        bucket_cache_.clear();
+        bucket_versions_.clear();
+        bucket_first_commands_.clear();
+        bucket_meshes_.clear();
+        bucket_materials_.clear();
+        destroy_command_recorders();
+        vkDestroyCommandPool(device_, transfer_command_pool_, gAllocator);
+        transfer_command_pool_ = {};
+        vkDestroyCommandPool(device_, command_pool_, gAllocator);
+        log_bucket_cache_statistics();
+        log_culling_statistics();
+        log_software_occlusion_statistics();
+        log_lighting_statistics();
+        log_frame_pacing_statistics();
+        log_resolution_statistics();
+        log_info("Defragmentation moved {} allocations ({:.1f} MiB)",
+                 defrag_moves_, defrag_bytes_moved_ / (1024.0 * 1024.0));
+        save_pipeline_cache();
+        vkDestroyPipelineCache(device_, pipeline_cache_, gAllocator);
+        pipeline_cache_ = {};
+        log_memory_statistics(memory_allocator_);
+        memory_allocator_.destroy();
+        vkDestroyDevice(device_, gAllocator);
         device_ = nullptr;
-        vkDestroySurfaceKHR(instance_, surface_, nullptr);
+        vkDestroySurfaceKHR(instance_, surface_, gAllocator);
         surface_ = {};
         if (enable_validation_layers_)
         {
-            DestroyDebugUtilsMessengerEXT(instance_, debug_messenger_, nullptr);
+            DestroyDebugUtilsMessengerEXT(instance_, debug_messenger_,
+                                          gAllocator);
             debug_messenger_ = {};
         }
-        vkDestroyInstance(instance_, nullptr);
+        vkDestroyInstance(instance_, gAllocator);
         instance_ = nullptr;
+        gHostAllocator.log_statistics("application lifetime");
         glfwDestroyWindow(window_);
         window_ = nullptr;
         glfwTerminate();
@@ -531,13 +1987,19 @@ class Application
                 throw std::runtime_error("Validation layers not available!!");
         }
 
+        // The newest version used, 1.2 for the timeline semaphore, and no
+        // newer than the loader
+        uint32_t loader_version = VK_API_VERSION_1_0;
+        vkEnumerateInstanceVersion(&loader_version);
+        api_version_ = std::min(loader_version, VK_API_VERSION_1_2);
+
         const VkApplicationInfo app_info {
             .sType              = VK_STRUCTURE_TYPE_APPLICATION_INFO,
             .pApplicationName   = "Hello Vulkan",
             .applicationVersion = VK_MAKE_VERSION(1, 0, 0),
             .pEngineName        = "No Engine",
             .engineVersion      = VK_MAKE_VERSION(1, 0, 0),
-            .apiVersion         = VK_API_VERSION_1_0,
+            .apiVersion         = api_version_,
         };
 
         const auto required_extensions = get_required_extensions();
@@ -574,7 +2036,8 @@ class Application
             }
         }
 
-        if (vkCreateInstance(&create_info, nullptr, &instance_) != VK_SUCCESS)
+        if (vkCreateInstance(&create_info, gAllocator, &instance_) !=
+            VK_SUCCESS)
         {
             throw std::runtime_error("Failed to create instance!");
         }
@@ -610,7 +2073,7 @@ class Application
         const auto debug_utils_messenger_info =
             get_debug_utils_messenger_info();
         if (CreateDebugUtilsMessengerEXT(instance_, &debug_utils_messenger_info,
-                                         nullptr,
+                                         gAllocator,
                                          &debug_messenger_) != VK_SUCCESS)
         {
             throw std::runtime_error("Failes to set up debug messenger!");
@@ -619,8 +2082,8 @@ class Application
 
     void create_surface()
     {
-        if (glfwCreateWindowSurface(instance_, window_, nullptr, &surface_) !=
-            VK_SUCCESS)
+        if (glfwCreateWindowSurface(instance_, window_, gAllocator,
+                                    &surface_) != VK_SUCCESS)
         {
             throw std::runtime_error("Failed to create window surface!");
         }
@@ -660,13 +2123,15 @@ class Application
             }
         }
 
-        physical_device_ = devices.front();
-        msaa_samples_    = get_max_usable_sample_count(physical_device_);
+        physical_device_    = devices.front();
+        msaa_sample_counts_ = get_usable_sample_counts(physical_device_);
+        max_msaa_samples_   = get_max_usable_sample_count(physical_device_);
+        msaa_samples_ = std::min(max_msaa_samples_, default_msaa_samples_);
 
         if (gBuildConfig.log_verbose)
         {
             log_info("Selected physical device with {} bit multisampling",
-                     static_cast<uint32_t>(msaa_samples_));
+                     static_cast<uint32_t>(max_msaa_samples_));
         }
     }
 
@@ -675,10 +2140,15 @@ class Application
         const QueueFamilyIndices indices =
             find_queue_families(physical_device_, surface_);
 
+        graphics_queue_family_ = indices.graphics_family.value();
+        transfer_queue_family_ =
+            indices.transfer_family.value_or(graphics_queue_family_);
+
         std::vector<VkDeviceQueueCreateInfo> queue_create_infos;
         std::set<uint32_t> unique_queue_families = {
-            indices.graphics_family.value(),
+            graphics_queue_family_,
             indices.present_family.value(),
+            transfer_queue_family_,
         };
 
         // NB: queue_priorities lifetime needs to match queue_create_infos
@@ -695,12 +2165,121 @@ class Application
             queue_create_infos.push_back(info);
         }
 
+        // GPU culling writes a range of indirect draws per bucket, each
+        // naming its mesh's constants with firstInstance
+        VkPhysicalDeviceFeatures supported_features = {};
+        vkGetPhysicalDeviceFeatures(physical_device_, &supported_features);
+        gpu_culling_supported_ = supported_features.multiDrawIndirect &&
+                                 supported_features.drawIndirectFirstInstance;
+
+        // Occlusion culling builds the depth pyramid from the multisampled
+        // depth buffer, writing every level through one array of images
+        VkPhysicalDeviceProperties properties = {};
+        vkGetPhysicalDeviceProperties(physical_device_, &properties);
+        VkFormatProperties depth_properties = {};
+        vkGetPhysicalDeviceFormatProperties(
+            physical_device_, find_depth_format(physical_device_),
+            &depth_properties);
+        sampled_depth_counts_ = properties.limits.sampledImageDepthSampleCounts;
+        occlusion_culling_supported_ =
+            gpu_culling_supported_ &&
+            max_msaa_samples_ != VK_SAMPLE_COUNT_1_BIT &&
+            (sampled_depth_counts_ & max_msaa_samples_) != 0 &&
+            (depth_properties.optimalTilingFeatures &
+             VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT) != 0 &&
+            supported_features.shaderStorageImageArrayDynamicIndexing;
+
         const VkPhysicalDeviceFeatures device_features = {
+            .multiDrawIndirect = supported_features.multiDrawIndirect,
+            .drawIndirectFirstInstance =
+                supported_features.drawIndirectFirstInstance,
             .samplerAnisotropy = VK_TRUE,
+            .shaderStorageImageArrayDynamicIndexing =
+                supported_features.shaderStorageImageArrayDynamicIndexing,
+        };
+
+        // Optional extensions go after the required ones
+        std::vector<const char *> extensions(device_extensions_.begin(),
+                                             device_extensions_.end());
+        const bool draw_indirect_count_supported = has_device_extension(
+            physical_device_, VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME);
+        if (draw_indirect_count_supported)
+        {
+            extensions.push_back(VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME);
+        }
+
+        // Features are only used up to the version both sides have
+        const uint32_t api_version =
+            std::min(properties.apiVersion, api_version_);
+
+        // Drivers report instruction and register counts for each shader
+        // variant through VK_KHR_pipeline_executable_properties
+        VkPhysicalDevicePipelineExecutablePropertiesFeaturesKHR
+            executable_features = {
+                .sType =
+                    VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PIPELINE_EXECUTABLE_PROPERTIES_FEATURES_KHR,
+            };
+        if (api_version >= VK_API_VERSION_1_1 &&
+            has_device_extension(
+                physical_device_,
+                VK_KHR_PIPELINE_EXECUTABLE_PROPERTIES_EXTENSION_NAME))
+        {
+            VkPhysicalDeviceFeatures2 features = {
+                .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+                .pNext = &executable_features,
+            };
+            vkGetPhysicalDeviceFeatures2(physical_device_, &features);
+        }
+        const bool executable_statistics =
+            executable_features.pipelineExecutableInfo;
+        if (executable_statistics)
+        {
+            extensions.push_back(
+                VK_KHR_PIPELINE_EXECUTABLE_PROPERTIES_EXTENSION_NAME);
+        }
+
+        // Frames are paced with a timeline semaphore where there is one,
+        // core from 1.2 and VK_KHR_timeline_semaphore before that, and
+        // otherwise with a fence per frame in flight
+        const bool khr_timeline_semaphore =
+            api_version >= VK_API_VERSION_1_1 &&
+            api_version < VK_API_VERSION_1_2 &&
+            has_device_extension(physical_device_,
+                                 VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME);
+        VkPhysicalDeviceTimelineSemaphoreFeatures timeline_features = {
+            .sType =
+                VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES,
         };
+        if (api_version >= VK_API_VERSION_1_2 || khr_timeline_semaphore)
+        {
+            VkPhysicalDeviceFeatures2 features = {
+                .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+                .pNext = &timeline_features,
+            };
+            vkGetPhysicalDeviceFeatures2(physical_device_, &features);
+        }
+        const bool timeline_semaphore = timeline_features.timelineSemaphore;
+        if (timeline_semaphore && khr_timeline_semaphore)
+        {
+            extensions.push_back(VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME);
+        }
+
+        // Each enabled feature struct goes on the front of the chain
+        void *features_chain = nullptr;
+        if (timeline_semaphore)
+        {
+            timeline_features.pNext = features_chain;
+            features_chain          = &timeline_features;
+        }
+        if (executable_statistics)
+        {
+            executable_features.pNext = features_chain;
+            features_chain            = &executable_features;
+        }
 
-        VkDeviceCreateInfo create_info = {
+        const VkDeviceCreateInfo create_info = {
             .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
+            .pNext = features_chain,
             .queueCreateInfoCount =
                 narrow_cast<uint32_t>(queue_create_infos.size()),
             .pQueueCreateInfos = queue_create_infos.data(),
@@ -711,13 +2290,13 @@ class Application
             .ppEnabledLayerNames =
                 enable_validation_layers_ ? validation_layers_.data() : nullptr,
             .enabledExtensionCount =
-                narrow_cast<uint32_t>(device_extensions_.size()),
-            .ppEnabledExtensionNames = device_extensions_.data(),
+                narrow_cast<uint32_t>(extensions.size()),
+            .ppEnabledExtensionNames = extensions.data(),
             .pEnabledFeatures        = &device_features,
         };
 
-        if (vkCreateDevice(physical_device_, &create_info, nullptr, &device_) !=
-            VK_SUCCESS)
+        if (vkCreateDevice(physical_device_, &create_info, gAllocator,
+                           &device_) != VK_SUCCESS)
         {
             throw std::runtime_error("Failed to create logical device!");
         }
@@ -725,85 +2304,553 @@ class Application
                          &graphics_queue_);
         vkGetDeviceQueue(device_, indices.present_family.value(), 0,
                          &present_queue_);
-    }
-
-    void create_swap_chain()
-    {
-        const SwapChainSupportDetails swap_chain_support =
-            query_swap_chain_support(physical_device_, surface_);
-
-        const VkSurfaceFormatKHR surface_format =
-            choose_swap_surface_format(swap_chain_support.formats);
-        const VkPresentModeKHR present_mode =
-            choose_swap_present_mode(swap_chain_support.present_modes);
-
-        int width  = 0;
-        int height = 0;
-        glfwGetFramebufferSize(window_, &width, &height);
-        Expects(width >= 0 && height >= 0);
-
-        const VkExtent2D extent =
-            choose_swap_extent(swap_chain_support.capabilities, width, height);
-
-        const uint32_t min_images =
-            swap_chain_support.capabilities.minImageCount;
-        const uint32_t max_images =
-            swap_chain_support.capabilities.maxImageCount;
-        const uint32_t image_count = max_images == 0
-                                         ? (min_images + 1)
-                                         : std::min(min_images + 1, max_images);
+        vkGetDeviceQueue(device_, transfer_queue_family_, 0, &transfer_queue_);
 
-        VkSwapchainCreateInfoKHR create_info = {
-            .sType            = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR,
-            .surface          = surface_,
-            .minImageCount    = min_images,
-            .imageFormat      = surface_format.format,
-            .imageColorSpace  = surface_format.colorSpace,
-            .imageExtent      = extent,
-            .imageArrayLayers = 1,
-            .imageUsage       = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
-            .preTransform   = swap_chain_support.capabilities.currentTransform,
-            .compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR,
-            .presentMode    = present_mode,
-            .clipped        = VK_TRUE,
-            .oldSwapchain   = {},
-        };
+        memory_allocator_.init(
+            std::make_unique<VulkanDeviceMemory>(physical_device_, device_));
 
-        const QueueFamilyIndices indices =
-            find_queue_families(physical_device_, surface_);
-        const uint32_t queue_family_indices[] = {
-            indices.graphics_family.value(), indices.present_family.value()};
-        if (indices.graphics_family != indices.present_family)
+        if (draw_indirect_count_supported)
         {
-            create_info.imageSharingMode      = VK_SHARING_MODE_CONCURRENT;
-            create_info.queueFamilyIndexCount = 2;
-            create_info.pQueueFamilyIndices   = &queue_family_indices[0];
+            cmd_draw_indirect_count_ =
+                LoadCmdDrawIndexedIndirectCountKHR(device_);
+        }
+        if (executable_statistics)
+        {
+            get_executable_properties_ =
+                LoadGetPipelineExecutablePropertiesKHR(device_);
+            get_executable_statistics_ =
+                LoadGetPipelineExecutableStatisticsKHR(device_);
+        }
+        if (timeline_semaphore)
+        {
+            wait_semaphores_ =
+                LoadWaitSemaphores(device_, khr_timeline_semaphore);
+            get_semaphore_counter_value_ =
+                LoadGetSemaphoreCounterValue(device_, khr_timeline_semaphore);
         }
         else
         {
-            create_info.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
+            log_warn("Pacing frames with fences, as timeline semaphores are "
+                     "unsupported");
         }
+        gpu_culling_       = gpu_culling_supported_;
+        occlusion_culling_ = occlusion_culling_supported_;
 
-        if (vkCreateSwapchainKHR(device_, &create_info, nullptr,
-                                 &swap_chain_) != VK_SUCCESS)
+        if (gBuildConfig.log_verbose)
         {
-            throw std::runtime_error("Failed to create swap chain!");
+            log_info(has_dedicated_transfer_queue()
+                         ? "Uploading on dedicated transfer queue family {}"
+                         : "Uploading on graphics queue family {}",
+                     transfer_queue_family_);
+        }
+        if (!gpu_culling_supported_)
+        {
+            log_warn("Culling on the CPU, as indirect multi-draw with a "
+                     "first instance is unsupported");
+        }
+        else if (gBuildConfig.log_verbose)
+        {
+            log_info(cmd_draw_indirect_count_
+                         ? "Culling on the GPU with compacted indirect draws"
+                         : "Culling on the GPU with zero instance draws");
+        }
+        if (gpu_culling_supported_ && !occlusion_culling_supported_)
+        {
+            log_warn("Occlusion culling is unsupported, as the multisampled "
+                     "depth buffer can't be sampled");
         }
-
-        uint32_t swap_chain_image_count = 0;
-        vkGetSwapchainImagesKHR(device_, swap_chain_, &swap_chain_image_count,
-                                nullptr);
-        swap_chain_images_.resize(swap_chain_image_count);
-        vkGetSwapchainImagesKHR(device_, swap_chain_, &swap_chain_image_count,
-                                swap_chain_images_.data());
-
-        swap_chain_image_format_ = surface_format.format;
-        swap_chain_extent_       = extent;
     }
 
-    void create_image_views()
+    // Creates the cache every pipeline is created through, seeded with
+    // what the last run saved. Drivers should reject data from another
+    // device or driver version themselves, but not all of them do.
+    void create_pipeline_cache()
     {
-        swap_chain_image_views_.resize(swap_chain_images_.size());
+        std::vector<char> data;
+        if (std::filesystem::exists(pipeline_cache_path_))
+        {
+            data = read_bytes(pipeline_cache_path_);
+            if (!is_pipeline_cache_compatible(data))
+            {
+                log_warn("Ignoring {}, as another device or driver saved it",
+                         pipeline_cache_path_);
+                data.clear();
+            }
+        }
+        pipeline_cache_warm_ = !data.empty();
+
+        const VkPipelineCacheCreateInfo cache_info = {
+            .sType           = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+            .initialDataSize = data.size(),
+            .pInitialData    = data.data(),
+        };
+        if (vkCreatePipelineCache(device_, &cache_info, gAllocator,
+                                  &pipeline_cache_) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create pipeline cache!");
+        }
+    }
+
+    // Whether the header of saved cache data matches this device and the
+    // driver's cache format
+    bool is_pipeline_cache_compatible(std::span<const char> data) const
+    {
+        VkPipelineCacheHeaderVersionOne header = {};
+        if (data.size() < sizeof(header))
+        {
+            return false;
+        }
+        std::memcpy(&header, data.data(), sizeof(header));
+
+        VkPhysicalDeviceProperties properties = {};
+        vkGetPhysicalDeviceProperties(physical_device_, &properties);
+        return header.headerSize >= sizeof(header) &&
+               header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+               header.vendorID == properties.vendorID &&
+               header.deviceID == properties.deviceID &&
+               std::memcmp(header.pipelineCacheUUID,
+                           properties.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+    }
+
+    // Writes the cache beside the old one and renames it into place, so
+    // that exiting part way through never leaves a truncated cache
+    void save_pipeline_cache() noexcept
+    {
+        std::size_t size = 0;
+        std::vector<char> data;
+        if (vkGetPipelineCacheData(device_, pipeline_cache_, &size,
+                                   nullptr) == VK_SUCCESS)
+        {
+            data.resize(size);
+        }
+        if (data.empty() ||
+            vkGetPipelineCacheData(device_, pipeline_cache_, &size,
+                                   data.data()) != VK_SUCCESS)
+        {
+            log_warn("Failed to read back the pipeline cache");
+            return;
+        }
+
+        const std::filesystem::path path = pipeline_cache_path_;
+        std::filesystem::path temporary  = path;
+        temporary += ".tmp";
+        {
+            std::ofstream file {temporary, std::ios::binary | std::ios::trunc};
+            file.write(data.data(), narrow_cast<std::streamsize>(size));
+            if (!file)
+            {
+                log_warn("Failed to write {}", temporary.string());
+                return;
+            }
+        }
+        std::error_code error;
+        std::filesystem::rename(temporary, path, error);
+        if (error)
+        {
+            log_warn("Failed to replace {}: {}", path.string(),
+                     error.message());
+        }
+    }
+
+    // Every pipeline is created through these, against the shared cache,
+    // which the driver synchronises for the background compiles
+    VkResult
+    create_graphics_pipeline(const VkGraphicsPipelineCreateInfo &info,
+                             VkPipeline *pipeline) const
+    {
+        return vkCreateGraphicsPipelines(device_, pipeline_cache_, 1, &info,
+                                         gAllocator, pipeline);
+    }
+
+    VkResult create_compute_pipeline(const VkComputePipelineCreateInfo &info,
+                                     VkPipeline *pipeline) const
+    {
+        return vkCreateComputePipelines(device_, pipeline_cache_, 1, &info,
+                                        gAllocator, pipeline);
+    }
+
+    // The state a pipeline of the given kind is compiled for now. Only the
+    // shaded pipelines are specialised.
+    PipelineState pipeline_state(PipelineKind kind,
+                                 const ShaderVariant &variant) const
+    {
+        const bool shaded =
+            kind == PipelineKind::Shaded || kind == PipelineKind::EqualDepth;
+        const bool post = kind == PipelineKind::Fxaa;
+        return {
+            .kind    = kind,
+            .samples = post ? VK_SAMPLE_COUNT_1_BIT : msaa_samples_,
+            .format  = swap_chain_image_format_,
+            .variant = shaded ? variant : ShaderVariant {},
+        };
+    }
+
+    // The shaders a bucket draws with, for its material and the current
+    // settings
+    ShaderVariant shader_variant(index_t bucket) const
+    {
+        if (!specialise_shaders_)
+        {
+            return {};
+        }
+        const Material &material = bucket_materials_[bucket];
+        return {
+            .max_point_lights = std::min(light_counts_[light_count_index_],
+                                         max_cluster_lights_),
+            .fog              = fog_,
+            .vertex_colour    = material.vertex_colour,
+            .textured         = !material.flat,
+            .base_colour      = material.flat ? material.texel : 0xffffffff,
+        };
+    }
+
+    // Queues a pipeline for the current state for the compile workers,
+    // unless it has already been asked for
+    std::shared_future<VkPipeline>
+    request_pipeline(PipelineKind kind, const ShaderVariant &variant)
+    {
+        const PipelineState state = pipeline_state(kind, variant);
+        if (const auto found = pipelines_.find(state);
+            found != pipelines_.end())
+        {
+            return found->second;
+        }
+
+        // Pipelines only need a compatible render pass, so compiles share
+        // their own, which the swap chain can be rebuilt without
+        const bool post = kind == PipelineKind::Fxaa;
+        VkRenderPass &compatible =
+            pipeline_render_passes_[{post, state.samples, state.format}];
+        if (!compatible)
+        {
+            compatible = post ? create_post_render_pass()
+                              : create_render_pass(CullingPhase::All);
+        }
+        const VkRenderPass render_pass = compatible;
+
+        std::promise<VkPipeline> compiled = {};
+        auto pipeline                     = compiled.get_future().share();
+        {
+            std::scoped_lock lock {compile_mutex_};
+            compile_jobs_.push_back({
+                .state       = state,
+                .render_pass = render_pass,
+                .pipeline    = std::move(compiled),
+            });
+        }
+        compile_queued_.notify_one();
+        pipelines_.emplace(state, pipeline);
+        return pipeline;
+    }
+
+    // Starts the threads that compile the queued pipelines, leaving the
+    // command recorders some cores
+    void create_compile_workers()
+    {
+        const auto thread_count = std::clamp<index_t>(
+            std::thread::hardware_concurrency() / 2, 1, max_compile_workers_);
+        for (index_t i = 0; i < thread_count; ++i)
+        {
+            compile_workers_.emplace_back(
+                [this](std::stop_token stop) { run_compile_worker(stop); });
+        }
+
+        log_info("Compiling pipelines on {} threads", thread_count);
+    }
+
+    // Stops and joins the workers. Any compile still queued is abandoned,
+    // which its future reports as a broken promise.
+    void destroy_compile_workers() noexcept
+    {
+        compile_workers_.clear();
+        compile_jobs_.clear();
+    }
+
+    // Compiles queued pipelines until asked to stop with the queue empty
+    void run_compile_worker(std::stop_token stop) noexcept
+    {
+        for (;;)
+        {
+            std::unique_lock lock {compile_mutex_};
+            if (!compile_queued_.wait(lock, stop, [this] {
+                    return !compile_jobs_.empty();
+                }))
+            {
+                return;
+            }
+            CompileJob job = std::move(compile_jobs_.front());
+            compile_jobs_.pop_front();
+            lock.unlock();
+
+            try
+            {
+                job.pipeline.set_value(
+                    job.state.kind == PipelineKind::Fxaa
+                        ? compile_fxaa_pipeline(job.render_pass)
+                        : compile_scene_pipeline(job.state, job.render_pass));
+            }
+            catch (...)
+            {
+                job.pipeline.set_exception(std::current_exception());
+            }
+        }
+    }
+
+    // Asks for every pipeline the current state draws with: the uber
+    // shaders, and each bucket's variant. Until they are ready, frames skip
+    // what they draw or fall back to the uber shaders.
+    void request_pipelines()
+    {
+        const auto size_before   = pipelines_.size();
+        const ShaderVariant uber = {};
+        for (const PipelineKind kind :
+             {PipelineKind::Shaded, PipelineKind::Depth,
+              PipelineKind::EqualDepth, PipelineKind::Fxaa})
+        {
+            request_pipeline(kind, uber);
+        }
+        for (index_t bucket = 0; bucket < std::ssize(bucket_materials_);
+             ++bucket)
+        {
+            const ShaderVariant variant = shader_variant(bucket);
+            request_pipeline(PipelineKind::Shaded, variant);
+            request_pipeline(PipelineKind::EqualDepth, variant);
+        }
+        if (pipelines_.size() > size_before)
+        {
+            pipelines_requested_ = clock::now();
+            pipelines_pending_   = true;
+        }
+        update_pipelines();
+    }
+
+    // The pipeline for the current state if it has finished compiling,
+    // rethrowing if it failed to
+    VkPipeline ready_pipeline(PipelineKind kind,
+                              const ShaderVariant &variant) const
+    {
+        const auto found = pipelines_.find(pipeline_state(kind, variant));
+        if (found == pipelines_.end() ||
+            found->second.wait_for(std::chrono::seconds(0)) !=
+                std::future_status::ready)
+        {
+            return {};
+        }
+        return found->second.get();
+    }
+
+    // Picks up the pipelines that have finished compiling, once per frame
+    // before recording
+    void update_pipelines()
+    {
+        const ShaderVariant uber = {};
+        const VkPipeline shaded  = ready_pipeline(PipelineKind::Shaded, uber);
+        const VkPipeline depth   = ready_pipeline(PipelineKind::Depth, uber);
+        const VkPipeline equal_depth =
+            ready_pipeline(PipelineKind::EqualDepth, uber);
+        if (shaded != graphics_pipeline_ || depth != depth_pipeline_ ||
+            equal_depth != equal_depth_pipeline_)
+        {
+            graphics_pipeline_    = shaded;
+            depth_pipeline_       = depth;
+            equal_depth_pipeline_ = equal_depth;
+            invalidate_buckets();
+        }
+        post_pipeline_ = ready_pipeline(PipelineKind::Fxaa, uber);
+
+        // A bucket whose variant is still compiling draws with the uber
+        // shaders meanwhile
+        bool variants_ready = true;
+        bucket_pipelines_.resize(bucket_materials_.size());
+        for (index_t bucket = 0; bucket < std::ssize(bucket_pipelines_);
+             ++bucket)
+        {
+            const ShaderVariant variant = shader_variant(bucket);
+            BucketPipelines pipelines = {
+                .shaded = ready_pipeline(PipelineKind::Shaded, variant),
+                .equal_depth =
+                    ready_pipeline(PipelineKind::EqualDepth, variant),
+            };
+            if (!pipelines.shaded || !pipelines.equal_depth)
+            {
+                variants_ready = false;
+                pipelines      = {graphics_pipeline_, equal_depth_pipeline_};
+            }
+            BucketPipelines &current = bucket_pipelines_[bucket];
+            if (pipelines.shaded != current.shaded ||
+                pipelines.equal_depth != current.equal_depth)
+            {
+                current = pipelines;
+                ++bucket_versions_[bucket];
+            }
+        }
+
+        variants_ready_ = variants_ready;
+
+        if (pipelines_pending_ && graphics_pipeline_ && depth_pipeline_ &&
+            equal_depth_pipeline_ && post_pipeline_ && variants_ready)
+        {
+            pipelines_pending_ = false;
+            log_info("Compiled pipelines in the background in {:.1f} ms with "
+                     "a {} pipeline cache",
+                     std::chrono::duration<double, std::milli>(
+                         clock::now() - pipelines_requested_)
+                         .count(),
+                     pipeline_cache_warm_ ? "warm" : "cold");
+        }
+    }
+
+    // Without its pipelines the pre-pass is left out, and the colour pass
+    // tests depth as usual
+    bool depth_prepass_ready() const
+    {
+        return depth_prepass_ && depth_pipeline_ && equal_depth_pipeline_;
+    }
+
+    // Until FXAA has compiled, the scene is scaled up without it
+    bool fxaa_ready() const
+    {
+        return fxaa_ && post_pipeline_;
+    }
+
+    // Waits for the compiles still running and destroys every pipeline and
+    // the layouts they were compiled against
+    void destroy_pipelines() noexcept
+    {
+        for (auto &[state, pipeline] : pipelines_)
+        {
+            try
+            {
+                vkDestroyPipeline(device_, pipeline.get(), gAllocator);
+            }
+            catch (const std::exception &e)
+            {
+                log_warn("A pipeline failed to compile: {}", e.what());
+            }
+        }
+        pipelines_.clear();
+        bucket_pipelines_.clear();
+        graphics_pipeline_    = {};
+        depth_pipeline_       = {};
+        equal_depth_pipeline_ = {};
+        post_pipeline_        = {};
+        for (const auto &[key, render_pass] : pipeline_render_passes_)
+        {
+            vkDestroyRenderPass(device_, render_pass, gAllocator);
+        }
+        pipeline_render_passes_.clear();
+        for (VkShaderModule *module :
+             {&vert_shader_module_, &frag_shader_module_,
+              &depth_shader_module_, &fullscreen_shader_module_,
+              &fxaa_shader_module_})
+        {
+            vkDestroyShaderModule(device_, *module, gAllocator);
+            *module = {};
+        }
+
+        vkDestroyPipelineLayout(device_, pipeline_layout_, gAllocator);
+        pipeline_layout_ = {};
+        vkDestroyPipelineLayout(device_, post_pipeline_layout_, gAllocator);
+        post_pipeline_layout_ = {};
+        vkDestroyDescriptorSetLayout(device_, post_set_layout_, gAllocator);
+        post_set_layout_ = {};
+        vkDestroySampler(device_, post_sampler_, gAllocator);
+        post_sampler_ = {};
+    }
+
+    void create_swap_chain()
+    {
+        const SwapChainSupportDetails swap_chain_support =
+            query_swap_chain_support(physical_device_, surface_);
+
+        const VkSurfaceFormatKHR surface_format =
+            choose_swap_surface_format(swap_chain_support.formats);
+        const VkPresentModeKHR present_mode =
+            choose_swap_present_mode(swap_chain_support.present_modes);
+
+        int width  = 0;
+        int height = 0;
+        glfwGetFramebufferSize(window_, &width, &height);
+        Expects(width >= 0 && height >= 0);
+
+        const VkExtent2D extent =
+            choose_swap_extent(swap_chain_support.capabilities, width, height);
+
+        const uint32_t min_images =
+            swap_chain_support.capabilities.minImageCount;
+        const uint32_t max_images =
+            swap_chain_support.capabilities.maxImageCount;
+        const uint32_t image_count = max_images == 0
+                                         ? (min_images + 1)
+                                         : std::min(min_images + 1, max_images);
+
+        // The scene is blitted into the image, or drawn there by FXAA. Colour
+        // attachment use is always supported.
+        if (!(swap_chain_support.capabilities.supportedUsageFlags &
+              VK_IMAGE_USAGE_TRANSFER_DST_BIT))
+        {
+            throw std::runtime_error("Swap chain images can't be blitted to!");
+        }
+
+        VkSwapchainCreateInfoKHR create_info = {
+            .sType            = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR,
+            .surface          = surface_,
+            .minImageCount    = min_images,
+            .imageFormat      = surface_format.format,
+            .imageColorSpace  = surface_format.colorSpace,
+            .imageExtent      = extent,
+            .imageArrayLayers = 1,
+            .imageUsage       = VK_IMAGE_USAGE_TRANSFER_DST_BIT |
+                          VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
+            .preTransform   = swap_chain_support.capabilities.currentTransform,
+            .compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR,
+            .presentMode    = present_mode,
+            .clipped        = VK_TRUE,
+            .oldSwapchain   = swap_chain_,
+        };
+
+        const QueueFamilyIndices indices =
+            find_queue_families(physical_device_, surface_);
+        const uint32_t queue_family_indices[] = {
+            indices.graphics_family.value(), indices.present_family.value()};
+        if (indices.graphics_family != indices.present_family)
+        {
+            create_info.imageSharingMode      = VK_SHARING_MODE_CONCURRENT;
+            create_info.queueFamilyIndexCount = 2;
+            create_info.pQueueFamilyIndices   = &queue_family_indices[0];
+        }
+        else
+        {
+            create_info.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        }
+
+        VkSwapchainKHR swap_chain = {};
+        if (vkCreateSwapchainKHR(device_, &create_info, gAllocator,
+                                 &swap_chain) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create swap chain!");
+        }
+        // Frames in flight may still present to the swap chain replaced
+        if (swap_chain_)
+        {
+            retired_resources().swap_chains.push_back(swap_chain_);
+        }
+        swap_chain_ = swap_chain;
+
+        uint32_t swap_chain_image_count = 0;
+        vkGetSwapchainImagesKHR(device_, swap_chain_, &swap_chain_image_count,
+                                nullptr);
+        swap_chain_images_.resize(swap_chain_image_count);
+        vkGetSwapchainImagesKHR(device_, swap_chain_, &swap_chain_image_count,
+                                swap_chain_images_.data());
+
+        swap_chain_image_format_ = surface_format.format;
+        swap_chain_extent_       = extent;
+    }
+
+    void create_image_views()
+    {
+        swap_chain_image_views_.resize(swap_chain_images_.size());
         for (index_t i = 0; i < std::ssize(swap_chain_images_); ++i)
         {
             swap_chain_image_views_[i] = create_image_view(
@@ -814,15 +2861,50 @@ class Application
 
     void create_render_pass()
     {
+        render_pass_ = create_render_pass(CullingPhase::All);
+        if (occlusion_culling_available())
+        {
+            early_render_pass_ = create_render_pass(CullingPhase::Early);
+            late_render_pass_  = create_render_pass(CullingPhase::Late);
+        }
+    }
+
+    // Creates the render pass drawing a culling phase's draws. The passes
+    // differ only in what happens to the multisampled attachments, so they
+    // are compatible and share framebuffers, pipelines and recorded draws.
+    VkRenderPass create_render_pass(CullingPhase phase) const
+    {
+        // The early pass keeps its samples for the late pass to continue
+        const bool keep_samples = phase == CullingPhase::Early;
+        const bool load_samples = phase == CullingPhase::Late;
+        const VkAttachmentLoadOp load_op =
+            load_samples ? VK_ATTACHMENT_LOAD_OP_LOAD
+                         : VK_ATTACHMENT_LOAD_OP_CLEAR;
+        const VkAttachmentStoreOp store_op =
+            keep_samples ? VK_ATTACHMENT_STORE_OP_STORE
+                         : VK_ATTACHMENT_STORE_OP_DONT_CARE;
+        // With a single sample the scene image is the colour attachment.
+        // There are no early and late passes then, as the depth pyramid
+        // reads a multisampled depth buffer.
+        const bool resolve = msaa_samples_ != VK_SAMPLE_COUNT_1_BIT;
+        const VkImageLayout scene_layout =
+            fxaa_ ? VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
+                  : VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+
         const VkAttachmentDescription colour_attachment = {
-            .format         = swap_chain_image_format_,
-            .samples        = msaa_samples_,
-            .loadOp         = VK_ATTACHMENT_LOAD_OP_CLEAR,
-            .storeOp        = VK_ATTACHMENT_STORE_OP_STORE,
+            .format  = swap_chain_image_format_,
+            .samples = msaa_samples_,
+            .loadOp  = load_op,
+            // NB: Otherwise only the resolved image is kept, so the samples
+            // never need to leave tile memory
+            .storeOp = resolve ? store_op : VK_ATTACHMENT_STORE_OP_STORE,
             .stencilLoadOp  = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
             .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
-            .initialLayout  = VK_IMAGE_LAYOUT_UNDEFINED,
-            .finalLayout    = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+            .initialLayout  = load_samples
+                                  ? VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL
+                                  : VK_IMAGE_LAYOUT_UNDEFINED,
+            .finalLayout    = resolve ? VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL
+                                      : scene_layout,
         };
 
         const VkAttachmentReference colour_attachment_ref = {
@@ -830,6 +2912,7 @@ class Application
             .layout     = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
         };
 
+        // The scene image, which is then scaled into the swap chain image
         const VkAttachmentDescription colour_attachment_resolve = {
             .format         = swap_chain_image_format_,
             .samples        = VK_SAMPLE_COUNT_1_BIT,
@@ -838,51 +2921,57 @@ class Application
             .stencilLoadOp  = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
             .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
             .initialLayout  = VK_IMAGE_LAYOUT_UNDEFINED,
-            .finalLayout    = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+            .finalLayout    = scene_layout,
         };
 
         const VkAttachmentReference colour_attachment_resolve_ref = {
-            .attachment = 1,
+            .attachment = 2,
             .layout     = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
         };
 
         const VkAttachmentDescription depth_attachment = {
             .format         = find_depth_format(physical_device_),
             .samples        = msaa_samples_,
-            .loadOp         = VK_ATTACHMENT_LOAD_OP_CLEAR,
-            .storeOp        = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+            .loadOp         = load_op,
+            .storeOp        = store_op,
             .stencilLoadOp  = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
             .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
-            .initialLayout  = VK_IMAGE_LAYOUT_UNDEFINED,
-            .finalLayout    = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+            .initialLayout =
+                load_samples ? VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL
+                             : VK_IMAGE_LAYOUT_UNDEFINED,
+            .finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
         };
 
         const VkAttachmentReference depth_attachment_ref = {
-            .attachment = 2,
+            .attachment = 1,
             .layout     = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
         };
 
         const VkSubpassDescription subpass = {
-            .pipelineBindPoint       = VK_PIPELINE_BIND_POINT_GRAPHICS,
-            .colorAttachmentCount    = 1,
-            .pColorAttachments       = &colour_attachment_ref,
-            .pResolveAttachments     = &colour_attachment_resolve_ref,
+            .pipelineBindPoint    = VK_PIPELINE_BIND_POINT_GRAPHICS,
+            .colorAttachmentCount = 1,
+            .pColorAttachments    = &colour_attachment_ref,
+            .pResolveAttachments =
+                resolve ? &colour_attachment_resolve_ref : nullptr,
             .pDepthStencilAttachment = &depth_attachment_ref,
         };
 
+        // The last frame's blit or FXAA may still be reading the scene image
         const VkSubpassDependency dependency = {
-            .srcSubpass    = VK_SUBPASS_EXTERNAL,
-            .dstSubpass    = 0,
-            .srcStageMask  = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+            .srcSubpass   = VK_SUBPASS_EXTERNAL,
+            .dstSubpass   = 0,
+            .srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+                            VK_PIPELINE_STAGE_TRANSFER_BIT |
+                            VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
             .dstStageMask  = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
             .srcAccessMask = 0,
             .dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT};
 
-        const std::array attachments = {
-            colour_attachment,
-            colour_attachment_resolve,
-            depth_attachment,
-        };
+        std::vector attachments = {colour_attachment, depth_attachment};
+        if (resolve)
+        {
+            attachments.push_back(colour_attachment_resolve);
+        }
 
         const VkRenderPassCreateInfo render_pass_info = {
             .sType           = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
@@ -894,20 +2983,22 @@ class Application
             .pDependencies   = &dependency,
         };
 
-        if (vkCreateRenderPass(device_, &render_pass_info, nullptr,
-                               &render_pass_) != VK_SUCCESS)
+        VkRenderPass render_pass = {};
+        if (vkCreateRenderPass(device_, &render_pass_info, gAllocator,
+                               &render_pass) != VK_SUCCESS)
         {
             throw std::runtime_error("Failed to create render pass!");
         }
+        return render_pass;
     }
 
     void create_descriptor_set_layout()
     {
-        const VkDescriptorSetLayoutBinding ubo_layout_binding = {
+        const VkDescriptorSetLayoutBinding frame_layout_binding = {
             .binding            = 0,
-            .descriptorType     = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+            .descriptorType     = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
             .descriptorCount    = 1,
-            .stageFlags         = VK_SHADER_STAGE_VERTEX_BIT,
+            .stageFlags         = VK_SHADER_STAGE_FRAGMENT_BIT,
             .pImmutableSamplers = nullptr,
         };
 
@@ -919,9 +3010,34 @@ class Application
             .pImmutableSamplers = nullptr,
         };
 
+        const VkDescriptorSetLayoutBinding object_layout_binding = {
+            .binding            = 2,
+            .descriptorType     = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC,
+            .descriptorCount    = 1,
+            .stageFlags         = VK_SHADER_STAGE_VERTEX_BIT,
+            .pImmutableSamplers = nullptr,
+        };
+
+        const VkDescriptorSetLayoutBinding light_layout_binding = {
+            .binding            = 3,
+            .descriptorType     = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC,
+            .descriptorCount    = 1,
+            .stageFlags         = VK_SHADER_STAGE_FRAGMENT_BIT,
+            .pImmutableSamplers = nullptr,
+        };
+
+        const VkDescriptorSetLayoutBinding cluster_layout_binding = {
+            .binding            = 4,
+            .descriptorType     = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .descriptorCount    = 1,
+            .stageFlags         = VK_SHADER_STAGE_FRAGMENT_BIT,
+            .pImmutableSamplers = nullptr,
+        };
+
         const std::array bindings = {
-            ubo_layout_binding,
-            sampler_layout_binding,
+            frame_layout_binding,  sampler_layout_binding,
+            object_layout_binding, light_layout_binding,
+            cluster_layout_binding,
         };
 
         const VkDescriptorSetLayoutCreateInfo layout_info = {
@@ -930,39 +3046,107 @@ class Application
             .pBindings    = bindings.data(),
         };
 
-        if (vkCreateDescriptorSetLayout(device_, &layout_info, nullptr,
+        if (vkCreateDescriptorSetLayout(device_, &layout_info, gAllocator,
                                         &descriptor_set_layout_) != VK_SUCCESS)
         {
             throw std::runtime_error("Failed to create descriptor set layout!");
         }
     }
 
-    void create_graphics_pipeline()
+    // Creates the layouts and shader modules the graphics pipelines are
+    // compiled against. They last as long as the pipelines, which outlive
+    // the swap chain.
+    void create_pipeline_layouts()
     {
-        // Shader modules
+        vert_shader_module_ =
+            create_shader_module(device_, read_bytes("shaders\\vert.spv"));
+        frag_shader_module_ =
+            create_shader_module(device_, read_bytes("shaders\\frag.spv"));
+        depth_shader_module_ =
+            create_shader_module(device_, read_bytes("shaders\\depth.spv"));
+        fullscreen_shader_module_ = create_shader_module(
+            device_, read_bytes("shaders\\fullscreen.spv"));
+        fxaa_shader_module_ =
+            create_shader_module(device_, read_bytes("shaders\\fxaa.spv"));
 
-        const auto vert_shader_code = read_bytes("shaders\\vert.spv");
-        const auto frag_shader_code = read_bytes("shaders\\frag.spv");
-        const VkShaderModule vert_shader_module =
-            create_shader_module(device_, vert_shader_code);
-        const VkShaderModule frag_shader_module =
-            create_shader_module(device_, frag_shader_code);
+        const VkPipelineLayoutCreateInfo pipeline_layout_info = {
+            .sType          = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+            .setLayoutCount = 1,
+            .pSetLayouts    = &descriptor_set_layout_,
+        };
+
+        if (vkCreatePipelineLayout(device_, &pipeline_layout_info, gAllocator,
+                                   &pipeline_layout_) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create pipeline layout!");
+        }
+
+        create_post_pipeline_layout();
+    }
+
+    // Compiles one of the pipelines drawing the scene, on a background
+    // thread: shaded, depth only or shaded where the depth matches
+    VkPipeline compile_scene_pipeline(const PipelineState &state,
+                                      VkRenderPass render_pass) const
+    {
+        const PipelineKind kind             = state.kind;
+        const VkSampleCountFlagBits samples = state.samples;
+
+        // Both stages take the same constants, each reading those it
+        // declares. The compiler drops whatever they switch off.
+        const ShaderVariant &variant = state.variant;
+        const vec4 base_colour =
+            srgb_to_linear(rgba_to_vec4(variant.base_colour));
+        const ShaderConstants constants = {
+            .max_point_lights = variant.max_point_lights,
+            .fog              = variant.fog ? VK_TRUE : VK_FALSE,
+            .vertex_colour    = variant.vertex_colour ? VK_TRUE : VK_FALSE,
+            .textured         = variant.textured ? VK_TRUE : VK_FALSE,
+            .base_colour      = vec3(base_colour),
+        };
+        constexpr uint32_t base_colour_offset =
+            offsetof(ShaderConstants, base_colour);
+        constexpr std::array<VkSpecializationMapEntry, 7> constant_entries = {{
+            {0, offsetof(ShaderConstants, max_point_lights), sizeof(uint32_t)},
+            {1, offsetof(ShaderConstants, fog), sizeof(VkBool32)},
+            {2, offsetof(ShaderConstants, vertex_colour), sizeof(VkBool32)},
+            {3, offsetof(ShaderConstants, textured), sizeof(VkBool32)},
+            {4, base_colour_offset, sizeof(float)},
+            {5, base_colour_offset + sizeof(float), sizeof(float)},
+            {6, base_colour_offset + 2 * sizeof(float), sizeof(float)},
+        }};
+        const VkSpecializationInfo specialization_info = {
+            .mapEntryCount = narrow_cast<uint32_t>(constant_entries.size()),
+            .pMapEntries   = constant_entries.data(),
+            .dataSize      = sizeof(constants),
+            .pData         = &constants,
+        };
 
         const VkPipelineShaderStageCreateInfo shader_stages[2] = {
             {
                 .sType  = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
                 .stage  = VK_SHADER_STAGE_VERTEX_BIT,
-                .module = vert_shader_module,
+                .module = vert_shader_module_,
                 .pName  = "main",
+                .pSpecializationInfo = &specialization_info,
             },
 
             {
                 .sType  = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
                 .stage  = VK_SHADER_STAGE_FRAGMENT_BIT,
-                .module = frag_shader_module,
+                .module = frag_shader_module_,
                 .pName  = "main",
+                .pSpecializationInfo = &specialization_info,
             }};
 
+        // The depth pre-pass has no fragment shader
+        const VkPipelineShaderStageCreateInfo depth_shader_stage = {
+            .sType  = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+            .stage  = VK_SHADER_STAGE_VERTEX_BIT,
+            .module = depth_shader_module_,
+            .pName  = "main",
+        };
+
         // Vertex input
 
         const auto binding_description = Vertex::get_binding_description();
@@ -977,6 +3161,18 @@ class Application
             .pVertexAttributeDescriptions = attribute_descriptions.data(),
         };
 
+        const auto position_binding_description =
+            Vertex::get_position_binding_description();
+        const auto position_attribute_description =
+            Vertex::get_position_attribute_description();
+        const VkPipelineVertexInputStateCreateInfo position_input_info = {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
+            .vertexBindingDescriptionCount   = 1,
+            .pVertexBindingDescriptions      = &position_binding_description,
+            .vertexAttributeDescriptionCount = 1,
+            .pVertexAttributeDescriptions    = &position_attribute_description,
+        };
+
         // Input assembly
 
         const VkPipelineInputAssemblyStateCreateInfo input_assembly = {
@@ -986,28 +3182,23 @@ class Application
             .primitiveRestartEnable = VK_FALSE,
         };
 
-        // Viewport
-
-        const VkViewport viewport = {
-            .x        = 0.0f,
-            .y        = 0.0f,
-            .width    = static_cast<float>(swap_chain_extent_.width),
-            .height   = static_cast<float>(swap_chain_extent_.height),
-            .minDepth = 0.0f,
-            .maxDepth = 1.0f,
-        };
-
-        const VkRect2D scissor = {
-            .offset = {0, 0},
-            .extent = swap_chain_extent_,
-        };
+        // Viewport, set to the render extent as the draws are recorded
 
         const VkPipelineViewportStateCreateInfo viewport_state = {
             .sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO,
             .viewportCount = 1,
-            .pViewports    = &viewport,
             .scissorCount  = 1,
-            .pScissors     = &scissor,
+        };
+
+        const std::array dynamic_states = {
+            VK_DYNAMIC_STATE_VIEWPORT,
+            VK_DYNAMIC_STATE_SCISSOR,
+        };
+
+        const VkPipelineDynamicStateCreateInfo dynamic_state = {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO,
+            .dynamicStateCount = narrow_cast<uint32_t>(dynamic_states.size()),
+            .pDynamicStates    = dynamic_states.data(),
         };
 
         // Rasterizer
@@ -1027,7 +3218,7 @@ class Application
 
         const VkPipelineMultisampleStateCreateInfo multisampling = {
             .sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO,
-            .rasterizationSamples = msaa_samples_,
+            .rasterizationSamples = samples,
             .sampleShadingEnable  = VK_FALSE,
         };
 
@@ -1046,6 +3237,18 @@ class Application
             .pAttachments    = &colour_blend_attachment,
         };
 
+        const VkPipelineColorBlendAttachmentState no_colour_attachment = {
+            .blendEnable    = VK_FALSE,
+            .colorWriteMask = 0,
+        };
+
+        const VkPipelineColorBlendStateCreateInfo no_colour_blending = {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
+            .logicOpEnable   = VK_FALSE,
+            .attachmentCount = 1,
+            .pAttachments    = &no_colour_attachment,
+        };
+
         // Depth testing
 
         const VkPipelineDepthStencilStateCreateInfo depth_stencil = {
@@ -1056,23 +3259,18 @@ class Application
             .depthBoundsTestEnable = VK_FALSE,
         };
 
-        // Create pipeline layout
-
-        const VkPipelineLayoutCreateInfo pipeline_layout_info = {
-            .sType          = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
-            .setLayoutCount = 1,
-            .pSetLayouts    = &descriptor_set_layout_,
+        // After the pre-pass, only the nearest surface is shaded
+        const VkPipelineDepthStencilStateCreateInfo equal_depth_stencil = {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO,
+            .depthTestEnable       = VK_TRUE,
+            .depthWriteEnable      = VK_FALSE,
+            .depthCompareOp        = VK_COMPARE_OP_EQUAL,
+            .depthBoundsTestEnable = VK_FALSE,
         };
 
-        if (vkCreatePipelineLayout(device_, &pipeline_layout_info, nullptr,
-                                   &pipeline_layout_) != VK_SUCCESS)
-        {
-            throw std::runtime_error("Failed to create pipeline layout!");
-        }
+        // Create the graphics pipeline
 
-        // Create graphics pipeline
-
-        const VkGraphicsPipelineCreateInfo pipeline_info = {
+        VkGraphicsPipelineCreateInfo pipeline_info = {
             .sType      = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
             .stageCount = 2,
             .pStages    = &shader_stages[0],
@@ -1083,328 +3281,1619 @@ class Application
             .pMultisampleState   = &multisampling,
             .pDepthStencilState  = &depth_stencil,
             .pColorBlendState    = &colour_blending,
+            .pDynamicState       = &dynamic_state,
             .layout              = pipeline_layout_,
-            .renderPass          = render_pass_,
+            .renderPass          = render_pass,
             .subpass             = 0,
         };
+        if (kind == PipelineKind::Depth)
+        {
+            pipeline_info.stageCount        = 1;
+            pipeline_info.pStages           = &depth_shader_stage;
+            pipeline_info.pVertexInputState = &position_input_info;
+            pipeline_info.pColorBlendState  = &no_colour_blending;
+        }
+        else if (kind == PipelineKind::EqualDepth)
+        {
+            pipeline_info.pDepthStencilState = &equal_depth_stencil;
+        }
+        // The shaded variants are compared on exit
+        if (kind == PipelineKind::Shaded && get_executable_statistics_)
+        {
+            pipeline_info.flags |=
+                VK_PIPELINE_CREATE_CAPTURE_STATISTICS_BIT_KHR;
+        }
 
-        if (vkCreateGraphicsPipelines(device_, VK_NULL_HANDLE, 1,
-                                      &pipeline_info, nullptr,
-                                      &graphics_pipeline_) != VK_SUCCESS)
+        VkPipeline pipeline = {};
+        if (create_graphics_pipeline(pipeline_info, &pipeline) != VK_SUCCESS)
         {
             throw std::runtime_error("Failed to create graphics pipeline!");
         }
-
-        // Cleanup
-        vkDestroyShaderModule(device_, frag_shader_module, nullptr);
-        vkDestroyShaderModule(device_, vert_shader_module, nullptr);
+        return pipeline;
     }
 
-    void create_colour_resources()
+    // Creates the multisampled colour and depth targets. They never
+    // outlive the render pass, so they use lazily allocated memory where
+    // the device has it, which tiled GPUs need never back. With a single
+    // sample the scene is drawn straight into the scene image, so there is
+    // only the depth.
+    void create_transient_attachments()
     {
         const VkFormat colour_format = swap_chain_image_format_;
-        std::tie(colour_image_, colour_image_memory_) =
-            create_image(physical_device_, device_, swap_chain_extent_.width,
-                         swap_chain_extent_.height, 1, msaa_samples_,
-                         colour_format, VK_IMAGE_TILING_OPTIMAL,
-                         VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT |
-                             VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
-                         VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-        colour_image_view_ =
-            create_image_view(device_, colour_image_, colour_format,
-                              VK_IMAGE_ASPECT_COLOR_BIT, 1);
-    }
+        const VkFormat depth_format  = find_depth_format(physical_device_);
 
-    void create_depth_resources()
-    {
-        const VkFormat depth_format = find_depth_format(physical_device_);
-
-        std::tie(depth_image_, depth_image_memory_) =
-            create_image(physical_device_, device_, swap_chain_extent_.width,
-                         swap_chain_extent_.height, 1, msaa_samples_,
-                         depth_format, VK_IMAGE_TILING_OPTIMAL,
-                         VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
-                         VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        if (msaa_samples_ != VK_SAMPLE_COUNT_1_BIT)
+        {
+            colour_image_ = create_unbound_image(
+                device_, swap_chain_extent_.width, swap_chain_extent_.height,
+                1, msaa_samples_, colour_format, VK_IMAGE_TILING_OPTIMAL,
+                VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT |
+                    VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT);
+            attachment_memory_.push_back(bind_attachment_memory(colour_image_));
+        }
+        // Occlusion culling reads the depth between the render passes, so
+        // it can't be transient then
+        depth_image_ = create_unbound_image(
+            device_, swap_chain_extent_.width, swap_chain_extent_.height, 1,
+            msaa_samples_, depth_format, VK_IMAGE_TILING_OPTIMAL,
+            (occlusion_culling_available()
+                 ? VK_IMAGE_USAGE_SAMPLED_BIT
+                 : VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT) |
+                VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT);
+        attachment_memory_.push_back(bind_attachment_memory(depth_image_));
+
+        if (colour_image_)
+        {
+            colour_image_view_ =
+                create_image_view(device_, colour_image_, colour_format,
+                                  VK_IMAGE_ASPECT_COLOR_BIT, 1);
+        }
+        // NB: No layout transition needed, the render pass starts the depth
+        // attachment from VK_IMAGE_LAYOUT_UNDEFINED
         depth_image_view_ = create_image_view(
             device_, depth_image_, depth_format, VK_IMAGE_ASPECT_DEPTH_BIT, 1);
-
-        transition_image_layout(
-            device_, command_pool_, graphics_queue_, depth_image_, depth_format,
-            VK_IMAGE_LAYOUT_UNDEFINED,
-            VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, 1);
     }
 
-    void create_framebuffers()
+    // Binds an attachment to memory of its own, lazily allocated where the
+    // device has it for the image
+    MemoryAllocation bind_attachment_memory(VkImage image)
     {
-        swap_chain_framebuffers_.resize(swap_chain_image_views_.size());
-        for (index_t i = 0; i < std::ssize(swap_chain_image_views_); ++i)
+        VkMemoryRequirements requirements = {};
+        vkGetImageMemoryRequirements(device_, image, &requirements);
+
+        constexpr VkMemoryPropertyFlags lazy_properties =
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |
+            VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT;
+        VkMemoryPropertyFlags properties = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+        if (memory_allocator_.supports(requirements.memoryTypeBits,
+                                       lazy_properties))
         {
-            const std::array attachments = {
-                colour_image_view_,
-                swap_chain_image_views_[i],
-                depth_image_view_,
-            };
-            const VkFramebufferCreateInfo framebuffer_info = {
-                .sType           = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
-                .renderPass      = render_pass_,
-                .attachmentCount = narrow_cast<uint32_t>(attachments.size()),
-                .pAttachments    = attachments.data(),
-                .width           = swap_chain_extent_.width,
-                .height          = swap_chain_extent_.height,
-                .layers          = 1,
-            };
-
-            if (vkCreateFramebuffer(device_, &framebuffer_info, nullptr,
-                                    &swap_chain_framebuffers_[i]) != VK_SUCCESS)
-            {
-                throw std::runtime_error("Failed to create framebuffer!");
-            }
+            properties = lazy_properties;
         }
+        const MemoryAllocation allocation =
+            memory_allocator_.allocate(requirements, properties, false);
+        vkBindImageMemory(device_, image, allocation.memory, allocation.offset);
+        return allocation;
     }
 
-    void create_command_pool()
+    // The memory an image of these properties would take
+    VkMemoryRequirements image_requirements(VkExtent2D extent,
+                                            VkSampleCountFlagBits samples,
+                                            VkFormat format,
+                                            VkImageUsageFlags usage) const
     {
-        const QueueFamilyIndices queue_family_indices =
-            find_queue_families(physical_device_, surface_);
-
-        const VkCommandPoolCreateInfo pool_info = {
-            .sType            = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
-            .flags            = 0,
-            .queueFamilyIndex = queue_family_indices.graphics_family.value(),
-        };
+        const VkImage image =
+            create_unbound_image(device_, extent.width, extent.height, 1,
+                                 samples, format, VK_IMAGE_TILING_OPTIMAL,
+                                 usage);
+        VkMemoryRequirements requirements = {};
+        vkGetImageMemoryRequirements(device_, image, &requirements);
+        vkDestroyImage(device_, image, gAllocator);
+        return requirements;
+    }
 
-        if (vkCreateCommandPool(device_, &pool_info, nullptr, &command_pool_) !=
-            VK_SUCCESS)
+    // The memory of the render targets an anti-aliasing mode draws into at
+    // an extent: the scene image, the depth buffer and, with more than one
+    // sample, the colour samples
+    VkDeviceSize render_target_bytes(VkExtent2D extent,
+                                     AntiAliasingMode mode) const
+    {
+        VkDeviceSize bytes =
+            image_requirements(extent, VK_SAMPLE_COUNT_1_BIT,
+                               swap_chain_image_format_,
+                               VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+                                   VK_IMAGE_USAGE_TRANSFER_SRC_BIT |
+                                   VK_IMAGE_USAGE_SAMPLED_BIT)
+                .size;
+        bytes += image_requirements(
+                     extent, mode.samples, find_depth_format(physical_device_),
+                     VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT |
+                         VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT)
+                     .size;
+        if (mode.samples != VK_SAMPLE_COUNT_1_BIT)
         {
-            throw std::runtime_error("Failed to create command pool!");
+            bytes += image_requirements(
+                         extent, mode.samples, swap_chain_image_format_,
+                         VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT |
+                             VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT)
+                         .size;
         }
+        return bytes;
     }
 
-    void create_mesh()
+    // Logs what the render targets of each anti-aliasing mode would cost at
+    // the benchmark window sizes
+    void log_attachment_footprints() const
     {
-        // Load data
-        // auto meshes = create_octahedron();
-        // auto meshes = create_cube();
-        // auto meshes = create_grass_block();
-        const auto meshes =
-            load_mesh("assets\\lighthouse.obj", "assets",
-                      glm::scale(glm::translate(glm::mat4(1.0f),
-                                                vec3(0.0f, -0.95f, 0.0f)),
-                                 vec3(0.009f, 0.009f, 0.009f)));
-
-        // Build buffers
-        for (auto mesh : meshes)
+        const VkMemoryRequirements samples = image_requirements(
+            swap_chain_extent_, max_msaa_samples_, swap_chain_image_format_,
+            VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT |
+                VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT);
+        const bool lazy =
+            memory_allocator_.supports(samples.memoryTypeBits,
+                                       VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT);
+
+        const std::vector<AntiAliasingMode> modes = anti_aliasing_modes();
+        for (const VkExtent2D extent : benchmark_window_sizes_)
         {
-            uint32_t texture_index = 0;
+            std::string footprints;
+            for (const AntiAliasingMode mode : modes)
             {
-                auto it = texture_names_.find(mesh.texture_name);
-                if (it == texture_names_.end())
-                {
-                    const auto texture =
-                        create_texture(physical_device_, device_, command_pool_,
-                                       graphics_queue_, mesh.texture_name);
-                    textures_.push_back(texture);
-                    const auto result = texture_names_.emplace(
-                        mesh.texture_name,
-                        narrow_cast<uint32_t>(textures_.size() - 1));
-                    it = result.first;
-                }
-                texture_index = it->second;
+                footprints += fmt::format(
+                    "{}{} {:.1f} MiB", footprints.empty() ? "" : ", ",
+                    anti_aliasing_name(mode),
+                    render_target_bytes(extent, mode) / (1024.0 * 1024.0));
             }
+            log_info("Render target memory at {}x{}: {}{}", extent.width,
+                     extent.height, footprints,
+                     lazy ? ", with the samples lazily allocated" : "");
+        }
+        log_info("Anti-aliasing with {}",
+                 anti_aliasing_name({msaa_samples_, fxaa_}));
+    }
 
+    // The modes M steps through: each sample count the device has, from
+    // the most, then FXAA
+    std::vector<AntiAliasingMode> anti_aliasing_modes() const
+    {
+        std::vector<AntiAliasingMode> modes;
+        for (uint32_t samples = max_msaa_samples_;
+             samples > VK_SAMPLE_COUNT_1_BIT; samples >>= 1)
+        {
+            if (msaa_sample_counts_ & samples)
             {
-                const VkDeviceSize buffer_size =
-                    sizeof(Vertex) *
-                    narrow_cast<VkDeviceSize>(mesh.vertices.size());
-
-                const auto [staging_buffer, staging_buffer_memory] =
-                    create_buffer(physical_device_, device_, buffer_size,
-                                  VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                                  VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                                      VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-
-                void *data = nullptr;
-                vkMapMemory(device_, staging_buffer_memory, 0, buffer_size, 0,
-                            &data);
-                std::memcpy(data, mesh.vertices.data(),
-                            narrow_cast<std::size_t>(buffer_size));
-                vkUnmapMemory(device_, staging_buffer_memory);
-
-                const auto [vertex_buffer, vertex_buffer_memory] =
-                    create_buffer(physical_device_, device_, buffer_size,
-                                  VK_BUFFER_USAGE_TRANSFER_DST_BIT |
-                                      VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-                                  VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-
-                copy_buffer(staging_buffer, vertex_buffer, buffer_size);
-                vkDestroyBuffer(device_, staging_buffer, nullptr);
-                vkFreeMemory(device_, staging_buffer_memory, nullptr);
-
-                vertex_buffers_.push_back(vertex_buffer);
-                vertex_buffer_memory_.push_back(vertex_buffer_memory);
+                modes.push_back(
+                    {static_cast<VkSampleCountFlagBits>(samples), false});
             }
+        }
+        if (modes.empty())
+        {
+            modes.push_back({VK_SAMPLE_COUNT_1_BIT, false});
+        }
+        modes.push_back({VK_SAMPLE_COUNT_1_BIT, true});
+        return modes;
+    }
 
+    AntiAliasingMode next_anti_aliasing_mode() const noexcept
+    {
+        if (fxaa_)
+        {
+            return {max_msaa_samples_, false};
+        }
+        for (uint32_t samples = msaa_samples_ >> 1;
+             samples > VK_SAMPLE_COUNT_1_BIT; samples >>= 1)
+        {
+            if (msaa_sample_counts_ & samples)
             {
-                const VkDeviceSize buffer_size =
-                    sizeof(mesh.indices[0]) *
-                    narrow_cast<VkDeviceSize>(mesh.indices.size());
-
-                const auto [staging_buffer, staging_buffer_memory] =
-                    create_buffer(physical_device_, device_, buffer_size,
-                                  VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                                  VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                                      VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-
-                void *data = nullptr;
-                vkMapMemory(device_, staging_buffer_memory, 0, buffer_size, 0,
-                            &data);
-                std::memcpy(data, mesh.indices.data(),
-                            narrow_cast<std::size_t>(buffer_size));
-                vkUnmapMemory(device_, staging_buffer_memory);
+                return {static_cast<VkSampleCountFlagBits>(samples), false};
+            }
+        }
+        return {VK_SAMPLE_COUNT_1_BIT, true};
+    }
 
-                const auto [index_buffer, index_buffer_memory] =
-                    create_buffer(physical_device_, device_, buffer_size,
-                                  VK_BUFFER_USAGE_TRANSFER_DST_BIT |
-                                      VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
-                                  VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    static std::string anti_aliasing_name(AntiAliasingMode mode)
+    {
+        if (mode.fxaa)
+        {
+            return "FXAA";
+        }
+        if (mode.samples == VK_SAMPLE_COUNT_1_BIT)
+        {
+            return "no anti-aliasing";
+        }
+        return fmt::format("{}x MSAA", static_cast<uint32_t>(mode.samples));
+    }
 
-                copy_buffer(staging_buffer, index_buffer, buffer_size);
+    // The targets, passes and pipelines are rebuilt for the mode with the
+    // swap chain, before the next frame
+    void set_anti_aliasing_mode(AntiAliasingMode mode) noexcept
+    {
+        msaa_samples_        = mode.samples;
+        fxaa_                = mode.fxaa;
+        framebuffer_resized_ = true;
+    }
 
-                vkDestroyBuffer(device_, staging_buffer, nullptr);
-                vkFreeMemory(device_, staging_buffer_memory, nullptr);
+    // Creates the single-sampled image the scene resolves into, or is drawn
+    // into without multisampling. Like the other targets it has the swap
+    // chain's extent, the largest the render extent can be, so scaling only
+    // changes the viewport.
+    void create_scene_image()
+    {
+        std::tie(scene_image_, scene_image_memory_) = create_image(
+            memory_allocator_, device_, swap_chain_extent_.width,
+            swap_chain_extent_.height, 1, VK_SAMPLE_COUNT_1_BIT,
+            swap_chain_image_format_, VK_IMAGE_TILING_OPTIMAL,
+            VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+                VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        scene_image_view_ =
+            create_image_view(device_, scene_image_, swap_chain_image_format_,
+                              VK_IMAGE_ASPECT_COLOR_BIT, 1);
+        render_extent_ = scaled_extent(resolution_scale_);
+    }
 
-                index_buffers_.push_back(index_buffer);
-                index_buffer_memory_.push_back(index_buffer_memory);
-                index_buffer_counts_.push_back(
-                    narrow_cast<uint16_t>(mesh.indices.size()));
-            }
+    void create_framebuffers()
+    {
+        const bool resolve = msaa_samples_ != VK_SAMPLE_COUNT_1_BIT;
+        std::vector attachments = {
+            resolve ? colour_image_view_ : scene_image_view_,
+            depth_image_view_,
+        };
+        if (resolve)
+        {
+            attachments.push_back(scene_image_view_);
+        }
+        const VkFramebufferCreateInfo framebuffer_info = {
+            .sType           = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
+            .renderPass      = render_pass_,
+            .attachmentCount = narrow_cast<uint32_t>(attachments.size()),
+            .pAttachments    = attachments.data(),
+            .width           = swap_chain_extent_.width,
+            .height          = swap_chain_extent_.height,
+            .layers          = 1,
+        };
 
-            texture_indices_.push_back(texture_index);
+        if (vkCreateFramebuffer(device_, &framebuffer_info, gAllocator,
+                                &scene_framebuffer_) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create framebuffer!");
         }
     }
 
-    void create_uniform_buffers()
+    VkExtent2D scaled_extent(float scale) const noexcept
     {
-        constexpr VkDeviceSize buffer_size = sizeof(UniformBufferObject);
-        uniform_buffers_.resize(swap_chain_images_.size());
-        uniform_buffers_memory_.resize(swap_chain_images_.size());
-        for (index_t i = 0; i < std::ssize(swap_chain_images_); ++i)
+        const auto scaled = [scale](uint32_t size) {
+            return std::max(narrow_cast<uint32_t>(std::lround(size * scale)),
+                            1u);
+        };
+        return {scaled(swap_chain_extent_.width),
+                scaled(swap_chain_extent_.height)};
+    }
+
+    // Feeds a finished frame's GPU time to the controller, and moves the
+    // render extent once the scale has drifted a whole step from it. The
+    // cached draws set the viewport, so they are re-recorded.
+    void update_resolution_scale(double frame_ms)
+    {
+        const float scale =
+            dynamic_resolution_
+                ? resolution_controller_.update(frame_ms, gpu_frame_budget_ms_)
+                : 1.0f;
+        // Full scale is always taken, so that turning scaling off restores it
+        if (scale < 1.0f &&
+            std::abs(scale - resolution_scale_) < resolution_scale_step_)
         {
-            std::tie(uniform_buffers_[i], uniform_buffers_memory_[i]) =
-                create_buffer(physical_device_, device_, buffer_size,
-                              VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-                              VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                                  VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+            return;
+        }
+        const float stepped =
+            std::round(scale / resolution_scale_step_) * resolution_scale_step_;
+        if (stepped == resolution_scale_)
+        {
+            return;
         }
+
+        resolution_scale_ = stepped;
+        render_extent_    = scaled_extent(resolution_scale_);
+        invalidate_buckets();
+        const std::string title =
+            fmt::format("Hello Vulkan ({}x{}, {:.0f}%)", render_extent_.width,
+                        render_extent_.height, 100.0f * resolution_scale_);
+        glfwSetWindowTitle(window_, title.c_str());
     }
 
-    void create_descriptor_pool()
+    // Records scaling the resolved scene up to the swap chain image, ready
+    // to present
+    void record_upscale(VkCommandBuffer command_buffer, uint32_t image_index)
     {
-        const std::array<VkDescriptorPoolSize, 2> pool_sizes = {{
+        const VkImage swap_chain_image = swap_chain_images_[image_index];
+        const VkImageSubresourceRange colour_range = {
+            VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+
+        // The swap chain image is only written once acquired, which the
+        // submission waits for at the transfer stage. The scene is left
+        // ready for FXAA while its pipeline compiles.
+        const std::array<VkImageMemoryBarrier, 2> to_blit = {{
             {
-                .type            = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-                .descriptorCount = narrow_cast<uint32_t>(
-                    swap_chain_images_.size() * textures_.size()),
+                .sType         = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+                .srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+                .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+                .oldLayout     = fxaa_
+                                     ? VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
+                                     : VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                .newLayout     = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                .image               = scene_image_,
+                .subresourceRange    = colour_range,
             },
 
             {
-                .type            = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-                .descriptorCount = narrow_cast<uint32_t>(
-                    swap_chain_images_.size() * textures_.size()),
+                .sType               = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+                .srcAccessMask       = 0,
+                .dstAccessMask       = VK_ACCESS_TRANSFER_WRITE_BIT,
+                .oldLayout           = VK_IMAGE_LAYOUT_UNDEFINED,
+                .newLayout           = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                .image               = swap_chain_image,
+                .subresourceRange    = colour_range,
             },
         }};
+        vkCmdPipelineBarrier(command_buffer,
+                             VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+                                 VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0,
+                             nullptr, narrow_cast<uint32_t>(to_blit.size()),
+                             to_blit.data());
+
+        const VkImageBlit region = {
+            .srcSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1},
+            .srcOffsets     = {{0, 0, 0},
+                               {narrow_cast<int32_t>(render_extent_.width),
+                                narrow_cast<int32_t>(render_extent_.height),
+                                1}},
+            .dstSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1},
+            .dstOffsets     = {{0, 0, 0},
+                               {narrow_cast<int32_t>(swap_chain_extent_.width),
+                                narrow_cast<int32_t>(swap_chain_extent_.height),
+                                1}},
+        };
+        vkCmdBlitImage(command_buffer, scene_image_,
+                       VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, swap_chain_image,
+                       VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region,
+                       VK_FILTER_LINEAR);
+
+        const VkImageMemoryBarrier to_present = {
+            .sType               = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+            .srcAccessMask       = VK_ACCESS_TRANSFER_WRITE_BIT,
+            .dstAccessMask       = 0,
+            .oldLayout           = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+            .newLayout           = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .image               = swap_chain_image,
+            .subresourceRange    = colour_range,
+        };
+        vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0,
+                             nullptr, 0, nullptr, 1, &to_present);
+    }
 
+    // Creates the pass drawing FXAA from the scene image into each swap
+    // chain image. It is rebuilt with the swap chain, whose images and
+    // extent it uses.
+    void create_post_pass()
+    {
+        post_render_pass_ = create_post_render_pass();
+
+        post_framebuffers_.resize(swap_chain_image_views_.size());
+        for (index_t i = 0; i < std::ssize(swap_chain_image_views_); ++i)
+        {
+            const VkFramebufferCreateInfo framebuffer_info = {
+                .sType           = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
+                .renderPass      = post_render_pass_,
+                .attachmentCount = 1,
+                .pAttachments    = &swap_chain_image_views_[i],
+                .width           = swap_chain_extent_.width,
+                .height          = swap_chain_extent_.height,
+                .layers          = 1,
+            };
+            if (vkCreateFramebuffer(device_, &framebuffer_info, gAllocator,
+                                    &post_framebuffers_[i]) != VK_SUCCESS)
+            {
+                throw std::runtime_error("Failed to create framebuffer!");
+            }
+        }
+
+        const VkDescriptorPoolSize pool_size = {
+            .type            = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            .descriptorCount = 1,
+        };
         const VkDescriptorPoolCreateInfo pool_info = {
             .sType         = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
-            .maxSets       = narrow_cast<uint32_t>(swap_chain_images_.size() *
-                                             textures_.size()),
-            .poolSizeCount = narrow_cast<uint32_t>(pool_sizes.size()),
-            .pPoolSizes    = pool_sizes.data(),
+            .maxSets       = 1,
+            .poolSizeCount = 1,
+            .pPoolSizes    = &pool_size,
         };
-
-        if (vkCreateDescriptorPool(device_, &pool_info, nullptr,
-                                   &descriptor_pool_) != VK_SUCCESS)
+        if (vkCreateDescriptorPool(device_, &pool_info, gAllocator,
+                                   &post_descriptor_pool_) != VK_SUCCESS)
         {
             throw std::runtime_error("Failed to create descriptor pool!");
         }
-    }
-
-    void create_descriptor_sets()
-    {
-        const auto swap_chain_count = swap_chain_images_.size();
-        const auto texture_count    = textures_.size();
-        descriptor_sets_.resize(swap_chain_count * texture_count);
-
-        std::vector<VkDescriptorSetLayout> layouts(descriptor_sets_.size(),
-                                                   descriptor_set_layout_);
 
         const VkDescriptorSetAllocateInfo alloc_info = {
-            .sType          = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
-            .descriptorPool = descriptor_pool_,
-            .descriptorSetCount = narrow_cast<uint32_t>(layouts.size()),
-            .pSetLayouts        = layouts.data()};
-
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+            .descriptorPool     = post_descriptor_pool_,
+            .descriptorSetCount = 1,
+            .pSetLayouts        = &post_set_layout_,
+        };
         if (vkAllocateDescriptorSets(device_, &alloc_info,
-                                     descriptor_sets_.data()) != VK_SUCCESS)
+                                     &post_descriptor_set_) != VK_SUCCESS)
         {
             throw std::runtime_error("Failed to allocate descriptor sets!");
         }
 
-        for (index_t i = 0; i < std::ssize(swap_chain_images_); ++i)
-        {
-            for (index_t j = 0; j < std::ssize(textures_); ++j)
-            {
-                const VkDescriptorBufferInfo buffer_info = {
-                    .buffer = uniform_buffers_[i],
-                    .offset = 0,
-                    .range  = sizeof(UniformBufferObject),
-                };
-
-                // TODO: Figure out how to set correct sampler, image_view
-                const index_t set_index = i * textures_.size() + j;
-                const int mesh_index    = j;
-
-                const VkDescriptorImageInfo image_info = {
-                    .sampler     = textures_[mesh_index].sampler_,
-                    .imageView   = textures_[mesh_index].image_view_,
-                    .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-                };
-
-                const std::array<VkWriteDescriptorSet, 2> descriptor_writes = {{
-                    {
-                        .sType      = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-                        .dstSet     = descriptor_sets_[set_index],
-                        .dstBinding = 0,
-                        .dstArrayElement = 0,
-                        .descriptorCount = 1,
-                        .descriptorType  = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-                        .pBufferInfo     = &buffer_info,
-                    },
-
-                    {
-                        .sType      = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-                        .dstSet     = descriptor_sets_[set_index],
-                        .dstBinding = 1,
-                        .dstArrayElement = 0,
-                        .descriptorCount = 1,
-                        .descriptorType =
-                            VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-                        .pImageInfo = &image_info,
-                    },
-                }};
-
-                vkUpdateDescriptorSets(
-                    device_, narrow_cast<uint32_t>(descriptor_writes.size()),
-                    descriptor_writes.data(), 0, nullptr);
-            }
-        }
+        const VkDescriptorImageInfo scene_info = {
+            .sampler     = post_sampler_,
+            .imageView   = scene_image_view_,
+            .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+        };
+        const VkWriteDescriptorSet write = {
+            .sType           = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .dstSet          = post_descriptor_set_,
+            .dstBinding      = 0,
+            .dstArrayElement = 0,
+            .descriptorCount = 1,
+            .descriptorType  = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            .pImageInfo      = &scene_info,
+        };
+        vkUpdateDescriptorSets(device_, 1, &write, 0, nullptr);
     }
 
-    void create_command_buffers()
+    // The FXAA pass writes one swap chain image, ready to present
+    VkRenderPass create_post_render_pass() const
     {
-        command_buffers_.resize(swap_chain_framebuffers_.size());
+        const VkAttachmentDescription attachment = {
+            .format         = swap_chain_image_format_,
+            .samples        = VK_SAMPLE_COUNT_1_BIT,
+            .loadOp         = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+            .storeOp        = VK_ATTACHMENT_STORE_OP_STORE,
+            .stencilLoadOp  = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+            .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+            .initialLayout  = VK_IMAGE_LAYOUT_UNDEFINED,
+            .finalLayout    = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+        };
 
-        const VkCommandBufferAllocateInfo alloc_info = {
+        const VkAttachmentReference attachment_ref = {
+            .attachment = 0,
+            .layout     = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+        };
+
+        const VkSubpassDescription subpass = {
+            .pipelineBindPoint    = VK_PIPELINE_BIND_POINT_GRAPHICS,
+            .colorAttachmentCount = 1,
+            .pColorAttachments    = &attachment_ref,
+        };
+
+        // Waits for the scene to be drawn, and for the swap chain image,
+        // which the submission waits for at the colour output stage
+        const VkSubpassDependency dependency = {
+            .srcSubpass    = VK_SUBPASS_EXTERNAL,
+            .dstSubpass    = 0,
+            .srcStageMask  = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+            .dstStageMask  = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT |
+                            VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+            .srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+            .dstAccessMask = VK_ACCESS_SHADER_READ_BIT |
+                             VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+        };
+
+        const VkRenderPassCreateInfo render_pass_info = {
+            .sType           = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
+            .attachmentCount = 1,
+            .pAttachments    = &attachment,
+            .subpassCount    = 1,
+            .pSubpasses      = &subpass,
+            .dependencyCount = 1,
+            .pDependencies   = &dependency,
+        };
+        VkRenderPass render_pass = {};
+        if (vkCreateRenderPass(device_, &render_pass_info, gAllocator,
+                               &render_pass) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create render pass!");
+        }
+        return render_pass;
+    }
+
+    // Creates the sampler and layouts FXAA is compiled against, which last
+    // as long as its pipelines
+    void create_post_pipeline_layout()
+    {
+        // Filtered, as the scene is scaled up as it is read
+        const VkSamplerCreateInfo sampler_info = {
+            .sType        = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+            .magFilter    = VK_FILTER_LINEAR,
+            .minFilter    = VK_FILTER_LINEAR,
+            .mipmapMode   = VK_SAMPLER_MIPMAP_MODE_NEAREST,
+            .addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+            .addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+            .addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+            .maxLod       = 0.0f,
+        };
+        if (vkCreateSampler(device_, &sampler_info, gAllocator,
+                            &post_sampler_) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create texture sampler!");
+        }
+
+        const VkDescriptorSetLayoutBinding scene_binding = {
+            .binding            = 0,
+            .descriptorType     = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            .descriptorCount    = 1,
+            .stageFlags         = VK_SHADER_STAGE_FRAGMENT_BIT,
+            .pImmutableSamplers = nullptr,
+        };
+        const VkDescriptorSetLayoutCreateInfo layout_info = {
+            .sType        = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+            .bindingCount = 1,
+            .pBindings    = &scene_binding,
+        };
+        if (vkCreateDescriptorSetLayout(device_, &layout_info, gAllocator,
+                                        &post_set_layout_) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create descriptor set layout!");
+        }
+
+        const VkPushConstantRange push_constant_range = {
+            .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
+            .offset     = 0,
+            .size       = sizeof(FxaaConstants),
+        };
+        const VkPipelineLayoutCreateInfo pipeline_layout_info = {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+            .setLayoutCount         = 1,
+            .pSetLayouts            = &post_set_layout_,
+            .pushConstantRangeCount = 1,
+            .pPushConstantRanges    = &push_constant_range,
+        };
+        if (vkCreatePipelineLayout(device_, &pipeline_layout_info, gAllocator,
+                                   &post_pipeline_layout_) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create pipeline layout!");
+        }
+    }
+
+    // Compiles the FXAA pipeline, on a background thread
+    VkPipeline compile_fxaa_pipeline(VkRenderPass render_pass) const
+    {
+        const std::array<VkPipelineShaderStageCreateInfo, 2> shader_stages = {{
+            {
+                .sType  = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+                .stage  = VK_SHADER_STAGE_VERTEX_BIT,
+                .module = fullscreen_shader_module_,
+                .pName  = "main",
+            },
+
+            {
+                .sType  = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+                .stage  = VK_SHADER_STAGE_FRAGMENT_BIT,
+                .module = fxaa_shader_module_,
+                .pName  = "main",
+            },
+        }};
+
+        // The triangle comes from the vertex index alone
+        const VkPipelineVertexInputStateCreateInfo vertex_input_info = {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
+        };
+
+        const VkPipelineInputAssemblyStateCreateInfo input_assembly = {
+            .sType =
+                VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO,
+            .topology               = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST,
+            .primitiveRestartEnable = VK_FALSE,
+        };
+
+        // Set when recording, so the pipeline outlives the swap chain
+        const VkPipelineViewportStateCreateInfo viewport_state = {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO,
+            .viewportCount = 1,
+            .scissorCount  = 1,
+        };
+        const std::array<VkDynamicState, 2> dynamic_states = {
+            VK_DYNAMIC_STATE_VIEWPORT,
+            VK_DYNAMIC_STATE_SCISSOR,
+        };
+        const VkPipelineDynamicStateCreateInfo dynamic_state = {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO,
+            .dynamicStateCount = narrow_cast<uint32_t>(dynamic_states.size()),
+            .pDynamicStates    = dynamic_states.data(),
+        };
+
+        const VkPipelineRasterizationStateCreateInfo rasterizer = {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO,
+            .depthClampEnable        = VK_FALSE,
+            .rasterizerDiscardEnable = VK_FALSE,
+            .polygonMode             = VK_POLYGON_MODE_FILL,
+            .cullMode                = VK_CULL_MODE_NONE,
+            .frontFace               = VK_FRONT_FACE_COUNTER_CLOCKWISE,
+            .depthBiasEnable         = VK_FALSE,
+            .lineWidth               = 1.0f,
+        };
+
+        const VkPipelineMultisampleStateCreateInfo multisampling = {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO,
+            .rasterizationSamples = VK_SAMPLE_COUNT_1_BIT,
+            .sampleShadingEnable  = VK_FALSE,
+        };
+
+        const VkPipelineColorBlendAttachmentState colour_blend_attachment = {
+            .blendEnable = VK_FALSE,
+            .colorWriteMask =
+                VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT |
+                VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT};
+
+        const VkPipelineColorBlendStateCreateInfo colour_blending = {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
+            .logicOpEnable   = VK_FALSE,
+            .attachmentCount = 1,
+            .pAttachments    = &colour_blend_attachment,
+        };
+
+        const VkGraphicsPipelineCreateInfo pipeline_info = {
+            .sType      = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
+            .stageCount = narrow_cast<uint32_t>(shader_stages.size()),
+            .pStages    = shader_stages.data(),
+            .pVertexInputState   = &vertex_input_info,
+            .pInputAssemblyState = &input_assembly,
+            .pViewportState      = &viewport_state,
+            .pRasterizationState = &rasterizer,
+            .pMultisampleState   = &multisampling,
+            .pColorBlendState    = &colour_blending,
+            .pDynamicState       = &dynamic_state,
+            .layout              = post_pipeline_layout_,
+            .renderPass          = render_pass,
+            .subpass             = 0,
+        };
+        VkPipeline pipeline = {};
+        if (create_graphics_pipeline(pipeline_info, &pipeline) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create graphics pipeline!");
+        }
+        return pipeline;
+    }
+
+    void retire_post_pass(RetiredResources &retired) noexcept
+    {
+        retired.descriptor_pools.push_back(post_descriptor_pool_);
+        post_descriptor_pool_ = {};
+        post_descriptor_set_  = {};
+        retired.framebuffers.insert(retired.framebuffers.end(),
+                                    post_framebuffers_.begin(),
+                                    post_framebuffers_.end());
+        post_framebuffers_.clear();
+        retired.render_passes.push_back(post_render_pass_);
+        post_render_pass_ = {};
+    }
+
+    // Records FXAA reading the scene image and writing the swap chain
+    // image, ready to present. It scales the render extent up as it goes.
+    void record_fxaa(VkCommandBuffer command_buffer, uint32_t image_index)
+    {
+        const VkRenderPassBeginInfo render_pass_info = {
+            .sType       = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
+            .renderPass  = post_render_pass_,
+            .framebuffer = post_framebuffers_[image_index],
+            .renderArea  = {.offset = {0, 0}, .extent = swap_chain_extent_},
+        };
+        vkCmdBeginRenderPass(command_buffer, &render_pass_info,
+                             VK_SUBPASS_CONTENTS_INLINE);
+        vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                          post_pipeline_);
+        vkCmdBindDescriptorSets(command_buffer,
+                                VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                post_pipeline_layout_, 0, 1,
+                                &post_descriptor_set_, 0, nullptr);
+
+        const VkViewport viewport = {
+            .x        = 0.0f,
+            .y        = 0.0f,
+            .width    = narrow_cast<float>(swap_chain_extent_.width),
+            .height   = narrow_cast<float>(swap_chain_extent_.height),
+            .minDepth = 0.0f,
+            .maxDepth = 1.0f,
+        };
+        const VkRect2D scissor = {
+            .offset = {0, 0},
+            .extent = swap_chain_extent_,
+        };
+        vkCmdSetViewport(command_buffer, 0, 1, &viewport);
+        vkCmdSetScissor(command_buffer, 0, 1, &scissor);
+
+        const vec2 scene_size(swap_chain_extent_.width,
+                              swap_chain_extent_.height);
+        const FxaaConstants constants = {
+            .uv_scale =
+                vec2(render_extent_.width, render_extent_.height) / scene_size,
+            .texel_size = 1.0f / scene_size,
+        };
+        vkCmdPushConstants(command_buffer, post_pipeline_layout_,
+                           VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(constants),
+                           &constants);
+        vkCmdDraw(command_buffer, 3, 1, 0, 0);
+        vkCmdEndRenderPass(command_buffer);
+    }
+
+    void log_resolution_statistics() const
+    {
+        const uint64_t frames =
+            std::accumulate(gpu_frame_time_histogram_.begin(),
+                            gpu_frame_time_histogram_.end(), uint64_t {0});
+        if (frames == 0)
+        {
+            return;
+        }
+
+        std::string histogram;
+        for (index_t i = 0; i < std::ssize(gpu_frame_time_histogram_); ++i)
+        {
+            const uint64_t count = gpu_frame_time_histogram_[i];
+            if (count == 0)
+            {
+                continue;
+            }
+            const bool last = i + 1 == std::ssize(gpu_frame_time_histogram_);
+            histogram += fmt::format(
+                "{}{}{} ms {:.1f}%", histogram.empty() ? "" : ", ", i,
+                last ? "+" : fmt::format("-{}", i + 1), 100.0 * count / frames);
+        }
+        log_info("GPU frame times against a {:.2f} ms budget: {}",
+                 gpu_frame_budget_ms_, histogram);
+        log_info("Resolution scale at exit: {:.0f}% ({}x{})",
+                 100.0f * resolution_scale_, render_extent_.width,
+                 render_extent_.height);
+    }
+
+    void create_command_pool()
+    {
+        // Command buffers are re-recorded as meshes finish uploading
+        const VkCommandPoolCreateInfo pool_info = {
+            .sType            = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+            .flags            = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+            .queueFamilyIndex = graphics_queue_family_,
+        };
+
+        if (vkCreateCommandPool(device_, &pool_info, gAllocator,
+                                &command_pool_) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create command pool!");
+        }
+
+        const VkCommandPoolCreateInfo transfer_pool_info = {
+            .sType            = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+            .flags            = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+            .queueFamilyIndex = transfer_queue_family_,
+        };
+
+        if (vkCreateCommandPool(device_, &transfer_pool_info, gAllocator,
+                                &transfer_command_pool_) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create transfer command pool!");
+        }
+    }
+
+    void create_mesh()
+    {
+        // Load data
+        // auto meshes = create_octahedron();
+        // auto meshes = create_cube();
+        // auto meshes = create_grass_block();
+        auto meshes =
+            load_mesh("assets\\lighthouse.obj", "assets",
+                      glm::scale(glm::translate(glm::mat4(1.0f),
+                                                vec3(0.0f, -0.95f, 0.0f)),
+                                 vec3(0.009f, 0.009f, 0.009f)));
+        collect_occluders(meshes);
+        std::erase_if(meshes, [](const MeshObject &mesh) {
+            return mesh.occluder_only;
+        });
+
+        // Decode and analyse the textures in parallel
+        const bool single_channel_supported =
+            single_channel_textures_supported();
+        std::map<std::string, std::future<TextureData>> texture_data;
+        for (const auto &mesh : meshes)
+        {
+            if (!texture_names_.contains(mesh.texture_name) &&
+                !texture_data.contains(mesh.texture_name))
+            {
+                texture_data.emplace(
+                    mesh.texture_name,
+                    std::async(std::launch::async, load_texture_data,
+                               mesh.texture_name, single_channel_supported));
+            }
+        }
+
+        VkDeviceSize texture_bytes       = 0;
+        VkDeviceSize rgba_texture_bytes  = 0;
+        int flat_texture_count           = 0;
+        int single_channel_texture_count = 0;
+
+        // All meshes share one vertex and one index buffer so that a bucket
+        // can be drawn with a single indirect call
+        size_t vertex_count = 0;
+        size_t index_count  = 0;
+        for (const auto &mesh : meshes)
+        {
+            vertex_count += mesh.vertices.size();
+            index_count += mesh.indices.size();
+        }
+        Expects(vertex_count > 0 && index_count > 0);
+
+        scene_vertex_bytes_   = sizeof(Vertex) * VkDeviceSize {vertex_count};
+        scene_position_bytes_ = sizeof(vec3) * VkDeviceSize {vertex_count};
+        scene_index_bytes_    = sizeof(uint16_t) * VkDeviceSize {index_count};
+        std::tie(scene_vertex_buffer_, scene_vertex_memory_) =
+            create_upload_buffer(scene_vertex_bytes_,
+                                 VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
+        // The depth pre-pass fetches a quarter of the bytes per vertex
+        std::tie(scene_position_buffer_, scene_position_memory_) =
+            create_upload_buffer(scene_position_bytes_,
+                                 VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
+        std::tie(scene_index_buffer_, scene_index_memory_) =
+            create_upload_buffer(scene_index_bytes_,
+                                 VK_BUFFER_USAGE_INDEX_BUFFER_BIT);
+        size_t first_vertex = 0;
+        size_t first_index  = 0;
+
+        // Record the whole scene into as few batches as possible, drawing
+        // each mesh once the batch holding it has landed
+        UploadBatch batch = begin_upload_batch();
+        for (const auto &mesh : meshes)
+        {
+            if (batch.staging_bytes >= max_upload_batch_bytes_ ||
+                (serial_uploads_ && batch.staging_bytes > 0))
+            {
+                submit_upload_batch(std::move(batch));
+                batch = begin_upload_batch();
+            }
+            if (serial_uploads_)
+            {
+                vkQueueWaitIdle(transfer_queue_);
+                poll_uploads();
+                vkQueueWaitIdle(graphics_queue_);
+                poll_uploads();
+            }
+
+            uint32_t texture_index = 0;
+            {
+                auto it = texture_names_.find(mesh.texture_name);
+                if (it == texture_names_.end())
+                {
+                    const TextureData data =
+                        texture_data.at(mesh.texture_name).get();
+                    const auto texture =
+                        create_texture(physical_device_, memory_allocator_,
+                                       device_, data);
+                    upload_texture(batch, texture, data);
+                    textures_.push_back(texture);
+
+                    texture_bytes += texture.memory_size_;
+                    rgba_texture_bytes += texture_memory_size(
+                        data.source_width, data.source_height, 4,
+                        mip_level_count(data.source_width,
+                                        data.source_height));
+                    flat_texture_count += data.analysis.flat ? 1 : 0;
+                    single_channel_texture_count +=
+                        data.format == VK_FORMAT_R8_SRGB ? 1 : 0;
+
+                    const auto result = texture_names_.emplace(
+                        mesh.texture_name,
+                        narrow_cast<uint32_t>(textures_.size() - 1));
+                    it = result.first;
+                    bucket_materials_.push_back({
+                        .flat  = data.analysis.flat,
+                        .texel = first_texel(data),
+                    });
+                }
+                texture_index = it->second;
+            }
+
+            // Buckets are by texture, so the material follows the texture
+            const bool white = std::ranges::all_of(
+                mesh.vertices,
+                [](const Vertex &vertex) { return vertex.colour == vec3(1); });
+            bucket_materials_[texture_index].vertex_colour |= !white;
+
+            const MeshRange range = {
+                .vertex_offset = narrow_cast<int32_t>(first_vertex),
+                .first_index   = narrow_cast<uint32_t>(first_index),
+                .index_count   = narrow_cast<uint32_t>(mesh.indices.size()),
+                .vertex_count  = narrow_cast<uint32_t>(mesh.vertices.size()),
+            };
+            upload_mesh(batch, mesh, range, scene_vertex_buffer_,
+                        scene_position_buffer_, scene_index_buffer_);
+            first_vertex += mesh.vertices.size();
+            first_index += mesh.indices.size();
+
+            mesh_ranges_.push_back(range);
+            mesh_bounds_.push_back(bounding_sphere(mesh.vertices));
+            mesh_boxes_.push_back(bounding_box(mesh.vertices));
+            texture_indices_.push_back(texture_index);
+            mesh_uploads_.push_back(batch.ticket);
+        }
+        submit_upload_batch(std::move(batch));
+        mesh_visibility_.assign(mesh_ranges_.size(), true);
+
+        constexpr double mebibyte = 1024.0 * 1024.0;
+        log_info("Created {} textures ({} flat, {} single channel) using "
+                 "{:.1f} MiB, saving {:.1f} MiB over RGBA",
+                 texture_data.size(), flat_texture_count,
+                 single_channel_texture_count, texture_bytes / mebibyte,
+                 (rgba_texture_bytes - texture_bytes) / mebibyte);
+    }
+
+    // Records copying a mesh's vertices, positions and indices into the
+    // range of the scene buffers
+    void upload_mesh(UploadBatch &batch, const MeshObject &mesh,
+                     const MeshRange &range, VkBuffer vertex_buffer,
+                     VkBuffer position_buffer, VkBuffer index_buffer)
+    {
+        const VkDeviceSize first_vertex =
+            narrow_cast<VkDeviceSize>(range.vertex_offset);
+        upload_buffer(batch, vertex_buffer, sizeof(Vertex) * first_vertex,
+                      mesh.vertices.data(),
+                      sizeof(Vertex) * VkDeviceSize {mesh.vertices.size()},
+                      VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT);
+        std::vector<vec3> positions(mesh.vertices.size());
+        std::ranges::transform(mesh.vertices, positions.begin(), &Vertex::pos);
+        upload_buffer(batch, position_buffer, sizeof(vec3) * first_vertex,
+                      positions.data(),
+                      sizeof(vec3) * VkDeviceSize {positions.size()},
+                      VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT);
+        upload_buffer(batch, index_buffer,
+                      sizeof(uint16_t) * VkDeviceSize {range.first_index},
+                      mesh.indices.data(),
+                      sizeof(uint16_t) * VkDeviceSize {mesh.indices.size()},
+                      VK_ACCESS_INDEX_READ_BIT);
+    }
+
+    // Whether grayscale textures can be stored and mipmapped as R8
+    bool single_channel_textures_supported() const noexcept
+    {
+        VkFormatProperties properties = {};
+        vkGetPhysicalDeviceFormatProperties(physical_device_, VK_FORMAT_R8_SRGB,
+                                            &properties);
+        constexpr VkFormatFeatureFlags mipmap_features =
+            VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT |
+            VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT |
+            VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT;
+        return (properties.optimalTilingFeatures & mipmap_features) ==
+               mipmap_features;
+    }
+
+    // Starts replacing every texture with a placeholder of its first
+    // texel, or the placeholders with the textures decoded again from
+    // disk. Nothing waits on the GPU; poll_texture_swap finishes the swap.
+    void start_texture_swap()
+    {
+        if (texture_swap_ || !pending_uploads_.empty())
+        {
+            log_warn("Textures are still being uploaded");
+            return;
+        }
+
+        texture_swap_ = TextureSwap {
+            .resident   = !textures_resident_,
+            .begin_time = clock::now(),
+        };
+        if (!texture_swap_->resident)
+        {
+            // Flat materials are drawn with this texel already
+            std::vector<TextureData> placeholders;
+            for (index_t i = 0; i < std::ssize(textures_); ++i)
+            {
+                const uint32_t texel = bucket_materials_[i].texel;
+                TextureData data     = {
+                    .width         = 1,
+                    .height        = 1,
+                    .source_width  = 1,
+                    .source_height = 1,
+                };
+                for (int shift = 24; shift >= 0; shift -= 8)
+                {
+                    data.pixels.push_back(narrow_cast<uint8_t>(texel >> shift));
+                }
+                placeholders.push_back(std::move(data));
+            }
+            upload_texture_swap(placeholders);
+            return;
+        }
+
+        const bool single_channel_supported =
+            single_channel_textures_supported();
+        texture_swap_->data.resize(textures_.size());
+        for (const auto &[filename, index] : texture_names_)
+        {
+            texture_swap_->data[index] =
+                std::async(std::launch::async, load_texture_data, filename,
+                           single_channel_supported);
+        }
+    }
+
+    // Records the swap's textures into upload batches, in bucket order
+    void upload_texture_swap(const std::vector<TextureData> &data)
+    {
+        UploadBatch batch = begin_upload_batch();
+        for (const auto &texture_data : data)
+        {
+            if (batch.staging_bytes >= max_upload_batch_bytes_)
+            {
+                submit_upload_batch(std::move(batch));
+                batch = begin_upload_batch();
+            }
+            const auto texture = create_texture(
+                physical_device_, memory_allocator_, device_, texture_data);
+            upload_texture(batch, texture, texture_data);
+            texture_swap_->textures.push_back(texture);
+        }
+        texture_swap_->ticket = batch.ticket;
+        submit_upload_batch(std::move(batch));
+    }
+
+    // Uploads the swap's textures once they have been decoded, and swaps
+    // them in once they have landed. Frames in flight may still be
+    // sampling the replaced textures, so they are retired rather than
+    // destroyed. Never waits on the GPU or the decoding threads.
+    void poll_texture_swap()
+    {
+        if (!texture_swap_)
+        {
+            return;
+        }
+
+        if (!texture_swap_->data.empty())
+        {
+            const bool decoded = std::ranges::all_of(
+                texture_swap_->data, [](const auto &future) {
+                    return future.wait_for(std::chrono::seconds(0)) ==
+                           std::future_status::ready;
+                });
+            if (decoded)
+            {
+                std::vector<TextureData> data;
+                for (auto &future : texture_swap_->data)
+                {
+                    data.push_back(future.get());
+                }
+                texture_swap_->data.clear();
+                upload_texture_swap(data);
+            }
+            return;
+        }
+
+        // A defragmentation pass may still be copying into the textures
+        if (completed_uploads_ < texture_swap_->ticket || defrag_pass_)
+        {
+            return;
+        }
+
+        // The buckets' descriptor sets and cached buffers are rewritten for
+        // the new textures as each frame comes round
+        RetiredResources &retired = retired_resources();
+        VkDeviceSize texture_bytes = 0;
+        for (index_t i = 0; i < std::ssize(textures_); ++i)
+        {
+            retire_texture(retired, textures_[i]);
+            textures_[i] = texture_swap_->textures[i];
+            texture_bytes += textures_[i].memory_size_;
+            ++bucket_versions_[i];
+        }
+        textures_resident_ = texture_swap_->resident;
+
+        log_info("Swapped in {} {} using {:.1f} MiB, {} ms after starting",
+                 textures_.size(),
+                 textures_resident_ ? "textures" : "placeholder textures",
+                 texture_bytes / (1024.0 * 1024.0),
+                 std::chrono::duration_cast<std::chrono::milliseconds>(
+                     clock::now() - texture_swap_->begin_time)
+                     .count());
+        texture_swap_.reset();
+    }
+
+    static void retire_texture(RetiredResources &retired,
+                               Texture &texture) noexcept
+    {
+        retired.samplers.push_back(texture.sampler_);
+        retired.image_views.push_back(texture.image_view_);
+        retired.images.push_back(texture.image_);
+        retired.memory.push_back(texture.device_memory_);
+        texture = {};
+    }
+
+    // Starts replacing the scene buffers with ones holding the kept meshes,
+    // in order, followed by the added ones. Nothing waits on the GPU;
+    // poll_scene_swap finishes the swap. Returns false if the swap has to
+    // wait for other uploads.
+    bool start_scene_swap(std::span<const index_t> kept,
+                          std::span<const MeshObject> added)
+    {
+        // A defragmentation pass may still be copying the scene buffers
+        if (scene_swap_ || defrag_pass_ || !pending_uploads_.empty())
+        {
+            log_warn("The scene is still being uploaded");
+            return false;
+        }
+        for (const auto &mesh : added)
+        {
+            if (!texture_names_.contains(mesh.texture_name))
+            {
+                throw std::runtime_error(
+                    "Failed to find the texture of an added mesh!");
+            }
+        }
+
+        SceneSwap swap = {.begin_time = clock::now()};
+        for (const index_t mesh_index : kept)
+        {
+            swap.vertex_count += mesh_ranges_[mesh_index].vertex_count;
+            swap.index_count += mesh_ranges_[mesh_index].index_count;
+        }
+        for (const auto &mesh : added)
+        {
+            swap.vertex_count += mesh.vertices.size();
+            swap.index_count += mesh.indices.size();
+        }
+        Expects(swap.vertex_count > 0 && swap.index_count > 0);
+
+        std::tie(swap.vertex_buffer, swap.vertex_memory) =
+            create_upload_buffer(sizeof(Vertex) * swap.vertex_count,
+                                 VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
+        std::tie(swap.position_buffer, swap.position_memory) =
+            create_upload_buffer(sizeof(vec3) * swap.vertex_count,
+                                 VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
+        std::tie(swap.index_buffer, swap.index_memory) =
+            create_upload_buffer(sizeof(uint16_t) * swap.index_count,
+                                 VK_BUFFER_USAGE_INDEX_BUFFER_BIT);
+
+        // The kept meshes close up over the removed ones
+        std::vector<VkBufferCopy> vertex_copies;
+        std::vector<VkBufferCopy> position_copies;
+        std::vector<VkBufferCopy> index_copies;
+        uint32_t first_vertex = 0;
+        uint32_t first_index  = 0;
+        for (const index_t mesh_index : kept)
+        {
+            const MeshRange &range = mesh_ranges_[mesh_index];
+            const VkDeviceSize vertex_offset =
+                narrow_cast<VkDeviceSize>(range.vertex_offset);
+            vertex_copies.push_back({
+                .srcOffset = sizeof(Vertex) * vertex_offset,
+                .dstOffset = sizeof(Vertex) * VkDeviceSize {first_vertex},
+                .size      = sizeof(Vertex) * VkDeviceSize {range.vertex_count},
+            });
+            position_copies.push_back({
+                .srcOffset = sizeof(vec3) * vertex_offset,
+                .dstOffset = sizeof(vec3) * VkDeviceSize {first_vertex},
+                .size      = sizeof(vec3) * VkDeviceSize {range.vertex_count},
+            });
+            index_copies.push_back({
+                .srcOffset =
+                    sizeof(uint16_t) * VkDeviceSize {range.first_index},
+                .dstOffset = sizeof(uint16_t) * VkDeviceSize {first_index},
+                .size =
+                    sizeof(uint16_t) * VkDeviceSize {range.index_count},
+            });
+
+            swap.ranges.push_back({
+                .vertex_offset = narrow_cast<int32_t>(first_vertex),
+                .first_index   = first_index,
+                .index_count   = range.index_count,
+                .vertex_count  = range.vertex_count,
+            });
+            swap.bounds.push_back(mesh_bounds_[mesh_index]);
+            swap.boxes.push_back(mesh_boxes_[mesh_index]);
+            swap.texture_indices.push_back(texture_indices_[mesh_index]);
+            first_vertex += range.vertex_count;
+            first_index += range.index_count;
+        }
+
+        // The copies read the current buffers on the graphics queue, which
+        // owns them, before any staging can split the batch
+        UploadBatch batch = begin_upload_batch();
+        if (!kept.empty())
+        {
+            const VkMemoryBarrier read_barrier = {
+                .sType         = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+                .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+                .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+            };
+            vkCmdPipelineBarrier(batch.graphics_commands,
+                                 VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                 VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1,
+                                 &read_barrier, 0, nullptr, 0, nullptr);
+            vkCmdCopyBuffer(batch.graphics_commands, scene_vertex_buffer_,
+                            swap.vertex_buffer,
+                            narrow_cast<uint32_t>(vertex_copies.size()),
+                            vertex_copies.data());
+            vkCmdCopyBuffer(batch.graphics_commands, scene_position_buffer_,
+                            swap.position_buffer,
+                            narrow_cast<uint32_t>(position_copies.size()),
+                            position_copies.data());
+            vkCmdCopyBuffer(batch.graphics_commands, scene_index_buffer_,
+                            swap.index_buffer,
+                            narrow_cast<uint32_t>(index_copies.size()),
+                            index_copies.data());
+            const VkMemoryBarrier draw_barrier = {
+                .sType         = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+                .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+                .dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT |
+                                 VK_ACCESS_INDEX_READ_BIT,
+            };
+            vkCmdPipelineBarrier(batch.graphics_commands,
+                                 VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                 VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 0, 1,
+                                 &draw_barrier, 0, nullptr, 0, nullptr);
+        }
+
+        for (const auto &mesh : added)
+        {
+            if (batch.staging_bytes >= max_upload_batch_bytes_)
+            {
+                submit_upload_batch(std::move(batch));
+                batch = begin_upload_batch();
+            }
+
+            // A bucket drawing vertex colours needs its pipelines rebuilt,
+            // once the mesh is swapped in
+            const uint32_t texture_index = texture_names_.at(mesh.texture_name);
+            const bool white             = std::ranges::all_of(
+                mesh.vertices,
+                [](const Vertex &vertex) { return vertex.colour == vec3(1); });
+            if (!white && !bucket_materials_[texture_index].vertex_colour)
+            {
+                swap.vertex_colour_buckets.push_back(texture_index);
+            }
+
+            const MeshRange range = {
+                .vertex_offset = narrow_cast<int32_t>(first_vertex),
+                .first_index   = first_index,
+                .index_count   = narrow_cast<uint32_t>(mesh.indices.size()),
+                .vertex_count  = narrow_cast<uint32_t>(mesh.vertices.size()),
+            };
+            upload_mesh(batch, mesh, range, swap.vertex_buffer,
+                        swap.position_buffer, swap.index_buffer);
+            first_vertex += range.vertex_count;
+            first_index += range.index_count;
+
+            swap.ranges.push_back(range);
+            swap.bounds.push_back(bounding_sphere(mesh.vertices));
+            swap.boxes.push_back(bounding_box(mesh.vertices));
+            swap.texture_indices.push_back(texture_index);
+        }
+        swap.ticket = batch.ticket;
+        submit_upload_batch(std::move(batch));
+        scene_swap_ = std::move(swap);
+        return true;
+    }
+
+    // Swaps in the scene once its batches have landed. Frames in flight may
+    // still be drawing from the replaced buffers, so they are retired
+    // rather than destroyed. Never waits on the GPU.
+    void poll_scene_swap()
+    {
+        if (!scene_swap_ || completed_uploads_ < scene_swap_->ticket)
+        {
+            return;
+        }
+
+        RetiredResources &retired = retired_resources();
+        retired.buffers.insert(retired.buffers.end(),
+                               {scene_vertex_buffer_, scene_position_buffer_,
+                                scene_index_buffer_});
+        retired.memory.insert(retired.memory.end(),
+                              {scene_vertex_memory_, scene_position_memory_,
+                               scene_index_memory_});
+        scene_vertex_buffer_   = scene_swap_->vertex_buffer;
+        scene_vertex_memory_   = scene_swap_->vertex_memory;
+        scene_vertex_bytes_    = sizeof(Vertex) * scene_swap_->vertex_count;
+        scene_position_buffer_ = scene_swap_->position_buffer;
+        scene_position_memory_ = scene_swap_->position_memory;
+        scene_position_bytes_  = sizeof(vec3) * scene_swap_->vertex_count;
+        scene_index_buffer_    = scene_swap_->index_buffer;
+        scene_index_memory_    = scene_swap_->index_memory;
+        scene_index_bytes_     = sizeof(uint16_t) * scene_swap_->index_count;
+
+        mesh_ranges_     = std::move(scene_swap_->ranges);
+        mesh_bounds_     = std::move(scene_swap_->bounds);
+        mesh_boxes_      = std::move(scene_swap_->boxes);
+        texture_indices_ = std::move(scene_swap_->texture_indices);
+        mesh_uploads_.assign(mesh_ranges_.size(), scene_swap_->ticket);
+        mesh_visibility_.assign(mesh_ranges_.size(), true);
+
+        // The buckets' descriptor sets, which bind the object array, and
+        // cached buffers are rewritten as each frame comes round, as are
+        // the culling commands and sets by update_culling_draws
+        assign_buckets();
+        invalidate_buckets();
+        for (const uint32_t bucket : scene_swap_->vertex_colour_buckets)
+        {
+            bucket_materials_[bucket].vertex_colour = true;
+            pipelines_outdated_                     = true;
+        }
+        if (gpu_culling_supported_)
+        {
+            retired.buffers.push_back(scene_draw_buffer_);
+            retired.memory.push_back(scene_draw_memory_);
+            retired.buffers.push_back(visibility_buffer_);
+            retired.memory.push_back(visibility_memory_);
+            create_scene_draws();
+            reset_visibility_ = true;
+        }
+        ++scene_generation_;
+
+        log_info("Swapped in a scene of {} meshes, {} ms after starting",
+                 mesh_ranges_.size(),
+                 std::chrono::duration_cast<std::chrono::milliseconds>(
+                     clock::now() - scene_swap_->begin_time)
+                     .count());
+        scene_swap_.reset();
+    }
+
+    static void retire_scene_swap(RetiredResources &retired,
+                                  SceneSwap &swap) noexcept
+    {
+        retired.buffers.insert(retired.buffers.end(),
+                               {swap.vertex_buffer, swap.position_buffer,
+                                swap.index_buffer});
+        retired.memory.insert(retired.memory.end(),
+                              {swap.vertex_memory, swap.position_memory,
+                               swap.index_memory});
+        swap = {};
+    }
+
+    // Adds a small cube beside the scene, drawn with one of its textures
+    void add_cube()
+    {
+        // Each cube goes a little further round the lighthouse
+        const float angle    = 0.7f * narrow_cast<float>(added_cube_count_);
+        const mat4 transform = glm::scale(
+            glm::translate(mat4(1.0f), vec3(0.5f * std::cos(angle), -0.9f,
+                                            0.5f * std::sin(angle))),
+            vec3(0.05f));
+
+        auto meshes = create_cube();
+        for (auto &mesh : meshes)
+        {
+            for (auto &vertex : mesh.vertices)
+            {
+                vertex.pos = vec3(transform * vec4(vertex.pos, 1.0f));
+            }
+            mesh.texture_name = texture_names_.begin()->first;
+        }
+
+        std::vector<index_t> kept(mesh_ranges_.size());
+        std::iota(kept.begin(), kept.end(), 0);
+        if (start_scene_swap(kept, meshes))
+        {
+            ++added_cube_count_;
+        }
+    }
+
+    // Removes the meshes of the cube add_cube added last
+    void remove_cube()
+    {
+        if (added_cube_count_ == 0)
+        {
+            log_warn("There are no added cubes to remove");
+            return;
+        }
+
+        const index_t cube_meshes = std::ssize(create_cube());
+        std::vector<index_t> kept(mesh_ranges_.size() - cube_meshes);
+        std::iota(kept.begin(), kept.end(), 0);
+        if (start_scene_swap(kept, {}))
+        {
+            --added_cube_count_;
+        }
+    }
+
+    void create_uniform_arena()
+    {
+        VkPhysicalDeviceProperties properties = {};
+        vkGetPhysicalDeviceProperties(physical_device_, &properties);
+
+        std::tie(uniform_arena_.buffer, uniform_arena_.memory) = create_buffer(
+            memory_allocator_, device_,
+            uniform_arena_frame_size_ * max_frames_in_flight_,
+            VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT |
+                VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+
+        // Object constants are bound as a storage buffer array
+        uniform_arena_.frame_size = uniform_arena_frame_size_;
+        uniform_arena_.alignment =
+            std::max(properties.limits.minUniformBufferOffsetAlignment,
+                     properties.limits.minStorageBufferOffsetAlignment);
+    }
+
+    void create_descriptor_pool()
+    {
+        const uint32_t set_count =
+            narrow_cast<uint32_t>(max_frames_in_flight_ * textures_.size());
+        const std::array<VkDescriptorPoolSize, 4> pool_sizes = {{
+            {
+                .type            = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+                .descriptorCount = set_count,
+            },
+
+            {
+                .type            = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC,
+                .descriptorCount = 2 * set_count,
+            },
+
+            {
+                .type            = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                .descriptorCount = set_count,
+            },
+
+            {
+                .type            = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                .descriptorCount = set_count,
+            },
+        }};
+
+        const VkDescriptorPoolCreateInfo pool_info = {
+            .sType         = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+            .maxSets       = set_count,
+            .poolSizeCount = narrow_cast<uint32_t>(pool_sizes.size()),
+            .pPoolSizes    = pool_sizes.data(),
+        };
+
+        if (vkCreateDescriptorPool(device_, &pool_info, gAllocator,
+                                   &descriptor_pool_) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create descriptor pool!");
+        }
+    }
+
+    void create_descriptor_sets()
+    {
+        descriptor_sets_.resize(max_frames_in_flight_ * textures_.size());
+
+        std::vector<VkDescriptorSetLayout> layouts(descriptor_sets_.size(),
+                                                   descriptor_set_layout_);
+
+        const VkDescriptorSetAllocateInfo alloc_info = {
+            .sType          = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+            .descriptorPool = descriptor_pool_,
+            .descriptorSetCount = narrow_cast<uint32_t>(layouts.size()),
+            .pSetLayouts        = layouts.data()};
+
+        if (vkAllocateDescriptorSets(device_, &alloc_info,
+                                     descriptor_sets_.data()) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to allocate descriptor sets!");
+        }
+
+        // Sets are written for their bucket's version, which starts at 1
+        descriptor_set_versions_.assign(descriptor_sets_.size(), 0);
+        for (index_t i = 0; i < max_frames_in_flight_; ++i)
+        {
+            update_descriptor_sets(i);
+        }
+    }
+
+    // Points the descriptor sets of a frame in flight at the current
+    // textures, for the buckets that have changed. The frame's command
+    // buffers must be idle, and the bucket's cached buffer for the frame is
+    // re-recorded as the update invalidates it.
+    void update_descriptor_sets(index_t i)
+    {
+        const VkDescriptorBufferInfo frame_buffer_info = {
+            .buffer = uniform_arena_.buffer,
+            .offset = 0,
+            .range  = sizeof(FrameUniforms),
+        };
+        const VkDescriptorBufferInfo object_buffer_info = {
+            .buffer = uniform_arena_.buffer,
+            .offset = 0,
+            .range  = object_array_bytes(),
+        };
+        const VkDescriptorBufferInfo light_buffer_info = {
+            .buffer = uniform_arena_.buffer,
+            .offset = 0,
+            .range  = light_array_bytes(),
+        };
+        const VkDescriptorBufferInfo cluster_buffer_info = {
+            .buffer = cluster_frames_[i].clusters,
+            .offset = 0,
+            .range  = VK_WHOLE_SIZE,
+        };
+
+        for (index_t j = 0; j < std::ssize(textures_); ++j)
+        {
+
+            // TODO: Figure out how to set correct sampler, image_view
+            const index_t set_index = i * textures_.size() + j;
+            const int mesh_index    = j;
+            if (descriptor_set_versions_[set_index] == bucket_versions_[j])
+            {
+                continue;
+            }
+
+            const VkDescriptorImageInfo image_info = {
+                .sampler     = textures_[mesh_index].sampler_,
+                .imageView   = textures_[mesh_index].image_view_,
+                .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+            };
+
+            const std::array<VkWriteDescriptorSet, 5> descriptor_writes = {{
+                {
+                    .sType           = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                    .dstSet          = descriptor_sets_[set_index],
+                    .dstBinding      = 0,
+                    .dstArrayElement = 0,
+                    .descriptorCount = 1,
+                    .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+                    .pBufferInfo    = &frame_buffer_info,
+                },
+
+                {
+                    .sType           = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                    .dstSet          = descriptor_sets_[set_index],
+                    .dstBinding      = 1,
+                    .dstArrayElement = 0,
+                    .descriptorCount = 1,
+                    .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                    .pImageInfo     = &image_info,
+                },
+
+                {
+                    .sType           = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                    .dstSet          = descriptor_sets_[set_index],
+                    .dstBinding      = 2,
+                    .dstArrayElement = 0,
+                    .descriptorCount = 1,
+                    .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC,
+                    .pBufferInfo    = &object_buffer_info,
+                },
+
+                {
+                    .sType           = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                    .dstSet          = descriptor_sets_[set_index],
+                    .dstBinding      = 3,
+                    .dstArrayElement = 0,
+                    .descriptorCount = 1,
+                    .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC,
+                    .pBufferInfo    = &light_buffer_info,
+                },
+
+                {
+                    .sType           = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                    .dstSet          = descriptor_sets_[set_index],
+                    .dstBinding      = 4,
+                    .dstArrayElement = 0,
+                    .descriptorCount = 1,
+                    .descriptorType  = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                    .pBufferInfo     = &cluster_buffer_info,
+                },
+            }};
+
+            vkUpdateDescriptorSets(
+                device_, narrow_cast<uint32_t>(descriptor_writes.size()),
+                descriptor_writes.data(), 0, nullptr);
+            descriptor_set_versions_[set_index] = bucket_versions_[j];
+        }
+    }
+
+    void create_command_buffers()
+    {
+        command_buffers_.resize(max_frames_in_flight_);
+
+        const VkCommandBufferAllocateInfo alloc_info = {
             .sType       = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
             .commandPool = command_pool_,
             .level       = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
@@ -1412,675 +4901,3981 @@ class Application
                 narrow_cast<uint32_t>(command_buffers_.size()),
         };
 
-        if (vkAllocateCommandBuffers(device_, &alloc_info,
-                                     command_buffers_.data()) != VK_SUCCESS)
+        if (vkAllocateCommandBuffers(device_, &alloc_info,
+                                     command_buffers_.data()) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to allocate command buffers!");
+        }
+    }
+
+    void create_command_recorders()
+    {
+        const auto thread_count = std::clamp<index_t>(
+            std::thread::hardware_concurrency(), 1, max_command_recorders_);
+
+        // Buffers are re-recorded every frame and reset with their pool
+        const VkCommandPoolCreateInfo pool_info = {
+            .sType            = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+            .flags            = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+            .queueFamilyIndex = graphics_queue_family_,
+        };
+
+        // Cached buffers are kept until their bucket changes
+        const VkCommandPoolCreateInfo cache_pool_info = {
+            .sType            = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+            .flags            = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+            .queueFamilyIndex = graphics_queue_family_,
+        };
+
+        for (index_t i = 0; i < thread_count; ++i)
+        {
+            CommandRecorder &recorder = command_recorders_.emplace_back();
+            recorder.pools.resize(max_frames_in_flight_);
+            recorder.buffers.resize(max_frames_in_flight_);
+            recorder.cache_pools.resize(max_frames_in_flight_);
+            for (index_t frame = 0; frame < max_frames_in_flight_; ++frame)
+            {
+                if (vkCreateCommandPool(device_, &pool_info, gAllocator,
+                                        &recorder.pools[frame]) !=
+                        VK_SUCCESS ||
+                    vkCreateCommandPool(device_, &cache_pool_info, gAllocator,
+                                        &recorder.cache_pools[frame]) !=
+                        VK_SUCCESS)
+                {
+                    throw std::runtime_error(
+                        "Failed to create command pool!");
+                }
+
+                const VkCommandBufferAllocateInfo alloc_info = {
+                    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+                    .commandPool        = recorder.pools[frame],
+                    .level              = VK_COMMAND_BUFFER_LEVEL_SECONDARY,
+                    .commandBufferCount = 1,
+                };
+                if (vkAllocateCommandBuffers(device_, &alloc_info,
+                                             &recorder.buffers[frame]) !=
+                    VK_SUCCESS)
+                {
+                    throw std::runtime_error(
+                        "Failed to allocate command buffers!");
+                }
+            }
+
+            if (i > 0)
+            {
+                recorder.thread = std::jthread(run_command_recorder,
+                                               std::ref(recorder));
+            }
+        }
+
+        log_info("Recording command buffers on up to {} threads",
+                 thread_count);
+    }
+
+    void destroy_command_recorders() noexcept
+    {
+        for (const auto &recorder : command_recorders_)
+        {
+            for (auto pool : recorder.pools)
+            {
+                vkDestroyCommandPool(device_, pool, gAllocator);
+            }
+            for (auto pool : recorder.cache_pools)
+            {
+                vkDestroyCommandPool(device_, pool, gAllocator);
+            }
+        }
+        command_recorders_.clear();
+    }
+
+    // Groups the meshes into render buckets by texture and allocates a
+    // cached secondary buffer for each bucket and frame in flight. A
+    // bucket's buffers come from the cache pools of one recorder, so that
+    // recorder's thread can re-record them without locking.
+    void create_bucket_cache()
+    {
+        const index_t bucket_count = std::ssize(textures_);
+        assign_buckets();
+
+        // Cached entries start at version 0, so every bucket starts stale
+        bucket_versions_.assign(bucket_count, 1);
+        bucket_cache_.resize(max_frames_in_flight_ * bucket_count);
+        for (index_t frame = 0; frame < max_frames_in_flight_; ++frame)
+        {
+            for (index_t bucket = 0; bucket < bucket_count; ++bucket)
+            {
+                const CommandRecorder &recorder = command_recorders_
+                    [bucket % std::ssize(command_recorders_)];
+                const VkCommandBufferAllocateInfo alloc_info = {
+                    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+                    .commandPool        = recorder.cache_pools[frame],
+                    .level              = VK_COMMAND_BUFFER_LEVEL_SECONDARY,
+                    .commandBufferCount = 2,
+                };
+                std::array<VkCommandBuffer, 2> buffers = {};
+                if (vkAllocateCommandBuffers(device_, &alloc_info,
+                                             buffers.data()) != VK_SUCCESS)
+                {
+                    throw std::runtime_error(
+                        "Failed to allocate command buffers!");
+                }
+                CachedBucket &cached =
+                    bucket_cache_[frame * bucket_count + bucket];
+                cached.buffer       = buffers[0];
+                cached.depth_buffer = buffers[1];
+            }
+        }
+    }
+
+    // Sorts the meshes into their texture's bucket
+    void assign_buckets()
+    {
+        const index_t bucket_count = std::ssize(textures_);
+        bucket_meshes_.assign(bucket_count, {});
+        for (index_t mesh_index = 0; mesh_index < std::ssize(mesh_ranges_);
+             ++mesh_index)
+        {
+            bucket_meshes_[texture_indices_[mesh_index]].push_back(mesh_index);
+        }
+
+        // Each bucket's indirect draws follow the previous bucket's
+        bucket_first_commands_.assign(bucket_count, 0);
+        for (index_t bucket = 1; bucket < bucket_count; ++bucket)
+        {
+            bucket_first_commands_[bucket] =
+                bucket_first_commands_[bucket - 1] +
+                narrow_cast<uint32_t>(bucket_meshes_[bucket - 1].size());
+        }
+    }
+
+    // Marks every bucket as changed, e.g. after the pipeline is rebuilt
+    void invalidate_buckets() noexcept
+    {
+        for (auto &version : bucket_versions_)
+        {
+            ++version;
+        }
+    }
+
+    void log_bucket_cache_statistics() const
+    {
+        // Estimate the cost of recording a reused draw from the draws that
+        // were actually recorded
+        using milliseconds = std::chrono::duration<double, std::milli>;
+        const double recording_ms =
+            milliseconds(bucket_recording_time_).count();
+        const double saved_ms =
+            cached_draws_recorded_ > 0
+                ? recording_ms * cached_draws_reused_ / cached_draws_recorded_
+                : 0.0;
+        const uint64_t lookups = bucket_cache_hits_ + bucket_cache_misses_;
+        log_info("Command buffer cache: {:.1f}% hit rate ({} hits, {} "
+                 "misses), {:.1f} ms recording, about {:.1f} ms saved",
+                 lookups > 0 ? 100.0 * bucket_cache_hits_ / lookups : 0.0,
+                 bucket_cache_hits_, bucket_cache_misses_, recording_ms,
+                 saved_ms);
+    }
+
+    // Runs job(0) on this thread and job(1) to job(count - 1) on the
+    // recorders' threads, and waits for all of them
+    void run_on_recorders(index_t count,
+                          const std::function<void(index_t)> &job)
+    {
+        Expects(count >= 1 && count <= std::ssize(command_recorders_));
+
+        for (index_t i = 1; i < count; ++i)
+        {
+            CommandRecorder &recorder = command_recorders_[i];
+            recorder.job              = [&job, i]() { job(i); };
+            recorder.start.release();
+        }
+
+        // The jobs refer to the caller's state, so wait for them even on
+        // failure
+        std::exception_ptr error = {};
+        try
+        {
+            job(0);
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+        for (index_t i = 1; i < count; ++i)
+        {
+            CommandRecorder &recorder = command_recorders_[i];
+            recorder.done.acquire();
+            if (recorder.error && !error)
+            {
+                error = recorder.error;
+            }
+            recorder.error = {};
+        }
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+    }
+
+    static void run_command_recorder(CommandRecorder &recorder) noexcept
+    {
+        for (;;)
+        {
+            recorder.start.acquire();
+            if (!recorder.job)
+            {
+                return;
+            }
+            try
+            {
+                recorder.job();
+            }
+            catch (...)
+            {
+                recorder.error = std::current_exception();
+            }
+            recorder.done.release();
+        }
+    }
+
+    // Records drawing into the swap chain image with the uniforms written
+    // for this frame. Each bucket's draws live in a cached secondary command
+    // buffer, re-recorded only when the bucket has changed, which the
+    // frame's primary command buffer executes.
+    void record_command_buffer(index_t frame, uint32_t image_index)
+    {
+        record_stale_buckets(frame);
+
+        const VkCommandBuffer command_buffer = command_buffers_[frame];
+
+        const VkCommandBufferBeginInfo begin_info = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+            .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+        };
+
+        if (vkBeginCommandBuffer(command_buffer, &begin_info) != VK_SUCCESS)
+        {
+            throw std::runtime_error(
+                "Failed to begin recording command buffer!");
+        }
+
+        const uint32_t first_query = narrow_cast<uint32_t>(2 * frame);
+        if (timestamp_pool_)
+        {
+            vkCmdResetQueryPool(command_buffer, timestamp_pool_, first_query,
+                                2);
+            vkCmdWriteTimestamp(command_buffer,
+                                VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                                timestamp_pool_, first_query);
+        }
+
+        record_light_clustering(command_buffer, frame);
+
+        // const vec4 lighter = srgb_to_linear(rgba_to_vec4(0xf4f4f8ff));
+        // const auto bg      = lighter;
+        const vec4 bg {0.537f, 0.671f, 0.847f, 1.0f};
+
+        // Colour, depth and, with multisampling, the resolved colour
+        std::array<VkClearValue, 3> clear_values;
+        clear_values[0].color.float32[0] = bg.r;
+        clear_values[0].color.float32[1] = bg.g;
+        clear_values[0].color.float32[2] = bg.b;
+        clear_values[0].color.float32[3] = bg.a;
+
+        clear_values[1].depthStencil.depth = 1.0f;
+
+        clear_values[2].color.float32[0] = bg.r;
+        clear_values[2].color.float32[1] = bg.g;
+        clear_values[2].color.float32[2] = bg.b;
+        clear_values[2].color.float32[3] = bg.a;
+
+        VkRenderPassBeginInfo render_pass_info = {
+            .sType           = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
+            .renderPass      = render_pass_,
+            .framebuffer     = scene_framebuffer_,
+            .renderArea      = {.offset = {0, 0}, .extent = render_extent_},
+            .clearValueCount = narrow_cast<uint32_t>(clear_values.size()),
+            .pClearValues    = clear_values.data(),
+        };
+
+        // With the pre-pass, every bucket's depth is drawn before any is
+        // shaded
+        const auto cached_buckets = std::span(bucket_cache_).subspan(
+            narrow_cast<std::size_t>(frame * std::ssize(bucket_meshes_)),
+            bucket_meshes_.size());
+        std::vector<VkCommandBuffer> secondary_buffers;
+        for (const CachedBucket &cached : cached_buckets)
+        {
+            if (depth_prepass_ready() && cached.draw_count > 0)
+            {
+                secondary_buffers.push_back(cached.depth_buffer);
+            }
+        }
+        for (const CachedBucket &cached : cached_buckets)
+        {
+            if (cached.draw_count > 0)
+            {
+                secondary_buffers.push_back(cached.buffer);
+            }
+        }
+
+        const auto draw_buckets = [&](VkRenderPass render_pass) {
+            render_pass_info.renderPass = render_pass;
+            vkCmdBeginRenderPass(command_buffer, &render_pass_info,
+                                 VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+            if (!secondary_buffers.empty())
+            {
+                vkCmdExecuteCommands(
+                    command_buffer,
+                    narrow_cast<uint32_t>(secondary_buffers.size()),
+                    secondary_buffers.data());
+            }
+            vkCmdEndRenderPass(command_buffer);
+        };
+
+        const CullingMode mode = culling_mode();
+        if (mode == CullingMode::Occlusion)
+        {
+            // The buckets draw whatever commands culling last wrote, so the
+            // same buffers serve both passes
+            record_culling(command_buffer, frame, CullingPhase::Early);
+            draw_buckets(early_render_pass_);
+            record_depth_pyramid(command_buffer, frame);
+            record_culling(command_buffer, frame, CullingPhase::Late);
+            draw_buckets(late_render_pass_);
+        }
+        else
+        {
+            if (mode == CullingMode::Frustum)
+            {
+                record_culling(command_buffer, frame, CullingPhase::All);
+            }
+            draw_buckets(render_pass_);
+        }
+
+        if (fxaa_ready())
+        {
+            record_fxaa(command_buffer, image_index);
+        }
+        else
+        {
+            record_upscale(command_buffer, image_index);
+        }
+
+        if (timestamp_pool_)
+        {
+            vkCmdWriteTimestamp(command_buffer,
+                                VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                                timestamp_pool_, first_query + 1);
+        }
+        frame_setups_[frame] = {
+            .culling             = mode,
+            .depth_prepass       = depth_prepass_ready(),
+            .lights              = light_count_index_,
+            .anti_aliasing_run   = next_benchmark_frame(),
+            .specialised_shaders = specialise_shaders_ && variants_ready_,
+        };
+        if (vkEndCommandBuffer(command_buffer) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to record command buffer!");
+        }
+    }
+
+    // Re-records the buckets whose draws or resources have changed since
+    // they were last recorded for this frame. The uniform offsets baked into
+    // them are stable, as update_uniforms pushes in the same order each
+    // frame.
+    void record_stale_buckets(index_t frame)
+    {
+        const index_t bucket_count = std::ssize(bucket_meshes_);
+        std::vector<index_t> stale_buckets;
+        index_t stale_draws = 0;
+        for (index_t bucket = 0; bucket < bucket_count; ++bucket)
+        {
+            const CachedBucket &cached =
+                bucket_cache_[frame * bucket_count + bucket];
+            if (cached.version == bucket_versions_[bucket])
+            {
+                ++bucket_cache_hits_;
+                cached_draws_reused_ += cached.draw_count;
+                continue;
+            }
+            ++bucket_cache_misses_;
+            stale_buckets.push_back(bucket);
+            stale_draws += std::ssize(bucket_meshes_[bucket]);
+        }
+        if (stale_buckets.empty())
+        {
+            return;
+        }
+
+        // A bucket is recorded by the recorder owning its pool, or by this
+        // thread when there are too few draws to be worth sharing out
+        const auto start = clock::now();
+        const index_t recorder_count =
+            stale_draws >= 2 * min_draws_per_recorder_
+                ? std::ssize(command_recorders_)
+                : 1;
+        run_on_recorders(recorder_count, [&](index_t recorder) {
+            for (const index_t bucket : stale_buckets)
+            {
+                if (bucket % recorder_count == recorder)
+                {
+                    record_bucket(frame, bucket);
+                }
+            }
+        });
+        bucket_recording_time_ += clock::now() - start;
+
+        for (const index_t bucket : stale_buckets)
+        {
+            cached_draws_recorded_ +=
+                bucket_cache_[frame * bucket_count + bucket].draw_count;
+        }
+    }
+
+    void record_bucket(index_t frame, index_t bucket)
+    {
+        CachedBucket &cached =
+            bucket_cache_[frame * std::ssize(bucket_meshes_) + bucket];
+
+        // Meshes still uploading are drawn once they have landed. On the
+        // CPU path, meshes the software occlusion buffer hides are left out.
+        std::vector<index_t> draws;
+        for (const index_t mesh_index : bucket_meshes_[bucket])
+        {
+            if (mesh_uploads_[mesh_index] <= completed_uploads_ &&
+                (gpu_culling_ || mesh_visibility_[mesh_index]))
+            {
+                draws.push_back(mesh_index);
+            }
+        }
+
+        // Nothing is drawn until the pipelines have compiled, and the
+        // bucket is recorded again once they have
+        if (!bucket_pipelines_[bucket].shaded)
+        {
+            draws.clear();
+        }
+
+        // With GPU culling the bucket is one indirect draw, and cull.comp
+        // leaves out the meshes that have not landed
+        cached.version    = bucket_versions_[bucket];
+        cached.draw_count = gpu_culling_
+                                ? std::min<index_t>(std::ssize(draws), 1)
+                                : std::ssize(draws);
+        if (draws.empty())
+        {
+            return;
+        }
+
+        // No framebuffer, so the buffers suit every swap chain image
+        const auto record = [&](VkCommandBuffer command_buffer,
+                                DrawPass pass) {
+            if (gpu_culling_)
+            {
+                record_indirect_command_buffer(command_buffer, frame, bucket,
+                                               pass);
+            }
+            else
+            {
+                record_secondary_command_buffer(
+                    command_buffer, frame, VK_NULL_HANDLE,
+                    bucket_pipelines_[bucket], draws, pass);
+            }
+        };
+        record(cached.buffer, DrawPass::Colour);
+        if (depth_prepass_ready())
+        {
+            record(cached.depth_buffer, DrawPass::Depth);
+        }
+    }
+
+    // Splits draws into contiguous slices, one per recorder, and records
+    // them in parallel into the recorders' buffers for this frame, without
+    // the cache
+    void record_draws(index_t frame, std::span<const index_t> draws,
+                      index_t recorder_count)
+    {
+        run_on_recorders(recorder_count, [&](index_t slice) {
+            const auto count = std::ssize(draws);
+            const auto first = count * slice / recorder_count;
+            const auto last  = count * (slice + 1) / recorder_count;
+
+            // Resetting the pool recycles the buffer's memory in one go
+            CommandRecorder &recorder = command_recorders_[slice];
+            vkResetCommandPool(device_, recorder.pools[frame], 0);
+            record_secondary_command_buffer(
+                recorder.buffers[frame], frame, scene_framebuffer_,
+                {graphics_pipeline_, equal_depth_pipeline_},
+                draws.subspan(narrow_cast<std::size_t>(first),
+                              narrow_cast<std::size_t>(last - first)),
+                DrawPass::Colour);
+        });
+    }
+
+    void begin_secondary_command_buffer(VkCommandBuffer command_buffer,
+                                        VkFramebuffer framebuffer,
+                                        const BucketPipelines &pipelines,
+                                        DrawPass pass) const
+    {
+        const VkCommandBufferInheritanceInfo inheritance_info = {
+            .sType       = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO,
+            .renderPass  = render_pass_,
+            .subpass     = 0,
+            .framebuffer = framebuffer,
+        };
+        // Cached buckets are submitted again in later frames, and with
+        // occlusion culling executed by both passes of a frame
+        VkCommandBufferUsageFlags flags =
+            VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+        if (occlusion_culling_supported_)
+        {
+            flags |= VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
+        }
+        const VkCommandBufferBeginInfo begin_info = {
+            .sType            = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+            .flags            = flags,
+            .pInheritanceInfo = &inheritance_info,
+        };
+
+        if (vkBeginCommandBuffer(command_buffer, &begin_info) != VK_SUCCESS)
+        {
+            throw std::runtime_error(
+                "Failed to begin recording command buffer!");
+        }
+
+        // The colour pass can only match the depth the pre-pass wrote
+        const VkPipeline pipeline =
+            pass == DrawPass::Depth ? depth_pipeline_
+            : depth_prepass_ready() ? pipelines.equal_depth
+                                    : pipelines.shaded;
+        vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                          pipeline);
+
+        const VkViewport viewport = {
+            .x        = 0.0f,
+            .y        = 0.0f,
+            .width    = static_cast<float>(render_extent_.width),
+            .height   = static_cast<float>(render_extent_.height),
+            .minDepth = 0.0f,
+            .maxDepth = 1.0f,
+        };
+        const VkRect2D scissor = {
+            .offset = {0, 0},
+            .extent = render_extent_,
+        };
+        vkCmdSetViewport(command_buffer, 0, 1, &viewport);
+        vkCmdSetScissor(command_buffer, 0, 1, &scissor);
+
+        const VkBuffer vertex_buffers[] = {pass == DrawPass::Depth
+                                               ? scene_position_buffer_
+                                               : scene_vertex_buffer_};
+        const VkDeviceSize offsets[]    = {0};
+        vkCmdBindVertexBuffers(command_buffer, 0, 1, &vertex_buffers[0],
+                               &offsets[0]);
+        vkCmdBindIndexBuffer(command_buffer, scene_index_buffer_, 0,
+                             VK_INDEX_TYPE_UINT16);
+    }
+
+    void bind_descriptor_set(VkCommandBuffer command_buffer, index_t frame,
+                             uint32_t texture_index) const
+    {
+        const std::array dynamic_offsets = {
+            frame_uniform_offset_,
+            object_uniform_offset_,
+            light_uniform_offset_,
+        };
+        vkCmdBindDescriptorSets(
+            command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout_,
+            0, 1, &descriptor_sets_[frame * textures_.size() + texture_index],
+            narrow_cast<uint32_t>(dynamic_offsets.size()),
+            dynamic_offsets.data());
+    }
+
+    void record_secondary_command_buffer(VkCommandBuffer command_buffer,
+                                         index_t frame,
+                                         VkFramebuffer framebuffer,
+                                         const BucketPipelines &pipelines,
+                                         std::span<const index_t> draws,
+                                         DrawPass pass)
+    {
+        begin_secondary_command_buffer(command_buffer, framebuffer, pipelines,
+                                       pass);
+
+        // The instance index picks the mesh's constants from the array
+        std::optional<uint32_t> bound_texture;
+        for (const index_t mesh_index : draws)
+        {
+            const auto texture_index = texture_indices_[mesh_index];
+            if (bound_texture != texture_index)
+            {
+                bind_descriptor_set(command_buffer, frame, texture_index);
+                bound_texture = texture_index;
+            }
+
+            const MeshRange &range = mesh_ranges_[mesh_index];
+            vkCmdDrawIndexed(command_buffer, range.index_count, 1,
+                             range.first_index, range.vertex_offset,
+                             narrow_cast<uint32_t>(mesh_index));
+        }
+
+        if (vkEndCommandBuffer(command_buffer) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to record command buffer!");
+        }
+    }
+
+    // Records a bucket as one indirect draw of the commands cull.comp
+    // writes for it this frame
+    void record_indirect_command_buffer(VkCommandBuffer command_buffer,
+                                        index_t frame, index_t bucket,
+                                        DrawPass pass)
+    {
+        begin_secondary_command_buffer(command_buffer, VK_NULL_HANDLE,
+                                       bucket_pipelines_[bucket], pass);
+        bind_descriptor_set(command_buffer, frame,
+                            narrow_cast<uint32_t>(bucket));
+
+        const CullingFrame &culling = culling_frames_[frame];
+        const auto draw_count =
+            narrow_cast<uint32_t>(bucket_meshes_[bucket].size());
+        constexpr uint32_t stride = sizeof(VkDrawIndexedIndirectCommand);
+        const VkDeviceSize offset =
+            stride * VkDeviceSize {bucket_first_commands_[bucket]};
+        if (cmd_draw_indirect_count_)
+        {
+            const VkDeviceSize count_offset =
+                sizeof(uint32_t) * narrow_cast<VkDeviceSize>(bucket);
+            cmd_draw_indirect_count_(command_buffer, culling.commands, offset,
+                                     culling.counts, count_offset, draw_count,
+                                     stride);
+        }
+        else
+        {
+            // Culled draws are left in place with no instances
+            vkCmdDrawIndexedIndirect(command_buffer, culling.commands, offset,
+                                     draw_count, stride);
+        }
+
+        if (vkEndCommandBuffer(command_buffer) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to record command buffer!");
+        }
+    }
+
+    // Times recording a large draw list, made by repeating the landed
+    // meshes, with each number of recording threads and without the cache.
+    // The frame's buffers are idle here.
+    void benchmark_command_recording(index_t frame)
+    {
+        using std::chrono::duration;
+
+        std::vector<index_t> landed;
+        for (index_t mesh_index = 0; mesh_index < std::ssize(mesh_ranges_);
+             ++mesh_index)
+        {
+            if (mesh_uploads_[mesh_index] <= completed_uploads_)
+            {
+                landed.push_back(mesh_index);
+            }
+        }
+
+        std::vector<index_t> draws;
+        draws.reserve(benchmark_draw_count_);
+        for (index_t i = 0; i < benchmark_draw_count_ && !landed.empty(); ++i)
+        {
+            draws.push_back(landed[i % std::ssize(landed)]);
+        }
+        if (draws.empty())
+        {
+            log_warn("Nothing to benchmark until a mesh has uploaded");
+            return;
+        }
+        if (!graphics_pipeline_)
+        {
+            log_warn("Nothing to benchmark until the pipelines have compiled");
+            return;
+        }
+
+        constexpr int repeats = 5;
+        for (index_t count = 1; count <= std::ssize(command_recorders_);
+             ++count)
+        {
+            const auto start = clock::now();
+            for (int i = 0; i < repeats; ++i)
+            {
+                record_draws(frame, draws, count);
+            }
+            const duration<double, std::milli> elapsed = clock::now() - start;
+            log_info("Recorded {} draws on {} thread(s) in {:.2f} ms",
+                     std::ssize(draws), count, elapsed.count() / repeats);
+        }
+        log_bucket_cache_statistics();
+    }
+
+    // Rasterises the occluders, split into bands of tile rows across count
+    // threads
+    void render_occluders(index_t count)
+    {
+        occluder_clip_.resize(occluder_triangles_.size());
+        std::ranges::transform(occluder_triangles_, occluder_clip_.begin(),
+                               [this](vec3 position) {
+                                   return model_view_proj_ *
+                                          vec4(position, 1.0f);
+                               });
+
+        occlusion_buffer_.clear();
+        const index_t rows = occlusion_buffer_.tile_rows();
+        count              = std::min(count, rows);
+        run_on_recorders(count, [&](index_t slice) {
+            occlusion_buffer_.render(
+                occluder_clip_, narrow_cast<int>(rows * slice / count),
+                narrow_cast<int>(rows * (slice + 1) / count));
+        });
+    }
+
+    // Tests every mesh's box against the software occlusion buffer, and
+    // marks the buckets whose visible meshes have changed as stale
+    void cull_on_cpu()
+    {
+        const auto start = clock::now();
+        render_occluders(std::ssize(command_recorders_));
+        const auto rendered = clock::now();
+
+        for (index_t mesh_index = 0; mesh_index < std::ssize(mesh_boxes_);
+             ++mesh_index)
+        {
+            const BoundingBox &box = mesh_boxes_[mesh_index];
+            const bool visible =
+                occlusion_buffer_.is_visible(model_view_proj_, box.lo, box.hi);
+            if (visible != mesh_visibility_[mesh_index])
+            {
+                mesh_visibility_[mesh_index] = visible;
+                ++bucket_versions_[texture_indices_[mesh_index]];
+            }
+            software_occlusion_culled_ += visible ? 0 : 1;
+        }
+
+        occluder_render_time_ += rendered - start;
+        occlusion_test_time_ += clock::now() - rendered;
+        software_occlusion_tested_ += mesh_boxes_.size();
+        ++software_occlusion_frames_;
+    }
+
+    // Shows every mesh again once software occlusion culling stops
+    void reset_mesh_visibility() noexcept
+    {
+        mesh_visibility_.assign(mesh_visibility_.size(), true);
+        invalidate_buckets();
+    }
+
+    // Times rasterising the occluders with each number of threads, and
+    // testing a large number of boxes made by repeating the meshes' boxes
+    void benchmark_software_occlusion()
+    {
+        using std::chrono::duration;
+
+        constexpr int repeats = 20;
+        for (index_t count = 1; count <= std::ssize(command_recorders_);
+             ++count)
+        {
+            const auto start = clock::now();
+            for (int i = 0; i < repeats; ++i)
+            {
+                render_occluders(count);
+            }
+            const duration<double, std::milli> elapsed = clock::now() - start;
+            log_info("Rasterised {} occluder triangles on {} thread(s) in "
+                     "{:.3f} ms ({})",
+                     occluder_triangles_.size() / 3, count,
+                     elapsed.count() / repeats,
+                     occlusion_buffer_.uses_avx2() ? "AVX2" : "scalar");
+        }
+
+        const auto start = clock::now();
+        index_t visible  = 0;
+        for (index_t i = 0; i < benchmark_box_count_; ++i)
+        {
+            const BoundingBox &box = mesh_boxes_[i % std::ssize(mesh_boxes_)];
+            visible += occlusion_buffer_.is_visible(model_view_proj_, box.lo,
+                                                    box.hi)
+                           ? 1
+                           : 0;
+        }
+        const duration<double, std::milli> elapsed = clock::now() - start;
+        log_info("Tested {} boxes in {:.2f} ms, {:.1f} million per second, "
+                 "{} visible",
+                 benchmark_box_count_, elapsed.count(),
+                 benchmark_box_count_ / elapsed.count() / 1000.0, visible);
+    }
+
+    void log_software_occlusion_statistics() const
+    {
+        if (software_occlusion_frames_ == 0)
+        {
+            return;
+        }
+
+        using milliseconds = std::chrono::duration<double, std::milli>;
+        const auto frames  = static_cast<double>(software_occlusion_frames_);
+        log_info("Software occlusion culling: {:.3f} ms rasterising and "
+                 "{:.3f} ms testing per frame, {:.1f}% of meshes culled",
+                 milliseconds(occluder_render_time_).count() / frames,
+                 milliseconds(occlusion_test_time_).count() / frames,
+                 100.0 * software_occlusion_culled_ /
+                     std::max<uint64_t>(software_occlusion_tested_, 1));
+    }
+
+    // Creates what cull.comp needs: each mesh's bounds, command slot and
+    // visibility, and per frame in flight, the commands it writes, bucket
+    // counts and statistics
+    void create_gpu_culling()
+    {
+        if (!gpu_culling_supported_)
+        {
+            return;
+        }
+
+        create_scene_draws();
+        culling_frames_.resize(max_frames_in_flight_);
+        for (auto &culling : culling_frames_)
+        {
+            std::tie(culling.commands, culling.commands_memory) =
+                create_culling_commands();
+            std::tie(culling.counts, culling.counts_memory) = create_buffer(
+                memory_allocator_, device_,
+                sizeof(uint32_t) * VkDeviceSize {bucket_meshes_.size()},
+                VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                    VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+                    VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+            std::tie(culling.statistics, culling.statistics_memory) =
+                create_buffer(memory_allocator_, device_,
+                              sizeof(CullingStatistics),
+                              VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                                  VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                              VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                  VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+        }
+
+        create_culling_descriptor_sets();
+        create_culling_pipeline();
+        if (occlusion_culling_supported_)
+        {
+            create_depth_pyramid_pipeline();
+        }
+    }
+
+    // Creates the bounds, command slot and visibility of each mesh in the
+    // current scene
+    void create_scene_draws()
+    {
+        Expects(!mesh_ranges_.empty());
+
+        // The draws only change with the scene, so they stay in host memory
+        std::vector<SceneDraw> draws(mesh_ranges_.size());
+        for (index_t bucket = 0; bucket < std::ssize(bucket_meshes_); ++bucket)
+        {
+            const auto &meshes = bucket_meshes_[bucket];
+            for (index_t slot = 0; slot < std::ssize(meshes); ++slot)
+            {
+                const index_t mesh_index = meshes[slot];
+                const MeshRange &range   = mesh_ranges_[mesh_index];
+                draws[mesh_index]        = {
+                    .sphere        = mesh_bounds_[mesh_index],
+                    .index_count   = range.index_count,
+                    .first_index   = range.first_index,
+                    .vertex_offset = range.vertex_offset,
+                    .bucket        = narrow_cast<uint32_t>(bucket),
+                    .first_command = bucket_first_commands_[bucket],
+                    .bucket_slot   = narrow_cast<uint32_t>(slot),
+                };
+            }
+        }
+
+        const VkDeviceSize draw_bytes = sizeof(SceneDraw) * draws.size();
+        std::tie(scene_draw_buffer_, scene_draw_memory_) =
+            create_buffer(memory_allocator_, device_, draw_bytes,
+                          VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                          VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                              VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+        std::memcpy(scene_draw_memory_.mapped, draws.data(), draw_bytes);
+
+        // Cleared before its first use by reset_visibility_
+        std::tie(visibility_buffer_, visibility_memory_) = create_buffer(
+            memory_allocator_, device_,
+            sizeof(uint32_t) * VkDeviceSize {draws.size()},
+            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    }
+
+    // Creates a frame's buffer of indirect draws, a slot for each mesh
+    std::pair<VkBuffer, MemoryAllocation> create_culling_commands()
+    {
+        return create_buffer(memory_allocator_, device_,
+                             sizeof(VkDrawIndexedIndirectCommand) *
+                                 VkDeviceSize {mesh_ranges_.size()},
+                             VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                                 VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+                             VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    }
+
+    void create_culling_descriptor_sets()
+    {
+        // As the bindings of cull.comp. The objects and frame uniforms are
+        // the frame's entries in the uniform arena.
+        constexpr std::array binding_types = {
+            VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, // Objects
+            VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,         // Draws
+            VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,         // Commands
+            VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,         // Counts
+            VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,         // Visibility
+            VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, // Depth pyramid
+            VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, // Frame uniforms
+            VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,         // Statistics
+        };
+        std::array<VkDescriptorSetLayoutBinding, binding_types.size()>
+            bindings = {};
+        for (uint32_t i = 0; i < bindings.size(); ++i)
+        {
+            bindings[i] = {
+                .binding         = i,
+                .descriptorType  = binding_types[i],
+                .descriptorCount = 1,
+                .stageFlags      = VK_SHADER_STAGE_COMPUTE_BIT,
+            };
+        }
+
+        const VkDescriptorSetLayoutCreateInfo layout_info = {
+            .sType        = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+            .bindingCount = narrow_cast<uint32_t>(bindings.size()),
+            .pBindings    = bindings.data(),
+        };
+        if (vkCreateDescriptorSetLayout(device_, &layout_info, gAllocator,
+                                        &culling_set_layout_) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create descriptor set layout!");
+        }
+
+        const uint32_t set_count = max_frames_in_flight_;
+        std::vector<VkDescriptorPoolSize> pool_sizes;
+        for (const auto type : binding_types)
+        {
+            const auto it = std::ranges::find(pool_sizes, type,
+                                              &VkDescriptorPoolSize::type);
+            if (it == pool_sizes.end())
+            {
+                pool_sizes.push_back({type, set_count});
+            }
+            else
+            {
+                it->descriptorCount += set_count;
+            }
+        }
+        const VkDescriptorPoolCreateInfo pool_info = {
+            .sType         = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+            .maxSets       = set_count,
+            .poolSizeCount = narrow_cast<uint32_t>(pool_sizes.size()),
+            .pPoolSizes    = pool_sizes.data(),
+        };
+        if (vkCreateDescriptorPool(device_, &pool_info, gAllocator,
+                                   &culling_descriptor_pool_) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create descriptor pool!");
+        }
+
+        for (auto &culling : culling_frames_)
+        {
+            const VkDescriptorSetAllocateInfo alloc_info = {
+                .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+                .descriptorPool     = culling_descriptor_pool_,
+                .descriptorSetCount = 1,
+                .pSetLayouts        = &culling_set_layout_,
+            };
+            if (vkAllocateDescriptorSets(device_, &alloc_info,
+                                         &culling.descriptor_set) !=
+                VK_SUCCESS)
+            {
+                throw std::runtime_error("Failed to allocate descriptor sets!");
+            }
+
+            // NB: The depth pyramid is written with the swap chain, and the
+            // scene's draws by write_culling_draws
+            const std::array<std::pair<uint32_t, VkDescriptorBufferInfo>, 3>
+                buffer_infos = {{
+                    {3, {culling.counts, 0, VK_WHOLE_SIZE}},
+                    {6, {uniform_arena_.buffer, 0, sizeof(FrameUniforms)}},
+                    {7, {culling.statistics, 0, VK_WHOLE_SIZE}},
+                }};
+            std::array<VkWriteDescriptorSet, buffer_infos.size()> writes = {};
+            for (index_t i = 0; i < std::ssize(writes); ++i)
+            {
+                const auto &[binding, buffer_info] = buffer_infos[i];
+                writes[i]                          = {
+                    .sType           = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                    .dstSet          = culling.descriptor_set,
+                    .dstBinding      = binding,
+                    .dstArrayElement = 0,
+                    .descriptorCount = 1,
+                    .descriptorType  = binding_types[binding],
+                    .pBufferInfo     = &buffer_info,
+                };
+            }
+            vkUpdateDescriptorSets(device_,
+                                   narrow_cast<uint32_t>(writes.size()),
+                                   writes.data(), 0, nullptr);
+            write_culling_draws(culling);
+        }
+    }
+
+    // Points a culling set at the current scene's draws and objects, and
+    // at its frame's commands
+    void write_culling_draws(CullingFrame &culling) noexcept
+    {
+        const std::array<std::pair<uint32_t, VkDescriptorBufferInfo>, 4>
+            buffer_infos = {{
+                {0, {uniform_arena_.buffer, 0, object_array_bytes()}},
+                {1, {scene_draw_buffer_, 0, VK_WHOLE_SIZE}},
+                {2, {culling.commands, 0, VK_WHOLE_SIZE}},
+                {4, {visibility_buffer_, 0, VK_WHOLE_SIZE}},
+            }};
+        std::array<VkWriteDescriptorSet, buffer_infos.size()> writes = {};
+        for (index_t i = 0; i < std::ssize(writes); ++i)
+        {
+            // The objects are the frame's entry in the uniform arena
+            const auto &[binding, buffer_info] = buffer_infos[i];
+            const VkDescriptorType type =
+                binding == 0 ? VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC
+                             : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            writes[i] = {
+                .sType           = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                .dstSet          = culling.descriptor_set,
+                .dstBinding      = binding,
+                .dstArrayElement = 0,
+                .descriptorCount = 1,
+                .descriptorType  = type,
+                .pBufferInfo     = &buffer_info,
+            };
+        }
+        vkUpdateDescriptorSets(device_, narrow_cast<uint32_t>(writes.size()),
+                               writes.data(), 0, nullptr);
+        culling.scene_generation = scene_generation_;
+    }
+
+    // Gives a frame in flight commands sized for the current scene and
+    // points its set at them, once the frame has finished with the scene it
+    // was made for
+    void update_culling_draws(index_t frame)
+    {
+        if (culling_frames_.empty() ||
+            culling_frames_[frame].scene_generation == scene_generation_)
+        {
+            return;
+        }
+        CullingFrame &culling = culling_frames_[frame];
+
+        RetiredResources &retired = retired_resources();
+        retired.buffers.push_back(culling.commands);
+        retired.memory.push_back(culling.commands_memory);
+        std::tie(culling.commands, culling.commands_memory) =
+            create_culling_commands();
+        write_culling_draws(culling);
+    }
+
+    void create_culling_pipeline()
+    {
+        const VkPushConstantRange push_constant_range = {
+            .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+            .offset     = 0,
+            .size       = sizeof(CullingConstants),
+        };
+        const VkPipelineLayoutCreateInfo pipeline_layout_info = {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+            .setLayoutCount         = 1,
+            .pSetLayouts            = &culling_set_layout_,
+            .pushConstantRangeCount = 1,
+            .pPushConstantRanges    = &push_constant_range,
+        };
+        if (vkCreatePipelineLayout(device_, &pipeline_layout_info, gAllocator,
+                                   &culling_pipeline_layout_) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create pipeline layout!");
+        }
+
+        const auto cull_shader_code = read_bytes("shaders\\cull.spv");
+        const VkShaderModule cull_shader_module =
+            create_shader_module(device_, cull_shader_code);
+
+        const VkComputePipelineCreateInfo pipeline_info = {
+            .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+            .stage =
+                {
+                    .sType =
+                        VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+                    .stage  = VK_SHADER_STAGE_COMPUTE_BIT,
+                    .module = cull_shader_module,
+                    .pName  = "main",
+                },
+            .layout = culling_pipeline_layout_,
+        };
+        const VkResult result =
+            create_compute_pipeline(pipeline_info, &culling_pipeline_);
+        vkDestroyShaderModule(device_, cull_shader_module, gAllocator);
+        if (result != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create compute pipeline!");
+        }
+    }
+
+    // Creates what depth_pyramid.comp needs apart from the pyramid itself,
+    // which is sized with the swap chain
+    void create_depth_pyramid_pipeline()
+    {
+        const VkSamplerCreateInfo sampler_info = {
+            .sType        = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+            .magFilter    = VK_FILTER_NEAREST,
+            .minFilter    = VK_FILTER_NEAREST,
+            .mipmapMode   = VK_SAMPLER_MIPMAP_MODE_NEAREST,
+            .addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+            .addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+            .addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+            .maxLod       = VK_LOD_CLAMP_NONE,
+        };
+        if (vkCreateSampler(device_, &sampler_info, gAllocator,
+                            &depth_sampler_) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create depth sampler!");
+        }
+
+        // Counts the finished workgroups so the last can build the top
+        std::tie(pyramid_progress_buffer_, pyramid_progress_memory_) =
+            create_buffer(memory_allocator_, device_, sizeof(uint32_t),
+                          VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                              VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                          VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+        const std::array<VkDescriptorSetLayoutBinding, 3> bindings = {{
+            {
+                .binding         = 0,
+                .descriptorType  = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                .descriptorCount = 1,
+                .stageFlags      = VK_SHADER_STAGE_COMPUTE_BIT,
+            },
+
+            {
+                .binding         = 1,
+                .descriptorType  = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+                .descriptorCount = max_depth_pyramid_levels_,
+                .stageFlags      = VK_SHADER_STAGE_COMPUTE_BIT,
+            },
+
+            {
+                .binding         = 2,
+                .descriptorType  = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                .descriptorCount = 1,
+                .stageFlags      = VK_SHADER_STAGE_COMPUTE_BIT,
+            },
+        }};
+        const VkDescriptorSetLayoutCreateInfo layout_info = {
+            .sType        = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+            .bindingCount = narrow_cast<uint32_t>(bindings.size()),
+            .pBindings    = bindings.data(),
+        };
+        if (vkCreateDescriptorSetLayout(device_, &layout_info, gAllocator,
+                                        &pyramid_set_layout_) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create descriptor set layout!");
+        }
+
+        // A set per frame in flight, so that a new pyramid can be bound
+        // while the frames using the old one finish
+        const auto set_count = narrow_cast<uint32_t>(culling_frames_.size());
+        std::array<VkDescriptorPoolSize, bindings.size()> pool_sizes = {};
+        for (index_t i = 0; i < std::ssize(bindings); ++i)
+        {
+            pool_sizes[i] = {
+                .type            = bindings[i].descriptorType,
+                .descriptorCount = bindings[i].descriptorCount * set_count,
+            };
+        }
+        const VkDescriptorPoolCreateInfo pool_info = {
+            .sType         = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+            .maxSets       = set_count,
+            .poolSizeCount = narrow_cast<uint32_t>(pool_sizes.size()),
+            .pPoolSizes    = pool_sizes.data(),
+        };
+        if (vkCreateDescriptorPool(device_, &pool_info, gAllocator,
+                                   &pyramid_descriptor_pool_) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create descriptor pool!");
+        }
+
+        const std::vector<VkDescriptorSetLayout> layouts(set_count,
+                                                         pyramid_set_layout_);
+        const VkDescriptorSetAllocateInfo alloc_info = {
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+            .descriptorPool     = pyramid_descriptor_pool_,
+            .descriptorSetCount = set_count,
+            .pSetLayouts        = layouts.data(),
+        };
+        std::vector<VkDescriptorSet> sets(set_count);
+        if (vkAllocateDescriptorSets(device_, &alloc_info, sets.data()) !=
+            VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to allocate descriptor sets!");
+        }
+
+        const VkDescriptorBufferInfo progress_info = {
+            .buffer = pyramid_progress_buffer_,
+            .offset = 0,
+            .range  = VK_WHOLE_SIZE,
+        };
+        for (index_t i = 0; i < std::ssize(culling_frames_); ++i)
+        {
+            culling_frames_[i].pyramid_set = sets[i];
+            const VkWriteDescriptorSet progress_write = {
+                .sType           = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                .dstSet          = sets[i],
+                .dstBinding      = 2,
+                .dstArrayElement = 0,
+                .descriptorCount = 1,
+                .descriptorType  = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                .pBufferInfo     = &progress_info,
+            };
+            vkUpdateDescriptorSets(device_, 1, &progress_write, 0, nullptr);
+        }
+
+        const VkPushConstantRange push_constant_range = {
+            .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+            .offset     = 0,
+            .size       = sizeof(DepthPyramidConstants),
+        };
+        const VkPipelineLayoutCreateInfo pipeline_layout_info = {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+            .setLayoutCount         = 1,
+            .pSetLayouts            = &pyramid_set_layout_,
+            .pushConstantRangeCount = 1,
+            .pPushConstantRanges    = &push_constant_range,
+        };
+        if (vkCreatePipelineLayout(device_, &pipeline_layout_info, gAllocator,
+                                   &pyramid_pipeline_layout_) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create pipeline layout!");
+        }
+
+        const auto pyramid_shader_code =
+            read_bytes("shaders\\depth_pyramid.spv");
+        const VkShaderModule pyramid_shader_module =
+            create_shader_module(device_, pyramid_shader_code);
+
+        const VkComputePipelineCreateInfo pipeline_info = {
+            .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+            .stage =
+                {
+                    .sType =
+                        VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+                    .stage  = VK_SHADER_STAGE_COMPUTE_BIT,
+                    .module = pyramid_shader_module,
+                    .pName  = "main",
+                },
+            .layout = pyramid_pipeline_layout_,
+        };
+        const VkResult result =
+            create_compute_pipeline(pipeline_info, &pyramid_pipeline_);
+        vkDestroyShaderModule(device_, pyramid_shader_module, gAllocator);
+        if (result != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create compute pipeline!");
+        }
+    }
+
+    // Creates the depth pyramid for the swap chain's extent. Level 0 has a
+    // texel for each 2x2 pixels. cull.comp always binds the pyramid, so it
+    // exists whenever GPU culling does. The frames' descriptor sets are
+    // pointed at it as each frame comes round.
+    void create_depth_pyramid()
+    {
+        if (!gpu_culling_supported_)
+        {
+            return;
+        }
+
+        const uint32_t width  = (swap_chain_extent_.width + 1) / 2;
+        const uint32_t height = (swap_chain_extent_.height + 1) / 2;
+        const auto levels = std::min(std::bit_width(std::max(width, height)),
+                                     max_depth_pyramid_levels_);
+        std::tie(depth_pyramid_, depth_pyramid_memory_) = create_image(
+            memory_allocator_, device_, width, height, levels,
+            VK_SAMPLE_COUNT_1_BIT, VK_FORMAT_R32_SFLOAT,
+            VK_IMAGE_TILING_OPTIMAL,
+            VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        depth_pyramid_view_ =
+            create_image_view(device_, depth_pyramid_, VK_FORMAT_R32_SFLOAT,
+                              VK_IMAGE_ASPECT_COLOR_BIT, levels);
+        ++depth_pyramid_generation_;
+
+        if (!occlusion_culling_available())
+        {
+            return;
+        }
+
+        for (uint32_t level = 0; level < levels; ++level)
+        {
+            const VkImageViewCreateInfo view_info = {
+                .sType    = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+                .image    = depth_pyramid_,
+                .viewType = VK_IMAGE_VIEW_TYPE_2D,
+                .format   = VK_FORMAT_R32_SFLOAT,
+                .subresourceRange =
+                    {
+                        .aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
+                        .baseMipLevel   = level,
+                        .levelCount     = 1,
+                        .baseArrayLayer = 0,
+                        .layerCount     = 1,
+                    },
+            };
+            VkImageView view = {};
+            if (vkCreateImageView(device_, &view_info, gAllocator, &view) !=
+                VK_SUCCESS)
+            {
+                throw std::runtime_error(
+                    "Failed to create depth pyramid view!");
+            }
+            depth_pyramid_levels_.push_back(view);
+        }
+    }
+
+    // Points a frame's culling and pyramid descriptor sets at the current
+    // depth pyramid if it has been recreated since. The frame's command
+    // buffer must be idle.
+    void update_depth_pyramid_descriptors(index_t frame)
+    {
+        if (culling_frames_.empty() ||
+            culling_frames_[frame].pyramid_generation ==
+                depth_pyramid_generation_)
+        {
+            return;
+        }
+        CullingFrame &culling = culling_frames_[frame];
+
+        const VkDescriptorImageInfo pyramid_info = {
+            .sampler     = depth_sampler_,
+            .imageView   = depth_pyramid_view_,
+            .imageLayout = VK_IMAGE_LAYOUT_GENERAL,
+        };
+        const VkWriteDescriptorSet pyramid_write = {
+            .sType           = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .dstSet          = culling.descriptor_set,
+            .dstBinding      = 5,
+            .dstArrayElement = 0,
+            .descriptorCount = 1,
+            .descriptorType  = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            .pImageInfo      = &pyramid_info,
+        };
+        vkUpdateDescriptorSets(device_, 1, &pyramid_write, 0, nullptr);
+        culling.pyramid_generation = depth_pyramid_generation_;
+
+        if (!occlusion_culling_available() || depth_pyramid_levels_.empty())
+        {
+            return;
+        }
+
+        // Entries past the top level repeat it
+        std::array<VkDescriptorImageInfo, max_depth_pyramid_levels_>
+            level_infos = {};
+        for (uint32_t level = 0; level < max_depth_pyramid_levels_; ++level)
+        {
+            level_infos[level] = {
+                .sampler     = VK_NULL_HANDLE,
+                .imageView   = level < depth_pyramid_levels_.size()
+                                   ? depth_pyramid_levels_[level]
+                                   : depth_pyramid_levels_.back(),
+                .imageLayout = VK_IMAGE_LAYOUT_GENERAL,
+            };
+        }
+
+        const VkDescriptorImageInfo depth_info = {
+            .sampler     = depth_sampler_,
+            .imageView   = depth_image_view_,
+            .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+        };
+        const std::array<VkWriteDescriptorSet, 2> writes = {{
+            {
+                .sType           = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                .dstSet          = culling.pyramid_set,
+                .dstBinding      = 0,
+                .dstArrayElement = 0,
+                .descriptorCount = 1,
+                .descriptorType  = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                .pImageInfo      = &depth_info,
+            },
+
+            {
+                .sType           = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                .dstSet          = culling.pyramid_set,
+                .dstBinding      = 1,
+                .dstArrayElement = 0,
+                .descriptorCount = max_depth_pyramid_levels_,
+                .descriptorType  = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+                .pImageInfo      = level_infos.data(),
+            },
+        }};
+        vkUpdateDescriptorSets(device_, narrow_cast<uint32_t>(writes.size()),
+                               writes.data(), 0, nullptr);
+    }
+
+    void retire_depth_pyramid(RetiredResources &retired) noexcept
+    {
+        retired.image_views.insert(retired.image_views.end(),
+                                   depth_pyramid_levels_.begin(),
+                                   depth_pyramid_levels_.end());
+        depth_pyramid_levels_.clear();
+        retired.image_views.push_back(depth_pyramid_view_);
+        depth_pyramid_view_ = {};
+        retired.images.push_back(depth_pyramid_);
+        depth_pyramid_ = {};
+        retired.memory.push_back(depth_pyramid_memory_);
+        depth_pyramid_memory_ = {};
+    }
+
+    void destroy_gpu_culling() noexcept
+    {
+        vkDestroyPipeline(device_, pyramid_pipeline_, gAllocator);
+        pyramid_pipeline_ = {};
+        vkDestroyPipelineLayout(device_, pyramid_pipeline_layout_, gAllocator);
+        pyramid_pipeline_layout_ = {};
+        vkDestroyDescriptorPool(device_, pyramid_descriptor_pool_, gAllocator);
+        pyramid_descriptor_pool_ = {};
+        vkDestroyDescriptorSetLayout(device_, pyramid_set_layout_, gAllocator);
+        pyramid_set_layout_ = {};
+        vkDestroyBuffer(device_, pyramid_progress_buffer_, gAllocator);
+        memory_allocator_.free(pyramid_progress_memory_);
+        pyramid_progress_buffer_ = {};
+        vkDestroySampler(device_, depth_sampler_, gAllocator);
+        depth_sampler_ = {};
+
+        vkDestroyPipeline(device_, culling_pipeline_, gAllocator);
+        culling_pipeline_ = {};
+        vkDestroyPipelineLayout(device_, culling_pipeline_layout_, gAllocator);
+        culling_pipeline_layout_ = {};
+        vkDestroyDescriptorPool(device_, culling_descriptor_pool_, gAllocator);
+        culling_descriptor_pool_ = {};
+        vkDestroyDescriptorSetLayout(device_, culling_set_layout_, gAllocator);
+        culling_set_layout_ = {};
+        for (const auto &culling : culling_frames_)
+        {
+            vkDestroyBuffer(device_, culling.statistics, gAllocator);
+            memory_allocator_.free(culling.statistics_memory);
+            vkDestroyBuffer(device_, culling.counts, gAllocator);
+            memory_allocator_.free(culling.counts_memory);
+            vkDestroyBuffer(device_, culling.commands, gAllocator);
+            memory_allocator_.free(culling.commands_memory);
+        }
+        culling_frames_.clear();
+        vkDestroyBuffer(device_, visibility_buffer_, gAllocator);
+        memory_allocator_.free(visibility_memory_);
+        visibility_buffer_ = {};
+        vkDestroyBuffer(device_, scene_draw_buffer_, gAllocator);
+        memory_allocator_.free(scene_draw_memory_);
+        scene_draw_buffer_ = {};
+    }
+
+    // Creates a cluster buffer for each frame in flight, and the pipeline
+    // of cluster_lights.comp that fills it from the frame's lights
+    void create_light_clusters()
+    {
+        // As the bindings of cluster_lights.comp. The frame uniforms and
+        // lights are the frame's entries in the uniform arena.
+        constexpr std::array binding_types = {
+            VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, // Frame uniforms
+            VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, // Lights
+            VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,         // Clusters
+        };
+        const uint32_t set_count = max_frames_in_flight_;
+        std::array<VkDescriptorSetLayoutBinding, binding_types.size()>
+            bindings = {};
+        std::array<VkDescriptorPoolSize, binding_types.size()> pool_sizes =
+            {};
+        for (uint32_t i = 0; i < bindings.size(); ++i)
+        {
+            bindings[i] = {
+                .binding         = i,
+                .descriptorType  = binding_types[i],
+                .descriptorCount = 1,
+                .stageFlags      = VK_SHADER_STAGE_COMPUTE_BIT,
+            };
+            pool_sizes[i] = {
+                .type            = binding_types[i],
+                .descriptorCount = set_count,
+            };
+        }
+
+        const VkDescriptorSetLayoutCreateInfo layout_info = {
+            .sType        = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+            .bindingCount = narrow_cast<uint32_t>(bindings.size()),
+            .pBindings    = bindings.data(),
+        };
+        if (vkCreateDescriptorSetLayout(device_, &layout_info, gAllocator,
+                                        &cluster_set_layout_) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create descriptor set layout!");
+        }
+
+        const VkDescriptorPoolCreateInfo pool_info = {
+            .sType         = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+            .maxSets       = set_count,
+            .poolSizeCount = narrow_cast<uint32_t>(pool_sizes.size()),
+            .pPoolSizes    = pool_sizes.data(),
+        };
+        if (vkCreateDescriptorPool(device_, &pool_info, gAllocator,
+                                   &cluster_descriptor_pool_) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create descriptor pool!");
+        }
+
+        // Each cluster's light count, then its list of light indices
+        const VkDeviceSize cluster_bytes = sizeof(uint32_t) * cluster_count() *
+                                           (1 + max_cluster_lights_);
+        cluster_frames_.resize(max_frames_in_flight_);
+        for (auto &clusters : cluster_frames_)
+        {
+            std::tie(clusters.clusters, clusters.clusters_memory) =
+                create_buffer(memory_allocator_, device_, cluster_bytes,
+                              VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                              VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+            const VkDescriptorSetAllocateInfo alloc_info = {
+                .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+                .descriptorPool     = cluster_descriptor_pool_,
+                .descriptorSetCount = 1,
+                .pSetLayouts        = &cluster_set_layout_,
+            };
+            if (vkAllocateDescriptorSets(device_, &alloc_info,
+                                         &clusters.descriptor_set) !=
+                VK_SUCCESS)
+            {
+                throw std::runtime_error("Failed to allocate descriptor sets!");
+            }
+
+            const std::array<VkDescriptorBufferInfo, binding_types.size()>
+                buffer_infos = {{
+                    {uniform_arena_.buffer, 0, sizeof(FrameUniforms)},
+                    {uniform_arena_.buffer, 0, light_array_bytes()},
+                    {clusters.clusters, 0, VK_WHOLE_SIZE},
+                }};
+            std::array<VkWriteDescriptorSet, binding_types.size()> writes = {};
+            for (uint32_t i = 0; i < writes.size(); ++i)
+            {
+                writes[i] = {
+                    .sType           = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                    .dstSet          = clusters.descriptor_set,
+                    .dstBinding      = i,
+                    .dstArrayElement = 0,
+                    .descriptorCount = 1,
+                    .descriptorType  = binding_types[i],
+                    .pBufferInfo     = &buffer_infos[i],
+                };
+            }
+            vkUpdateDescriptorSets(device_,
+                                   narrow_cast<uint32_t>(writes.size()),
+                                   writes.data(), 0, nullptr);
+        }
+
+        const VkPipelineLayoutCreateInfo pipeline_layout_info = {
+            .sType          = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+            .setLayoutCount = 1,
+            .pSetLayouts    = &cluster_set_layout_,
+        };
+        if (vkCreatePipelineLayout(device_, &pipeline_layout_info, gAllocator,
+                                   &cluster_pipeline_layout_) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create pipeline layout!");
+        }
+
+        const auto cluster_shader_code =
+            read_bytes("shaders\\cluster_lights.spv");
+        const VkShaderModule cluster_shader_module =
+            create_shader_module(device_, cluster_shader_code);
+
+        const VkComputePipelineCreateInfo pipeline_info = {
+            .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+            .stage =
+                {
+                    .sType =
+                        VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+                    .stage  = VK_SHADER_STAGE_COMPUTE_BIT,
+                    .module = cluster_shader_module,
+                    .pName  = "main",
+                },
+            .layout = cluster_pipeline_layout_,
+        };
+        const VkResult result =
+            create_compute_pipeline(pipeline_info, &cluster_pipeline_);
+        vkDestroyShaderModule(device_, cluster_shader_module, gAllocator);
+        if (result != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create compute pipeline!");
+        }
+    }
+
+    void destroy_light_clusters() noexcept
+    {
+        vkDestroyPipeline(device_, cluster_pipeline_, gAllocator);
+        cluster_pipeline_ = {};
+        vkDestroyPipelineLayout(device_, cluster_pipeline_layout_, gAllocator);
+        cluster_pipeline_layout_ = {};
+        vkDestroyDescriptorPool(device_, cluster_descriptor_pool_, gAllocator);
+        cluster_descriptor_pool_ = {};
+        vkDestroyDescriptorSetLayout(device_, cluster_set_layout_, gAllocator);
+        cluster_set_layout_ = {};
+        for (const auto &clusters : cluster_frames_)
+        {
+            vkDestroyBuffer(device_, clusters.clusters, gAllocator);
+            memory_allocator_.free(clusters.clusters_memory);
+        }
+        cluster_frames_.clear();
+        lights_.clear();
+    }
+
+    static constexpr uint32_t cluster_count() noexcept
+    {
+        return cluster_tiles_x_ * cluster_tiles_y_ * cluster_slices_;
+    }
+
+    // Records cluster_lights.comp binning the frame's lights, ahead of the
+    // render passes that shade with them. The frame's last use of the
+    // slot has finished, so the last reads of its clusters are done.
+    void record_light_clustering(VkCommandBuffer command_buffer, index_t frame)
+    {
+        // Dynamic offsets in binding order, the frame then the lights
+        const std::array dynamic_offsets = {
+            frame_uniform_offset_,
+            light_uniform_offset_,
+        };
+        vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                          cluster_pipeline_);
+        vkCmdBindDescriptorSets(
+            command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+            cluster_pipeline_layout_, 0, 1,
+            &cluster_frames_[frame].descriptor_set,
+            narrow_cast<uint32_t>(dynamic_offsets.size()),
+            dynamic_offsets.data());
+        vkCmdDispatch(command_buffer,
+                      (cluster_count() + cluster_group_size_ - 1) /
+                          cluster_group_size_,
+                      1, 1);
+
+        const VkMemoryBarrier clusters_barrier = {
+            .sType         = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+            .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+            .dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
+        };
+        vkCmdPipelineBarrier(command_buffer,
+                             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                             VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 1,
+                             &clusters_barrier, 0, nullptr, 0, nullptr);
+    }
+
+    CullingMode culling_mode() const noexcept
+    {
+        if (!gpu_culling_)
+        {
+            return CullingMode::None;
+        }
+        return occlusion_culling_ && occlusion_culling_available()
+                   ? CullingMode::Occlusion
+                   : CullingMode::Frustum;
+    }
+
+    // depth_pyramid.comp reads a multisampled depth buffer, so occlusion
+    // culling is off while the anti-aliasing mode has a single sample
+    bool occlusion_culling_available() const noexcept
+    {
+        return occlusion_culling_supported_ &&
+               msaa_samples_ != VK_SAMPLE_COUNT_1_BIT &&
+               (sampled_depth_counts_ & msaa_samples_) != 0;
+    }
+
+    // Records cull.comp writing one phase's indirect draws, ahead of the
+    // render pass that draws them
+    void record_culling(VkCommandBuffer command_buffer, index_t frame,
+                        CullingPhase phase)
+    {
+        const CullingFrame &culling = culling_frames_[frame];
+
+        // Meshes upload in order, so the landed ones come first
+        const auto landed = std::ranges::find_if(mesh_uploads_, [&](auto t) {
+            return t > completed_uploads_;
+        });
+        const CullingConstants constants = {
+            .frustum_planes = frustum_planes_,
+            .landed_count =
+                narrow_cast<uint32_t>(landed - mesh_uploads_.begin()),
+            .draw_count = narrow_cast<uint32_t>(mesh_ranges_.size()),
+            .compact    = cmd_draw_indirect_count_ ? 1u : 0u,
+            .phase      = phase,
+            .viewport   = vec2(render_extent_.width, render_extent_.height),
+        };
+
+        // The late phase rewrites the commands the early pass drew, and
+        // reads the visibility the last frame's late phase wrote
+        const VkMemoryBarrier reuse_barrier = {
+            .sType         = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+            .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+            .dstAccessMask = VK_ACCESS_SHADER_READ_BIT |
+                             VK_ACCESS_SHADER_WRITE_BIT |
+                             VK_ACCESS_TRANSFER_WRITE_BIT,
+        };
+        vkCmdPipelineBarrier(command_buffer,
+                             VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT |
+                                 VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                             VK_PIPELINE_STAGE_TRANSFER_BIT |
+                                 VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                             0, 1, &reuse_barrier, 0, nullptr, 0, nullptr);
+
+        // The late phase adds to the early phase's statistics
+        vkCmdFillBuffer(command_buffer, culling.counts, 0, VK_WHOLE_SIZE, 0);
+        if (phase != CullingPhase::Late)
+        {
+            vkCmdFillBuffer(command_buffer, culling.statistics, 0,
+                            VK_WHOLE_SIZE, 0);
+        }
+        if (phase == CullingPhase::Early && reset_visibility_)
+        {
+            // Nothing is drawn early, so the late phase draws everything
+            vkCmdFillBuffer(command_buffer, visibility_buffer_, 0,
+                            VK_WHOLE_SIZE, 0);
+            reset_visibility_ = false;
+        }
+        const VkMemoryBarrier fill_barrier = {
+            .sType         = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+            .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+            .dstAccessMask =
+                VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+        };
+        vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1,
+                             &fill_barrier, 0, nullptr, 0, nullptr);
+
+        // Dynamic offsets in binding order, the objects then the frame
+        const std::array dynamic_offsets = {
+            object_uniform_offset_,
+            frame_uniform_offset_,
+        };
+        vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                          culling_pipeline_);
+        vkCmdBindDescriptorSets(
+            command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+            culling_pipeline_layout_, 0, 1, &culling.descriptor_set,
+            narrow_cast<uint32_t>(dynamic_offsets.size()),
+            dynamic_offsets.data());
+        vkCmdPushConstants(command_buffer, culling_pipeline_layout_,
+                           VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants),
+                           &constants);
+        vkCmdDispatch(command_buffer,
+                      (constants.draw_count + culling_group_size_ - 1) /
+                          culling_group_size_,
+                      1, 1);
+
+        // The statistics are read on the host once the frame has finished
+        const VkMemoryBarrier draws_barrier = {
+            .sType         = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+            .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+            .dstAccessMask =
+                VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_HOST_READ_BIT,
+        };
+        vkCmdPipelineBarrier(command_buffer,
+                             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                             VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT |
+                                 VK_PIPELINE_STAGE_HOST_BIT,
+                             0, 1, &draws_barrier, 0, nullptr, 0, nullptr);
+    }
+
+    // Records building the depth pyramid from what the early pass drew, and
+    // handing the attachments on to the late pass
+    void record_depth_pyramid(VkCommandBuffer command_buffer, index_t frame)
+    {
+        const VkFormat depth_format = find_depth_format(physical_device_);
+        const VkImageAspectFlags depth_aspect =
+            VK_IMAGE_ASPECT_DEPTH_BIT | (has_stencil_component(depth_format)
+                                             ? VK_IMAGE_ASPECT_STENCIL_BIT
+                                             : 0);
+
+        // The last frame's late phase may still read the progress count
+        vkCmdPipelineBarrier(command_buffer,
+                             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                             VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr,
+                             0, nullptr, 0, nullptr);
+        vkCmdFillBuffer(command_buffer, pyramid_progress_buffer_, 0,
+                        VK_WHOLE_SIZE, 0);
+
+        // The pyramid is rebuilt in full, so its old contents are dropped
+        const VkMemoryBarrier progress_barrier = {
+            .sType         = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+            .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+            .dstAccessMask =
+                VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+        };
+        const std::array<VkImageMemoryBarrier, 2> to_compute = {{
+            {
+                .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+                .srcAccessMask =
+                    VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+                .dstAccessMask       = VK_ACCESS_SHADER_READ_BIT,
+                .oldLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+                .newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                .image               = depth_image_,
+                .subresourceRange    = {depth_aspect, 0, 1, 0, 1},
+            },
+
+            {
+                .sType         = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+                .srcAccessMask = 0,
+                .dstAccessMask =
+                    VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+                .oldLayout           = VK_IMAGE_LAYOUT_UNDEFINED,
+                .newLayout           = VK_IMAGE_LAYOUT_GENERAL,
+                .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                .image               = depth_pyramid_,
+                .subresourceRange    = {VK_IMAGE_ASPECT_COLOR_BIT, 0,
+                                        VK_REMAINING_MIP_LEVELS, 0, 1},
+            },
+        }};
+        vkCmdPipelineBarrier(
+            command_buffer,
+            VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT |
+                VK_PIPELINE_STAGE_TRANSFER_BIT |
+                VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &progress_barrier, 0,
+            nullptr, narrow_cast<uint32_t>(to_compute.size()),
+            to_compute.data());
+
+        const DepthPyramidConstants constants = {
+            .extent      = glm::ivec2(render_extent_.width,
+                                      render_extent_.height),
+            .level_count = narrow_cast<int32_t>(depth_pyramid_levels_.size()),
+        };
+        vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                          pyramid_pipeline_);
+        vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                                pyramid_pipeline_layout_, 0, 1,
+                                &culling_frames_[frame].pyramid_set, 0,
+                                nullptr);
+        vkCmdPushConstants(command_buffer, pyramid_pipeline_layout_,
+                           VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants),
+                           &constants);
+        constexpr uint32_t tile = depth_pyramid_tile_size_;
+        vkCmdDispatch(command_buffer,
+                      (swap_chain_extent_.width + tile - 1) / tile,
+                      (swap_chain_extent_.height + tile - 1) / tile, 1);
+
+        // The late phase reads the pyramid, then the late pass continues
+        // the early pass's samples
+        const std::array<VkMemoryBarrier, 2> to_late = {{
+            {
+                .sType         = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+                .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+                .dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
+            },
+
+            {
+                .sType         = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+                .srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+                .dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT |
+                                 VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+            },
+        }};
+        const VkImageMemoryBarrier depth_barrier = {
+            .sType         = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+            .srcAccessMask = 0,
+            .dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
+                             VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+            .oldLayout           = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+            .newLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .image               = depth_image_,
+            .subresourceRange    = {depth_aspect, 0, 1, 0, 1},
+        };
+        vkCmdPipelineBarrier(
+            command_buffer,
+            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+                VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+                VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+                VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+            0, narrow_cast<uint32_t>(to_late.size()), to_late.data(), 0,
+            nullptr, 1, &depth_barrier);
+    }
+
+    void create_timestamp_queries()
+    {
+        frame_setups_.assign(max_frames_in_flight_, std::nullopt);
+
+        uint32_t family_count = 0;
+        vkGetPhysicalDeviceQueueFamilyProperties(physical_device_,
+                                                 &family_count, nullptr);
+        std::vector<VkQueueFamilyProperties> families(family_count);
+        vkGetPhysicalDeviceQueueFamilyProperties(
+            physical_device_, &family_count, families.data());
+        const uint32_t valid_bits =
+            families[graphics_queue_family_].timestampValidBits;
+        if (valid_bits == 0)
+        {
+            log_warn("GPU frame times are unavailable without timestamps");
+            return;
+        }
+
+        VkPhysicalDeviceProperties properties = {};
+        vkGetPhysicalDeviceProperties(physical_device_, &properties);
+        timestamp_period_ns_ = properties.limits.timestampPeriod;
+        timestamp_mask_ =
+            valid_bits >= 64 ? ~uint64_t {0} : (uint64_t {1} << valid_bits) - 1;
+
+        // The start and end of each frame in flight
+        const VkQueryPoolCreateInfo pool_info = {
+            .sType      = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+            .queryType  = VK_QUERY_TYPE_TIMESTAMP,
+            .queryCount = narrow_cast<uint32_t>(2 * max_frames_in_flight_),
+        };
+        if (vkCreateQueryPool(device_, &pool_info, gAllocator,
+                              &timestamp_pool_) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create query pool!");
+        }
+    }
+
+    // Adds up the GPU time and culling statistics of a frame that has
+    // finished, by how it was drawn
+    void collect_frame_statistics(index_t frame)
+    {
+        const auto setup = std::exchange(frame_setups_[frame], std::nullopt);
+        if (!setup)
+        {
+            return;
+        }
+
+        std::array<uint64_t, 2> ticks = {};
+        if (timestamp_pool_ &&
+            vkGetQueryPoolResults(
+                device_, timestamp_pool_, narrow_cast<uint32_t>(2 * frame),
+                narrow_cast<uint32_t>(ticks.size()), sizeof(ticks),
+                ticks.data(), sizeof(uint64_t),
+                VK_QUERY_RESULT_64_BIT) == VK_SUCCESS)
+        {
+            const uint64_t elapsed = (ticks[1] - ticks[0]) & timestamp_mask_;
+            const double elapsed_ms =
+                elapsed * timestamp_period_ns_ / 1'000'000.0;
+            FrameTimes &times =
+                gpu_frame_times_[setup->depth_prepass ? 1 : 0]
+                                [static_cast<size_t>(setup->culling)];
+            times.total_ms += elapsed_ms;
+            ++times.frames;
+
+            FrameTimes &light_times = light_frame_times_[setup->lights];
+            light_times.total_ms += elapsed_ms;
+            ++light_times.frames;
+
+            FrameTimes &shader_times =
+                shader_frame_times_[setup->specialised_shaders ? 1 : 0];
+            shader_times.total_ms += elapsed_ms;
+            ++shader_times.frames;
+
+            const auto bin = std::min<size_t>(
+                narrow_cast<size_t>(elapsed_ms),
+                gpu_frame_time_histogram_.size() - 1);
+            ++gpu_frame_time_histogram_[bin];
+            update_resolution_scale(elapsed_ms);
+
+            if (aa_benchmark_ && setup->anti_aliasing_run >= 0)
+            {
+                FrameTimes &run_times =
+                    aa_benchmark_->runs[setup->anti_aliasing_run].times;
+                run_times.total_ms += elapsed_ms;
+                ++run_times.frames;
+            }
+        }
+
+        if (setup->culling == CullingMode::Occlusion)
+        {
+            CullingStatistics statistics = {};
+            std::memcpy(&statistics,
+                        culling_frames_[frame].statistics_memory.mapped,
+                        sizeof(statistics));
+            occlusion_landed_ += statistics.landed;
+            occlusion_outside_frustum_ += statistics.outside_frustum;
+            occlusion_occluded_ += statistics.occluded;
+        }
+    }
+
+    void log_culling_statistics() const
+    {
+        constexpr std::array mode_names    = {"CPU", "frustum", "occlusion"};
+        constexpr std::array prepass_names = {"", " and a depth pre-pass"};
+        std::array<std::array<double, mode_names.size()>, 2> average_ms = {};
+        for (index_t prepass = 0; prepass < 2; ++prepass)
+        {
+            for (index_t i = 0; i < std::ssize(mode_names); ++i)
+            {
+                const FrameTimes &times = gpu_frame_times_[prepass][i];
+                if (times.frames > 0)
+                {
+                    average_ms[prepass][i] = times.total_ms / times.frames;
+                    log_info("GPU frame time with {} culling{}: {:.3f} ms "
+                             "over {} frames",
+                             mode_names[i], prepass_names[prepass],
+                             average_ms[prepass][i], times.frames);
+                }
+            }
+        }
+
+        for (index_t i = 0; i < std::ssize(mode_names); ++i)
+        {
+            if (gpu_frame_times_[0][i].frames > 0 &&
+                gpu_frame_times_[1][i].frames > 0)
+            {
+                log_info("The depth pre-pass saved {:.3f} ms of GPU time per "
+                         "frame with {} culling",
+                         average_ms[0][i] - average_ms[1][i], mode_names[i]);
+            }
+        }
+
+        if (occlusion_landed_ > 0)
+        {
+            const double percent = 100.0 / occlusion_landed_;
+            log_info("Occlusion culling skipped {:.1f}% of meshes, {:.1f}% "
+                     "outside the frustum and {:.1f}% occluded",
+                     percent *
+                         (occlusion_outside_frustum_ + occlusion_occluded_),
+                     percent * occlusion_outside_frustum_,
+                     percent * occlusion_occluded_);
+        }
+
+        // Compared without the pre-pass, which hides much of the saving
+        const auto frustum   = static_cast<size_t>(CullingMode::Frustum);
+        const auto occlusion = static_cast<size_t>(CullingMode::Occlusion);
+        if (gpu_frame_times_[0][frustum].frames > 0 &&
+            gpu_frame_times_[0][occlusion].frames > 0)
+        {
+            log_info("Occlusion culling saved {:.3f} ms of GPU time per "
+                     "frame over frustum culling alone",
+                     average_ms[0][frustum] - average_ms[0][occlusion]);
+        }
+    }
+
+    // Compares the GPU frame times at each light count, whatever the
+    // culling, to show how the clustered lighting scales
+    void log_lighting_statistics() const
+    {
+        for (index_t i = 0; i < std::ssize(light_counts_); ++i)
+        {
+            const FrameTimes &times = light_frame_times_[i];
+            if (times.frames > 0)
+            {
+                log_info("GPU frame time with {} point lights: {:.3f} ms over "
+                         "{} frames",
+                         light_counts_[i], times.total_ms / times.frames,
+                         times.frames);
+            }
+        }
+    }
+
+    // What the driver reports about each stage of a pipeline compiled to
+    // capture statistics, such as instruction and register counts, by stage
+    // then by name
+    using ExecutableStatistics =
+        std::map<std::string, std::map<std::string, double>>;
+
+    ExecutableStatistics executable_statistics(VkPipeline pipeline) const
+    {
+        ExecutableStatistics statistics;
+        if (!pipeline || !get_executable_statistics_)
+        {
+            return statistics;
+        }
+
+        const VkPipelineInfoKHR pipeline_info = {
+            .sType    = VK_STRUCTURE_TYPE_PIPELINE_INFO_KHR,
+            .pipeline = pipeline,
+        };
+        uint32_t executable_count = 0;
+        get_executable_properties_(device_, &pipeline_info, &executable_count,
+                                   nullptr);
+        std::vector<VkPipelineExecutablePropertiesKHR> executables(
+            executable_count,
+            {.sType = VK_STRUCTURE_TYPE_PIPELINE_EXECUTABLE_PROPERTIES_KHR});
+        get_executable_properties_(device_, &pipeline_info, &executable_count,
+                                   executables.data());
+
+        for (uint32_t i = 0; i < executable_count; ++i)
+        {
+            const VkPipelineExecutableInfoKHR executable_info = {
+                .sType = VK_STRUCTURE_TYPE_PIPELINE_EXECUTABLE_INFO_KHR,
+                .pipeline        = pipeline,
+                .executableIndex = i,
+            };
+            uint32_t count = 0;
+            get_executable_statistics_(device_, &executable_info, &count,
+                                       nullptr);
+            std::vector<VkPipelineExecutableStatisticKHR> values(
+                count,
+                {.sType = VK_STRUCTURE_TYPE_PIPELINE_EXECUTABLE_STATISTIC_KHR});
+            get_executable_statistics_(device_, &executable_info, &count,
+                                       values.data());
+
+            auto &stage = statistics[&executables[i].name[0]];
+            for (const VkPipelineExecutableStatisticKHR &value : values)
+            {
+                stage[&value.name[0]] = statistic_value(value);
+            }
+        }
+        return statistics;
+    }
+
+    static double
+    statistic_value(const VkPipelineExecutableStatisticKHR &statistic) noexcept
+    {
+        switch (statistic.format)
+        {
+        case VK_PIPELINE_EXECUTABLE_STATISTIC_FORMAT_BOOL32_KHR:
+            return statistic.value.b32 ? 1.0 : 0.0;
+        case VK_PIPELINE_EXECUTABLE_STATISTIC_FORMAT_INT64_KHR:
+            return static_cast<double>(statistic.value.i64);
+        case VK_PIPELINE_EXECUTABLE_STATISTIC_FORMAT_UINT64_KHR:
+            return static_cast<double>(statistic.value.u64);
+        default:
+            return statistic.value.f64;
+        }
+    }
+
+    // Reports what each bucket's specialised variant leaves out of the uber
+    // shader: the statistics the driver compiled each to, and the GPU frame
+    // times drawing with either
+    void log_shader_statistics() const
+    {
+        constexpr std::array names = {"uber", "specialised"};
+        for (index_t i = 0; i < std::ssize(shader_frame_times_); ++i)
+        {
+            const FrameTimes &times = shader_frame_times_[i];
+            if (times.frames > 0)
+            {
+                log_info("GPU frame time with {} shaders: {:.3f} ms over {} "
+                         "frames",
+                         names[i], times.total_ms / times.frames,
+                         times.frames);
+            }
+        }
+
+        const auto [uber, specialised] = shader_frame_times_;
+        if (uber.frames > 0 && specialised.frames > 0)
+        {
+            log_info("Specialised shaders saved {:.3f} ms of GPU time per "
+                     "frame",
+                     uber.total_ms / uber.frames -
+                         specialised.total_ms / specialised.frames);
+        }
+
+        // What each variant leaves out of the uber shader, and the
+        // difference that makes to each statistic
+        std::map<ShaderVariant, index_t> variants;
+        for (index_t bucket = 0; bucket < std::ssize(bucket_materials_);
+             ++bucket)
+        {
+            ++variants[shader_variant(bucket)];
+        }
+        if (!get_executable_statistics_)
+        {
+            log_info("Shader statistics per variant need "
+                     "VK_KHR_pipeline_executable_properties");
+        }
+        const ExecutableStatistics uber_statistics =
+            executable_statistics(ready_pipeline(PipelineKind::Shaded, {}));
+        for (const auto &[stage, values] : uber_statistics)
+        {
+            std::string line;
+            for (const auto &[name, value] : values)
+            {
+                line += fmt::format("{}{} {}", line.empty() ? "" : ", ", name,
+                                    value);
+            }
+            log_info("Uber shader {}: {}", stage, line);
+        }
+        for (const auto &[variant, buckets] : variants)
+        {
+            log_info("Shader variant for {} buckets: {} point lights per "
+                     "cluster, fog {}, vertex colour {}, {}",
+                     buckets, variant.max_point_lights,
+                     variant.fog ? "on" : "off",
+                     variant.vertex_colour ? "on" : "off",
+                     variant.textured
+                         ? "textured"
+                         : fmt::format("untextured {:#010x}",
+                                       variant.base_colour));
+
+            const ExecutableStatistics statistics = executable_statistics(
+                ready_pipeline(PipelineKind::Shaded, variant));
+            for (const auto &[stage, values] : statistics)
+            {
+                const auto uber = uber_statistics.find(stage);
+                std::string line;
+                for (const auto &[name, value] : values)
+                {
+                    line += fmt::format("{}{} {}", line.empty() ? "" : ", ",
+                                        name, value);
+                    if (uber != uber_statistics.end() &&
+                        uber->second.contains(name))
+                    {
+                        line += fmt::format(" ({:+})",
+                                            value - uber->second.at(name));
+                    }
+                }
+                log_info("  {}: {}", stage, line);
+            }
+        }
+    }
+
+    // Starts timing every anti-aliasing mode at each benchmark window size.
+    // Dynamic resolution would change the work being timed, so it is off
+    // until the benchmark ends.
+    void start_anti_aliasing_benchmark()
+    {
+        if (aa_benchmark_)
+        {
+            return;
+        }
+        if (!timestamp_pool_)
+        {
+            log_warn("Can't benchmark anti-aliasing without GPU timestamps");
+            return;
+        }
+
+        AntiAliasingBenchmark benchmark = {
+            .mode               = {msaa_samples_, fxaa_},
+            .dynamic_resolution = dynamic_resolution_,
+        };
+        glfwGetWindowSize(window_, &benchmark.window_width,
+                          &benchmark.window_height);
+        for (const VkExtent2D window : benchmark_window_sizes_)
+        {
+            for (const AntiAliasingMode mode : anti_aliasing_modes())
+            {
+                benchmark.runs.push_back({.window = window, .mode = mode});
+            }
+        }
+        log_info("Benchmarking anti-aliasing over {} runs",
+                 benchmark.runs.size());
+
+        aa_benchmark_       = std::move(benchmark);
+        dynamic_resolution_ = false;
+        start_anti_aliasing_run();
+    }
+
+    // Resizes the window and switches to the mode of the benchmark's
+    // current run. The swap chain is rebuilt before the next frame.
+    void start_anti_aliasing_run()
+    {
+        AntiAliasingBenchmark &benchmark = *aa_benchmark_;
+        const AntiAliasingRun &run       = benchmark.runs[benchmark.run];
+        benchmark.frames                 = 0;
+        glfwSetWindowSize(window_, narrow_cast<int>(run.window.width),
+                          narrow_cast<int>(run.window.height));
+        set_anti_aliasing_mode(run.mode);
+    }
+
+    // Moves on once the current run has timed enough frames, and puts
+    // everything back after the last
+    void advance_anti_aliasing_benchmark()
+    {
+        if (!aa_benchmark_)
+        {
+            return;
+        }
+        AntiAliasingBenchmark &benchmark = *aa_benchmark_;
+        if (benchmark.runs[benchmark.run].times.frames <
+            benchmark_timed_frames_)
+        {
+            return;
+        }
+        if (++benchmark.run < std::ssize(benchmark.runs))
+        {
+            start_anti_aliasing_run();
+            return;
+        }
+
+        log_anti_aliasing_benchmark();
+        glfwSetWindowSize(window_, benchmark.window_width,
+                          benchmark.window_height);
+        set_anti_aliasing_mode(benchmark.mode);
+        dynamic_resolution_    = benchmark.dynamic_resolution;
+        resolution_controller_ = {};
+        aa_benchmark_.reset();
+    }
+
+    // The benchmark run that the frame being recorded is timed for, once
+    // the run has settled, or -1
+    index_t next_benchmark_frame() noexcept
+    {
+        if (!aa_benchmark_ ||
+            aa_benchmark_->frames++ < benchmark_settle_frames_)
+        {
+            return -1;
+        }
+        AntiAliasingRun &run = aa_benchmark_->runs[aa_benchmark_->run];
+        run.extent           = render_extent_;
+        return aa_benchmark_->run;
+    }
+
+    // The window may not reach the size asked for, so each run reports the
+    // extent it drew at
+    void log_anti_aliasing_benchmark() const
+    {
+        for (const AntiAliasingRun &run : aa_benchmark_->runs)
+        {
+            log_info("GPU frame time with {} at {}x{}: {:.3f} ms over {} "
+                     "frames, with {:.1f} MiB of render targets",
+                     anti_aliasing_name(run.mode), run.extent.width,
+                     run.extent.height, run.times.total_ms / run.times.frames,
+                     run.times.frames,
+                     render_target_bytes(run.extent, run.mode) /
+                         (1024.0 * 1024.0));
+        }
+    }
+
+    // Resizes the window every frame, alternating between its size and
+    // three quarters of it, to time recreating the swap chain under frames
+    // in flight
+    void start_resize_storm()
+    {
+        if (resize_storm_ || aa_benchmark_)
+        {
+            return;
+        }
+        ResizeStorm storm = {.frames = resize_storm_frames_};
+        glfwGetWindowSize(window_, &storm.window_width, &storm.window_height);
+        log_info("Resizing the window over {} frames", storm.frames);
+        resize_storm_ = storm;
+    }
+
+    void advance_resize_storm()
+    {
+        if (!resize_storm_)
+        {
+            return;
+        }
+        ResizeStorm &storm = *resize_storm_;
+        const auto now     = clock::now();
+        if (storm.last_frame != clock::time_point {})
+        {
+            const double ms =
+                std::chrono::duration<double, std::milli>(now -
+                                                          storm.last_frame)
+                    .count();
+            storm.frame_times.total_ms += ms;
+            ++storm.frame_times.frames;
+            storm.worst_frame_ms = std::max(storm.worst_frame_ms, ms);
+        }
+        storm.last_frame = now;
+
+        if (storm.frames > 0)
+        {
+            const bool shrink = storm.frames-- % 2 == 0;
+            glfwSetWindowSize(
+                window_,
+                shrink ? storm.window_width * 3 / 4 : storm.window_width,
+                shrink ? storm.window_height * 3 / 4 : storm.window_height);
+            return;
+        }
+
+        const FrameTimes &recreation = storm.recreation_times;
+        log_info("Recreated the swap chain {} times in {:.3f} ms on average",
+                 recreation.frames,
+                 recreation.total_ms /
+                     std::max<uint64_t>(recreation.frames, 1));
+        log_info("Frame time while resizing: {:.3f} ms on average, {:.3f} ms "
+                 "at worst",
+                 storm.frame_times.total_ms /
+                     std::max<uint64_t>(storm.frame_times.frames, 1),
+                 storm.worst_frame_ms);
+        glfwSetWindowSize(window_, storm.window_width, storm.window_height);
+        resize_storm_.reset();
+    }
+
+    void create_sync_objects()
+    {
+        image_available_semaphores_.resize(max_frames_in_flight_);
+        render_finished_semaphores_.resize(max_frames_in_flight_);
+
+        if (wait_semaphores_)
+        {
+            const VkSemaphoreTypeCreateInfo timeline_type_info = {
+                .sType         = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+                .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+                .initialValue  = frame_number_,
+            };
+            const VkSemaphoreCreateInfo timeline_info = {
+                .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+                .pNext = &timeline_type_info,
+            };
+            if (vkCreateSemaphore(device_, &timeline_info, gAllocator,
+                                  &frame_timeline_) != VK_SUCCESS)
+            {
+                throw std::runtime_error("Failed to create semaphore!");
+            }
+        }
+        else
+        {
+            // Signalled, as if every slot last ran a frame before the first
+            const VkFenceCreateInfo fence_info = {
+                .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+                .flags = VK_FENCE_CREATE_SIGNALED_BIT,
+            };
+            frame_fences_.resize(max_frames_in_flight_);
+            fence_frames_.assign(max_frames_in_flight_, 0);
+            for (auto &fence : frame_fences_)
+            {
+                if (vkCreateFence(device_, &fence_info, gAllocator, &fence) !=
+                    VK_SUCCESS)
+                {
+                    throw std::runtime_error("Failed to create fence!");
+                }
+            }
+        }
+
+        // Presentation only takes binary semaphores
+        const VkSemaphoreCreateInfo semaphore_info = {
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+        };
+
+        for (index_t i = 0; i < max_frames_in_flight_; ++i)
+        {
+            if (vkCreateSemaphore(device_, &semaphore_info, gAllocator,
+                                  &image_available_semaphores_[i]) !=
+                VK_SUCCESS)
+            {
+                throw std::runtime_error("Failed to create semaphore!");
+            }
+
+            if (vkCreateSemaphore(device_, &semaphore_info, gAllocator,
+                                  &render_finished_semaphores_[i]) !=
+                VK_SUCCESS)
+            {
+                throw std::runtime_error("Failed to create semaphore!");
+            }
+        }
+    }
+
+    // Blocks until the given number of frames have finished on the GPU
+    void wait_for_frames(uint64_t frames) const noexcept
+    {
+        if (wait_semaphores_)
+        {
+            const VkSemaphoreWaitInfo wait_info = {
+                .sType          = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+                .semaphoreCount = 1,
+                .pSemaphores    = &frame_timeline_,
+                .pValues        = &frames,
+            };
+            wait_semaphores_(device_, &wait_info, UINT64_MAX);
+            return;
+        }
+
+        // Only the last frame to use each slot can still be running
+        std::array<VkFence, max_frames_in_flight_> fences = {};
+        uint32_t fence_count                             = 0;
+        for (index_t i = 0; i < std::ssize(frame_fences_); ++i)
+        {
+            if (fence_frames_[i] <= frames)
+            {
+                fences[fence_count++] = frame_fences_[i];
+            }
+        }
+        if (fence_count > 0)
+        {
+            vkWaitForFences(device_, fence_count, fences.data(), VK_TRUE,
+                            UINT64_MAX);
+        }
+    }
+
+    // How many frames have finished on the GPU, without waiting
+    uint64_t finished_frames() const noexcept
+    {
+        uint64_t finished = 0;
+        if (get_semaphore_counter_value_)
+        {
+            get_semaphore_counter_value_(device_, frame_timeline_, &finished);
+            return finished;
+        }
+
+        // Every frame before the oldest one still running has finished
+        finished = frame_number_;
+        for (index_t i = 0; i < std::ssize(frame_fences_); ++i)
+        {
+            if (vkGetFenceStatus(device_, frame_fences_[i]) != VK_SUCCESS)
+            {
+                finished = std::min(finished, fence_frames_[i] - 1);
+            }
+        }
+        return finished;
+    }
+
+    // Sets how many frames the CPU may submit before the GPU finishes the
+    // first of them. Fewer cut latency and more keep the GPU busy. Takes
+    // effect from the next frame without waiting.
+    void set_frames_in_flight(int frames) noexcept
+    {
+        frames_in_flight_ = std::clamp(frames, 1, max_frames_in_flight_);
+        log_info("Up to {} frames in flight", frames_in_flight_);
+    }
+
+    void log_frame_pacing_statistics() const
+    {
+        for (index_t i = 0; i < std::ssize(frame_pacing_); ++i)
+        {
+            const FramePacingTimes &times = frame_pacing_[i];
+            if (times.timeline.frames == 0)
+            {
+                continue;
+            }
+            log_info("{} frames in flight: CPU waited {:.3f} ms per frame for "
+                     "earlier frames and {:.3f} ms to acquire over {} frames",
+                     i + 1, times.timeline.total_ms / times.timeline.frames,
+                     times.acquire.total_ms /
+                         std::max<uint64_t>(times.acquire.frames, 1),
+                     times.timeline.frames);
+        }
+    }
+
+    void draw_frame()
+    {
+        // This frame may start once all but frames_in_flight_ - 1 of the
+        // frames before it have finished. That includes the last frame to
+        // use this one's slot, as the slots cycle through all of them.
+        using milliseconds = std::chrono::duration<double, std::milli>;
+        FramePacingTimes &pacing = frame_pacing_[frames_in_flight_ - 1];
+        const auto in_flight     = narrow_cast<uint64_t>(frames_in_flight_);
+        const auto wait_start    = clock::now();
+        wait_for_frames(frame_number_ + 1 > in_flight
+                            ? frame_number_ + 1 - in_flight
+                            : 0);
+        pacing.timeline.total_ms +=
+            milliseconds(clock::now() - wait_start).count();
+        ++pacing.timeline.frames;
+
+        destroy_retired_resources(finished_frames());
+
+        collect_frame_statistics(current_frame_);
+        poll_uploads();
+        if (texture_swap_requested_)
+        {
+            texture_swap_requested_ = false;
+            start_texture_swap();
+        }
+        poll_texture_swap();
+        if (mesh_add_requested_)
+        {
+            mesh_add_requested_ = false;
+            add_cube();
+        }
+        if (mesh_remove_requested_)
+        {
+            mesh_remove_requested_ = false;
+            remove_cube();
+        }
+        poll_scene_swap();
+        defragment_memory();
+        if (pipelines_outdated_)
+        {
+            pipelines_outdated_ = false;
+            request_pipelines();
+        }
+        if (benchmark_anti_aliasing_)
+        {
+            benchmark_anti_aliasing_ = false;
+            start_anti_aliasing_benchmark();
+        }
+        advance_anti_aliasing_benchmark();
+        if (benchmark_resizing_)
+        {
+            benchmark_resizing_ = false;
+            start_resize_storm();
+        }
+        advance_resize_storm();
+
+        uint32_t image_index     = 0;
+        const auto acquire_start = clock::now();
+        const auto acquire_result =
+            vkAcquireNextImageKHR(device_, swap_chain_, UINT64_MAX,
+                                  image_available_semaphores_[current_frame_],
+                                  VK_NULL_HANDLE, &image_index);
+        pacing.acquire.total_ms +=
+            milliseconds(clock::now() - acquire_start).count();
+        ++pacing.acquire.frames;
+
+        // A suboptimal image is still drawn, and the swap chain recreated
+        // after presenting it so the semaphore is not left signalled
+        if (acquire_result == VK_ERROR_OUT_OF_DATE_KHR)
+        {
+            recreate_swap_chain();
+            return;
+        }
+        else if (acquire_result != VK_SUCCESS &&
+                 acquire_result != VK_SUBOPTIMAL_KHR)
+        {
+            throw std::runtime_error("Failed to acquire swap chain image!");
+        }
+
+        // The frame's command buffers, descriptor sets and uniforms are idle
+        // now, so pick up newly uploaded meshes and moved resources
+        update_descriptor_sets(current_frame_);
+        update_depth_pyramid_descriptors(current_frame_);
+        update_culling_draws(current_frame_);
+        update_uniforms();
+        update_pipelines();
+        if (!gpu_culling_ && software_occlusion_)
+        {
+            cull_on_cpu();
+        }
+        if (benchmark_recording_)
+        {
+            benchmark_recording_ = false;
+            benchmark_command_recording(current_frame_);
+            benchmark_software_occlusion();
+        }
+        record_command_buffer(current_frame_, image_index);
+
+        const VkSemaphore wait_semaphores[] = {
+            image_available_semaphores_[current_frame_],
+        };
+        // Only the upscale or FXAA touches the swap chain image
+        const VkPipelineStageFlags wait_stages[] = {
+            fxaa_ready() ? VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT
+                         : VK_PIPELINE_STAGE_TRANSFER_BIT,
+        };
+        // Presenting waits on the first, the next frames on the second
+        const VkSemaphore signal_semaphores[] = {
+            render_finished_semaphores_[current_frame_],
+            frame_timeline_,
+        };
+        const uint64_t signal_values[] = {
+            0, // Binary
+            frame_number_ + 1,
+        };
+        const VkTimelineSemaphoreSubmitInfo timeline_info = {
+            .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+            .signalSemaphoreValueCount =
+                narrow_cast<uint32_t>(std::size(signal_values)),
+            .pSignalSemaphoreValues = &signal_values[0],
+        };
+
+        // Without a timeline, the next frames wait on the slot's fence
+        const bool timeline = frame_timeline_ != VK_NULL_HANDLE;
+        VkFence frame_fence = VK_NULL_HANDLE;
+        if (!timeline)
+        {
+            frame_fence = frame_fences_[current_frame_];
+            vkResetFences(device_, 1, &frame_fence);
+            fence_frames_[current_frame_] = frame_number_ + 1;
+        }
+
+        const VkSubmitInfo submit_info = {
+            .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+            .pNext = timeline ? &timeline_info : nullptr,
+            .waitSemaphoreCount =
+                narrow_cast<uint32_t>(std::size(wait_semaphores)),
+            .pWaitSemaphores    = &wait_semaphores[0],
+            .pWaitDstStageMask  = &wait_stages[0],
+            .commandBufferCount = 1,
+            .pCommandBuffers    = &command_buffers_[current_frame_],
+            .signalSemaphoreCount =
+                timeline ? narrow_cast<uint32_t>(std::size(signal_semaphores))
+                         : 1u,
+            .pSignalSemaphores = &signal_semaphores[0],
+        };
+
+        if (vkQueueSubmit(graphics_queue_, 1, &submit_info, frame_fence) !=
+            VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to submit draw command buffer!");
+        }
+
+        const VkSwapchainKHR swap_chains[] = {
+            swap_chain_,
+        };
+
+        const VkPresentInfoKHR present_info = {
+            .sType              = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
+            .waitSemaphoreCount = 1,
+            .pWaitSemaphores    = &signal_semaphores[0],
+            .swapchainCount  = narrow_cast<uint32_t>(std::size(swap_chains)),
+            .pSwapchains     = &swap_chains[0],
+            .pImageIndices   = &image_index,
+        };
+
+        const auto present_result =
+            vkQueuePresentKHR(present_queue_, &present_info);
+
+        current_frame_ = (current_frame_ + 1) % max_frames_in_flight_;
+        ++frame_number_;
+
+        if (present_result == VK_ERROR_OUT_OF_DATE_KHR ||
+            present_result == VK_SUBOPTIMAL_KHR ||
+            acquire_result == VK_SUBOPTIMAL_KHR || framebuffer_resized_)
+        {
+            framebuffer_resized_ = false;
+            recreate_swap_chain();
+        }
+        else if (present_result != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to present swap chain image!");
+        }
+    }
+
+    // Hands everything sized to the swap chain, but not the swap chain
+    // itself, to the retirement queue. Frames in flight may still use them.
+    void retire_swap_chain_resources() noexcept
+    {
+        RetiredResources &retired = retired_resources();
+        retired.image_views.push_back(colour_image_view_);
+        colour_image_view_ = {};
+        retired.images.push_back(colour_image_);
+        colour_image_ = {};
+
+        retired.image_views.push_back(depth_image_view_);
+        depth_image_view_ = {};
+        retired.images.push_back(depth_image_);
+        depth_image_ = {};
+        retire_depth_pyramid(retired);
+        retired.memory.insert(retired.memory.end(), attachment_memory_.begin(),
+                              attachment_memory_.end());
+        attachment_memory_.clear();
+
+        retire_post_pass(retired);
+        retired.framebuffers.push_back(scene_framebuffer_);
+        scene_framebuffer_ = {};
+        retired.image_views.push_back(scene_image_view_);
+        scene_image_view_ = {};
+        retired.images.push_back(scene_image_);
+        scene_image_ = {};
+        retired.memory.push_back(scene_image_memory_);
+        scene_image_memory_ = {};
+        retired.render_passes.insert(
+            retired.render_passes.end(),
+            {render_pass_, early_render_pass_, late_render_pass_});
+        render_pass_       = {};
+        early_render_pass_ = {};
+        late_render_pass_  = {};
+        retired.image_views.insert(retired.image_views.end(),
+                                   swap_chain_image_views_.begin(),
+                                   swap_chain_image_views_.end());
+        swap_chain_image_views_.clear();
+    }
+
+    void cleanup_swap_chain() noexcept
+    {
+        retire_swap_chain_resources();
+        retired_resources().swap_chains.push_back(swap_chain_);
+        swap_chain_ = {};
+        destroy_retired_resources(std::numeric_limits<uint64_t>::max());
+    }
+
+    // The resources retired while recording the current frame
+    RetiredResources &retired_resources()
+    {
+        if (retired_resources_.empty() ||
+            retired_resources_.back().frame != frame_number_)
+        {
+            retired_resources_.push_back({.frame = frame_number_});
+        }
+        return retired_resources_.back();
+    }
+
+    // Destroys the resources retired before the given number of frames
+    // had been submitted, all of which must have finished
+    void destroy_retired_resources(uint64_t finished_frames) noexcept
+    {
+        while (!retired_resources_.empty() &&
+               retired_resources_.front().frame <= finished_frames)
+        {
+            const RetiredResources &retired = retired_resources_.front();
+            for (auto framebuffer : retired.framebuffers)
+            {
+                vkDestroyFramebuffer(device_, framebuffer, gAllocator);
+            }
+            for (auto render_pass : retired.render_passes)
+            {
+                vkDestroyRenderPass(device_, render_pass, gAllocator);
+            }
+            for (auto pool : retired.descriptor_pools)
+            {
+                vkDestroyDescriptorPool(device_, pool, gAllocator);
+            }
+            for (auto sampler : retired.samplers)
+            {
+                vkDestroySampler(device_, sampler, gAllocator);
+            }
+            for (auto view : retired.image_views)
+            {
+                vkDestroyImageView(device_, view, gAllocator);
+            }
+            for (auto image : retired.images)
+            {
+                vkDestroyImage(device_, image, gAllocator);
+            }
+            for (auto buffer : retired.buffers)
+            {
+                vkDestroyBuffer(device_, buffer, gAllocator);
+            }
+            for (const auto &memory : retired.memory)
+            {
+                memory_allocator_.free(memory);
+            }
+            for (auto swap_chain : retired.swap_chains)
+            {
+                vkDestroySwapchainKHR(device_, swap_chain, gAllocator);
+            }
+            retired_resources_.pop_front();
+        }
+    }
+
+    void recreate_swap_chain()
+    {
+        // Wait until not-minimised
+        int width  = 0;
+        int height = 0;
+        glfwGetFramebufferSize(window_, &width, &height);
+        while (width == 0 || height == 0)
+        {
+            glfwGetFramebufferSize(window_, &width, &height);
+            glfwWaitEvents();
+        }
+
+        // Without waiting for the device. The old resources are retired
+        // until the frames in flight have finished with them, and the
+        // pipelines, descriptor sets and command buffers are kept.
+        const auto start         = clock::now();
+        const auto before_resize = gHostAllocator.statistics();
+
+        retire_swap_chain_resources();
+        // Cached draws refer to the old render pass
+        invalidate_buckets();
+
+        create_swap_chain();
+        create_image_views();
+        create_render_pass();
+        request_pipelines();
+        create_transient_attachments();
+        create_depth_pyramid();
+        create_scene_image();
+        create_framebuffers();
+        create_post_pass();
+
+        const auto elapsed = clock::now() - start;
+        if (resize_storm_)
+        {
+            FrameTimes &times = resize_storm_->recreation_times;
+            times.total_ms +=
+                std::chrono::duration<double, std::milli>(elapsed).count();
+            ++times.frames;
+        }
+        if (gBuildConfig.log_verbose)
+        {
+            gHostAllocator.log_statistics("swap chain recreation",
+                                          before_resize);
+        }
+    }
+
+    // Helpers
+
+    static bool is_device_suitable(VkPhysicalDevice device,
+                                   VkSurfaceKHR surface)
+    {
+        const bool extensions_supported =
+            check_device_extension_support(device);
+        const bool swap_chain_adequate = [surface, device,
+                                          extensions_supported]() {
+            if (!extensions_supported)
+            {
+                return false;
+            }
+            const auto swap_details = query_swap_chain_support(device, surface);
+            return !swap_details.formats.empty() &&
+                   !swap_details.present_modes.empty();
+        }();
+        const QueueFamilyIndices indices = find_queue_families(device, surface);
+
+        VkPhysicalDeviceFeatures supported_features = {};
+        vkGetPhysicalDeviceFeatures(device, &supported_features);
+
+        return indices.is_complete() && extensions_supported &&
+               swap_chain_adequate && supported_features.samplerAnisotropy;
+    }
+
+    static bool check_device_extension_support(VkPhysicalDevice device)
+    {
+        uint32_t extension_count = 0;
+        vkEnumerateDeviceExtensionProperties(device, nullptr, &extension_count,
+                                             nullptr);
+        std::vector<VkExtensionProperties> available_extensions(
+            extension_count);
+        vkEnumerateDeviceExtensionProperties(device, nullptr, &extension_count,
+                                             available_extensions.data());
+
+        std::set<std::string> required_extensions {device_extensions_.begin(),
+                                                   device_extensions_.end()};
+        for (const auto &ext : available_extensions)
+        {
+            required_extensions.erase(std::string(&ext.extensionName[0]));
+        }
+        return required_extensions.empty();
+    }
+
+    static bool has_device_extension(VkPhysicalDevice device,
+                                     std::string_view name)
+    {
+        uint32_t extension_count = 0;
+        vkEnumerateDeviceExtensionProperties(device, nullptr, &extension_count,
+                                             nullptr);
+        std::vector<VkExtensionProperties> available_extensions(
+            extension_count);
+        vkEnumerateDeviceExtensionProperties(device, nullptr, &extension_count,
+                                             available_extensions.data());
+
+        return std::ranges::any_of(available_extensions, [&](const auto &ext) {
+            return name == &ext.extensionName[0];
+        });
+    }
+
+    struct QueueFamilyIndices
+    {
+        std::optional<uint32_t> graphics_family;
+        std::optional<uint32_t> present_family;
+        std::optional<uint32_t> transfer_family; // Transfer-only, if any
+
+        bool is_complete() const noexcept
+        {
+            return graphics_family.has_value() && present_family.has_value();
+        }
+    };
+
+    static QueueFamilyIndices find_queue_families(VkPhysicalDevice device,
+                                                  VkSurfaceKHR surface)
+    {
+        QueueFamilyIndices indices = {};
+
+        uint32_t family_count = 0;
+        vkGetPhysicalDeviceQueueFamilyProperties(device, &family_count,
+                                                 nullptr);
+
+        std::vector<VkQueueFamilyProperties> families(family_count);
+        vkGetPhysicalDeviceQueueFamilyProperties(device, &family_count,
+                                                 families.data());
+
+        uint32_t i = 0;
+        for (const auto &family : families)
+        {
+            if (!indices.is_complete())
+            {
+                if (family.queueFlags & VK_QUEUE_GRAPHICS_BIT)
+                {
+                    indices.graphics_family = i;
+                }
+
+                VkBool32 present_support = false;
+                vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface,
+                                                     &present_support);
+                if (present_support)
+                {
+                    indices.present_family = i;
+                }
+            }
+
+            // A family without graphics or compute usually maps to the copy
+            // engines, which can stream data while the graphics queue renders
+            constexpr VkQueueFlags general_flags =
+                VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT;
+            if (!indices.transfer_family &&
+                (family.queueFlags & VK_QUEUE_TRANSFER_BIT) &&
+                !(family.queueFlags & general_flags))
+            {
+                indices.transfer_family = i;
+            }
+            i++;
+        }
+
+        return indices;
+    }
+
+    struct SwapChainSupportDetails
+    {
+        VkSurfaceCapabilitiesKHR capabilities       = {};
+        std::vector<VkSurfaceFormatKHR> formats     = {};
+        std::vector<VkPresentModeKHR> present_modes = {};
+    };
+
+    static SwapChainSupportDetails query_swap_chain_support(
+        VkPhysicalDevice device, VkSurfaceKHR surface)
+    {
+        SwapChainSupportDetails details = {};
+        vkGetPhysicalDeviceSurfaceCapabilitiesKHR(device, surface,
+                                                  &details.capabilities);
+        uint32_t format_count = 0;
+        vkGetPhysicalDeviceSurfaceFormatsKHR(device, surface, &format_count,
+                                             nullptr);
+        if (format_count != 0)
+        {
+            details.formats.resize(format_count);
+            vkGetPhysicalDeviceSurfaceFormatsKHR(device, surface, &format_count,
+                                                 details.formats.data());
+        }
+
+        uint32_t present_mode_count = 0;
+        vkGetPhysicalDeviceSurfacePresentModesKHR(device, surface,
+                                                  &present_mode_count, nullptr);
+        if (present_mode_count != 0)
+        {
+            details.present_modes.resize(present_mode_count);
+            vkGetPhysicalDeviceSurfacePresentModesKHR(
+                device, surface, &present_mode_count,
+                details.present_modes.data());
+        }
+        return details;
+    }
+
+    static VkSurfaceFormatKHR choose_swap_surface_format(
+        const std::vector<VkSurfaceFormatKHR> &available_formats) noexcept
+    {
+        Expects(!available_formats.empty());
+        for (const auto &format : available_formats)
+        {
+            if (format.format == VK_FORMAT_B8G8R8A8_SRGB &&
+                format.colorSpace == VK_COLOR_SPACE_SRGB_NONLINEAR_KHR)
+            {
+                return format;
+            }
+        }
+        return available_formats.front();
+    }
+
+    static VkPresentModeKHR choose_swap_present_mode(
+        const std::vector<VkPresentModeKHR> &available_present_modes)
+    {
+        Expects(!available_present_modes.empty());
+
+        if (std::find(
+                available_present_modes.begin(), available_present_modes.end(),
+                VK_PRESENT_MODE_MAILBOX_KHR) != available_present_modes.end())
+        {
+            return VK_PRESENT_MODE_MAILBOX_KHR;
+        }
+        else
+        {
+            return VK_PRESENT_MODE_FIFO_KHR;
+        }
+    }
+
+    static VkExtent2D choose_swap_extent(
+        const VkSurfaceCapabilitiesKHR &capabilities, uint32_t width,
+        uint32_t height) noexcept
+    {
+        if (capabilities.currentExtent.width != UINT32_MAX)
+        {
+            return capabilities.currentExtent;
+        }
+        else
+        {
+            const auto &minExtent = capabilities.minImageExtent;
+            const auto &maxExtent = capabilities.maxImageExtent;
+            return {std::clamp(width, minExtent.width, maxExtent.width),
+                    std::clamp(height, minExtent.height, maxExtent.height)};
+        }
+    }
+
+    [[gsl::suppress(26490)]] // Don't warn about the reinterpret_cast below
+    static VkShaderModule
+    create_shader_module(VkDevice device, const std::vector<char> &code)
+    {
+        VkShaderModuleCreateInfo create_info = {
+            .sType    = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+            .codeSize = narrow_cast<uint32_t>(code.size()),
+            .pCode    = reinterpret_cast<const uint32_t *>(code.data()),
+        };
+
+        VkShaderModule shader_module;
+        if (vkCreateShaderModule(device, &create_info, gAllocator,
+                                 &shader_module) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create shader module!");
+        }
+        return shader_module;
+    }
+
+    static std::vector<const char *> get_required_extensions()
+    {
+        uint32_t glfw_extension_count = 0;
+        const char *const *glfw_extensions =
+            glfwGetRequiredInstanceExtensions(&glfw_extension_count);
+        std::vector<const char *> extensions(
+            glfw_extensions, std::next(glfw_extensions, glfw_extension_count));
+        if (enable_validation_layers_)
+        {
+            extensions.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
+        }
+        return extensions;
+    }
+
+    static VKAPI_ATTR VkBool32 VKAPI_CALL debug_callback(
+        VkDebugUtilsMessageSeverityFlagBitsEXT message_severity,
+        [[maybe_unused]] VkDebugUtilsMessageTypeFlagsEXT message_type,
+        const VkDebugUtilsMessengerCallbackDataEXT *callback_data,
+        [[maybe_unused]] void *user_data)
+    {
+        Expects(callback_data != nullptr);
+
+        switch (message_severity)
+        {
+        case VK_DEBUG_UTILS_MESSAGE_SEVERITY_VERBOSE_BIT_EXT:
+        case VK_DEBUG_UTILS_MESSAGE_SEVERITY_INFO_BIT_EXT: {
+            if (gBuildConfig.log_verbose)
+            {
+                log_info("[Vulkan] {}", callback_data->pMessage);
+            }
+            break;
+        }
+        case VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT: {
+            log_warn("[Vulkan] {}", callback_data->pMessage);
+            break;
+        }
+        case VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT: {
+            log_error("[Vulkan] {}", callback_data->pMessage);
+            break;
+        }
+        }
+
+        return VK_FALSE;
+    }
+
+    static VkDebugUtilsMessengerCreateInfoEXT
+    get_debug_utils_messenger_info() noexcept
+    {
+        return {
+            .sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_MESSENGER_CREATE_INFO_EXT,
+            .messageSeverity = VK_DEBUG_UTILS_MESSAGE_SEVERITY_VERBOSE_BIT_EXT |
+                               VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT |
+                               VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT,
+            .messageType = VK_DEBUG_UTILS_MESSAGE_TYPE_GENERAL_BIT_EXT |
+                           VK_DEBUG_UTILS_MESSAGE_TYPE_VALIDATION_BIT_EXT |
+                           VK_DEBUG_UTILS_MESSAGE_TYPE_PERFORMANCE_BIT_EXT,
+            .pfnUserCallback = debug_callback,
+        };
+    }
+
+    static std::vector<char> read_bytes(const std::string &filename)
+    {
+        std::ifstream file {filename, std::ios::ate | std::ios::binary};
+        if (!file.is_open())
         {
-            throw std::runtime_error("Failed to allocate command buffers!");
+            throw std::runtime_error(
+                fmt::format("Failed to open {}! Reason: Read error.", filename)
+                    .c_str());
         }
+        const std::size_t size = static_cast<std::size_t>(file.tellg());
+        std::vector<char> buffer(size);
+        file.seekg(0);
+        file.read(buffer.data(), size);
+        file.close();
+        return buffer;
+    }
 
-        // Record
+    static VkBuffer create_unbound_buffer(VkDevice device, VkDeviceSize size,
+                                          VkBufferUsageFlags usage)
+    {
+        const VkBufferCreateInfo buffer_info = {
+            .sType       = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+            .size        = size,
+            .usage       = usage,
+            .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+        };
 
-        for (index_t i = 0; i < std::ssize(command_buffers_); ++i)
+        VkBuffer buffer;
+        if (vkCreateBuffer(device, &buffer_info, gAllocator, &buffer) !=
+            VK_SUCCESS)
         {
-            const VkCommandBufferBeginInfo begin_info = {
-                .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
-            };
-
-            if (vkBeginCommandBuffer(command_buffers_[i], &begin_info) !=
-                VK_SUCCESS)
-            {
-                throw std::runtime_error(
-                    "Failed to begin recording command buffer!");
-            }
-
-            // const vec4 lighter = srgb_to_linear(rgba_to_vec4(0xf4f4f8ff));
-            // const auto bg      = lighter;
-            const vec4 bg {0.537f, 0.671f, 0.847f, 1.0f};
-
-            std::array<VkClearValue, 3> clear_values;
-            clear_values[0].color.float32[0] = bg.r;
-            clear_values[0].color.float32[1] = bg.g;
-            clear_values[0].color.float32[2] = bg.b;
-            clear_values[0].color.float32[3] = bg.a;
-
-            clear_values[1].color.float32[0] = bg.r;
-            clear_values[1].color.float32[1] = bg.g;
-            clear_values[1].color.float32[2] = bg.b;
-            clear_values[1].color.float32[3] = bg.a;
-
-            clear_values[2].depthStencil.depth = 1.0f;
-
-            const VkRenderPassBeginInfo render_pass_info = {
-                .sType       = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
-                .renderPass  = render_pass_,
-                .framebuffer = swap_chain_framebuffers_[i],
-                .renderArea  = {.offset = {0, 0}, .extent = swap_chain_extent_},
-                .clearValueCount = narrow_cast<uint32_t>(clear_values.size()),
-                .pClearValues    = clear_values.data(),
-            };
-
-            vkCmdBeginRenderPass(command_buffers_[i], &render_pass_info,
-                                 VK_SUBPASS_CONTENTS_INLINE);
-            vkCmdBindPipeline(command_buffers_[i],
-                              VK_PIPELINE_BIND_POINT_GRAPHICS,
-                              graphics_pipeline_);
+            throw std::runtime_error("failed to create vertex buffer!");
+        }
+        return buffer;
+    }
 
-            // TODO: How do we bind the correct texture
-            // (use descriptor sets with correct texture?)
+    static std::pair<VkBuffer, MemoryAllocation> create_buffer(
+        DeviceMemoryAllocator &allocator, VkDevice device, VkDeviceSize size,
+        VkBufferUsageFlags usage, VkMemoryPropertyFlags properties)
+    {
+        const VkBuffer buffer = create_unbound_buffer(device, size, usage);
 
-            for (index_t mesh_index = 0;
-                 mesh_index < std::ssize(vertex_buffers_); ++mesh_index)
-            {
-                const auto texture_index = texture_indices_[mesh_index];
-                auto vertex_buffer       = vertex_buffers_[mesh_index];
-                auto index_buffer        = index_buffers_[mesh_index];
-                auto index_buffer_count  = index_buffer_counts_[mesh_index];
+        VkMemoryRequirements memory_requirements = {};
+        vkGetBufferMemoryRequirements(device, buffer, &memory_requirements);
 
-                const VkBuffer vertex_buffers[] = {vertex_buffer};
-                const VkDeviceSize offsets[]    = {0};
-                vkCmdBindVertexBuffers(command_buffers_[i], 0, 1,
-                                       &vertex_buffers[0], &offsets[0]);
-                vkCmdBindIndexBuffer(command_buffers_[i], index_buffer, 0,
-                                     VK_INDEX_TYPE_UINT16);
+        const MemoryAllocation buffer_memory =
+            allocator.allocate(memory_requirements, properties, true);
 
-                vkCmdBindDescriptorSets(
-                    command_buffers_[i], VK_PIPELINE_BIND_POINT_GRAPHICS,
-                    pipeline_layout_, 0, 1,
-                    &descriptor_sets_[i * textures_.size() + texture_index], 0,
-                    nullptr);
+        vkBindBufferMemory(device, buffer, buffer_memory.memory,
+                           buffer_memory.offset);
 
-                vkCmdDrawIndexed(command_buffers_[i], index_buffer_count, 1, 0,
-                                 0, 0);
-            }
-            vkCmdEndRenderPass(command_buffers_[i]);
-            if (vkEndCommandBuffer(command_buffers_[i]) != VK_SUCCESS)
-            {
-                throw std::runtime_error("Failed to record command buffer!");
-            }
-        }
+        return {buffer, buffer_memory};
     }
 
-    void create_sync_objects()
+    bool has_dedicated_transfer_queue() const noexcept
     {
-        image_available_semaphores_.resize(max_frames_in_flight_);
-        render_finished_semaphores_.resize(max_frames_in_flight_);
-        in_flight_fences_.resize(max_frames_in_flight_);
-        images_in_flight_.resize(swap_chain_images_.size(), VK_NULL_HANDLE);
+        return transfer_queue_family_ != graphics_queue_family_;
+    }
 
-        const VkSemaphoreCreateInfo semaphore_info = {
-            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
-        };
-        const VkFenceCreateInfo fence_info = {
-            .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
-            .flags = VK_FENCE_CREATE_SIGNALED_BIT,
+    UploadBatch begin_upload_batch()
+    {
+        UploadBatch batch = {
+            .ticket     = ++issued_uploads_,
+            .begin_time = clock::now(),
         };
 
-        for (index_t i = 0; i < max_frames_in_flight_; ++i)
+        const VkCommandBufferAllocateInfo transfer_alloc_info = {
+            .sType       = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+            .commandPool = transfer_command_pool_,
+            .level       = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+            .commandBufferCount = 1,
+        };
+        if (vkAllocateCommandBuffers(device_, &transfer_alloc_info,
+                                     &batch.transfer_commands) != VK_SUCCESS)
         {
-            if (vkCreateSemaphore(device_, &semaphore_info, nullptr,
-                                  &image_available_semaphores_[i]) !=
-                VK_SUCCESS)
-            {
-                throw std::runtime_error("Failed to create semaphore!");
-            }
+            throw std::runtime_error("Failed to allocate command buffers!");
+        }
 
-            if (vkCreateSemaphore(device_, &semaphore_info, nullptr,
-                                  &render_finished_semaphores_[i]) !=
+        batch.graphics_commands = batch.transfer_commands;
+        if (has_dedicated_transfer_queue())
+        {
+            const VkCommandBufferAllocateInfo graphics_alloc_info = {
+                .sType       = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+                .commandPool = command_pool_,
+                .level       = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+                .commandBufferCount = 1,
+            };
+            if (vkAllocateCommandBuffers(device_, &graphics_alloc_info,
+                                         &batch.graphics_commands) !=
                 VK_SUCCESS)
             {
-                throw std::runtime_error("Failed to create semaphore!");
-            }
-
-            if (vkCreateFence(device_, &fence_info, nullptr,
-                              &in_flight_fences_[i]) != VK_SUCCESS)
-            {
-                throw std::runtime_error("Failed to create fence!");
+                throw std::runtime_error("Failed to allocate command buffers!");
             }
         }
-    }
-
-    void draw_frame()
-    {
-        vkWaitForFences(device_, 1, &in_flight_fences_[current_frame_], VK_TRUE,
-                        UINT64_MAX);
-
-        uint32_t image_index = 0;
-        const auto acquire_result =
-            vkAcquireNextImageKHR(device_, swap_chain_, UINT64_MAX,
-                                  image_available_semaphores_[current_frame_],
-                                  VK_NULL_HANDLE, &image_index);
 
-        if (acquire_result == VK_ERROR_OUT_OF_DATE_KHR ||
-            acquire_result == VK_SUBOPTIMAL_KHR || framebuffer_resized_)
-        {
-            framebuffer_resized_ = false;
-            recreate_swap_chain();
-            return;
-        }
-        else if (acquire_result != VK_SUCCESS)
+        const VkCommandBufferBeginInfo begin_info = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+            .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+        };
+        vkBeginCommandBuffer(batch.transfer_commands, &begin_info);
+        if (has_dedicated_transfer_queue())
         {
-            throw std::runtime_error("Failed to acquire swap chain image!");
+            vkBeginCommandBuffer(batch.graphics_commands, &begin_info);
         }
 
-        if (images_in_flight_[image_index] != VK_NULL_HANDLE)
+        const VkFenceCreateInfo fence_info = {
+            .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+        };
+        if (vkCreateFence(device_, &fence_info, gAllocator, &batch.fence) !=
+            VK_SUCCESS)
         {
-            vkWaitForFences(device_, 1, &images_in_flight_[image_index],
-                            VK_TRUE, UINT64_MAX);
+            throw std::runtime_error("Failed to create fence!");
         }
-        images_in_flight_[image_index] = in_flight_fences_[current_frame_];
 
-        const VkSemaphore wait_semaphores[] = {
-            image_available_semaphores_[current_frame_],
-        };
-        const VkPipelineStageFlags wait_stages[] = {
-            VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
-        };
-        const VkSemaphore signal_semaphores[] = {
-            render_finished_semaphores_[current_frame_],
-        };
+        return batch;
+    }
 
-        update_uniform_buffer(image_index);
+    void create_staging_ring()
+    {
+        VkPhysicalDeviceProperties properties = {};
+        vkGetPhysicalDeviceProperties(physical_device_, &properties);
 
-        const VkSubmitInfo submit_info = {
-            .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-            .waitSemaphoreCount =
-                narrow_cast<uint32_t>(std::size(wait_semaphores)),
-            .pWaitSemaphores    = &wait_semaphores[0],
-            .pWaitDstStageMask  = &wait_stages[0],
-            .commandBufferCount = 1,
-            .pCommandBuffers    = &command_buffers_[image_index],
-            .signalSemaphoreCount =
-                narrow_cast<uint32_t>(std::size(signal_semaphores)),
-            .pSignalSemaphores = &signal_semaphores[0],
-        };
+        std::tie(staging_ring_.buffer, staging_ring_.memory) =
+            create_buffer(memory_allocator_, device_, staging_ring_size_,
+                          VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                          VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                              VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
 
-        vkResetFences(device_, 1, &in_flight_fences_[current_frame_]);
-        if (vkQueueSubmit(graphics_queue_, 1, &submit_info,
-                          in_flight_fences_[current_frame_]) != VK_SUCCESS)
-        {
-            throw std::runtime_error("Failed to submit draw command buffer!");
-        }
+        staging_ring_.mapped = staging_ring_.memory.mapped;
+        staging_ring_.size   = staging_ring_size_;
 
-        const VkSwapchainKHR swap_chains[] = {
-            swap_chain_,
-        };
+        // NB: Image copies need 4 byte aligned offsets
+        staging_ring_.alignment = std::max<VkDeviceSize>(
+            properties.limits.optimalBufferCopyOffsetAlignment, 16);
+    }
 
-        const VkPresentInfoKHR present_info = {
-            .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
-            .waitSemaphoreCount =
-                narrow_cast<uint32_t>(std::size(signal_semaphores)),
-            .pWaitSemaphores = &signal_semaphores[0],
-            .swapchainCount  = narrow_cast<uint32_t>(std::size(swap_chains)),
-            .pSwapchains     = &swap_chains[0],
-            .pImageIndices   = &image_index,
-        };
+    // Copies data into the staging ring and returns its offset. When the
+    // ring is full the batch is submitted and then older batches are waited
+    // on, so the batch may be a new one on return.
+    VkDeviceSize stage(UploadBatch &batch, const void *data, VkDeviceSize size)
+    {
+        Expects(size <= max_staging_chunk_bytes_);
 
-        vkQueuePresentKHR(present_queue_, &present_info);
+        std::optional<VkDeviceSize> offset = staging_ring_.allocate(size);
+        while (!offset)
+        {
+            if (batch.staging_bytes > 0)
+            {
+                // Nothing staged by this batch is released before it is
+                // submitted
+                submit_upload_batch(std::move(batch));
+                batch = begin_upload_batch();
+            }
+            else
+            {
+                wait_for_oldest_transfer();
+            }
+            offset = staging_ring_.allocate(size);
+        }
 
-        current_frame_ = (current_frame_ + 1) % max_frames_in_flight_;
+        std::memcpy(std::next(staging_ring_.mapped,
+                              narrow_cast<std::ptrdiff_t>(*offset)),
+                    data,
+                    narrow_cast<std::size_t>(size));
+        batch.staging_bytes += size;
+        return *offset;
     }
 
-    void cleanup_swap_chain() noexcept
+    // Creates a device local buffer for upload_buffer to copy into
+    std::pair<VkBuffer, MemoryAllocation>
+    create_upload_buffer(VkDeviceSize size, VkBufferUsageFlags usage)
     {
-        vkDestroyImageView(device_, colour_image_view_, nullptr);
-        colour_image_view_ = {};
-        vkDestroyImage(device_, colour_image_, nullptr);
-        colour_image_ = {};
-        vkFreeMemory(device_, colour_image_memory_, nullptr);
-        colour_image_memory_ = {};
+        // NB: Also a transfer source so that the defragmenter can move it
+        return create_buffer(memory_allocator_, device_, size,
+                             VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+                                 VK_BUFFER_USAGE_TRANSFER_DST_BIT | usage,
+                             VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    }
 
-        vkDestroyImageView(device_, depth_image_view_, nullptr);
-        depth_image_view_ = {};
-        vkDestroyImage(device_, depth_image_, nullptr);
-        depth_image_ = {};
-        vkFreeMemory(device_, depth_image_memory_, nullptr);
-        depth_image_memory_ = {};
+    // Records copying data into part of a buffer made by
+    // create_upload_buffer. That part is ready for dst_access once the
+    // batch has completed, and the rest of the buffer is left alone.
+    void upload_buffer(UploadBatch &batch, VkBuffer buffer,
+                       VkDeviceSize buffer_offset, const void *data,
+                       VkDeviceSize size, VkAccessFlags dst_access)
+    {
+        Expects(size > 0);
 
-        for (auto framebuffer : swap_chain_framebuffers_)
-        {
-            vkDestroyFramebuffer(device_, framebuffer, nullptr);
-        }
-        swap_chain_framebuffers_.clear();
-        for (auto buffer : uniform_buffers_)
+        const auto *bytes = static_cast<const uint8_t *>(data);
+        for (VkDeviceSize offset = 0; offset < size;
+             offset += max_staging_chunk_bytes_)
         {
-            vkDestroyBuffer(device_, buffer, nullptr);
+            const VkDeviceSize chunk_size =
+                std::min(size - offset, max_staging_chunk_bytes_);
+            const VkBufferCopy copy_region = {
+                .srcOffset = stage(batch, std::next(bytes, offset), chunk_size),
+                .dstOffset = buffer_offset + offset,
+                .size      = chunk_size,
+            };
+            vkCmdCopyBuffer(batch.transfer_commands, staging_ring_.buffer,
+                            buffer, 1, &copy_region);
         }
-        uniform_buffers_.clear();
-        for (auto buffer : uniform_buffers_memory_)
+
+        VkBufferMemoryBarrier barrier = {
+            .sType               = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+            .srcAccessMask       = VK_ACCESS_TRANSFER_WRITE_BIT,
+            .dstAccessMask       = dst_access,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .buffer              = buffer,
+            .offset              = buffer_offset,
+            .size                = size,
+        };
+
+        if (has_dedicated_transfer_queue())
         {
-            vkFreeMemory(device_, buffer, nullptr);
+            // Release on the transfer queue and acquire on the graphics queue
+            barrier.srcQueueFamilyIndex = transfer_queue_family_;
+            barrier.dstQueueFamilyIndex = graphics_queue_family_;
+            vkCmdPipelineBarrier(batch.transfer_commands,
+                                 VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                 VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0,
+                                 nullptr, 1, &barrier, 0, nullptr);
+            vkCmdPipelineBarrier(batch.graphics_commands,
+                                 VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                                 VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 0, 0,
+                                 nullptr, 1, &barrier, 0, nullptr);
         }
-        uniform_buffers_memory_.clear();
-        vkDestroyDescriptorPool(device_, descriptor_pool_, nullptr);
-        descriptor_pool_ = {};
-        vkFreeCommandBuffers(device_, command_pool_,
-                             narrow_cast<uint32_t>(command_buffers_.size()),
-                             command_buffers_.data());
-        vkDestroyPipeline(device_, graphics_pipeline_, nullptr);
-        vkDestroyPipelineLayout(device_, pipeline_layout_, nullptr);
-        vkDestroyRenderPass(device_, render_pass_, nullptr);
-        pipeline_layout_ = {};
-        for (auto view : swap_chain_image_views_)
+        else
         {
-            vkDestroyImageView(device_, view, nullptr);
+            vkCmdPipelineBarrier(batch.graphics_commands,
+                                 VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                 VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 0, 0,
+                                 nullptr, 1, &barrier, 0, nullptr);
         }
-        swap_chain_image_views_.clear();
-        vkDestroySwapchainKHR(device_, swap_chain_, nullptr);
-        swap_chain_ = {};
     }
 
-    void recreate_swap_chain()
+    // Records copying the base level of the texture on the transfer queue,
+    // then generating the remaining levels on the graphics queue
+    void upload_texture(UploadBatch &batch, const Texture &texture,
+                        const TextureData &data)
     {
-        // Wait until not-minimised
-        int width  = 0;
-        int height = 0;
-        glfwGetFramebufferSize(window_, &width, &height);
-        while (width == 0 || height == 0)
+        const VkImageSubresourceRange all_levels = {
+            .aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
+            .baseMipLevel   = 0,
+            .levelCount     = texture.mip_levels_,
+            .baseArrayLayer = 0,
+            .layerCount     = 1,
+        };
+
+        const VkImageMemoryBarrier transfer_dst_barrier = {
+            .sType               = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+            .srcAccessMask       = 0,
+            .dstAccessMask       = VK_ACCESS_TRANSFER_WRITE_BIT,
+            .oldLayout           = VK_IMAGE_LAYOUT_UNDEFINED,
+            .newLayout           = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .image               = texture.image_,
+            .subresourceRange    = all_levels,
+        };
+        vkCmdPipelineBarrier(batch.transfer_commands,
+                             VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                             VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0,
+                             nullptr, 1, &transfer_dst_barrier);
+
+        // Copy whole rows at a time
+        const uint32_t row_size =
+            narrow_cast<uint32_t>(data.pixels.size() / data.height);
+        const uint32_t chunk_rows = std::max(
+            narrow_cast<uint32_t>(max_staging_chunk_bytes_ / row_size), 1u);
+        for (uint32_t row = 0; row < data.height; row += chunk_rows)
         {
-            glfwGetFramebufferSize(window_, &width, &height);
-            glfwWaitEvents();
+            const uint32_t rows = std::min(data.height - row, chunk_rows);
+            const VkDeviceSize offset =
+                stage(batch, std::next(data.pixels.data(), row * row_size),
+                      VkDeviceSize {rows} * row_size);
+            copy_buffer_to_image(batch.transfer_commands, staging_ring_.buffer,
+                                 offset, texture.image_,
+                                 {0, narrow_cast<int32_t>(row)},
+                                 {data.width, rows});
         }
 
-        vkDeviceWaitIdle(device_);
-
-        // NB: Could use vkWaitSemaphore instead of recreating the semaphore
-        for (auto &semaphore : image_available_semaphores_)
+        if (has_dedicated_transfer_queue())
         {
-            vkDestroySemaphore(device_, semaphore, nullptr);
-            const VkSemaphoreCreateInfo semaphore_info = {
-                .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+            // Release on the transfer queue and acquire on the graphics queue,
+            // keeping the layout for the mipmap blits
+            const VkImageMemoryBarrier ownership_barrier = {
+                .sType               = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+                .srcAccessMask       = VK_ACCESS_TRANSFER_WRITE_BIT,
+                .dstAccessMask       = VK_ACCESS_TRANSFER_READ_BIT |
+                                       VK_ACCESS_TRANSFER_WRITE_BIT,
+                .oldLayout           = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                .newLayout           = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                .srcQueueFamilyIndex = transfer_queue_family_,
+                .dstQueueFamilyIndex = graphics_queue_family_,
+                .image               = texture.image_,
+                .subresourceRange    = all_levels,
             };
-            if (vkCreateSemaphore(device_, &semaphore_info, nullptr,
-                                  &semaphore) != VK_SUCCESS)
-            {
-                throw std::runtime_error("Failed to create semaphore!");
-            }
+            vkCmdPipelineBarrier(batch.transfer_commands,
+                                 VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                 VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0,
+                                 nullptr, 0, nullptr, 1, &ownership_barrier);
+            vkCmdPipelineBarrier(batch.graphics_commands,
+                                 VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                                 VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr,
+                                 0, nullptr, 1, &ownership_barrier);
         }
 
-        cleanup_swap_chain();
-
-        create_swap_chain();
-        create_image_views();
-        create_render_pass();
-        create_graphics_pipeline();
-        create_colour_resources();
-        create_depth_resources();
-        create_framebuffers();
-        create_uniform_buffers();
-        create_descriptor_pool();
-        create_descriptor_sets();
-        create_command_buffers();
+        generate_mipmaps(batch.graphics_commands, texture.image_,
+                         narrow_cast<int32_t>(data.width),
+                         narrow_cast<int32_t>(data.height),
+                         texture.mip_levels_);
     }
 
-    // Helpers
-
-    static bool is_device_suitable(VkPhysicalDevice device,
-                                   VkSurfaceKHR surface)
+    void submit_upload_batch(UploadBatch &&batch)
     {
-        const bool extensions_supported =
-            check_device_extension_support(device);
-        const bool swap_chain_adequate = [surface, device,
-                                          extensions_supported]() {
-            if (!extensions_supported)
-            {
-                return false;
-            }
-            const auto swap_details = query_swap_chain_support(device, surface);
-            return !swap_details.formats.empty() &&
-                   !swap_details.present_modes.empty();
-        }();
-        const QueueFamilyIndices indices = find_queue_families(device, surface);
-
-        VkPhysicalDeviceFeatures supported_features = {};
-        vkGetPhysicalDeviceFeatures(device, &supported_features);
-
-        return indices.is_complete() && extensions_supported &&
-               swap_chain_adequate && supported_features.samplerAnisotropy;
-    }
+        vkEndCommandBuffer(batch.transfer_commands);
+        if (has_dedicated_transfer_queue())
+        {
+            vkEndCommandBuffer(batch.graphics_commands);
+        }
 
-    static bool check_device_extension_support(VkPhysicalDevice device)
-    {
-        uint32_t extension_count = 0;
-        vkEnumerateDeviceExtensionProperties(device, nullptr, &extension_count,
-                                             nullptr);
-        std::vector<VkExtensionProperties> available_extensions(
-            extension_count);
-        vkEnumerateDeviceExtensionProperties(device, nullptr, &extension_count,
-                                             available_extensions.data());
+        const VkSubmitInfo submit_info = {
+            .sType              = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+            .commandBufferCount = 1,
+            .pCommandBuffers    = &batch.transfer_commands,
+        };
+        if (vkQueueSubmit(transfer_queue_, 1, &submit_info, batch.fence) !=
+            VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to submit upload command buffer!");
+        }
 
-        std::set<std::string> required_extensions {device_extensions_.begin(),
-                                                   device_extensions_.end()};
-        for (const auto &ext : available_extensions)
+        batch.staging_end = staging_ring_.head;
+        batch.submit_time = clock::now();
+        if (transfer_idle_since_)
         {
-            required_extensions.erase(std::string(&ext.extensionName[0]));
+            transfer_idle_time_ += batch.submit_time - *transfer_idle_since_;
+            transfer_idle_since_.reset();
         }
-        return required_extensions.empty();
+        pending_uploads_.push_back(std::move(batch));
     }
 
-    struct QueueFamilyIndices
+    // Moves finished copies on to the graphics queue and retires finished
+    // uploads in submission order. Never waits on the GPU.
+    void poll_uploads()
     {
-        std::optional<uint32_t> graphics_family;
-        std::optional<uint32_t> present_family;
-
-        bool is_complete() const noexcept
+        bool transferred = false;
+        for (auto &batch : pending_uploads_)
         {
-            return graphics_family.has_value() && present_family.has_value();
-        }
-    };
+            if (batch.transferred)
+            {
+                continue;
+            }
 
-    static QueueFamilyIndices find_queue_families(VkPhysicalDevice device,
-                                                  VkSurfaceKHR surface)
-    {
-        QueueFamilyIndices indices = {};
+            // Stop at the first batch still copying, so the staging ring is
+            // only ever released in order
+            if (vkGetFenceStatus(device_, batch.fence) != VK_SUCCESS)
+            {
+                break;
+            }
 
-        uint32_t family_count = 0;
-        vkGetPhysicalDeviceQueueFamilyProperties(device, &family_count,
-                                                 nullptr);
+            staging_ring_.tail =
+                std::max(staging_ring_.tail, batch.staging_end);
+            batch.transferred = true;
+            transferred       = true;
 
-        std::vector<VkQueueFamilyProperties> families(family_count);
-        vkGetPhysicalDeviceQueueFamilyProperties(device, &family_count,
-                                                 families.data());
+            if (has_dedicated_transfer_queue())
+            {
+                // The copies have finished, so the acquire can't stall the
+                // frames queued behind it
+                const VkSubmitInfo submit_info = {
+                    .sType              = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+                    .commandBufferCount = 1,
+                    .pCommandBuffers    = &batch.graphics_commands,
+                };
+                vkResetFences(device_, 1, &batch.fence);
+                if (vkQueueSubmit(graphics_queue_, 1, &submit_info,
+                                  batch.fence) != VK_SUCCESS)
+                {
+                    throw std::runtime_error(
+                        "Failed to submit batch command buffer!");
+                }
+            }
+        }
 
-        uint32_t i = 0;
-        for (const auto &family : families)
+        // The transfer queue is idle once the last batch has been copied
+        if (transferred && pending_uploads_.back().transferred)
+        {
+            transfer_idle_since_ = clock::now();
+        }
+
+        while (!pending_uploads_.empty() &&
+               pending_uploads_.front().transferred &&
+               vkGetFenceStatus(device_, pending_uploads_.front().fence) ==
+                   VK_SUCCESS)
         {
-            if (family.queueFlags & VK_QUEUE_GRAPHICS_BIT)
+            const UploadBatch &batch = pending_uploads_.front();
+            if (gBuildConfig.log_verbose)
             {
-                indices.graphics_family = i;
+                using milliseconds = std::chrono::duration<double, std::milli>;
+                const auto now = clock::now();
+                log_info("Upload batch {}: {:.1f} MiB staged, recorded in "
+                         "{:.1f} ms, landed {:.1f} ms after submit",
+                         batch.ticket, batch.staging_bytes / (1024.0 * 1024.0),
+                         milliseconds(batch.submit_time - batch.begin_time)
+                             .count(),
+                         milliseconds(now - batch.submit_time).count());
             }
 
-            VkBool32 present_support = false;
-            vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface,
-                                                 &present_support);
-            if (present_support)
+            completed_uploads_ = batch.ticket;
+
+            // Buckets are made once the scene has loaded, all stale
+            for (index_t mesh_index = 0;
+                 mesh_index < std::ssize(mesh_uploads_) &&
+                 !bucket_versions_.empty();
+                 ++mesh_index)
             {
-                indices.present_family = i;
+                if (mesh_uploads_[mesh_index] == batch.ticket)
+                {
+                    ++bucket_versions_[texture_indices_[mesh_index]];
+                }
             }
+            destroy_upload_batch(pending_uploads_.front());
+            pending_uploads_.pop_front();
 
-            if (indices.is_complete())
+            if (pending_uploads_.empty())
             {
-                break;
+                using std::chrono::milliseconds;
+                log_info("Finished {} upload batches {} ms after startup, "
+                         "with the transfer queue idle for {} ms between "
+                         "them{}",
+                         completed_uploads_,
+                         std::chrono::duration_cast<milliseconds>(
+                             clock::now() - init_time_)
+                             .count(),
+                         std::chrono::duration_cast<milliseconds>(
+                             transfer_idle_time_)
+                             .count(),
+                         serial_uploads_ ? " (serial uploads)" : "");
+                transfer_idle_since_.reset();
+                transfer_idle_time_ = {};
             }
-            i++;
         }
-
-        return indices;
     }
 
-    struct SwapChainSupportDetails
+    // Blocks until the oldest batch still copying has finished with its
+    // staging memory
+    void wait_for_oldest_transfer()
     {
-        VkSurfaceCapabilitiesKHR capabilities       = {};
-        std::vector<VkSurfaceFormatKHR> formats     = {};
-        std::vector<VkPresentModeKHR> present_modes = {};
-    };
+        const auto it = std::find_if(
+            pending_uploads_.begin(), pending_uploads_.end(),
+            [](const UploadBatch &batch) { return !batch.transferred; });
+        Expects(it != pending_uploads_.end());
 
-    static SwapChainSupportDetails query_swap_chain_support(
-        VkPhysicalDevice device, VkSurfaceKHR surface)
-    {
-        SwapChainSupportDetails details = {};
-        vkGetPhysicalDeviceSurfaceCapabilitiesKHR(device, surface,
-                                                  &details.capabilities);
-        uint32_t format_count = 0;
-        vkGetPhysicalDeviceSurfaceFormatsKHR(device, surface, &format_count,
-                                             nullptr);
-        if (format_count != 0)
-        {
-            details.formats.resize(format_count);
-            vkGetPhysicalDeviceSurfaceFormatsKHR(device, surface, &format_count,
-                                                 details.formats.data());
-        }
+        vkWaitForFences(device_, 1, &it->fence, VK_TRUE, UINT64_MAX);
+        poll_uploads();
+    }
 
-        uint32_t present_mode_count = 0;
-        vkGetPhysicalDeviceSurfacePresentModesKHR(device, surface,
-                                                  &present_mode_count, nullptr);
-        if (present_mode_count != 0)
+    void destroy_upload_batch(UploadBatch &batch) noexcept
+    {
+        vkFreeCommandBuffers(device_, transfer_command_pool_, 1,
+                             &batch.transfer_commands);
+        if (has_dedicated_transfer_queue())
         {
-            details.present_modes.resize(present_mode_count);
-            vkGetPhysicalDeviceSurfacePresentModesKHR(
-                device, surface, &present_mode_count,
-                details.present_modes.data());
+            vkFreeCommandBuffers(device_, command_pool_, 1,
+                                 &batch.graphics_commands);
         }
-        return details;
+        batch.transfer_commands = {};
+        batch.graphics_commands = {};
+        vkDestroyFence(device_, batch.fence, gAllocator);
+        batch.fence = {};
     }
 
-    static VkSurfaceFormatKHR choose_swap_surface_format(
-        const std::vector<VkSurfaceFormatKHR> &available_formats) noexcept
+    // Copies up to a frame's budget of vertex, index and texture memory out
+    // of the blocks the allocator wants emptied. Runs after loading, one
+    // pass at a time, and stays idle until allocations change.
+    void defragment_memory()
     {
-        Expects(!available_formats.empty());
-        for (const auto &format : available_formats)
+        if (defrag_pass_)
         {
-            if (format.format == VK_FORMAT_B8G8R8A8_SRGB &&
-                format.colorSpace == VK_COLOR_SPACE_SRGB_NONLINEAR_KHR)
+            if (vkGetFenceStatus(device_, defrag_pass_->fence) != VK_SUCCESS)
             {
-                return format;
+                return;
             }
+            finish_defragmentation_pass();
         }
-        return available_formats.front();
-    }
-
-    static VkPresentModeKHR choose_swap_present_mode(
-        const std::vector<VkPresentModeKHR> &available_present_modes)
-    {
-        Expects(!available_present_modes.empty());
 
-        if (std::find(
-                available_present_modes.begin(), available_present_modes.end(),
-                VK_PRESENT_MODE_MAILBOX_KHR) != available_present_modes.end())
+        // A texture swap holds on to the handles of the textures it replaces
+        if (!pending_uploads_.empty() || texture_swap_ ||
+            memory_allocator_.generation() == defrag_idle_generation_)
         {
-            return VK_PRESENT_MODE_MAILBOX_KHR;
+            return;
         }
-        else
+
+        DefragmentationPass pass = {};
+        const VkCommandBufferAllocateInfo alloc_info = {
+            .sType       = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+            .commandPool = command_pool_,
+            .level       = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+            .commandBufferCount = 1,
+        };
+        if (vkAllocateCommandBuffers(device_, &alloc_info, &pass.commands) !=
+            VK_SUCCESS)
         {
-            return VK_PRESENT_MODE_FIFO_KHR;
+            throw std::runtime_error("Failed to allocate command buffers!");
         }
-    }
 
-    static VkExtent2D choose_swap_extent(
-        const VkSurfaceCapabilitiesKHR &capabilities, uint32_t width,
-        uint32_t height) noexcept
-    {
-        if (capabilities.currentExtent.width != UINT32_MAX)
+        const VkCommandBufferBeginInfo begin_info = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+            .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+        };
+        vkBeginCommandBuffer(pass.commands, &begin_info);
+
+        // Buckets drawing the moved resources pick up the new handles. Every
+        // bucket draws from the scene buffers.
+        const bool moved_vertices =
+            move_buffer(pass, scene_vertex_buffer_, scene_vertex_memory_,
+                        scene_vertex_bytes_, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
+        const bool moved_positions = move_buffer(
+            pass, scene_position_buffer_, scene_position_memory_,
+            scene_position_bytes_, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
+        const bool moved_indices =
+            move_buffer(pass, scene_index_buffer_, scene_index_memory_,
+                        scene_index_bytes_, VK_BUFFER_USAGE_INDEX_BUFFER_BIT);
+        if (moved_vertices || moved_positions || moved_indices)
         {
-            return capabilities.currentExtent;
+            invalidate_buckets();
         }
-        else
+        for (index_t i = 0; i < std::ssize(textures_); ++i)
         {
-            const auto &minExtent = capabilities.minImageExtent;
-            const auto &maxExtent = capabilities.maxImageExtent;
-            return {std::clamp(width, minExtent.width, maxExtent.width),
-                    std::clamp(height, minExtent.height, maxExtent.height)};
+            if (move_texture(pass, textures_[i]))
+            {
+                ++bucket_versions_[i];
+            }
         }
-    }
 
-    [[gsl::suppress(26490)]] // Don't warn about the reinterpret_cast below
-    static VkShaderModule
-    create_shader_module(VkDevice device, const std::vector<char> &code)
-    {
-        VkShaderModuleCreateInfo create_info = {
-            .sType    = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
-            .codeSize = narrow_cast<uint32_t>(code.size()),
-            .pCode    = reinterpret_cast<const uint32_t *>(code.data()),
+        if (pass.memory.empty())
+        {
+            // Whatever is left in the blocks being drained can't be moved
+            vkFreeCommandBuffers(device_, command_pool_, 1, &pass.commands);
+            defrag_idle_generation_ = memory_allocator_.generation();
+            return;
+        }
+
+        // Make the copied buffers visible to the frames queued after them
+        const VkMemoryBarrier barrier = {
+            .sType         = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+            .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+            .dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT |
+                             VK_ACCESS_INDEX_READ_BIT,
         };
+        vkCmdPipelineBarrier(pass.commands, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 0, 1, &barrier,
+                             0, nullptr, 0, nullptr);
+        vkEndCommandBuffer(pass.commands);
 
-        VkShaderModule shader_module;
-        if (vkCreateShaderModule(device, &create_info, nullptr,
-                                 &shader_module) != VK_SUCCESS)
+        const VkFenceCreateInfo fence_info = {
+            .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+        };
+        if (vkCreateFence(device_, &fence_info, gAllocator, &pass.fence) !=
+            VK_SUCCESS)
         {
-            throw std::runtime_error("Failed to create shader module!");
+            throw std::runtime_error("Failed to create fence!");
         }
-        return shader_module;
-    }
 
-    static std::vector<const char *> get_required_extensions()
-    {
-        uint32_t glfw_extension_count = 0;
-        const char *const *glfw_extensions =
-            glfwGetRequiredInstanceExtensions(&glfw_extension_count);
-        std::vector<const char *> extensions(
-            glfw_extensions, std::next(glfw_extensions, glfw_extension_count));
-        if (enable_validation_layers_)
+        const VkSubmitInfo submit_info = {
+            .sType              = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+            .commandBufferCount = 1,
+            .pCommandBuffers    = &pass.commands,
+        };
+        if (vkQueueSubmit(graphics_queue_, 1, &submit_info, pass.fence) !=
+            VK_SUCCESS)
         {
-            extensions.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
+            throw std::runtime_error(
+                "Failed to submit defragmentation command buffer!");
         }
-        return extensions;
+
+        defrag_moves_ += narrow_cast<uint32_t>(pass.memory.size());
+        defrag_bytes_moved_ += pass.bytes;
+        defrag_pass_ = std::move(pass);
     }
 
-    static VKAPI_ATTR VkBool32 VKAPI_CALL debug_callback(
-        VkDebugUtilsMessageSeverityFlagBitsEXT message_severity,
-        [[maybe_unused]] VkDebugUtilsMessageTypeFlagsEXT message_type,
-        const VkDebugUtilsMessengerCallbackDataEXT *callback_data,
-        [[maybe_unused]] void *user_data)
+    // Records copying a buffer into memory the allocator has chosen to
+    // compact it into, and swaps in the copy. Returns false if the buffer
+    // stays put.
+    bool move_buffer(DefragmentationPass &pass, VkBuffer &buffer,
+                     MemoryAllocation &memory, VkDeviceSize size,
+                     VkBufferUsageFlags usage)
     {
-        Expects(callback_data != nullptr);
-
-        switch (message_severity)
+        if (!memory_allocator_.should_move(memory) ||
+            (pass.bytes > 0 &&
+             pass.bytes + memory.size > defrag_bytes_per_frame_))
         {
-        case VK_DEBUG_UTILS_MESSAGE_SEVERITY_VERBOSE_BIT_EXT:
-        case VK_DEBUG_UTILS_MESSAGE_SEVERITY_INFO_BIT_EXT: {
-            if (gBuildConfig.log_verbose)
-            {
-                log_info("[Vulkan] {}", callback_data->pMessage);
-            }
-            break;
-        }
-        case VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT: {
-            log_warn("[Vulkan] {}", callback_data->pMessage);
-            break;
-        }
-        case VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT: {
-            log_error("[Vulkan] {}", callback_data->pMessage);
-            break;
-        }
+            return false;
         }
 
-        return VK_FALSE;
-    }
+        const VkBuffer moved_buffer = create_unbound_buffer(
+            device_, size,
+            VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+                VK_BUFFER_USAGE_TRANSFER_DST_BIT | usage);
 
-    static VkDebugUtilsMessengerCreateInfoEXT
-    get_debug_utils_messenger_info() noexcept
-    {
-        return {
-            .sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_MESSENGER_CREATE_INFO_EXT,
-            .messageSeverity = VK_DEBUG_UTILS_MESSAGE_SEVERITY_VERBOSE_BIT_EXT |
-                               VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT |
-                               VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT,
-            .messageType = VK_DEBUG_UTILS_MESSAGE_TYPE_GENERAL_BIT_EXT |
-                           VK_DEBUG_UTILS_MESSAGE_TYPE_VALIDATION_BIT_EXT |
-                           VK_DEBUG_UTILS_MESSAGE_TYPE_PERFORMANCE_BIT_EXT,
-            .pfnUserCallback = debug_callback,
+        VkMemoryRequirements requirements = {};
+        vkGetBufferMemoryRequirements(device_, moved_buffer, &requirements);
+        const auto moved_memory =
+            memory_allocator_.allocate_for_move(memory, requirements);
+        if (!moved_memory)
+        {
+            vkDestroyBuffer(device_, moved_buffer, gAllocator);
+            return false;
+        }
+        vkBindBufferMemory(device_, moved_buffer, moved_memory->memory,
+                           moved_memory->offset);
+
+        const VkBufferCopy copy_region = {
+            .srcOffset = 0,
+            .dstOffset = 0,
+            .size      = size,
         };
+        vkCmdCopyBuffer(pass.commands, buffer, moved_buffer, 1, &copy_region);
+
+        pass.buffers.push_back(buffer);
+        pass.memory.push_back(memory);
+        pass.bytes += memory.size;
+        buffer = moved_buffer;
+        memory = *moved_memory;
+        return true;
     }
 
-    static std::vector<char> read_bytes(const std::string &filename)
+    // Records copying every level of a texture into memory the allocator
+    // has chosen to compact it into, and swaps in the copy. Returns false
+    // if the texture stays put.
+    bool move_texture(DefragmentationPass &pass, Texture &texture)
     {
-        std::ifstream file {filename, std::ios::ate | std::ios::binary};
-        if (!file.is_open())
+        const MemoryAllocation &memory = texture.device_memory_;
+        if (!memory_allocator_.should_move(memory) ||
+            (pass.bytes > 0 &&
+             pass.bytes + memory.size > defrag_bytes_per_frame_))
         {
-            throw std::runtime_error(
-                fmt::format("Failed to open {}! Reason: Read error.", filename)
-                    .c_str());
+            return false;
         }
-        const std::size_t size = static_cast<std::size_t>(file.tellg());
-        std::vector<char> buffer(size);
-        file.seekg(0);
-        file.read(buffer.data(), size);
-        file.close();
-        return buffer;
-    }
 
-    static uint32_t find_memory_type(VkPhysicalDevice physical_device,
-                                     uint32_t type_filter,
-                                     VkMemoryPropertyFlags properties)
-    {
-        VkPhysicalDeviceMemoryProperties memory_properties = {};
-        vkGetPhysicalDeviceMemoryProperties(physical_device,
-                                            &memory_properties);
+        const VkImage moved_image = create_unbound_image(
+            device_, texture.extent_.width, texture.extent_.height,
+            texture.mip_levels_, VK_SAMPLE_COUNT_1_BIT, texture.format_,
+            VK_IMAGE_TILING_OPTIMAL,
+            VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT |
+                VK_IMAGE_USAGE_SAMPLED_BIT);
 
-        [[gsl::suppress(bounds .2)]] [[gsl::suppress(
-            bounds .4)]] for (uint32_t i = 0;
-                              i < memory_properties.memoryTypeCount; ++i)
+        VkMemoryRequirements requirements = {};
+        vkGetImageMemoryRequirements(device_, moved_image, &requirements);
+        const auto moved_memory =
+            memory_allocator_.allocate_for_move(memory, requirements);
+        if (!moved_memory)
         {
-            const bool matches_type_filter = (type_filter & (1 << i)) != 0;
-            const bool matches_properties =
-                (memory_properties.memoryTypes[i].propertyFlags & properties) ==
-                properties;
-            if (matches_type_filter && matches_properties)
+            vkDestroyImage(device_, moved_image, gAllocator);
+            return false;
+        }
+        vkBindImageMemory(device_, moved_image, moved_memory->memory,
+                          moved_memory->offset);
+
+        const VkImageSubresourceRange all_levels = {
+            .aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
+            .baseMipLevel   = 0,
+            .levelCount     = texture.mip_levels_,
+            .baseArrayLayer = 0,
+            .layerCount     = 1,
+        };
+
+        // Earlier frames may still be sampling the old image
+        const std::array<VkImageMemoryBarrier, 2> copy_barriers = {{
             {
-                return i;
-            }
+                .sType               = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+                .srcAccessMask       = VK_ACCESS_SHADER_READ_BIT,
+                .dstAccessMask       = VK_ACCESS_TRANSFER_READ_BIT,
+                .oldLayout           = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                .newLayout           = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                .image               = texture.image_,
+                .subresourceRange    = all_levels,
+            },
+            {
+                .sType               = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+                .srcAccessMask       = 0,
+                .dstAccessMask       = VK_ACCESS_TRANSFER_WRITE_BIT,
+                .oldLayout           = VK_IMAGE_LAYOUT_UNDEFINED,
+                .newLayout           = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                .image               = moved_image,
+                .subresourceRange    = all_levels,
+            },
+        }};
+        vkCmdPipelineBarrier(pass.commands,
+                             VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                             VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0,
+                             nullptr,
+                             narrow_cast<uint32_t>(copy_barriers.size()),
+                             copy_barriers.data());
+
+        std::vector<VkImageCopy> regions;
+        for (uint32_t level = 0; level < texture.mip_levels_; ++level)
+        {
+            const VkImageSubresourceLayers subresource = {
+                .aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
+                .mipLevel       = level,
+                .baseArrayLayer = 0,
+                .layerCount     = 1,
+            };
+            regions.push_back({
+                .srcSubresource = subresource,
+                .srcOffset      = {0, 0, 0},
+                .dstSubresource = subresource,
+                .dstOffset      = {0, 0, 0},
+                .extent =
+                    {
+                        std::max(texture.extent_.width >> level, 1u),
+                        std::max(texture.extent_.height >> level, 1u),
+                        1,
+                    },
+            });
         }
+        vkCmdCopyImage(pass.commands, texture.image_,
+                       VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, moved_image,
+                       VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                       narrow_cast<uint32_t>(regions.size()), regions.data());
 
-        throw std::runtime_error("Failed to find suitable memory type!");
+        const VkImageMemoryBarrier read_barrier = {
+            .sType               = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+            .srcAccessMask       = VK_ACCESS_TRANSFER_WRITE_BIT,
+            .dstAccessMask       = VK_ACCESS_SHADER_READ_BIT,
+            .oldLayout           = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+            .newLayout           = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .image               = moved_image,
+            .subresourceRange    = all_levels,
+        };
+        vkCmdPipelineBarrier(pass.commands, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0,
+                             nullptr, 0, nullptr, 1, &read_barrier);
+
+        pass.images.push_back(texture.image_);
+        pass.image_views.push_back(texture.image_view_);
+        pass.memory.push_back(memory);
+        pass.bytes += memory.size;
+        texture.image_         = moved_image;
+        texture.device_memory_ = *moved_memory;
+        texture.image_view_ =
+            create_image_view(device_, moved_image, texture.format_,
+                              VK_IMAGE_ASPECT_COLOR_BIT, texture.mip_levels_,
+                              texture.components_);
+        return true;
     }
 
-    static std::pair<VkBuffer, VkDeviceMemory> create_buffer(
-        VkPhysicalDevice physical_device, VkDevice device, VkDeviceSize size,
-        VkBufferUsageFlags usage, VkMemoryPropertyFlags properties)
+    // Destroys the resources a finished pass replaced, which frees the
+    // blocks they emptied
+    void finish_defragmentation_pass() noexcept
     {
-        const VkBufferCreateInfo buffer_info = {
-            .sType       = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-            .size        = size,
-            .usage       = usage,
-            .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
-        };
-
-        VkBuffer buffer;
-        if (vkCreateBuffer(device, &buffer_info, nullptr, &buffer) !=
-            VK_SUCCESS)
+        for (auto view : defrag_pass_->image_views)
         {
-            throw std::runtime_error("failed to create vertex buffer!");
+            vkDestroyImageView(device_, view, gAllocator);
         }
-
-        VkMemoryRequirements memory_requirements = {};
-        vkGetBufferMemoryRequirements(device, buffer, &memory_requirements);
-
-        const auto memory_type = find_memory_type(
-            physical_device, memory_requirements.memoryTypeBits, properties);
-        const VkMemoryAllocateInfo alloc_info = {
-            .sType           = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-            .allocationSize  = memory_requirements.size,
-            .memoryTypeIndex = memory_type,
-        };
-
-        VkDeviceMemory buffer_memory;
-        if (vkAllocateMemory(device, &alloc_info, nullptr, &buffer_memory) !=
-            VK_SUCCESS)
+        for (auto image : defrag_pass_->images)
         {
-            throw std::runtime_error(
-                "Failed to allocate vertex buffer memory!");
+            vkDestroyImage(device_, image, gAllocator);
         }
+        for (auto buffer : defrag_pass_->buffers)
+        {
+            vkDestroyBuffer(device_, buffer, gAllocator);
+        }
+        for (const auto &memory : defrag_pass_->memory)
+        {
+            memory_allocator_.free(memory);
+        }
+        vkFreeCommandBuffers(device_, command_pool_, 1,
+                             &defrag_pass_->commands);
+        vkDestroyFence(device_, defrag_pass_->fence, gAllocator);
 
-        vkBindBufferMemory(device, buffer, buffer_memory, 0);
-
-        return {buffer, buffer_memory};
-    }
-
-    void copy_buffer(VkBuffer src_buffer, VkBuffer dst_buffer,
-                     VkDeviceSize size) noexcept
-    {
-        const VkCommandBuffer command_buffer =
-            begin_single_time_commands(device_, command_pool_);
-
-        const VkBufferCopy copy_region = {
-            .size = size,
-        };
-        vkCmdCopyBuffer(command_buffer, src_buffer, dst_buffer, 1,
-                        &copy_region);
-
-        end_single_time_commands(device_, command_pool_, graphics_queue_,
-                                 command_buffer);
+        if (gBuildConfig.log_verbose)
+        {
+            log_info("Defragmentation pass moved {} allocations ({:.1f} MiB), "
+                     "fragmentation now {:.0f}%",
+                     defrag_pass_->memory.size(),
+                     defrag_pass_->bytes / (1024.0 * 1024.0),
+                     memory_allocator_.fragmentation() * 100.0);
+        }
+        defrag_pass_.reset();
     }
 
-    static void copy_buffer_to_image(VkDevice device,
-                                     VkCommandPool command_pool, VkQueue queue,
-                                     VkBuffer buffer, VkImage image,
-                                     uint32_t width, uint32_t height) noexcept
+    static void copy_buffer_to_image(VkCommandBuffer command_buffer,
+                                     VkBuffer buffer,
+                                     VkDeviceSize buffer_offset, VkImage image,
+                                     VkOffset2D image_offset,
+                                     VkExtent2D image_extent) noexcept
     {
-        VkCommandBuffer command_buffer =
-            begin_single_time_commands(device, command_pool);
-
         const VkBufferImageCopy region = {
-            .bufferOffset      = 0,
+            .bufferOffset      = buffer_offset,
             .bufferRowLength   = 0,
             .bufferImageHeight = 0,
             .imageSubresource =
@@ -2090,22 +8885,22 @@ class Application
                     .baseArrayLayer = 0,
                     .layerCount     = 1,
                 },
-            .imageOffset = {0, 0, 0},
+            .imageOffset = {image_offset.x, image_offset.y, 0},
             .imageExtent =
                 {
-                    width,
-                    height,
+                    image_extent.width,
+                    image_extent.height,
                     1,
                 },
         };
         vkCmdCopyBufferToImage(command_buffer, buffer, image,
                                VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1,
                                &region);
-
-        end_single_time_commands(device, command_pool, queue, command_buffer);
     }
 
-    void update_uniform_buffer(uint32_t current_image)
+    // Writes the constants of the current frame and of every mesh into the
+    // frame's region of the uniform arena
+    void update_uniforms()
     {
         const float time = []() noexcept {
             static const auto start_time =
@@ -2165,29 +8960,150 @@ class Application
 
         const mat4 model_transform = mat4(1.0f);
 
-        const UniformBufferObject ubo = {
-            .model = model_transform,
-            .view  = camera_transform_,
-            .proj  = glm::perspective(glm::radians(70.0f), aspect_ratio, 0.1f,
-                                     10.0f),
-            .time  = time,
+        uniform_arena_.begin_frame(current_frame_);
+
+        update_lights(time);
+
+        // The sun circles the scene once every 2 pi seconds
+        const FrameUniforms frame_uniforms = {
+            .view = camera_transform_,
+            .proj = glm::perspective(glm::radians(70.0f), aspect_ratio,
+                                     near_plane_, far_plane_),
+            .time = time,
+            .sun_position =
+                glm::rotate(mat4(1.0f), -time, vec3(0.0f, 1.0f, 0.0f)) *
+                vec4(90.0f, 100.0f, 90.0f, 1.0f),
+            .viewport    = vec2(render_extent_.width, render_extent_.height),
+            .near_plane  = near_plane_,
+            .far_plane   = far_plane_,
+            .light_count = narrow_cast<uint32_t>(lights_.size()),
         };
+        frame_uniform_offset_ = uniform_arena_.push(frame_uniforms);
 
-        void *data = nullptr;
-        vkMapMemory(device_, uniform_buffers_memory_[current_image], 0,
-                    sizeof(ubo), 0, &data);
-        std::memcpy(data, &ubo, sizeof(ubo));
-        vkUnmapMemory(device_, uniform_buffers_memory_[current_image]);
+        frustum_planes_ =
+            frustum_planes(frame_uniforms.proj * frame_uniforms.view);
+        // Every object shares the model transform
+        model_view_proj_ =
+            frame_uniforms.proj * frame_uniforms.view * model_transform;
+
+        // Each draw finds its object by its first instance
+        const std::vector<ObjectUniforms> objects(
+            mesh_ranges_.size(),
+            {
+                .model           = model_transform,
+                .model_view_proj = model_view_proj_,
+                .normal = glm::transpose(glm::inverse(model_transform)),
+            });
+        object_uniform_offset_ =
+            uniform_arena_.push_array<ObjectUniforms>(objects);
+
+        // Pushed after the objects, so that its offset is as stable
+        light_uniform_offset_ = uniform_arena_.push_array<PointLight>(lights_);
     }
 
-    static VkSampleCountFlagBits get_max_usable_sample_count(
-        VkPhysicalDevice physical_device) noexcept
+    // The bytes bound for the array of every object's constants
+    VkDeviceSize object_array_bytes() const noexcept
+    {
+        return sizeof(ObjectUniforms) *
+               std::max<VkDeviceSize>(mesh_ranges_.size(), 1);
+    }
+
+    // The bytes bound for the array of lights, enough for the most
+    static constexpr VkDeviceSize light_array_bytes() noexcept
+    {
+        return sizeof(PointLight) * VkDeviceSize {light_counts_.back()};
+    }
+
+    // Moves the lights along their orbits around the scene. Each light
+    // keeps its orbit as the count changes. Their radii shrink as their
+    // number grows, which keeps about as many lights on each cluster.
+    void update_lights(float time)
+    {
+        const uint32_t count = light_counts_[light_count_index_];
+        const float radius =
+            0.6f * std::cbrt(narrow_cast<float>(light_counts_.front()) / count);
+        lights_.resize(count);
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            // Additive recurrences spread any number of lights evenly
+            const float u     = std::fmod(i * 0.618034f, 1.0f);
+            const float v     = std::fmod(i * 0.754878f, 1.0f);
+            const float w     = std::fmod(i * 0.569840f, 1.0f);
+            const float orbit = 0.3f + 1.2f * u;
+            const float angle =
+                glm::radians(360.0f * v) + time * (0.2f + 0.6f * w) / orbit;
+            const float height =
+                -1.0f + 2.0f * w + 0.1f * std::sin(time + 10.0f * u);
+
+            // A fully saturated hue
+            const vec3 hue = glm::mod(6.0f * v + vec3(0.0f, 4.0f, 2.0f), 6.0f);
+            const vec3 colour =
+                glm::clamp(glm::abs(hue - 3.0f) - 1.0f, 0.0f, 1.0f);
+            lights_[i] = {
+                .position = vec4(orbit * std::cos(angle), height,
+                                 orbit * std::sin(angle), radius),
+                .colour   = vec4(colour * 1.5f, 1.0f),
+            };
+        }
+    }
+
+    // Returns the planes of a view projection's frustum, facing inwards.
+    // The near plane is that of a -1..1 depth range, which contains the
+    // 0..1 one, so either convention culls conservatively.
+    static std::array<vec4, 6> frustum_planes(const mat4 &view_proj) noexcept
+    {
+        const mat4 rows            = glm::transpose(view_proj);
+        std::array<vec4, 6> planes = {
+            rows[3] + rows[0], rows[3] - rows[0], rows[3] + rows[1],
+            rows[3] - rows[1], rows[3] + rows[2], rows[3] - rows[2],
+        };
+        for (auto &plane : planes)
+        {
+            plane /= glm::length(vec3(plane));
+        }
+        return planes;
+    }
+
+    static BoundingBox bounding_box(std::span<const Vertex> vertices) noexcept
+    {
+        BoundingBox box = {};
+        box.lo = box.hi = vertices.empty() ? vec3 {} : vertices.front().pos;
+        for (const auto &vertex : vertices)
+        {
+            box.lo = glm::min(box.lo, vertex.pos);
+            box.hi = glm::max(box.hi, vertex.pos);
+        }
+        return box;
+    }
+
+    // Returns a sphere around the centre of the vertices' bounding box, as
+    // xyz and radius
+    static vec4 bounding_sphere(std::span<const Vertex> vertices) noexcept
+    {
+        const BoundingBox box = bounding_box(vertices);
+        const vec3 centre     = (box.lo + box.hi) * 0.5f;
+        float radius      = 0.0f;
+        for (const auto &vertex : vertices)
+        {
+            radius = std::max(radius, glm::distance(centre, vertex.pos));
+        }
+        return vec4(centre, radius);
+    }
+
+    static VkSampleCountFlags
+    get_usable_sample_counts(VkPhysicalDevice physical_device) noexcept
     {
         VkPhysicalDeviceProperties properties = {};
         vkGetPhysicalDeviceProperties(physical_device, &properties);
+        return properties.limits.framebufferColorSampleCounts &
+               properties.limits.framebufferDepthSampleCounts;
+    }
+
+    static VkSampleCountFlagBits get_max_usable_sample_count(
+        VkPhysicalDevice physical_device) noexcept
+    {
         const VkSampleCountFlags counts =
-            properties.limits.framebufferColorSampleCounts &
-            properties.limits.framebufferDepthSampleCounts;
+            get_usable_sample_counts(physical_device);
         const VkSampleCountFlagBits preferred_bits[] = {
             VK_SAMPLE_COUNT_64_BIT, VK_SAMPLE_COUNT_32_BIT,
             VK_SAMPLE_COUNT_16_BIT, VK_SAMPLE_COUNT_8_BIT,
@@ -2204,14 +9120,13 @@ class Application
         return VK_SAMPLE_COUNT_1_BIT;
     }
 
-    static std::pair<VkImage, VkDeviceMemory> create_image(
-        VkPhysicalDevice physical_device, VkDevice device, uint32_t width,
-        uint32_t height, uint32_t mip_levels, VkSampleCountFlagBits num_samples,
-        VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage,
-        VkMemoryPropertyFlags properties)
+    static VkImage create_unbound_image(VkDevice device, uint32_t width,
+                                        uint32_t height, uint32_t mip_levels,
+                                        VkSampleCountFlagBits num_samples,
+                                        VkFormat format, VkImageTiling tiling,
+                                        VkImageUsageFlags usage)
     {
-        VkImage image               = {};
-        VkDeviceMemory image_memory = {};
+        VkImage image = {};
 
         const VkImageCreateInfo image_info = {
             .sType         = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
@@ -2227,27 +9142,32 @@ class Application
             .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
         };
 
-        if (vkCreateImage(device, &image_info, nullptr, &image) != VK_SUCCESS)
+        if (vkCreateImage(device, &image_info, gAllocator, &image) !=
+            VK_SUCCESS)
         {
             throw std::runtime_error("Failed to create image!");
         }
+        return image;
+    }
+
+    static std::pair<VkImage, MemoryAllocation> create_image(
+        DeviceMemoryAllocator &allocator, VkDevice device, uint32_t width,
+        uint32_t height, uint32_t mip_levels, VkSampleCountFlagBits num_samples,
+        VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage,
+        VkMemoryPropertyFlags properties)
+    {
+        const VkImage image =
+            create_unbound_image(device, width, height, mip_levels,
+                                 num_samples, format, tiling, usage);
 
         VkMemoryRequirements requirements;
         vkGetImageMemoryRequirements(device, image, &requirements);
 
-        const VkMemoryAllocateInfo alloc_info = {
-            .sType           = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-            .allocationSize  = requirements.size,
-            .memoryTypeIndex = find_memory_type(
-                physical_device, requirements.memoryTypeBits, properties)};
-
-        if (vkAllocateMemory(device, &alloc_info, nullptr, &image_memory) !=
-            VK_SUCCESS)
-        {
-            throw std::runtime_error("Failed to allocate image memory!");
-        }
+        const MemoryAllocation image_memory = allocator.allocate(
+            requirements, properties, tiling == VK_IMAGE_TILING_LINEAR);
 
-        vkBindImageMemory(device, image, image_memory, 0);
+        vkBindImageMemory(device, image, image_memory.memory,
+                          image_memory.offset);
 
         return {image, image_memory};
     }
@@ -2255,13 +9175,15 @@ class Application
     static VkImageView create_image_view(VkDevice device, VkImage image,
                                          VkFormat format,
                                          VkImageAspectFlags aspect_flags,
-                                         uint32_t mip_levels)
+                                         uint32_t mip_levels,
+                                         VkComponentMapping components = {})
     {
         const VkImageViewCreateInfo view_info = {
             .sType            = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
             .image            = image,
             .viewType         = VK_IMAGE_VIEW_TYPE_2D,
             .format           = format,
+            .components       = components,
             .subresourceRange = {
                 .aspectMask     = aspect_flags,
                 .baseMipLevel   = 0,
@@ -2271,7 +9193,7 @@ class Application
             }};
 
         VkImageView image_view = {};
-        if (vkCreateImageView(device, &view_info, nullptr, &image_view) !=
+        if (vkCreateImageView(device, &view_info, gAllocator, &image_view) !=
             VK_SUCCESS)
         {
             throw std::runtime_error("Failed to create texture image view!");
@@ -2316,146 +9238,25 @@ class Application
             VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT);
     }
 
-    static constexpr bool has_stencil_component(VkFormat format)
+    // The first pixel of a decoded texture, as sRGB RGBA
+    static uint32_t first_texel(const TextureData &data) noexcept
     {
-        return format == VK_FORMAT_D32_SFLOAT_S8_UINT ||
-               format == VK_FORMAT_D24_UNORM_S8_UINT;
-    }
-
-    // Supported layout transitions are:
-    //     VK_IMAGE_LAYOUT_UNDEFINED ->
-    //         VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL
-    //     VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL ->
-    //         VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
-    //     VK_IMAGE_LAYOUT_UNDEFINED ->
-    //         VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL
-    static void transition_image_layout(
-        VkDevice device, VkCommandPool command_pool, VkQueue queue,
-        VkImage image, VkFormat format, VkImageLayout old_layout,
-        VkImageLayout new_layout, uint32_t mip_levels)
-    {
-        Expects(
-            (old_layout == VK_IMAGE_LAYOUT_UNDEFINED &&
-             new_layout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL) ||
-            (old_layout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL &&
-             new_layout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL) ||
-            (old_layout == VK_IMAGE_LAYOUT_UNDEFINED &&
-             new_layout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL));
-
-        VkCommandBuffer command_buffer =
-            begin_single_time_commands(device, command_pool);
-
-        const VkImageAspectFlags aspect_mask =
-            new_layout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL
-                ? (VK_IMAGE_ASPECT_DEPTH_BIT |
-                   (has_stencil_component(format) ? VK_IMAGE_ASPECT_STENCIL_BIT
-                                                  : 0))
-                : VK_IMAGE_ASPECT_COLOR_BIT;
-
-        VkImageMemoryBarrier barrier = {
-            .sType               = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-            .oldLayout           = old_layout,
-            .newLayout           = new_layout,
-            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-            .image               = image,
-            .subresourceRange =
-                {
-                    .aspectMask     = aspect_mask,
-                    .baseMipLevel   = 0,
-                    .levelCount     = mip_levels,
-                    .baseArrayLayer = 0,
-                    .layerCount     = 1,
-                },
-        };
-
-        VkPipelineStageFlags source_stage      = {};
-        VkPipelineStageFlags destination_stage = {};
-        if (old_layout == VK_IMAGE_LAYOUT_UNDEFINED &&
-            new_layout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL)
-        {
-            barrier.srcAccessMask = 0;
-            barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-            source_stage          = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
-            destination_stage     = VK_PIPELINE_STAGE_TRANSFER_BIT;
-        }
-        else if (old_layout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL &&
-                 new_layout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL)
+        const uint8_t *p = data.pixels.data();
+        if (data.format == VK_FORMAT_R8_SRGB)
         {
-            barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-            barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-            source_stage          = VK_PIPELINE_STAGE_TRANSFER_BIT;
-            destination_stage     = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+            return uint32_t {p[0]} << 24 | uint32_t {p[0]} << 16 |
+                   uint32_t {p[0]} << 8 | 0xff;
         }
-        else if (old_layout == VK_IMAGE_LAYOUT_UNDEFINED &&
-                 new_layout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL)
-        {
-            barrier.srcAccessMask = 0;
-            barrier.dstAccessMask =
-                VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
-                VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
-            source_stage      = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
-            destination_stage = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
-        }
-        else
-        {
-            throw std::invalid_argument("Unsupported layout transition!");
-        }
-
-        vkCmdPipelineBarrier(command_buffer, source_stage, destination_stage, 0,
-                             0, nullptr, 0, nullptr, 1, &barrier);
-
-        end_single_time_commands(device, command_pool, queue, command_buffer);
-    }
-
-    static VkCommandBuffer begin_single_time_commands(
-        VkDevice device, VkCommandPool command_pool) noexcept
-    {
-        const VkCommandBufferAllocateInfo alloc_info = {
-            .sType       = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-            .commandPool = command_pool,
-            .level       = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-            .commandBufferCount = 1,
-        };
-
-        VkCommandBuffer command_buffer = {};
-        vkAllocateCommandBuffers(device, &alloc_info, &command_buffer);
-
-        const VkCommandBufferBeginInfo begin_info = {
-            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
-            .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
-        };
-
-        vkBeginCommandBuffer(command_buffer, &begin_info);
-
-        return command_buffer;
+        return uint32_t {p[0]} << 24 | uint32_t {p[1]} << 16 |
+               uint32_t {p[2]} << 8 | uint32_t {p[3]};
     }
 
-    static void end_single_time_commands(
-        VkDevice device, VkCommandPool command_pool, VkQueue queue,
-        VkCommandBuffer command_buffer) noexcept
+    static constexpr bool has_stencil_component(VkFormat format)
     {
-        vkEndCommandBuffer(command_buffer);
-
-        const VkSubmitInfo submit_info = {
-            .sType              = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-            .commandBufferCount = 1,
-            .pCommandBuffers    = &command_buffer,
-        };
-        vkQueueSubmit(queue, 1, &submit_info, VK_NULL_HANDLE);
-        vkQueueWaitIdle(queue);
-
-        vkFreeCommandBuffers(device, command_pool, 1, &command_buffer);
+        return format == VK_FORMAT_D32_SFLOAT_S8_UINT ||
+               format == VK_FORMAT_D24_UNORM_S8_UINT;
     }
 
-    // Represents a single part of a scene with a single material etc
-    struct MeshObject
-    {
-        std::vector<Vertex> vertices  = {};
-        std::vector<uint16_t> indices = {};
-        std::string texture_name      = {};
-    };
-
     static void compute_normals_from_triangles(std::vector<Vertex> &vertices)
     {
         for (index_t i = 0; i < std::ssize(vertices); i += 3)
@@ -2821,6 +9622,14 @@ class Application
                 index_offset += vertex_count;
             }
 
+            // Shapes named occluder* are simplified stand-ins for the
+            // software occlusion buffer, and are never drawn
+            if (shapes[shape_index].name.starts_with("occluder"))
+            {
+                meshes.push_back({vertices, indices, {}, true});
+                continue;
+            }
+
             // TODO: Support per-face material instead of per-shape
             std::string texture_basename = fmt::format(
                 "assets\\{}_baseColor",
@@ -2849,9 +9658,50 @@ class Application
         return meshes;
     }
 
-    static Texture create_texture(VkPhysicalDevice physical_device,
-                                  VkDevice device, VkCommandPool command_pool,
-                                  VkQueue queue, std::string filename)
+    // Gathers the triangles the software occlusion buffer rasterises: the
+    // occluder-only shapes, or without any, those of the largest meshes
+    void collect_occluders(std::span<const MeshObject> meshes)
+    {
+        std::vector<const MeshObject *> occluders;
+        for (const auto &mesh : meshes)
+        {
+            if (mesh.occluder_only)
+            {
+                occluders.push_back(&mesh);
+            }
+        }
+        if (occluders.empty())
+        {
+            for (const auto &mesh : meshes)
+            {
+                occluders.push_back(&mesh);
+            }
+            const auto count =
+                std::min(std::ssize(occluders), occluder_mesh_count_);
+            std::ranges::partial_sort(
+                occluders, occluders.begin() + count, std::ranges::greater {},
+                [](const MeshObject *mesh) {
+                    return bounding_sphere(mesh->vertices).w;
+                });
+            occluders.resize(narrow_cast<std::size_t>(count));
+        }
+
+        for (const MeshObject *mesh : occluders)
+        {
+            for (const uint16_t index : mesh->indices)
+            {
+                occluder_triangles_.push_back(mesh->vertices[index].pos);
+            }
+        }
+        log_info("Software occlusion uses {} triangles from {} meshes",
+                 occluder_triangles_.size() / 3, occluders.size());
+    }
+
+    // Decodes an image and picks the most compact format that represents it
+    // exactly: a 1x1 texture for a single colour, a single swizzled channel
+    // for opaque grayscale, and RGBA otherwise.
+    static TextureData load_texture_data(const std::string &filename,
+                                         bool single_channel_supported)
     {
         int tex_width    = 0;
         int tex_height   = 0;
@@ -2861,57 +9711,84 @@ class Application
 
         if (pixels == nullptr || tex_width == 0 || tex_height == 0)
         {
+            stbi_image_free(pixels);
             throw std::runtime_error(
                 fmt::format("Failed to load texture \"{}\"!", filename));
         }
+        const auto free_pixels =
+            gsl::finally([pixels]() noexcept { stbi_image_free(pixels); });
+
+        TextureData data = {
+            .filename      = filename,
+            .width         = narrow_cast<uint32_t>(tex_width),
+            .height        = narrow_cast<uint32_t>(tex_height),
+            .source_width  = narrow_cast<uint32_t>(tex_width),
+            .source_height = narrow_cast<uint32_t>(tex_height),
+            .analysis      = analyse_pixels(
+                pixels, narrow_cast<std::size_t>(tex_width) * tex_height),
+        };
 
-        const uint32_t mip_levels =
-            narrow_cast<uint32_t>(
-                std::floor(std::log2(std::max(tex_width, tex_height)))) +
-            1;
+        if (data.analysis.flat)
+        {
+            data.width  = 1;
+            data.height = 1;
+        }
 
-        const VkDeviceSize image_size =
-            narrow_cast<VkDeviceSize>(tex_width) * tex_height * 4;
+        const std::size_t pixel_count =
+            narrow_cast<std::size_t>(data.width) * data.height;
+        if (single_channel_supported && data.analysis.grayscale &&
+            data.analysis.opaque)
+        {
+            data.format     = VK_FORMAT_R8_SRGB;
+            data.components = {
+                .r = VK_COMPONENT_SWIZZLE_R,
+                .g = VK_COMPONENT_SWIZZLE_R,
+                .b = VK_COMPONENT_SWIZZLE_R,
+                .a = VK_COMPONENT_SWIZZLE_ONE,
+            };
+            data.pixels.resize(pixel_count);
+            for (std::size_t i = 0; i < pixel_count; ++i)
+            {
+                data.pixels[i] = *std::next(pixels, i * 4);
+            }
+        }
+        else
+        {
+            data.pixels.assign(pixels, std::next(pixels, pixel_count * 4));
+        }
+        return data;
+    }
 
-        const auto [staging_buffer, staging_buffer_memory] =
-            create_buffer(physical_device, device, image_size,
-                          VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                          VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                              VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    // Creates the image, view and sampler. The pixels are copied in by
+    // upload_texture.
+    static Texture create_texture(VkPhysicalDevice physical_device,
+                                  DeviceMemoryAllocator &allocator,
+                                  VkDevice device, const TextureData &data)
+    {
+        VkFormatProperties format_properties = {};
+        vkGetPhysicalDeviceFormatProperties(physical_device, data.format,
+                                            &format_properties);
 
-        void *data = nullptr;
-        vkMapMemory(device, staging_buffer_memory, 0, image_size, 0, &data);
-        std::memcpy(data, pixels, narrow_cast<std::size_t>(image_size));
-        vkUnmapMemory(device, staging_buffer_memory);
+        if (!(format_properties.optimalTilingFeatures &
+              VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT))
+        {
+            throw std::runtime_error(
+                "Texture image format does not support linear blitting!");
+        }
 
-        stbi_image_free(pixels);
+        const uint32_t mip_levels = mip_level_count(data.width, data.height);
 
         const auto [texture_image, texture_image_memory] = create_image(
-            physical_device, device, tex_width, tex_height, mip_levels,
-            VK_SAMPLE_COUNT_1_BIT, VK_FORMAT_R8G8B8A8_SRGB,
-            VK_IMAGE_TILING_OPTIMAL,
+            allocator, device, data.width, data.height, mip_levels,
+            VK_SAMPLE_COUNT_1_BIT, data.format, VK_IMAGE_TILING_OPTIMAL,
             VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT |
                 VK_IMAGE_USAGE_SAMPLED_BIT,
             VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
 
-        transition_image_layout(
-            device, command_pool, queue, texture_image, VK_FORMAT_R8G8B8A8_SRGB,
-            VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-            mip_levels);
-
-        copy_buffer_to_image(device, command_pool, queue, staging_buffer,
-                             texture_image, tex_width, tex_height);
-
-        vkDestroyBuffer(device, staging_buffer, nullptr);
-        vkFreeMemory(device, staging_buffer_memory, nullptr);
-
-        generate_mipmaps(physical_device, device, command_pool, queue,
-                         texture_image, VK_FORMAT_R8G8B8A8_SRGB, tex_width,
-                         tex_height, mip_levels);
-
         const auto texture_image_view =
-            create_image_view(device, texture_image, VK_FORMAT_R8G8B8A8_SRGB,
-                              VK_IMAGE_ASPECT_COLOR_BIT, mip_levels);
+            create_image_view(device, texture_image, data.format,
+                              VK_IMAGE_ASPECT_COLOR_BIT, mip_levels,
+                              data.components);
 
         const VkSamplerCreateInfo sampler_info = {
             .sType                   = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
@@ -2933,37 +9810,30 @@ class Application
         };
 
         VkSampler texture_sampler;
-        if (vkCreateSampler(device, &sampler_info, nullptr, &texture_sampler) !=
-            VK_SUCCESS)
+        if (vkCreateSampler(device, &sampler_info, gAllocator,
+                            &texture_sampler) != VK_SUCCESS)
         {
             throw std::runtime_error("Failed to create texture sampler!");
         }
 
-        return {texture_image, texture_image_memory, texture_image_view,
-                texture_sampler, mip_levels};
+        const uint32_t bytes_per_pixel =
+            data.format == VK_FORMAT_R8_SRGB ? 1u : 4u;
+        return {texture_image,
+                texture_image_memory,
+                texture_image_view,
+                texture_sampler,
+                mip_levels,
+                data.format,
+                texture_memory_size(data.width, data.height, bytes_per_pixel,
+                                    mip_levels),
+                {data.width, data.height},
+                data.components};
     }
 
-    static void generate_mipmaps(VkPhysicalDevice physical_device,
-                                 VkDevice device, VkCommandPool command_pool,
-                                 VkQueue queue, VkImage image,
-                                 VkFormat image_format, int32_t tex_width,
-                                 int32_t tex_height, uint32_t mip_levels)
+    static void generate_mipmaps(VkCommandBuffer command_buffer, VkImage image,
+                                 int32_t tex_width, int32_t tex_height,
+                                 uint32_t mip_levels) noexcept
     {
-
-        VkFormatProperties format_properties = {};
-        vkGetPhysicalDeviceFormatProperties(physical_device, image_format,
-                                            &format_properties);
-
-        if (!(format_properties.optimalTilingFeatures &
-              VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT))
-        {
-            throw std::runtime_error(
-                "Texture image format does not support linear blitting!");
-        }
-
-        const auto command_buffer =
-            begin_single_time_commands(device, command_pool);
-
         int32_t mip_width  = tex_width;
         int32_t mip_height = tex_height;
         for (uint32_t i = 1; i < mip_levels; ++i)
@@ -3073,8 +9943,6 @@ class Application
                              VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0,
                              nullptr, 0, nullptr, 1,
                              &transition_last_mipmap_barrier);
-
-        end_single_time_commands(device, command_pool, queue, command_buffer);
     }
 
     static void glfw_error_callback([[maybe_unused]] int error,
@@ -3091,6 +9959,153 @@ class Application
         {
             glfwSetWindowShouldClose(window, GLFW_TRUE);
         }
+        else if (key == GLFW_KEY_B && action == GLFW_PRESS)
+        {
+            auto *app =
+                static_cast<Application *>(glfwGetWindowUserPointer(window));
+            app->benchmark_recording_ = true;
+        }
+        else if (key == GLFW_KEY_G && action == GLFW_PRESS)
+        {
+            auto *app =
+                static_cast<Application *>(glfwGetWindowUserPointer(window));
+            if (app->gpu_culling_supported_)
+            {
+                // The buckets record differently on each path
+                app->gpu_culling_ = !app->gpu_culling_;
+                app->invalidate_buckets();
+                app->reset_visibility_ = true;
+                log_info(app->gpu_culling_ ? "Culling on the GPU"
+                                           : "Drawing every mesh from the CPU");
+            }
+        }
+        else if (key == GLFW_KEY_P && action == GLFW_PRESS)
+        {
+            auto *app =
+                static_cast<Application *>(glfwGetWindowUserPointer(window));
+            // The buckets record their depth and colour draws differently
+            app->depth_prepass_ = !app->depth_prepass_;
+            app->invalidate_buckets();
+            log_info(app->depth_prepass_ ? "Drawing a depth pre-pass"
+                                         : "Drawing without a depth pre-pass");
+        }
+        else if (key == GLFW_KEY_O && action == GLFW_PRESS)
+        {
+            auto *app =
+                static_cast<Application *>(glfwGetWindowUserPointer(window));
+            app->software_occlusion_ = !app->software_occlusion_;
+            if (!app->software_occlusion_)
+            {
+                app->reset_mesh_visibility();
+            }
+            log_info(app->software_occlusion_
+                         ? "Culling occluded meshes on the CPU"
+                         : "Drawing every mesh on the CPU path");
+        }
+        else if (key == GLFW_KEY_L && action == GLFW_PRESS)
+        {
+            auto *app =
+                static_cast<Application *>(glfwGetWindowUserPointer(window));
+            app->light_count_index_ =
+                (app->light_count_index_ + 1) % std::ssize(light_counts_);
+            log_info("Drawing {} point lights",
+                     light_counts_[app->light_count_index_]);
+            // The shaders are specialised for the light count
+            app->pipelines_outdated_ = true;
+        }
+        else if (key == GLFW_KEY_F && action == GLFW_PRESS)
+        {
+            auto *app =
+                static_cast<Application *>(glfwGetWindowUserPointer(window));
+            // Only the specialised shaders leave fog out
+            app->fog_                = !app->fog_;
+            app->pipelines_outdated_ = true;
+            log_info(app->fog_ ? "Drawing fog" : "Drawing without fog");
+        }
+        else if (key == GLFW_KEY_V && action == GLFW_PRESS)
+        {
+            auto *app =
+                static_cast<Application *>(glfwGetWindowUserPointer(window));
+            app->specialise_shaders_ = !app->specialise_shaders_;
+            app->pipelines_outdated_ = true;
+            log_info(app->specialise_shaders_
+                         ? "Drawing with specialised shaders"
+                         : "Drawing with the uber shaders");
+        }
+        else if (key == GLFW_KEY_R && action == GLFW_PRESS)
+        {
+            auto *app =
+                static_cast<Application *>(glfwGetWindowUserPointer(window));
+            // Off, the scale returns to full with the next finished frame
+            app->dynamic_resolution_    = !app->dynamic_resolution_;
+            app->resolution_controller_ = {};
+            log_info(app->dynamic_resolution_
+                         ? "Scaling the resolution to the GPU frame time"
+                         : "Drawing at full resolution");
+        }
+        else if (key == GLFW_KEY_M && action == GLFW_PRESS)
+        {
+            auto *app =
+                static_cast<Application *>(glfwGetWindowUserPointer(window));
+            // The benchmark is switching modes itself
+            if (!app->aa_benchmark_)
+            {
+                const AntiAliasingMode mode = app->next_anti_aliasing_mode();
+                app->set_anti_aliasing_mode(mode);
+                log_info("Anti-aliasing with {}", anti_aliasing_name(mode));
+            }
+        }
+        else if (key == GLFW_KEY_A && action == GLFW_PRESS)
+        {
+            auto *app =
+                static_cast<Application *>(glfwGetWindowUserPointer(window));
+            app->benchmark_anti_aliasing_ = true;
+        }
+        else if (key == GLFW_KEY_W && action == GLFW_PRESS)
+        {
+            auto *app =
+                static_cast<Application *>(glfwGetWindowUserPointer(window));
+            app->benchmark_resizing_ = true;
+        }
+        else if (key == GLFW_KEY_T && action == GLFW_PRESS)
+        {
+            auto *app =
+                static_cast<Application *>(glfwGetWindowUserPointer(window));
+            app->texture_swap_requested_ = true;
+        }
+        else if (key == GLFW_KEY_C && action == GLFW_PRESS)
+        {
+            auto *app =
+                static_cast<Application *>(glfwGetWindowUserPointer(window));
+            app->mesh_add_requested_ = true;
+        }
+        else if (key == GLFW_KEY_X && action == GLFW_PRESS)
+        {
+            auto *app =
+                static_cast<Application *>(glfwGetWindowUserPointer(window));
+            app->mesh_remove_requested_ = true;
+        }
+        else if (key >= GLFW_KEY_1 && key <= GLFW_KEY_4 &&
+                 action == GLFW_PRESS)
+        {
+            auto *app =
+                static_cast<Application *>(glfwGetWindowUserPointer(window));
+            app->set_frames_in_flight(key - GLFW_KEY_1 + 1);
+        }
+        else if (key == GLFW_KEY_H && action == GLFW_PRESS)
+        {
+            auto *app =
+                static_cast<Application *>(glfwGetWindowUserPointer(window));
+            if (app->occlusion_culling_supported_)
+            {
+                // Visibility goes stale while occlusion culling is off
+                app->occlusion_culling_ = !app->occlusion_culling_;
+                app->reset_visibility_  = true;
+                log_info(app->occlusion_culling_
+                             ? "Culling occluded meshes on the GPU"
+                             : "Culling meshes outside the frustum only");
+            }
+        }
     }
 
     static void glfw_mouse_button(GLFWwindow *window, int button,
@@ -0,0 +1,344 @@
+// Hello Vulkan
+// Benjamin Porter, 2020
+//
+// Software occlusion culling, kept apart from the renderer so that it can
+// be tested on its own
+
+#pragma once
+
+#include "masked_occlusion_tile.h"
+
+#include <glm/glm.hpp>
+#include <gsl/gsl>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <utility>
+#include <vector>
+
+// A coarse depth buffer for occlusion culling on the CPU, after Hasselgren
+// et al., "Masked Software Occlusion Culling". The buffer is split into
+// tiles of 32x8 pixels. Each tile keeps a reference depth that the whole
+// tile is hidden behind, and a mask of pixels hidden behind a nearer depth.
+// Once the mask fills, its depth becomes the reference.
+//
+// Depths are 1 / w, so larger is nearer and depth is linear across the
+// screen. Each tile is only ever written by the thread rendering its row,
+// in triangle order, so results do not depend on how rows are split.
+class MaskedOcclusionBuffer
+{
+  public:
+    static constexpr int tile_width  = occlusion_tile_width;
+    static constexpr int tile_height = occlusion_tile_height;
+
+    // The AVX2 path is used when the processor supports it, unless use_avx2
+    // says otherwise. Both paths give identical results.
+    MaskedOcclusionBuffer(int width, int height,
+                          bool use_avx2 = avx2_supported())
+        : width_(width), height_(height), tiles_x_(width / tile_width),
+          tiles_y_(height / tile_height),
+          tiles_(gsl::narrow_cast<std::size_t>(tiles_x_ * tiles_y_)),
+          use_avx2_(use_avx2 && avx2_supported())
+    {
+        Expects(width > 0 && height > 0 && width % tile_width == 0 &&
+                height % tile_height == 0);
+    }
+
+    int tile_rows() const noexcept { return tiles_y_; }
+
+    bool uses_avx2() const noexcept { return use_avx2_; }
+
+    // Buffers are equal when they hold the same depths, whichever path
+    // rendered them
+    bool operator==(const MaskedOcclusionBuffer &other) const noexcept
+    {
+        return width_ == other.width_ && height_ == other.height_ &&
+               tiles_ == other.tiles_;
+    }
+
+    void clear() noexcept { std::ranges::fill(tiles_, Tile {}); }
+
+    // Rasterises clip space triangles, three vertices each, into the rows
+    // of tiles from first_row up to last_row. Either winding is drawn.
+    // Triangles crossing the near plane are skipped, which only leaves
+    // fewer occluders.
+    void render(std::span<const glm::vec4> triangles, int first_row,
+                int last_row) noexcept
+    {
+        first_row = std::max(first_row, 0);
+        last_row  = std::min(last_row, tiles_y_);
+        for (std::size_t i = 0; i + 3 <= triangles.size(); i += 3)
+        {
+            const auto clip = triangles.subspan(i, 3);
+            if (std::ranges::any_of(clip, [](const glm::vec4 &vertex) {
+                    return vertex.z < 0.0f || vertex.w <= 0.0f;
+                }))
+            {
+                continue;
+            }
+            render_triangle(
+                {glm::vec3(snap(to_screen(clip[0])), 1.0f / clip[0].w),
+                 glm::vec3(snap(to_screen(clip[1])), 1.0f / clip[1].w),
+                 glm::vec3(snap(to_screen(clip[2])), 1.0f / clip[2].w)},
+                first_row, last_row);
+        }
+    }
+
+    // Returns whether any of the box lo..hi, transformed to clip space by
+    // model_view_proj, may be visible
+    bool is_visible(const glm::mat4 &model_view_proj, glm::vec3 lo,
+                    glm::vec3 hi) const noexcept
+    {
+        glm::vec2 first = glm::vec2(std::numeric_limits<float>::max());
+        glm::vec2 last  = glm::vec2(std::numeric_limits<float>::lowest());
+        float nearest   = 0.0f;
+        for (int i = 0; i < 8; ++i)
+        {
+            const glm::vec3 corner = {(i & 1) != 0 ? hi.x : lo.x,
+                                      (i & 2) != 0 ? hi.y : lo.y,
+                                      (i & 4) != 0 ? hi.z : lo.z};
+            const glm::vec4 clip = model_view_proj * glm::vec4(corner, 1.0f);
+            if (clip.z < 0.0f || clip.w <= 0.0f)
+            {
+                return true; // Crosses the near plane
+            }
+            const glm::vec2 screen = to_screen(clip);
+            first                  = glm::min(first, screen);
+            last                   = glm::max(last, screen);
+            nearest                = std::max(nearest, 1.0f / clip.w);
+        }
+        if (last.x < 0.0f || last.y < 0.0f ||
+            first.x > static_cast<float>(width_) ||
+            first.y > static_cast<float>(height_))
+        {
+            return false; // Off the screen
+        }
+
+        const int first_x = tile_index(first.x, tile_width, tiles_x_);
+        const int last_x  = tile_index(last.x, tile_width, tiles_x_);
+        const int first_y = tile_index(first.y, tile_height, tiles_y_);
+        const int last_y  = tile_index(last.y, tile_height, tiles_y_);
+        for (int y = first_y; y <= last_y; ++y)
+        {
+            for (int x = first_x; x <= last_x; ++x)
+            {
+                if (nearest > tiles_[y * tiles_x_ + x].reference)
+                {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+  private:
+    using RowMasks = std::array<uint32_t, tile_height>;
+
+    struct Tile
+    {
+        RowMasks mask    = {};
+        float reference  = 0.0f; // Infinitely far
+        float mask_depth = std::numeric_limits<float>::max();
+
+        bool operator==(const Tile &) const = default;
+    };
+
+    using EdgeKind = OcclusionEdgeKind;
+    using Edge     = OcclusionEdge;
+
+    glm::vec2 to_screen(const glm::vec4 &clip) const noexcept
+    {
+        return (glm::vec2(clip) / clip.w * 0.5f + 0.5f) *
+               glm::vec2(width_, height_);
+    }
+
+    // Snapping to 1/256 of a pixel keeps slopes finite
+    static glm::vec2 snap(glm::vec2 screen) noexcept
+    {
+        return glm::round(screen * 256.0f) / 256.0f;
+    }
+
+    static int tile_index(float coordinate, int tile_size, int count) noexcept
+    {
+        const float tile = std::floor(coordinate / tile_size);
+        return static_cast<int>(
+            std::clamp(tile, 0.0f, static_cast<float>(count - 1)));
+    }
+
+    void render_triangle(std::array<glm::vec3, 3> v, int first_row,
+                         int last_row) noexcept
+    {
+        // Wind the triangle so that its inside is left of each edge
+        float area = (v[1].x - v[0].x) * (v[2].y - v[0].y) -
+                     (v[2].x - v[0].x) * (v[1].y - v[0].y);
+        if (area == 0.0f)
+        {
+            return;
+        }
+        if (area > 0.0f)
+        {
+            std::swap(v[1], v[2]);
+            area = -area;
+        }
+
+        std::array<Edge, 3> edges = {};
+        for (std::size_t i = 0; i < edges.size(); ++i)
+        {
+            const glm::vec3 &a = v[i];
+            const glm::vec3 &b = v[(i + 1) % v.size()];
+            const float dx     = b.x - a.x;
+            const float dy     = b.y - a.y;
+            edges[i]           = {
+                .kind  = dy > 0.0f   ? EdgeKind::Left
+                         : dy < 0.0f ? EdgeKind::Right
+                                     : EdgeKind::Horizontal,
+                .x0    = a.x,
+                .y0    = a.y,
+                .slope = dy != 0.0f ? dx / dy : 0.0f,
+                .dx    = dx,
+            };
+        }
+
+        // The depth plane z = x * dzdx + y * dzdy + z0. The farthest depth
+        // in a tile is also no nearer than the farthest vertex.
+        const float dzdx = ((v[1].z - v[0].z) * (v[2].y - v[0].y) -
+                            (v[2].z - v[0].z) * (v[1].y - v[0].y)) /
+                           area;
+        const float dzdy = ((v[2].z - v[0].z) * (v[1].x - v[0].x) -
+                            (v[1].z - v[0].z) * (v[2].x - v[0].x)) /
+                           area;
+        const float z0 = v[0].z - v[0].x * dzdx - v[0].y * dzdy;
+        const float farthest_vertex =
+            std::min({v[0].z, v[1].z, v[2].z});
+
+        const glm::vec2 lo =
+            glm::min(glm::min(glm::vec2(v[0]), glm::vec2(v[1])),
+                     glm::vec2(v[2]));
+        const glm::vec2 hi =
+            glm::max(glm::max(glm::vec2(v[0]), glm::vec2(v[1])),
+                     glm::vec2(v[2]));
+        if (hi.x < 0.0f || hi.y < 0.0f ||
+            lo.x >= static_cast<float>(width_) ||
+            lo.y >= static_cast<float>(height_))
+        {
+            return;
+        }
+        const int first_x = tile_index(lo.x, tile_width, tiles_x_);
+        const int last_x  = tile_index(hi.x, tile_width, tiles_x_);
+        const int first_y =
+            std::max(tile_index(lo.y, tile_height, tiles_y_), first_row);
+        const int last_y =
+            std::min(tile_index(hi.y, tile_height, tiles_y_), last_row - 1);
+        for (int y = first_y; y <= last_y; ++y)
+        {
+            for (int x = first_x; x <= last_x; ++x)
+            {
+                const auto left = static_cast<float>(x * tile_width);
+                const auto top  = static_cast<float>(y * tile_height);
+                RowMasks coverage = {};
+                if (!cover_tile(edges, left, top, coverage))
+                {
+                    continue;
+                }
+
+                const float farthest_corner =
+                    z0 + (dzdx >= 0.0f ? left : left + tile_width) * dzdx +
+                    (dzdy >= 0.0f ? top : top + tile_height) * dzdy;
+                update_tile(tiles_[y * tiles_x_ + x], coverage,
+                            std::max(farthest_corner, farthest_vertex));
+            }
+        }
+    }
+
+    // Sets the bits of the pixels in the tile whose centres are inside
+    // every edge. Returns whether any are.
+    bool cover_tile(const std::array<Edge, 3> &edges, float left, float top,
+                    RowMasks &coverage) const noexcept
+    {
+        return use_avx2_
+                   ? cover_tile_avx2(edges.data(), left, top, coverage.data())
+                   : cover_tile_scalar(edges, left, top, coverage);
+    }
+
+    static bool cover_tile_scalar(const std::array<Edge, 3> &edges,
+                                  float left, float top,
+                                  RowMasks &coverage) noexcept
+    {
+        bool any = false;
+        for (int row = 0; row < tile_height; ++row)
+        {
+            const float y = top + (static_cast<float>(row) + 0.5f);
+            uint32_t bits = ~0u;
+            for (const Edge &edge : edges)
+            {
+                const float dy = y - edge.y0;
+                if (edge.kind == EdgeKind::Horizontal)
+                {
+                    bits = dy * edge.dx <= 0.0f ? bits : 0u;
+                    continue;
+                }
+
+                // The first pixel whose centre is at or right of the edge
+                const float x      = edge.x0 + dy * edge.slope;
+                const float offset = (x - left) - 0.5f;
+                const auto first   = static_cast<int>(std::ceil(std::min(
+                    std::max(offset, 0.0f), static_cast<float>(tile_width))));
+                const uint32_t right_of = first < tile_width ? ~0u << first
+                                                             : 0u;
+                bits &= edge.kind == EdgeKind::Left ? right_of : ~right_of;
+            }
+            coverage[row] = bits;
+            any           = any || bits != 0;
+        }
+        return any;
+    }
+
+    static void update_tile(Tile &tile, const RowMasks &coverage,
+                            float depth) noexcept
+    {
+        if (depth <= tile.reference)
+        {
+            return; // Behind what already hides the tile
+        }
+
+        const bool covers_tile = std::ranges::all_of(
+            coverage, [](uint32_t bits) { return bits == ~0u; });
+        if (covers_tile)
+        {
+            tile.reference = depth;
+        }
+        else
+        {
+            tile.mask_depth = std::min(tile.mask_depth, depth);
+            for (int row = 0; row < tile_height; ++row)
+            {
+                tile.mask[row] |= coverage[row];
+            }
+            if (std::ranges::all_of(tile.mask,
+                                    [](uint32_t bits) { return bits == ~0u; }))
+            {
+                tile.reference = tile.mask_depth;
+                tile.mask      = {};
+            }
+        }
+
+        // A mask no nearer than the reference hides nothing more
+        if (tile.mask_depth <= tile.reference)
+        {
+            tile.mask       = {};
+            tile.mask_depth = std::numeric_limits<float>::max();
+        }
+    }
+
+    int width_               = 0;
+    int height_              = 0;
+    int tiles_x_             = 0;
+    int tiles_y_             = 0;
+    std::vector<Tile> tiles_ = {};
+    bool use_avx2_           = false;
+};
@@ -0,0 +1,70 @@
+// Hello Vulkan
+// Benjamin Porter, 2020
+//
+// The AVX2 tile coverage step of the masked occlusion buffer. This file is
+// the only one compiled with AVX2 enabled, and is only called after
+// avx2_supported has checked the processor.
+
+#include "masked_occlusion_tile.h"
+
+#if defined(__AVX2__)
+
+#include <immintrin.h>
+
+[[gsl::suppress(26490)]] // Don't warn about the reinterpret_cast below
+bool cover_tile_avx2(const OcclusionEdge *edges, float left, float top,
+                     uint32_t *coverage) noexcept
+{
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 full =
+        _mm256_set1_ps(static_cast<float>(occlusion_tile_width));
+    const __m256i ones = _mm256_set1_epi32(-1);
+    const __m256 y     = _mm256_add_ps(
+        _mm256_set1_ps(top),
+        _mm256_setr_ps(0.5f, 1.5f, 2.5f, 3.5f, 4.5f, 5.5f, 6.5f, 7.5f));
+    __m256i rows = ones;
+    for (int i = 0; i < 3; ++i)
+    {
+        const OcclusionEdge &edge = edges[i];
+        const __m256 dy = _mm256_sub_ps(y, _mm256_set1_ps(edge.y0));
+        if (edge.kind == OcclusionEdgeKind::Horizontal)
+        {
+            const __m256 inside =
+                _mm256_cmp_ps(_mm256_mul_ps(dy, _mm256_set1_ps(edge.dx)),
+                              zero, _CMP_LE_OQ);
+            rows = _mm256_and_si256(rows, _mm256_castps_si256(inside));
+            continue;
+        }
+
+        // The first pixel whose centre is at or right of the edge
+        const __m256 x = _mm256_add_ps(
+            _mm256_set1_ps(edge.x0),
+            _mm256_mul_ps(dy, _mm256_set1_ps(edge.slope)));
+        const __m256 offset = _mm256_sub_ps(
+            _mm256_sub_ps(x, _mm256_set1_ps(left)), _mm256_set1_ps(0.5f));
+        const __m256i first = _mm256_cvttps_epi32(_mm256_ceil_ps(
+            _mm256_min_ps(_mm256_max_ps(offset, zero), full)));
+        const __m256i right_of = _mm256_sllv_epi32(ones, first);
+        rows                   = _mm256_and_si256(
+            rows, edge.kind == OcclusionEdgeKind::Left
+                      ? right_of
+                      : _mm256_xor_si256(right_of, ones));
+    }
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(coverage), rows);
+    return _mm256_testz_si256(rows, rows) == 0;
+}
+
+#elif defined(__x86_64__) || defined(__i386__) || defined(_M_X64) ||         \
+    defined(_M_IX86)
+
+#error "masked_occlusion_avx2.cpp must be compiled with AVX2 enabled"
+
+#else
+
+// Other processors never pass avx2_supported
+bool cover_tile_avx2(const OcclusionEdge *, float, float, uint32_t *) noexcept
+{
+    return false;
+}
+
+#endif
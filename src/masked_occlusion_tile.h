@@ -0,0 +1,41 @@
+// Hello Vulkan
+// Benjamin Porter, 2020
+//
+// The tile coverage step of the masked occlusion buffer. This header is
+// shared with masked_occlusion_avx2.cpp, which is compiled for AVX2, so it
+// must only declare plain types and functions: an inline function here
+// could be emitted with AVX2 instructions and chosen by the linker for
+// every caller.
+
+#pragma once
+
+#include <cstdint>
+
+constexpr int occlusion_tile_width  = 32; // One bit per pixel in a row
+constexpr int occlusion_tile_height = 8;  // One AVX2 lane per row
+
+// One side of a triangle, as the half-plane of x at each row
+enum class OcclusionEdgeKind
+{
+    Left,      // x >= x0 + (y - y0) * slope
+    Right,     // x < x0 + (y - y0) * slope
+    Horizontal // (y - y0) * dx <= 0
+};
+
+struct OcclusionEdge
+{
+    OcclusionEdgeKind kind = OcclusionEdgeKind::Horizontal;
+    float x0               = 0.0f;
+    float y0               = 0.0f;
+    float slope            = 0.0f;
+    float dx               = 0.0f;
+};
+
+// Whether this processor and operating system can run the AVX2 path
+bool avx2_supported() noexcept;
+
+// Sets a bit in coverage, one uint32_t per row of the tile, for each pixel
+// whose centre is inside all three edges. Returns whether any are. Only
+// call this when avx2_supported is true.
+bool cover_tile_avx2(const OcclusionEdge *edges, float left, float top,
+                     uint32_t *coverage) noexcept;
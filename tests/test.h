@@ -0,0 +1,56 @@
+// Hello Vulkan
+// Benjamin Porter, 2020
+//
+// A minimal test harness: TEST_CASE registers a function, CHECK records a
+// failure without stopping the test, and run_tests runs everything
+
+#pragma once
+
+#include <cstdio>
+#include <vector>
+
+struct TestCase
+{
+    const char *name = nullptr;
+    void (*run)()    = nullptr;
+};
+
+inline std::vector<TestCase> &test_cases()
+{
+    static std::vector<TestCase> cases;
+    return cases;
+}
+
+inline int gFailures = 0;
+
+inline void check(bool passed, const char *expression, const char *file,
+                  int line)
+{
+    if (!passed)
+    {
+        std::printf("%s(%d): CHECK(%s) failed\n", file, line, expression);
+        ++gFailures;
+    }
+}
+
+#define CHECK(expression) check((expression), #expression, __FILE__, __LINE__)
+
+#define TEST_CASE(name)                                                        \
+    static void name();                                                        \
+    static const bool name##_registered =                                      \
+        (test_cases().push_back({#name, name}), true);                         \
+    static void name()
+
+inline int run_tests()
+{
+    for (const TestCase &test : test_cases())
+    {
+        const int failures = gFailures;
+        test.run();
+        std::printf("[%s] %s\n", gFailures == failures ? "Pass" : "Fail",
+                    test.name);
+    }
+    std::printf("%zu tests, %d failed checks\n", test_cases().size(),
+                gFailures);
+    return gFailures == 0 ? 0 : 1;
+}
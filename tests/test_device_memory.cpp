@@ -0,0 +1,372 @@
+// Hello Vulkan
+// Benjamin Porter, 2020
+//
+// Tests of the device memory allocator against a fake device
+
+#include "device_memory.h"
+#include "test.h"
+
+#include <map>
+#include <type_traits>
+
+namespace
+{
+
+constexpr VkDeviceSize kibibyte = 1024;
+constexpr VkDeviceSize mebibyte = 1024 * kibibyte;
+
+constexpr VkMemoryPropertyFlags device_local =
+    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+constexpr VkMemoryPropertyFlags host_visible =
+    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+    VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+
+// Non-dispatchable handles are pointers on 64-bit targets and integers on
+// 32-bit ones
+template <class Handle> Handle make_handle(uint64_t id)
+{
+    if constexpr (std::is_pointer_v<Handle>)
+    {
+        return reinterpret_cast<Handle>(static_cast<std::uintptr_t>(id));
+    }
+    else
+    {
+        return static_cast<Handle>(id);
+    }
+}
+
+struct FakeMemoryType
+{
+    VkMemoryPropertyFlags flags = {};
+    VkDeviceSize heap_size      = {};
+};
+
+// One heap per memory type. Host visible memory is backed by real storage
+// so that mapped pointers can be checked.
+class FakeDevice : public DeviceMemoryInterface
+{
+  public:
+    struct Counters
+    {
+        int allocations = 0;
+        int frees       = 0;
+        std::map<VkDeviceMemory, VkDeviceSize> live = {};
+    };
+
+    FakeDevice(std::initializer_list<FakeMemoryType> types,
+               VkDeviceSize granularity, Counters &counters)
+        : granularity_(granularity), counters_(counters)
+    {
+        for (const FakeMemoryType &type : types)
+        {
+            const uint32_t i = properties_.memoryTypeCount++;
+            properties_.memoryTypes[i] = {type.flags, i};
+            properties_.memoryHeaps[i] = {type.heap_size, 0};
+            properties_.memoryHeapCount++;
+        }
+    }
+
+    VkPhysicalDeviceMemoryProperties memory_properties() const override
+    {
+        return properties_;
+    }
+
+    VkDeviceSize buffer_image_granularity() const override
+    {
+        return granularity_;
+    }
+
+    VkResult allocate(const VkMemoryAllocateInfo &info,
+                      VkDeviceMemory *memory) override
+    {
+        *memory = make_handle<VkDeviceMemory>(++next_handle_);
+        counters_.allocations += 1;
+        counters_.live[*memory] = info.allocationSize;
+        if (properties_.memoryTypes[info.memoryTypeIndex].propertyFlags &
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+        {
+            storage_[*memory].resize(info.allocationSize);
+        }
+        return VK_SUCCESS;
+    }
+
+    void free(VkDeviceMemory memory) noexcept override
+    {
+        counters_.frees += 1;
+        counters_.live.erase(memory);
+        storage_.erase(memory);
+    }
+
+    VkResult map(VkDeviceMemory memory, void **data) override
+    {
+        const auto it = storage_.find(memory);
+        if (it == storage_.end())
+        {
+            return VK_ERROR_MEMORY_MAP_FAILED;
+        }
+        *data = it->second.data();
+        return VK_SUCCESS;
+    }
+
+    const uint8_t *storage(VkDeviceMemory memory) const
+    {
+        return storage_.at(memory).data();
+    }
+
+  private:
+    VkPhysicalDeviceMemoryProperties properties_ = {};
+    VkDeviceSize granularity_                    = {};
+    Counters &counters_;
+    uint64_t next_handle_                                   = 0;
+    std::map<VkDeviceMemory, std::vector<uint8_t>> storage_ = {};
+};
+
+VkMemoryRequirements requirements(VkDeviceSize size,
+                                  VkDeviceSize alignment = 1,
+                                  uint32_t type_bits     = ~0u)
+{
+    return {size, alignment, type_bits};
+}
+
+} // namespace
+
+TEST_CASE(buddy_split_and_merge)
+{
+    BuddyAllocator buddy(1024, 64);
+    CHECK(buddy.size() == 1024);
+    CHECK(buddy.largest_free() == 1024);
+    CHECK(buddy.rounded_size(100, 1) == 128);
+    CHECK(buddy.rounded_size(10, 256) == 256);
+    CHECK(buddy.rounded_size(1, 1) == 64);
+
+    // The first allocation splits the block all the way down
+    const auto a = buddy.allocate(64, 1);
+    CHECK(a == 0u);
+    CHECK(buddy.largest_free() == 512);
+    const auto b = buddy.allocate(64, 1);
+    CHECK(b == 64u);
+    const auto c = buddy.allocate(200, 1);
+    CHECK(c == 256u);
+    CHECK(buddy.used() == 384);
+    CHECK(!buddy.allocate(1024, 1));
+
+    // Freeing both halves merges them back up to the 256 byte buddy of c
+    buddy.free(*a, 64);
+    buddy.free(*b, 64);
+    CHECK(buddy.used() == 256);
+    CHECK(buddy.allocate(256, 1) == 0u);
+    buddy.free(0, 256);
+
+    buddy.free(*c, 256);
+    CHECK(buddy.used() == 0);
+    CHECK(buddy.largest_free() == 1024);
+    CHECK(buddy.allocate(1024, 1) == 0u);
+    CHECK(!buddy.allocate(64, 1));
+}
+
+TEST_CASE(allocations_are_aligned)
+{
+    FakeDevice::Counters counters;
+    DeviceMemoryAllocator allocator;
+    allocator.init(std::make_unique<FakeDevice>(
+        std::initializer_list<FakeMemoryType>{{device_local, 1024 * mebibyte}},
+        1, counters));
+
+    const MemoryAllocation small =
+        allocator.allocate(requirements(100, 4), device_local, true);
+    const MemoryAllocation aligned =
+        allocator.allocate(requirements(300, 4096), device_local, true);
+    const MemoryAllocation after =
+        allocator.allocate(requirements(100, 256), device_local, true);
+    CHECK(small.memory == aligned.memory && aligned.memory == after.memory);
+    CHECK(small.offset % 4 == 0);
+    CHECK(aligned.offset % 4096 == 0);
+    CHECK(aligned.size == 4096);
+    CHECK(after.offset % 256 == 0);
+    CHECK(aligned.offset != small.offset && after.offset != small.offset);
+    CHECK(aligned.offset + aligned.size <= after.offset ||
+          after.offset + after.size <= aligned.offset);
+    allocator.destroy();
+    CHECK(counters.live.empty());
+}
+
+TEST_CASE(granularity_separates_buffers_and_images)
+{
+    for (const VkDeviceSize granularity : {VkDeviceSize{1}, 4 * kibibyte})
+    {
+        FakeDevice::Counters counters;
+        DeviceMemoryAllocator allocator;
+        allocator.init(std::make_unique<FakeDevice>(
+            std::initializer_list<FakeMemoryType>{
+                {device_local, 1024 * mebibyte}},
+            granularity, counters));
+
+        const MemoryAllocation buffer =
+            allocator.allocate(requirements(1000), device_local, true);
+        const MemoryAllocation image =
+            allocator.allocate(requirements(1000), device_local, false);
+        const bool separate =
+            granularity > DeviceMemoryAllocator::min_allocation_size;
+        CHECK(buffer.block >= 0 && image.block >= 0);
+        CHECK((buffer.memory != image.memory) == separate);
+        CHECK((buffer.pool != image.pool) == separate);
+        CHECK(counters.allocations == (separate ? 2 : 1));
+        allocator.destroy();
+        CHECK(counters.live.empty());
+    }
+}
+
+TEST_CASE(dedicated_allocation_threshold)
+{
+    FakeDevice::Counters counters;
+    DeviceMemoryAllocator allocator;
+    allocator.init(std::make_unique<FakeDevice>(
+        std::initializer_list<FakeMemoryType>{
+            {device_local, 8 * mebibyte},
+            {device_local, 1024 * mebibyte},
+            {VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |
+                 VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT,
+             1024 * mebibyte}},
+        1, counters));
+
+    // An 8 MiB heap gets 1 MiB blocks, so anything over half of that is
+    // given its own memory
+    const MemoryAllocation under =
+        allocator.allocate(requirements(512 * kibibyte, 1, 1), device_local,
+                           true);
+    const MemoryAllocation over = allocator.allocate(
+        requirements(600 * kibibyte, 1, 1), device_local, true);
+    CHECK(under.block >= 0);
+    CHECK(over.block < 0 && over.offset == 0);
+    CHECK(counters.live.at(under.memory) == mebibyte);
+    CHECK(counters.live.at(over.memory) == 600 * kibibyte);
+
+    // Large optimal images are dedicated even when they fit in a block
+    const MemoryAllocation buffer =
+        allocator.allocate(requirements(16 * mebibyte, 1, 2), device_local,
+                           true);
+    const MemoryAllocation image =
+        allocator.allocate(requirements(16 * mebibyte, 1, 2), device_local,
+                           false);
+    CHECK(buffer.block >= 0);
+    CHECK(image.block < 0);
+    CHECK(counters.live.at(buffer.memory) ==
+          DeviceMemoryAllocator::max_block_size);
+
+    const MemoryAllocation lazy = allocator.allocate(
+        requirements(kibibyte, 1, 4),
+        VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT, false);
+    CHECK(lazy.block < 0 && lazy.memory_type == 2);
+
+    const int frees = counters.frees;
+    allocator.free(over);
+    allocator.free(image);
+    allocator.free(lazy);
+    CHECK(counters.frees == frees + 3);
+    allocator.destroy();
+    CHECK(counters.live.empty());
+}
+
+TEST_CASE(heap_statistics)
+{
+    FakeDevice::Counters counters;
+    DeviceMemoryAllocator allocator;
+    auto device = std::make_unique<FakeDevice>(
+        std::initializer_list<FakeMemoryType>{{device_local, 8 * mebibyte},
+                                              {host_visible, 8 * mebibyte}},
+        1, counters);
+    const FakeDevice &fake = *device;
+    allocator.init(std::move(device));
+
+    const MemoryAllocation local =
+        allocator.allocate(requirements(1000), device_local, true);
+    const MemoryAllocation first =
+        allocator.allocate(requirements(3000), host_visible, true);
+    const MemoryAllocation second =
+        allocator.allocate(requirements(100), host_visible, true);
+    const MemoryAllocation dedicated =
+        allocator.allocate(requirements(mebibyte), host_visible, true);
+
+    const auto &heaps = allocator.heap_statistics();
+    CHECK(heaps.size() == 2);
+    CHECK(heaps[0].block_count == 1 && heaps[0].block_bytes == mebibyte);
+    CHECK(heaps[0].allocation_count == 1);
+    CHECK(heaps[0].allocation_bytes == kibibyte);
+    CHECK(heaps[0].dedicated_count == 0);
+    CHECK(heaps[1].block_count == 1 && heaps[1].block_bytes == mebibyte);
+    CHECK(heaps[1].allocation_count == 2);
+    CHECK(heaps[1].allocation_bytes == 4 * kibibyte + 256);
+    CHECK(heaps[1].dedicated_count == 1);
+    CHECK(heaps[1].dedicated_bytes == mebibyte);
+
+    // Host visible memory stays mapped and allocations point into it
+    CHECK(local.mapped == nullptr);
+    CHECK(first.mapped == fake.storage(first.memory) + first.offset);
+    CHECK(second.mapped == fake.storage(second.memory) + second.offset);
+    CHECK(dedicated.mapped == fake.storage(dedicated.memory));
+    CHECK(allocator.fragmentation() > 0.0);
+
+    const uint64_t generation = allocator.generation();
+    allocator.free(second);
+    allocator.free(dedicated);
+    CHECK(allocator.generation() != generation);
+    CHECK(heaps[1].allocation_count == 1);
+    CHECK(heaps[1].allocation_bytes == 4 * kibibyte);
+    CHECK(heaps[1].dedicated_count == 0 && heaps[1].dedicated_bytes == 0);
+
+    // The last block of a pool is kept when it empties
+    allocator.free(first);
+    allocator.free(local);
+    CHECK(heaps[0].block_count == 1 && heaps[1].block_count == 1);
+    CHECK(heaps[0].allocation_count == 0 && heaps[1].allocation_count == 0);
+    CHECK(allocator.fragmentation() == 0.0);
+    allocator.destroy();
+    CHECK(counters.live.empty());
+}
+
+TEST_CASE(compaction_moves_out_of_emptiest_block)
+{
+    FakeDevice::Counters counters;
+    DeviceMemoryAllocator allocator;
+    allocator.init(std::make_unique<FakeDevice>(
+        std::initializer_list<FakeMemoryType>{{device_local, 8 * mebibyte}},
+        1, counters));
+
+    // Two 1 MiB blocks, the first holding a and b, the second c
+    const VkMemoryRequirements half = requirements(512 * kibibyte);
+    const MemoryAllocation a = allocator.allocate(half, device_local, true);
+    const MemoryAllocation b = allocator.allocate(
+        requirements(256 * kibibyte), device_local, true);
+    const MemoryAllocation c = allocator.allocate(half, device_local, true);
+    CHECK(a.block == 0 && b.block == 0 && c.block == 1);
+    CHECK(counters.allocations == 2);
+
+    // Nothing fits elsewhere while both blocks are three quarters full
+    CHECK(!allocator.should_move(a));
+    CHECK(!allocator.should_move(c));
+
+    // Equally full blocks drain the first into the second
+    allocator.free(b);
+    CHECK(allocator.should_move(a));
+    CHECK(!allocator.should_move(c));
+
+    const auto moved = allocator.allocate_for_move(a, half);
+    CHECK(moved.has_value());
+    CHECK(moved->block == 1 && moved->memory == c.memory);
+    CHECK(moved->offset != c.offset);
+    CHECK(counters.allocations == 2);
+
+    // Freeing the original gives the emptied block back
+    allocator.free(a);
+    CHECK(counters.frees == 1);
+    CHECK(allocator.heap_statistics()[0].block_count == 1);
+    CHECK(!allocator.should_move(*moved));
+    CHECK(!allocator.allocate_for_move(*moved, half));
+
+    allocator.free(*moved);
+    allocator.free(c);
+    allocator.destroy();
+    CHECK(counters.live.empty());
+}
+
+int main() { return run_tests(); }
@@ -0,0 +1,196 @@
+// Hello Vulkan
+// Benjamin Porter, 2020
+//
+// Tests of the software occlusion buffer
+
+#define GLM_FORCE_DEPTH_ZERO_TO_ONE
+#define GLM_FORCE_RADIANS
+#define GLM_FORCE_PURE
+#include "masked_occlusion.h"
+#include "test.h"
+
+#include <random>
+#include <thread>
+
+namespace
+{
+
+// A clip space vertex at normalised device coordinates x, y and depth w
+glm::vec4 clip(float x, float y, float w) { return {x * w, y * w, 0.5f, w}; }
+
+// Two triangles covering x0..x1, y0..y1 in normalised device coordinates
+std::vector<glm::vec4> quad(float x0, float y0, float x1, float y1, float w)
+{
+    return {clip(x0, y0, w), clip(x1, y0, w), clip(x1, y1, w),
+            clip(x0, y0, w), clip(x1, y1, w), clip(x0, y1, w)};
+}
+
+// Whether a box covering x0..x1, y0..y1 in normalised device coordinates
+// at depth w may be visible. The matrix maps the box's z to clip w.
+bool box_visible(const MaskedOcclusionBuffer &buffer, float x0, float y0,
+                 float x1, float y1, float w)
+{
+    glm::mat4 model_view_proj(0.0f);
+    model_view_proj[0][0] = 1.0f;
+    model_view_proj[1][1] = 1.0f;
+    model_view_proj[2][3] = 1.0f;
+    model_view_proj[3][2] = 0.5f;
+    return buffer.is_visible(model_view_proj, {x0 * w, y0 * w, w},
+                             {x1 * w, y1 * w, w});
+}
+
+// Triangles of every size and orientation, some off the screen and some
+// crossing the near plane
+std::vector<glm::vec4> random_triangles(unsigned seed, int count)
+{
+    std::mt19937 random(seed);
+    std::uniform_real_distribution<float> position(-1.5f, 1.5f);
+    std::uniform_real_distribution<float> offset(-0.3f, 0.3f);
+    std::uniform_real_distribution<float> depth(1.0f, 10.0f);
+    std::vector<glm::vec4> triangles;
+    for (int i = 0; i < count; ++i)
+    {
+        const glm::vec2 centre = {position(random), position(random)};
+        const float scale      = i % 4 == 0 ? 4.0f : 1.0f;
+        for (int corner = 0; corner < 3; ++corner)
+        {
+            glm::vec4 vertex = clip(centre.x + offset(random) * scale,
+                                    centre.y + offset(random) * scale,
+                                    depth(random));
+            if (i % 37 == 0 && corner == 0)
+            {
+                vertex.z = -1.0f;
+            }
+            triangles.push_back(vertex);
+        }
+    }
+    return triangles;
+}
+
+} // namespace
+
+TEST_CASE(empty_buffer_hides_nothing)
+{
+    const MaskedOcclusionBuffer buffer(64, 16);
+    CHECK(box_visible(buffer, -0.5f, -0.5f, 0.5f, 0.5f, 100.0f));
+    CHECK(!box_visible(buffer, 1.5f, -0.5f, 2.0f, 0.5f, 1.0f));
+}
+
+TEST_CASE(full_occluder_hides_farther_boxes)
+{
+    MaskedOcclusionBuffer buffer(64, 16);
+    buffer.render(quad(-1.0f, -1.0f, 1.0f, 1.0f, 2.0f), 0, buffer.tile_rows());
+    CHECK(!box_visible(buffer, -0.5f, -0.5f, 0.5f, 0.5f, 4.0f));
+    CHECK(!box_visible(buffer, -1.0f, -1.0f, 1.0f, 1.0f, 4.0f));
+    CHECK(box_visible(buffer, -0.5f, -0.5f, 0.5f, 0.5f, 1.5f));
+
+    buffer.clear();
+    CHECK(box_visible(buffer, -0.5f, -0.5f, 0.5f, 0.5f, 4.0f));
+}
+
+TEST_CASE(partial_occluder_hides_its_tiles)
+{
+    // The left half of a 64 pixel wide buffer is exactly the first column
+    // of tiles
+    MaskedOcclusionBuffer buffer(64, 16);
+    buffer.render(quad(-1.0f, -1.0f, 0.0f, 1.0f, 2.0f), 0, buffer.tile_rows());
+    CHECK(!box_visible(buffer, -0.9f, -0.9f, -0.1f, 0.9f, 4.0f));
+    CHECK(box_visible(buffer, 0.1f, -0.9f, 0.9f, 0.9f, 4.0f));
+    CHECK(box_visible(buffer, -0.5f, -0.5f, 0.5f, 0.5f, 4.0f));
+}
+
+TEST_CASE(masks_merge_into_the_reference)
+{
+    // Neither half of a diagonally split tile hides anything on its own
+    MaskedOcclusionBuffer buffer(32, 8);
+    const std::vector<glm::vec4> lower = {
+        clip(-1.0f, -1.0f, 2.0f), clip(1.0f, -1.0f, 2.0f),
+        clip(1.0f, 1.0f, 2.0f)};
+    const std::vector<glm::vec4> upper = {
+        clip(-1.0f, -1.0f, 2.0f), clip(1.0f, 1.0f, 2.0f),
+        clip(-1.0f, 1.0f, 2.0f)};
+    buffer.render(lower, 0, buffer.tile_rows());
+    CHECK(box_visible(buffer, -0.5f, -0.5f, 0.5f, 0.5f, 4.0f));
+    buffer.render(upper, 0, buffer.tile_rows());
+    CHECK(!box_visible(buffer, -0.5f, -0.5f, 0.5f, 0.5f, 4.0f));
+    CHECK(box_visible(buffer, -0.5f, -0.5f, 0.5f, 0.5f, 1.5f));
+}
+
+TEST_CASE(triangles_crossing_the_near_plane_are_skipped)
+{
+    MaskedOcclusionBuffer buffer(64, 16);
+    std::vector<glm::vec4> triangles = quad(-1.0f, -1.0f, 1.0f, 1.0f, 2.0f);
+    for (glm::vec4 &vertex : triangles)
+    {
+        vertex.z = -1.0f;
+    }
+    buffer.render(triangles, 0, buffer.tile_rows());
+    CHECK(box_visible(buffer, -0.5f, -0.5f, 0.5f, 0.5f, 4.0f));
+}
+
+TEST_CASE(results_do_not_depend_on_row_splits)
+{
+    const std::vector<glm::vec4> triangles = random_triangles(1, 300);
+
+    MaskedOcclusionBuffer reference(256, 128);
+    reference.render(triangles, 0, reference.tile_rows());
+    // The scene hides some, but not all, of a row of boxes
+    int hidden = 0;
+    for (float x = -1.0f; x < 1.0f; x += 0.25f)
+    {
+        hidden += box_visible(reference, x, -0.1f, x + 0.1f, 0.0f, 5.0f)
+                      ? 0
+                      : 1;
+    }
+    CHECK(hidden > 0 && hidden < 8);
+
+    // One row at a time, last row first
+    MaskedOcclusionBuffer rows(256, 128);
+    for (int row = rows.tile_rows() - 1; row >= 0; --row)
+    {
+        rows.render(triangles, row, row + 1);
+    }
+    CHECK(rows == reference);
+
+    // Uneven bands on separate threads, as render_occluders does
+    for (const int count : {2, 3, 5})
+    {
+        MaskedOcclusionBuffer threaded(256, 128);
+        std::vector<std::thread> threads;
+        for (int slice = 0; slice < count; ++slice)
+        {
+            threads.emplace_back([&, slice] {
+                threaded.render(triangles,
+                                threaded.tile_rows() * slice / count,
+                                threaded.tile_rows() * (slice + 1) / count);
+            });
+        }
+        for (std::thread &thread : threads)
+        {
+            thread.join();
+        }
+        CHECK(threaded == reference);
+    }
+}
+
+TEST_CASE(scalar_and_avx2_paths_match)
+{
+    if (!avx2_supported())
+    {
+        std::printf("Skipped: this processor doesn't support AVX2\n");
+        return;
+    }
+
+    for (unsigned seed = 1; seed <= 8; ++seed)
+    {
+        const std::vector<glm::vec4> triangles = random_triangles(seed, 500);
+        MaskedOcclusionBuffer scalar(256, 128, false);
+        MaskedOcclusionBuffer avx2(256, 128, true);
+        CHECK(!scalar.uses_avx2() && avx2.uses_avx2());
+        scalar.render(triangles, 0, scalar.tile_rows());
+        avx2.render(triangles, 0, avx2.tile_rows());
+        CHECK(scalar == avx2);
+    }
+}
+
+int main() { return run_tests(); }